@@ -0,0 +1,127 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * $Id$
+ */
+
+#include <iostream>
+#include <iomanip>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "checksum.h"
+
+// end around carry fold to 16 bit.  The result is 0 only for a zero sum,
+// otherwise 1 .. 0xffff, which is what the running fold of the Microsoft
+// implementation yields as well.
+static inline DWORD
+fold (ULONG64 x)
+{
+  while (x > 0xffff)
+    x = (x & 0xffff) + (x >> 16);
+  return (DWORD) x;
+}
+
+//------- class PEChecksum ------------------------------------------
+
+PEChecksum::PEChecksum()
+{
+  fileSize = 0;
+  base = 0;
+  added = 0;
+  removed = 0;
+}
+
+bool PEChecksum::init(DWORD storedCheckSum, ULONG64 fileSize)
+{
+  this->fileSize = fileSize;
+  added = removed = 0;
+  // the stored value is the folded sum (1 .. 0xffff) plus the file size
+  if (storedCheckSum <= (DWORD) fileSize
+      || storedCheckSum - (DWORD) fileSize > 0xffff)
+    {
+      if (debug)
+	std::cerr << "checksum 0x" << std::hex << storedCheckSum << std::dec
+		  << " can't be valid for a file of " << fileSize
+		  << " bytes" << std::endl;
+      base = 0;
+      return false;
+    }
+  base = storedCheckSum - (DWORD) fileSize;
+  return true;
+}
+
+void PEChecksum::update(ULONG64 fileOffset, const void *oldp, const void *newp, size_t len)
+{
+  added += sum (newp, len, fileOffset);
+  removed += sum (oldp, len, fileOffset);
+}
+
+DWORD PEChecksum::get(void)
+{
+  // (base + added - removed) in ones' complement, i.e. modulo 0xffff
+  ULONG64 r = (base % 0xffff + added % 0xffff + 0xffff - removed % 0xffff)
+	      % 0xffff;
+  // the sum of a file starting with "MZ" is never zero, so a result of 0
+  // stands for 0xffff, the other representation of ones' complement zero.
+  if (r == 0)
+    r = 0xffff;
+  return (DWORD) (r + fileSize);
+}
+
+ULONG64 PEChecksum::sum(const void *buf, size_t len, ULONG64 fileOffset)
+{
+  const BYTE *p = (const BYTE *) buf;
+  ULONG64 s = 0;
+
+  // words start at even file offsets
+  if (len && (fileOffset & 1))
+    {
+      s += (ULONG64) *p++ << 8;
+      len--;
+    }
+
+#ifdef __SSE2__
+  // sum the low and the high bytes of each word separately with psadbw,
+  // which adds up eight bytes into a 64 bit lane at a time.
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i lomask = _mm_set1_epi16 (0x00ff);
+  __m128i lo = _mm_setzero_si128 ();
+  __m128i hi = _mm_setzero_si128 ();
+  for (; len >= 16; p += 16, len -= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+      lo = _mm_add_epi64 (lo, _mm_sad_epu8 (_mm_and_si128 (v, lomask), zero));
+      hi = _mm_add_epi64 (hi, _mm_sad_epu8 (_mm_srli_epi16 (v, 8), zero));
+    }
+  ULONG64 l[2], h[2];
+  _mm_storeu_si128 ((__m128i *) l, lo);
+  _mm_storeu_si128 ((__m128i *) h, hi);
+  s += l[0] + l[1] + ((h[0] + h[1]) << 8);
+#endif
+
+  for (; len >= 2; p += 2, len -= 2)
+    s += p[0] | (p[1] << 8);
+  if (len)
+    s += *p;
+  return s;
+}
+
+DWORD PEChecksum::finish(ULONG64 partialSum, ULONG64 fileSize)
+{
+  return fold (partialSum) + (DWORD) fileSize;
+}
@@ -0,0 +1,59 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * $Id$
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "sections.h"
+
+/// the PE image checksum.
+/// The checksum is the ones' complement sum of all little endian 16 bit
+/// words of the file, with the CheckSum field counted as zero, plus the
+/// file length.  Since the sum is linear, patching a value in the file
+/// changes it by (new - old), which allows updating a valid checksum
+/// without reading the rest of the file.
+class PEChecksum : public Base
+  {
+  public:
+    PEChecksum();
+
+    // start from the checksum stored in a file of the given size.
+    // Returns false if the stored value can't be a valid checksum.
+    bool init(DWORD storedCheckSum, ULONG64 fileSize);
+
+    // account for len bytes at fileOffset changing from oldp to newp
+    void update(ULONG64 fileOffset, const void *oldp, const void *newp, size_t len);
+
+    // the checksum to store in the header
+    DWORD get(void);
+
+    // ones' complement partial sum of len bytes at fileOffset, for
+    // computing a checksum from scratch in one or more pieces.
+    static ULONG64 sum(const void *buf, size_t len, ULONG64 fileOffset);
+
+    // final checksum from the combined partial sums of the whole file
+    static DWORD finish(ULONG64 partialSum, ULONG64 fileSize);
+
+  private:
+    ULONG64 fileSize;
+    DWORD base;       // folded sum of the file before any update
+    ULONG64 added;    // contribution of the new values
+    ULONG64 removed;  // contribution of the old values
+  };
+
+#endif
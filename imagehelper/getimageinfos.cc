@@ -26,6 +26,13 @@
 #include "objectfile.h"
 #include "imagehelper.h"
 
+template <class PE>
+static inline void
+getImageInfos(PEImage<PE> image, ULONG64 *ImageBase, ULONG *ImageSize)
+{
+  *ImageBase = image.getImageBase ();
+  *ImageSize = image.getSizeOfImage ();
+}
 
 BOOL GetImageInfos64(LPCSTR filename, WORD *machine,
 		     ULONG64 *ImageBase, ULONG *ImageSize)
@@ -41,15 +48,9 @@ BOOL GetImageInfos64(LPCSTR filename, WORD *machine,
     }
 
   if (dll.is64bit ())
-    {
-      *ImageBase = dll.getNTHeader64 ()->OptionalHeader.ImageBase;
-      *ImageSize = dll.getNTHeader64 ()->OptionalHeader.SizeOfImage;
-    }
+    getImageInfos (PEImage<PE64> (dll.getNTHeader64 ()), ImageBase, ImageSize);
   else
-    {
-      *ImageBase = dll.getNTHeader32 ()->OptionalHeader.ImageBase;
-      *ImageSize = dll.getNTHeader32 ()->OptionalHeader.SizeOfImage;
-    }
+    getImageInfos (PEImage<PE32> (dll.getNTHeader32 ()), ImageBase, ImageSize);
   if (machine)
     *machine = dll.machine ();
 
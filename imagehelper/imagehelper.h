@@ -27,12 +27,28 @@
 extern "C" {
 #endif
 
+/* The following settings are process wide and only used by ReBaseImage
+   and ReBaseImage64.  ReBaseImageEx takes them per image, which is what
+   concurrent callers should use. */
+
 /* Set to TRUE if ReBaseImage{64} should also set the files last write
    time to TimeStamp when the file has been successfully rebased. */
 extern BOOL ReBaseChangeFileTime;
 /* Set to TRUE, if rebasing should also drop the /DYNAMICBASE flag
    from the PE flags. */
 extern BOOL ReBaseDropDynamicbaseFlag;
+/* Images of at least this many bytes are rebased by patching the relocated
+   pages with positional reads and writes instead of mapping the whole file.
+   Set to (ULONG64) -1 to always map the file.  Also the default of
+   REBASE_IMAGE_ENTRY's StreamingThreshold. */
+extern ULONG64 ReBaseStreamingThreshold;
+/* Set to TRUE to keep a non-zero PE checksum valid.  The checksum is
+   updated from the old and new values of every patched field, so this
+   requires the stored checksum to be valid before rebasing. */
+extern BOOL ReBaseUpdateCheckSum;
+/* Set to TRUE to compute the PE checksum of rebased images from scratch.
+   Takes precedence over ReBaseUpdateCheckSum. */
+extern BOOL ReBaseRecomputeCheckSum;
 
 BOOL ReBaseImage64(
   LPCSTR CurrentImageName,
@@ -48,6 +64,82 @@ BOOL ReBaseImage64(
   ULONG TimeStamp
 );
 
+/* Flags for ReBaseImageEx. */
+#define REBASE_IMAGE_GOING_DOWN		0x0001	/* ImageBase is the upper end */
+#define REBASE_IMAGE_FIX_RELOCATIONS	0x0002	/* FixImage bad relocations */
+#define REBASE_IMAGE_CHANGE_FILE_TIME	0x0004	/* see ReBaseChangeFileTime */
+#define REBASE_IMAGE_DROP_DYNAMICBASE	0x0008	/* see ReBaseDropDynamicbaseFlag */
+#define REBASE_IMAGE_UPDATE_CHECKSUM	0x0010	/* see ReBaseUpdateCheckSum */
+#define REBASE_IMAGE_RECOMPUTE_CHECKSUM	0x0020	/* see ReBaseRecomputeCheckSum */
+#define REBASE_IMAGE_EDIT_HEADER	0x0040	/* apply Header, see below */
+
+/* Indices of REBASE_IMAGE_HEADER's Sizes. */
+#define REBASE_IMAGE_STACK_RESERVE	0
+#define REBASE_IMAGE_STACK_COMMIT	1
+#define REBASE_IMAGE_HEAP_RESERVE	2
+#define REBASE_IMAGE_HEAP_COMMIT	3
+#define REBASE_IMAGE_LOADER_FLAGS	4	/* Cygwin heap size in MB */
+#define REBASE_IMAGE_SIZES		5
+
+/* Header fields changed together with the rebase, like peflags does, so
+   the file is only written once.  The sizes of 32 bit images and the
+   loader flags are 32 bit values.  With REBASE_IMAGE_EDIT_HEADER the
+   header is also changed if the image is at its base already. */
+typedef struct _REBASE_IMAGE_HEADER {
+  WORD CharacteristicsSet;	/* COFF characteristics */
+  WORD CharacteristicsClear;
+  WORD DllCharacteristicsSet;
+  WORD DllCharacteristicsClear;
+  ULONG SizeMask;		/* 1 << index of each of Sizes to write */
+  ULONG64 Sizes[REBASE_IMAGE_SIZES];
+} REBASE_IMAGE_HEADER, *PREBASE_IMAGE_HEADER;
+
+typedef struct _REBASE_IMAGE_ENTRY {
+  LPCSTR ImageName;
+  ULONG64 ImageBase;		/* requested base, see REBASE_IMAGE_GOING_DOWN */
+  ULONG Flags;			/* REBASE_IMAGE_* */
+  ULONG TimeStamp;
+  ULONG64 StreamingThreshold;	/* see ReBaseStreamingThreshold, 0 for it */
+  REBASE_IMAGE_HEADER Header;	/* see REBASE_IMAGE_EDIT_HEADER */
+} REBASE_IMAGE_ENTRY, *PREBASE_IMAGE_ENTRY;
+
+typedef struct _REBASE_IMAGE_RESULT {
+  ULONG64 OldImageBase;
+  ULONG64 NewImageBase;		/* the base the image is located at now */
+  ULONG OldImageSize;
+  ULONG NewImageSize;		/* rounded up to 64K like ReBaseImage's */
+  ULONG Relocations;		/* number of patched relocations */
+  BOOL Repaired;		/* bad relocations have been fixed first */
+  BOOL AlreadyRebased;		/* the image has been at NewImageBase */
+  BOOL HeaderChanged;		/* REBASE_IMAGE_EDIT_HEADER changed a field */
+  DWORD Error;			/* NO_ERROR or the Win32 error code */
+} REBASE_IMAGE_RESULT, *PREBASE_IMAGE_RESULT;
+
+/* Called after each image.  Returning FALSE cancels the remaining images,
+   their Error is set to ERROR_CANCELLED.  Calls are serialized, but with
+   more than one thread they are made from the worker threads and not
+   necessarily in the order of the entries. */
+typedef BOOL (*PREBASE_IMAGE_PROGRESS) (ULONG Index, ULONG Count,
+					const REBASE_IMAGE_ENTRY *Entry,
+					const REBASE_IMAGE_RESULT *Result,
+					PVOID Context);
+
+/* Rebase Count images in one call, each to its own base, and store the
+   outcome for each image in Results.  Threads is the number of images
+   which may be rebased concurrently, 0 or 1 to rebase them one by one.
+   The entries must name different files.  Progress may be NULL.  Returns
+   FALSE if any image failed, with the last error set to the Error of the
+   first one.  ReBaseImageEx is reentrant, so different threads may rebase
+   different images at the same time. */
+BOOL ReBaseImageEx(
+  const REBASE_IMAGE_ENTRY *Entries,
+  REBASE_IMAGE_RESULT *Results,
+  ULONG Count,
+  ULONG Threads,
+  PREBASE_IMAGE_PROGRESS Progress,
+  PVOID Context
+);
+
 BOOL ReBaseImage(
   LPCSTR CurrentImageName,
   LPCSTR SymbolPath,       // ignored
@@ -117,6 +209,8 @@ BOOL FixImage(
   LPCSTR ImageName
 );
 
+/* Set the debug level of the calling thread, and of the threads started
+   by its ReBaseImageEx calls.  Returns the old level. */
 DWORD SetImageHelperDebug(
   DWORD level
 );
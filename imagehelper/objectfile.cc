@@ -24,6 +24,7 @@
 #include <time.h>
 
 #include "objectfile.h"
+#include "checksum.h"
 
 // read a dll into the cache
 
@@ -31,26 +32,32 @@
 #include <sys/cygwin.h>
 #endif
 
-static PCWSTR
-Win32Path(const char *s)
+PCWSTR
+Win32Path(const char *s, PWSTR buf)
 {
-  /* No multithreading so a static global buffer is sufficient. */
-  static WCHAR w32_pbuf[32768];
-
   if (!s || *s == '\0')
     return L"";
 #if !defined (__CYGWIN__)
-  MultiByteToWideChar (CP_OEMCP, 0, s, -1, w32_pbuf, 32768);
+  MultiByteToWideChar (CP_OEMCP, 0, s, -1, buf, WIN32_PATH_MAX);
 #elif defined(__MSYS__)
   {
-    char buf[MAX_PATH];
-    cygwin_conv_to_win32_path(s, buf);
-    MultiByteToWideChar (CP_OEMCP, 0, buf, -1, w32_pbuf, 32768);
+    char abuf[MAX_PATH];
+    cygwin_conv_to_win32_path(s, abuf);
+    MultiByteToWideChar (CP_OEMCP, 0, abuf, -1, buf, WIN32_PATH_MAX);
   }
 #else
-  cygwin_conv_path (CCP_POSIX_TO_WIN_W, s, w32_pbuf, 32768 * sizeof (WCHAR));
+  cygwin_conv_path (CCP_POSIX_TO_WIN_W, s, buf, WIN32_PATH_MAX * sizeof (WCHAR));
 #endif
-  return w32_pbuf;
+  return buf;
+}
+
+static HANDLE
+openFile(const char *name, bool writeable, PWSTR buf)
+{
+  return CreateFileW(Win32Path(name, buf),
+		     writeable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		     FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		     FILE_ATTRIBUTE_NORMAL | FILE_FLAG_BACKUP_SEMANTICS, NULL);
 }
 
 
@@ -64,13 +71,15 @@ ObjectFile::ObjectFile(const char *aFileName, bool writeable)
   lpFileBase = 0;
   hfile = 0;
   hfilemapping = 0;
-  PCWSTR win32_path = Win32Path(aFileName);
+  PWSTR win32_path = (PWSTR) malloc(WIN32_PATH_MAX * sizeof (WCHAR));
+  if (!win32_path)
+    {
+      Error = 2;
+      return;
+    }
 
   // search for raw filename
-  hfile = CreateFileW(win32_path,
-		      writeable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
-		      FILE_SHARE_READ, NULL, OPEN_EXISTING,
-		      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  hfile = openFile(aFileName, writeable, win32_path);
   if (hfile != INVALID_HANDLE_VALUE)
     FileName = strdup(aFileName);
 
@@ -78,36 +87,40 @@ ObjectFile::ObjectFile(const char *aFileName, bool writeable)
   else
     {
       char name[MAX_PATH];
-      char path[MAX_PATH*20];
-      char *s = getenv("PATH");
-      strcpy(path,s);
+      const char *s = getenv("PATH");
+      const char *e;
 
       const char *basename = strrchr(aFileName,'/');
       basename = basename ? basename+1 : aFileName;
 
-      for (s = strtok(path,":"); s; s = strtok(NULL,":") )
+      for (; s && *s; s = *e ? e + 1 : e)
         {
-          strcpy(name,s);
-          strcat(name,"/");
-          strcat(name,basename);
+          e = strchr(s, ':');
+          if (!e)
+            e = s + strlen(s);
+          if (e - s + 1 + strlen(basename) >= sizeof name)
+            continue;
+          memcpy(name, s, e - s);
+          name[e - s] = '/';
+          strcpy(name + (e - s) + 1, basename);
           if (debug)
             std::cerr << __FUNCTION__ << ": name:" << name << std::endl;
-          hfile = CreateFileW(win32_path,
-		      writeable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
-		      FILE_SHARE_READ, NULL, OPEN_EXISTING,
-		      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+          hfile = openFile(name, writeable, win32_path);
           // found
           if (hfile != INVALID_HANDLE_VALUE)
             break;
         }
 
-      if (!s)
+      if (hfile == INVALID_HANDLE_VALUE)
         {
+          free(win32_path);
+          hfile = 0;
           Error = 2;
           return;
         }
       FileName = strdup(name);
     }
+  free(win32_path);
 
   hfilemapping = CreateFileMapping(hfile, NULL, writeable ? PAGE_READWRITE : PAGE_READONLY , 0, 0,  NULL);
   if (hfilemapping == 0)
@@ -152,18 +165,24 @@ ObjectFile::ObjectFile(const char *aFileName, bool writeable)
       return;
     }
 
-  is64bit_img = ntheader->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+  is64bit_img = isPE64(ntheader);
   machine_type = ntheader->FileHeader.Machine;
 
   sections = new SectionList(lpFileBase);
 
   ImageBase = is64bit_img
-	      ? getNTHeader64 ()->OptionalHeader.ImageBase
-	      : getNTHeader32 ()->OptionalHeader.ImageBase;
+	      ? PEImage<PE64>(ntheader).getImageBase()
+	      : PEImage<PE32>(ntheader).getImageBase();
 
   Error = 0;
 }
 
+DWORD ObjectFile::computeCheckSum(void)
+{
+  ULONG64 size = getFileSize ();
+  return PEChecksum::finish (PEChecksum::sum (lpFileBase, size, 0), size);
+}
+
 ObjectFile::~ObjectFile()
 {
   if (sections)
@@ -181,8 +200,6 @@ ObjectFile::~ObjectFile()
 
 
 
-int LinkedObjectFile::level = 0;
-
 LinkedObjectFile::LinkedObjectFile(const char *aFileName, bool writable) : ObjectFile(aFileName,writable)
 {
   exports = 0;
@@ -201,40 +218,28 @@ LinkedObjectFile::LinkedObjectFile(const char *aFileName, bool writable) : Objec
       << std::hex << ImageBase << std::dec << std::endl;
     }
 
-  PIMAGE_NT_HEADERS32 ntheader32 = getNTHeader32 ();
-  PIMAGE_NT_HEADERS64 ntheader64 = getNTHeader64 ();
+  if (is64bit ())
+    loadDirectories(PEImage<PE64>(getNTHeader64 ()));
+  else
+    loadDirectories(PEImage<PE32>(getNTHeader32 ()));
+}
 
+template <class PE>
+void LinkedObjectFile::loadDirectories(PEImage<PE> image)
+{
   Section *edata = sections->find(".edata");
   if (edata)
     exports = new Exports(*edata);
   else
-    {
-      DataDirectory *dir;
-      if (is64bit ())
-	dir = (DataDirectory *) &ntheader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
-      else
-	dir = (DataDirectory *) &ntheader32->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
-      exports = new Exports(*sections, dir);
-    }
-
+    exports = new Exports(*sections, image.getDataDirectory(IMAGE_DIRECTORY_ENTRY_EXPORT));
 
   Section *idata = sections->find(".idata");
   if (idata)
     imports = new Imports(*idata);
   else
-    {
-      DataDirectory *dir;
-      if (is64bit ())
-	dir = (DataDirectory *)&ntheader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
-      else
-	dir = (DataDirectory *)&ntheader32->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
-      imports = new Imports(*sections, dir);
-    }
-
-
+    imports = new Imports(*sections, image.getDataDirectory(IMAGE_DIRECTORY_ENTRY_IMPORT));
 
   relocs = new Relocations(*sections,".reloc");
-
 }
 
 bool LinkedObjectFile::rebind(ObjectFileList &cache)
@@ -247,6 +252,17 @@ bool LinkedObjectFile::rebind(ObjectFileList &cache)
     }
   // FIXME: set error code
 
+  if (is64bit ())
+    return rebindImage(PEImage<PE64>(getNTHeader64 ()), cache);
+  return rebindImage(PEImage<PE32>(getNTHeader32 ()), cache);
+}
+
+template <class PE>
+bool LinkedObjectFile::rebindImage(PEImage<PE> image, ObjectFileList &cache)
+{
+  typedef typename PE::ThunkData ThunkData;
+  typedef typename PE::Address Address;
+
   ImportDescriptor *p;
 
   Section *idata = sections->find(".idata");
@@ -259,7 +275,7 @@ bool LinkedObjectFile::rebind(ObjectFileList &cache)
   while ((p = imports->getNextDescriptor()) != NULL)
     {
       bool autoImportFlag;
-      int *patch_address;
+      Address *patch_address;
       char *dllname = (char *)idata->getAdjust() + p->Name;
       //  std::cerr << dllname << std::endl;
 
@@ -278,17 +294,17 @@ bool LinkedObjectFile::rebind(ObjectFileList &cache)
       if (debug)
         std::cerr << obj->getFileName() << std::endl;
 
-      PIMAGE_THUNK_DATA hintArray = PIMAGE_THUNK_DATA ((uint) p->OriginalFirstThunk + imports->getAdjust());
+      ThunkData *hintArray = (ThunkData *) ((uint) p->OriginalFirstThunk + imports->getAdjust());
 
-      PIMAGE_THUNK_DATA firstArray;
+      ThunkData *firstArray;
       if (debug)
         std::cerr << "FirstThunk 0x" << std::setw(8) << std::setfill('0') \
         << std::hex << p->FirstThunk << std::dec << std::endl;
 
       if ((autoImportFlag = text->isIn((uint)p->FirstThunk)))
-        firstArray = PIMAGE_THUNK_DATA ((uint) p->FirstThunk + text->getAdjust());
+        firstArray = (ThunkData *) ((uint) p->FirstThunk + text->getAdjust());
       else
-        firstArray = PIMAGE_THUNK_DATA ((uint) p->FirstThunk + imports->getAdjust());
+        firstArray = (ThunkData *) ((uint) p->FirstThunk + imports->getAdjust());
 
       if (debug)
         std::cerr << "FirstArray 0x" << std::setw(8) << std::setfill('0') \
@@ -302,9 +318,9 @@ bool LinkedObjectFile::rebind(ObjectFileList &cache)
             std::cerr << "symbol: " << a->Name << std::endl;
 
           if (autoImportFlag)
-            patch_address = (int *)&firstArray;
+            patch_address = (Address *)&firstArray;
           else
-            patch_address = (int *)&firstArray->u1.Function;
+            patch_address = (Address *)&firstArray->u1.Function;
 
           if (debug)
             std::cerr << "patch_address 0x" << std::setw(8) << std::setfill('0') \
@@ -326,32 +342,13 @@ bool LinkedObjectFile::rebind(ObjectFileList &cache)
       p->ForwarderChain = 0xffffffff;
     }
 
-  PIMAGE_NT_HEADERS32 ntheader32 = getNTHeader32 ();
-  PIMAGE_NT_HEADERS64 ntheader64 = getNTHeader64 ();
-
-  if (is64bit ())
-    ntheader64->FileHeader.TimeDateStamp = time(0);
-  else
-    ntheader32->FileHeader.TimeDateStamp = time(0);
+  *image.getTimeDateStamp() = time(0);
 
 #if 1
   // fill bound import section
-  DataDirectory *bdp;
-  SectionHeader *first_section;
-  BoundImportDescriptor *bp_org;
-  
-  if (is64bit ())
-    {
-      bdp = (DataDirectory *)&ntheader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT];
-      first_section = (SectionHeader *)(ntheader64+1);
-      bp_org = (BoundImportDescriptor *)(&first_section[ntheader64->FileHeader.NumberOfSections]);
-    }
-  else
-    {
-      bdp = (DataDirectory *)&ntheader32->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT];
-      first_section = (SectionHeader *)(ntheader32+1);
-      bp_org = (BoundImportDescriptor *)(&first_section[ntheader32->FileHeader.NumberOfSections]);
-    }
+  DataDirectory *bdp = image.getDataDirectory(IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT);
+  SectionHeader *first_section = image.getSectionHeaders();
+  BoundImportDescriptor *bp_org = (BoundImportDescriptor *)(&first_section[image.getSectionCount()]);
   BoundImportDescriptor *bp = bp_org;
   char *bp2 = (char *)&bp[cache.getCount() + 1];
 
@@ -382,7 +379,7 @@ bool LinkedObjectFile::rebind(ObjectFileList &cache)
   return true;
 }
 
-bool LinkedObjectFile::PrintDependencies(ObjectFileList &cache)
+bool LinkedObjectFile::PrintDependencies(ObjectFileList &cache, int level)
 {
   ImportDescriptor *p;
 
@@ -423,9 +420,7 @@ bool LinkedObjectFile::PrintDependencies(ObjectFileList &cache)
           cache.add(obj);
         }
 
-      level++;
-      obj->PrintDependencies(cache);
-      level--;
+      obj->PrintDependencies(cache, level + 1);
     }
   return false;
 }
@@ -444,6 +439,14 @@ bool LinkedObjectFile::unbind(void)
     }
   // FIXME: set error code
 
+  if (is64bit ())
+    return unbindImage(PEImage<PE64>(getNTHeader64 ()));
+  return unbindImage(PEImage<PE32>(getNTHeader32 ()));
+}
+
+template <class PE>
+bool LinkedObjectFile::unbindImage(PEImage<PE> image)
+{
   imports->reset();
 
   ImportDescriptor *p;
@@ -455,18 +458,10 @@ bool LinkedObjectFile::unbind(void)
       p->TimeDateStamp = 0;
       p->ForwarderChain = 0;
     }
-  if (is64bit ())
-    getNTHeader64 ()->FileHeader.TimeDateStamp = time(0);
-  else
-    getNTHeader32 ()->FileHeader.TimeDateStamp = time(0);
+  *image.getTimeDateStamp() = time(0);
 
   // fill bound import section
-  DataDirectory *bdp;
-  
-  if (is64bit ())
-    bdp = (DataDirectory *) &getNTHeader64 ()->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT];
-  else
-    bdp = (DataDirectory *) &getNTHeader32 ()->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT];
+  DataDirectory *bdp = image.getDataDirectory(IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT);
 
   // set data directory entry
   bdp->VirtualAddress = 0;
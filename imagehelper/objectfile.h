@@ -22,6 +22,14 @@
 #define OBJECTFILE_H
 
 #include "sections.h"
+#include "peimage.h"
+
+// size of a Win32 path buffer in WCHARs
+#define WIN32_PATH_MAX 32768
+
+// convert a POSIX path into a Win32 path in buf, which holds
+// WIN32_PATH_MAX WCHARs; returns buf
+PCWSTR Win32Path(const char *s, PWSTR buf);
 
 class ObjectFile : public Base
   {
@@ -75,6 +83,22 @@ class ObjectFile : public Base
       return sections;
     }
 
+    ULONG64 getFileSize(void)
+    {
+      DWORD high = 0;
+      DWORD low = GetFileSize (hfile, &high);
+      return ((ULONG64) high << 32) | low;
+    }
+
+    // file offset of the NT headers
+    DWORD getNTHeaderOffset(void)
+    {
+      return (char *) ntheader - (char *) lpFileBase;
+    }
+
+    // checksum of the whole file; the CheckSum field must be zero
+    DWORD computeCheckSum(void);
+
     void setFileTime (ULONG seconds_since_epoche)
     {
       LARGE_INTEGER filetime;
@@ -125,11 +149,12 @@ class LinkedObjectFile : public ObjectFile
     {
       return relocs->fix();
     }
-    bool performRelocation(int64_t difference)
+    bool performRelocation(int64_t difference, PEChecksum *sum = 0,
+			   ULONG *applied = 0)
     {
-      return relocs->relocate(difference);
+      return relocs->relocate(difference, sum, applied);
     }
-    bool PrintDependencies(ObjectFileList &cache);
+    bool PrintDependencies(ObjectFileList &cache, int level = 0);
 
     Imports *getImports()
     {
@@ -141,10 +166,13 @@ class LinkedObjectFile : public ObjectFile
     }
 
   protected:
+    template <class PE> void loadDirectories(PEImage<PE> image);
+    template <class PE> bool rebindImage(PEImage<PE> image, ObjectFileList &cache);
+    template <class PE> bool unbindImage(PEImage<PE> image);
+
     Imports *imports;
     Exports *exports;
     Relocations *relocs;
-    static int level;
     bool isPrinted;
   };
 
@@ -0,0 +1,155 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef PEIMAGE_H
+#define PEIMAGE_H
+
+#include "sections.h"
+
+/// the PE32 flavour: 32 bit headers, thunks and relocations.
+struct PE32
+  {
+    typedef IMAGE_NT_HEADERS32 NtHeaders;
+    typedef IMAGE_THUNK_DATA32 ThunkData;
+    typedef DWORD Address;
+    typedef int32_t RelocValue;
+    enum { Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC };
+    enum { RelocType = IMAGE_REL_BASED_HIGHLOW };
+  };
+
+/// the PE32+ flavour: 64 bit headers, thunks and relocations.
+struct PE64
+  {
+    typedef IMAGE_NT_HEADERS64 NtHeaders;
+    typedef IMAGE_THUNK_DATA64 ThunkData;
+    typedef ULONGLONG Address;
+    typedef int64_t RelocValue;
+    enum { Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC };
+    enum { RelocType = IMAGE_REL_BASED_DIR64 };
+  };
+
+/// a typed view of the NT headers of an image.
+/// The flavour is checked once when the image is opened, see isPE64();
+/// all code working on the headers is then instantiated for PE32 and
+/// PE64 and does not have to ask for the flavour on every field access.
+template <class PE>
+class PEImage
+  {
+  public:
+    typedef typename PE::NtHeaders NtHeaders;
+
+    PEImage(void *ntheader) : nt((NtHeaders *) ntheader)
+    {
+    }
+
+    NtHeaders *getHeaders(void)
+    {
+      return nt;
+    }
+
+    static DWORD getHeaderSize(void)
+    {
+      return sizeof (NtHeaders);
+    }
+
+    ULONG64 getImageBase(void)
+    {
+      return nt->OptionalHeader.ImageBase;
+    }
+
+    void setImageBase(ULONG64 base)
+    {
+      nt->OptionalHeader.ImageBase = (typename PE::Address) base;
+    }
+
+    ULONG getSizeOfImage(void)
+    {
+      return nt->OptionalHeader.SizeOfImage;
+    }
+
+    PDWORD getCheckSum(void)
+    {
+      return &nt->OptionalHeader.CheckSum;
+    }
+
+    PDWORD getTimeDateStamp(void)
+    {
+      return &nt->FileHeader.TimeDateStamp;
+    }
+
+    PWORD getDllCharacteristics(void)
+    {
+      return &nt->OptionalHeader.DllCharacteristics;
+    }
+
+    DataDirectory *getDataDirectory(int index)
+    {
+      return (DataDirectory *) &nt->OptionalHeader.DataDirectory[index];
+    }
+
+    SectionHeader *getSectionHeaders(void)
+    {
+      return (SectionHeader *) (nt + 1);
+    }
+
+    int getSectionCount(void)
+    {
+      return nt->FileHeader.NumberOfSections;
+    }
+
+    PWORD getCharacteristics(void)
+    {
+      return &nt->FileHeader.Characteristics;
+    }
+
+    typename PE::Address *getSizeOfStackReserve(void)
+    {
+      return &nt->OptionalHeader.SizeOfStackReserve;
+    }
+
+    typename PE::Address *getSizeOfStackCommit(void)
+    {
+      return &nt->OptionalHeader.SizeOfStackCommit;
+    }
+
+    typename PE::Address *getSizeOfHeapReserve(void)
+    {
+      return &nt->OptionalHeader.SizeOfHeapReserve;
+    }
+
+    typename PE::Address *getSizeOfHeapCommit(void)
+    {
+      return &nt->OptionalHeader.SizeOfHeapCommit;
+    }
+
+    PDWORD getLoaderFlags(void)
+    {
+      return &nt->OptionalHeader.LoaderFlags;
+    }
+
+  private:
+    NtHeaders *nt;
+  };
+
+// true if the NT headers at ntheader belong to a PE32+ image
+static inline bool
+isPE64(const void *ntheader)
+{
+  return ((const IMAGE_NT_HEADERS32 *) ntheader)->OptionalHeader.Magic
+	 == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+}
+
+#endif
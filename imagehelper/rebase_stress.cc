@@ -0,0 +1,311 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * $Id$
+ */
+
+/* Stress test of ReBaseImageEx with several threads, built with
+   -fsanitize=thread by "make check-tsan".
+
+     rebase_stress [-n COPIES] [-j THREADS] [-d DIR] DLL
+
+   DLL is copied COPIES times into DIR, and all copies are rebased by one
+   ReBaseImageEx call with THREADS threads, each to its own base, mapped
+   and streamed, updating and recomputing the checksum.  A second set of
+   copies is rebased the same way with one thread.  Every result, every
+   progress call, the image base and checksum of every copy are checked,
+   and both sets have to be identical. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <windows.h>
+
+#include "checksum.h"
+#include "imagehelper.h"
+
+// an arbitrary, fixed time stamp, so both sets get the same one
+#define STRESS_TIMESTAMP 0x5a5a5a5a
+
+static int failures;
+
+static void
+fail (const char *name, const char *what)
+{
+  fprintf (stderr, "%s: %s\n", name, what);
+  ++failures;
+}
+
+// read file name into a malloc'ed buffer
+static BYTE *
+read_file (const char *name, size_t *len)
+{
+  FILE *file = fopen (name, "rb");
+  struct stat st;
+  BYTE *buf = NULL;
+
+  if (!file)
+    return NULL;
+  if (fstat (fileno (file), &st) == 0
+      && (buf = (BYTE *) malloc (st.st_size + 1))
+      && fread (buf, 1, st.st_size, file) != (size_t) st.st_size)
+    {
+      free (buf);
+      buf = NULL;
+    }
+  *len = st.st_size;
+  fclose (file);
+  return buf;
+}
+
+static bool
+write_file (const char *name, const BYTE *buf, size_t len)
+{
+  FILE *file = fopen (name, "wb");
+  bool ok;
+
+  if (!file)
+    return false;
+  ok = fwrite (buf, 1, len, file) == len;
+  return fclose (file) == 0 && ok;
+}
+
+// the checksum stored in image name; valid is set if it matches the
+// checksum computed from scratch
+static DWORD
+stored_checksum (const char *name, bool *valid)
+{
+  DWORD stored = 0, zero = 0;
+  size_t len, offset;
+  LONG lfanew;
+  BYTE *buf;
+
+  *valid = false;
+  if (!(buf = read_file (name, &len)))
+    return 0;
+  memcpy (&lfanew, buf + offsetof (IMAGE_DOS_HEADER, e_lfanew), sizeof lfanew);
+  offset = lfanew + offsetof (IMAGE_NT_HEADERS32, OptionalHeader.CheckSum);
+  if (lfanew > 0 && offset + sizeof stored <= len)
+    {
+      memcpy (&stored, buf + offset, sizeof stored);
+      memcpy (buf + offset, &zero, sizeof zero);
+      *valid = PEChecksum::finish (PEChecksum::sum (buf, len, 0), len)
+	       == stored;
+    }
+  free (buf);
+  return stored;
+}
+
+// progress calls per entry, serialized by ReBaseImageEx
+static ULONG *progressCalls;
+
+static BOOL
+progress (ULONG Index, ULONG Count, const REBASE_IMAGE_ENTRY *Entry,
+	  const REBASE_IMAGE_RESULT *Result, PVOID Context)
+{
+  if (Index >= Count || Entry != &((const REBASE_IMAGE_ENTRY *) Context)[Index])
+    fail (Entry->ImageName, "progress called with a wrong entry");
+  else
+    ++progressCalls[Index];
+  return TRUE;
+}
+
+// rebase the copies named in entries with threads threads and check the
+// results against the original image at oldBase
+static void
+rebase_copies (REBASE_IMAGE_ENTRY *entries, ULONG count, ULONG threads,
+	       ULONG64 oldBase)
+{
+  REBASE_IMAGE_RESULT *results;
+  ULONG i;
+  BOOL ret;
+
+  results = (REBASE_IMAGE_RESULT *) calloc (count, sizeof *results);
+  progressCalls = (ULONG *) calloc (count, sizeof *progressCalls);
+  if (!results || !progressCalls)
+    {
+      fail ("rebase_stress", "out of memory");
+      exit (2);
+    }
+  ret = ReBaseImageEx (entries, results, count, threads, progress, entries);
+  for (i = 0; i < count; ++i)
+    {
+      const char *name = entries[i].ImageName;
+      ULONG64 base;
+      ULONG size;
+      bool valid;
+
+      if (results[i].Error != NO_ERROR)
+	{
+	  fprintf (stderr, "%s: rebase failed with error %u\n",
+		   name, (unsigned int) results[i].Error);
+	  ++failures;
+	  continue;
+	}
+      if (progressCalls[i] != 1)
+	fail (name, "not reported exactly once to progress");
+      if (results[i].OldImageBase != oldBase
+	  || results[i].NewImageBase != entries[i].ImageBase)
+	fail (name, "wrong old or new base in the result");
+      if (!GetImageInfos64 (name, NULL, &base, &size)
+	  || base != entries[i].ImageBase)
+	fail (name, "not at the requested base");
+      // updating keeps a zero checksum, recomputing always sets it
+      if ((stored_checksum (name, &valid) != 0
+	   || (entries[i].Flags & REBASE_IMAGE_RECOMPUTE_CHECKSUM))
+	  && !valid)
+	fail (name, "invalid checksum");
+    }
+  if (!ret && !failures)
+    fail ("ReBaseImageEx", "returned FALSE without a failed image");
+  free (progressCalls);
+  free (results);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: rebase_stress [-n COPIES] [-j THREADS] [-d DIR] DLL\n");
+  exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ULONG copies = 64, threads = 8, i;
+  const char *dir = "rebase_stress.tmp";
+  REBASE_IMAGE_ENTRY *entries[2];
+  ULONG64 oldBase, base, slot;
+  ULONG size;
+  WORD machine;
+  size_t len;
+  BYTE *image;
+  int opt, set;
+
+  while ((opt = getopt (argc, argv, "n:j:d:")) != -1)
+    switch (opt)
+      {
+      case 'n':
+	copies = strtoul (optarg, NULL, 0);
+	break;
+      case 'j':
+	threads = strtoul (optarg, NULL, 0);
+	break;
+      case 'd':
+	dir = optarg;
+	break;
+      default:
+	usage ();
+      }
+  if (optind != argc - 1 || copies == 0 || threads == 0)
+    usage ();
+  if (!GetImageInfos64 (argv[optind], &machine, &oldBase, &size)
+      || !(image = read_file (argv[optind], &len)))
+    {
+      fprintf (stderr, "%s: not a readable PE image\n", argv[optind]);
+      return 2;
+    }
+  if (mkdir (dir, 0755) < 0 && errno != EEXIST)
+    {
+      perror (dir);
+      return 2;
+    }
+
+  // one slot per copy, well away from the original base
+  slot = (size + 0xffff) & ~0xffffULL;
+  base = machine == IMAGE_FILE_MACHINE_I386 ? 0x10000000ULL : 0x300000000ULL;
+  if (oldBase >= base && oldBase < base + copies * slot)
+    base = oldBase + slot;
+  for (set = 0; set < 2; ++set)
+    {
+      entries[set] = (REBASE_IMAGE_ENTRY *) calloc (copies,
+						    sizeof *entries[set]);
+      if (!entries[set])
+	{
+	  fprintf (stderr, "rebase_stress: out of memory\n");
+	  return 2;
+	}
+      for (i = 0; i < copies; ++i)
+	{
+	  REBASE_IMAGE_ENTRY *entry = &entries[set][i];
+	  char *name = (char *) malloc (strlen (dir) + 32);
+
+	  if (!name)
+	    {
+	      fprintf (stderr, "rebase_stress: out of memory\n");
+	      return 2;
+	    }
+	  sprintf (name, "%s/%c%u.dll", dir, set ? 's' : 'c', (unsigned int) i);
+	  if (!write_file (name, image, len))
+	    {
+	      perror (name);
+	      return 2;
+	    }
+	  entry->ImageName = name;
+	  entry->ImageBase = base + i * slot;
+	  entry->Flags = (i & 1) ? REBASE_IMAGE_UPDATE_CHECKSUM
+				 : REBASE_IMAGE_RECOMPUTE_CHECKSUM;
+	  entry->TimeStamp = STRESS_TIMESTAMP;
+	  entry->StreamingThreshold = (i & 2) ? 1 : (ULONG64) -1;
+	}
+    }
+  free (image);
+
+  rebase_copies (entries[0], copies, threads, oldBase);
+  rebase_copies (entries[1], copies, 1, oldBase);
+
+  // the concurrent result must not differ from the serial one
+  for (i = 0; i < copies; ++i)
+    {
+      size_t len0, len1;
+      BYTE *buf0 = read_file (entries[0][i].ImageName, &len0);
+      BYTE *buf1 = read_file (entries[1][i].ImageName, &len1);
+
+      if (!buf0 || !buf1 || len0 != len1 || memcmp (buf0, buf1, len0))
+	fail (entries[0][i].ImageName, "differs from the serial rebase");
+      free (buf0);
+      free (buf1);
+    }
+
+  // keep the copies of a failed run for inspection
+  for (set = 0; set < 2; ++set)
+    {
+      for (i = 0; i < copies; ++i)
+	{
+	  if (!failures)
+	    unlink (entries[set][i].ImageName);
+	  free ((char *) entries[set][i].ImageName);
+	}
+      free (entries[set]);
+    }
+  if (!failures)
+    rmdir (dir);
+
+  if (failures)
+    {
+      fprintf (stderr, "rebase_stress: %d failures\n", failures);
+      return 1;
+    }
+  printf ("rebase_stress: %u copies, %u threads: ok\n",
+	  (unsigned int) copies, (unsigned int) threads);
+  return 0;
+}
@@ -20,6 +20,10 @@
 
 #include <iostream>
 #include <sstream>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <windows.h>
 /* Take care of old w32api releases which screwed up the definition. */
@@ -28,36 +32,227 @@
 #endif
 
 #include "objectfile.h"
+#include "streamfile.h"
+#include "peimage.h"
+#include "checksum.h"
 #include "imagehelper.h"
 
 BOOL ReBaseChangeFileTime = FALSE;
 BOOL ReBaseDropDynamicbaseFlag = FALSE;
+ULONG64 ReBaseStreamingThreshold = 64 * 1024 * 1024;
+BOOL ReBaseUpdateCheckSum = FALSE;
+BOOL ReBaseRecomputeCheckSum = FALSE;
 
-BOOL ReBaseImage64 (
-  LPCSTR CurrentImageName,
-  LPCSTR SymbolPath,       // ignored
-  BOOL fReBase,
-  BOOL fRebaseSysfileOk,   // ignored
-  BOOL fGoingDown,
-  ULONG CheckImageSize,    // ignored
-  ULONG *OldImageSize,
-  ULONG64 *OldImageBase,
-  ULONG *NewImageSize,
-  ULONG64 *NewImageBase,
-  ULONG TimeStamp
+// a mapped image is written back by the system when it is unmapped
+static inline bool
+flushImage (LinkedObjectFile &dll)
+{
+  return true;
+}
+
+static inline bool
+flushImage (StreamedObjectFile &dll)
+{
+  return dll.flush ();
+}
+
+// store value in field, returns true if that changed it
+template <class T>
+static inline bool
+setHeaderField (T *field, ULONG64 value)
+{
+  if (*field == (T) value)
+    return false;
+  *field = (T) value;
+  return true;
+}
+
+// apply the header changes of entry to image, returns true if any field
+// changed.
+template <class PE>
+static bool
+editHeader (PEImage<PE> image, const REBASE_IMAGE_HEADER *header)
+{
+  bool changed = false;
+  WORD characteristics, dllCharacteristics;
+
+  characteristics = (*image.getCharacteristics () | header->CharacteristicsSet)
+		    & ~header->CharacteristicsClear;
+  changed |= setHeaderField (image.getCharacteristics (), characteristics);
+  dllCharacteristics = (*image.getDllCharacteristics ()
+			| header->DllCharacteristicsSet)
+		       & ~header->DllCharacteristicsClear;
+  changed |= setHeaderField (image.getDllCharacteristics (),
+			     dllCharacteristics);
+
+  if (header->SizeMask & (1 << REBASE_IMAGE_STACK_RESERVE))
+    changed |= setHeaderField (image.getSizeOfStackReserve (),
+			       header->Sizes[REBASE_IMAGE_STACK_RESERVE]);
+  if (header->SizeMask & (1 << REBASE_IMAGE_STACK_COMMIT))
+    changed |= setHeaderField (image.getSizeOfStackCommit (),
+			       header->Sizes[REBASE_IMAGE_STACK_COMMIT]);
+  if (header->SizeMask & (1 << REBASE_IMAGE_HEAP_RESERVE))
+    changed |= setHeaderField (image.getSizeOfHeapReserve (),
+			       header->Sizes[REBASE_IMAGE_HEAP_RESERVE]);
+  if (header->SizeMask & (1 << REBASE_IMAGE_HEAP_COMMIT))
+    changed |= setHeaderField (image.getSizeOfHeapCommit (),
+			       header->Sizes[REBASE_IMAGE_HEAP_COMMIT]);
+  if (header->SizeMask & (1 << REBASE_IMAGE_LOADER_FLAGS))
+    changed |= setHeaderField (image.getLoaderFlags (),
+			       header->Sizes[REBASE_IMAGE_LOADER_FLAGS]);
+  return changed;
+}
+
+// true if the sizes of header fit into the fields of image
+template <class PE>
+static bool
+checkHeaderSizes (PEImage<PE> image, const REBASE_IMAGE_HEADER *header)
+{
+  for (int i = 0; i < REBASE_IMAGE_SIZES; ++i)
+    if ((header->SizeMask & (1 << i))
+	&& header->Sizes[i] > ((i == REBASE_IMAGE_LOADER_FLAGS
+				|| sizeof (typename PE::Address) == 4)
+			       ? 0xffffffffULL : 0x0000ffffffffffffULL))
+      return false;
+  return true;
+}
+
+template <class PE, class ImageFile>
+static bool
+rebaseImageView (
+  ImageFile &dll,
+  PEImage<PE> image,
+  const REBASE_IMAGE_ENTRY *entry,
+  REBASE_IMAGE_RESULT *result
 )
 {
-  if (fReBase == 0)
+  ULONG flags = entry->Flags;
+
+  // set new header elements
+  result->OldImageBase = image.getImageBase ();
+  result->OldImageSize = image.getSizeOfImage ();
+
+  // Round NewImageSize to be consistent with MS's rebase.
+  const ULONG imageSizeGranularity = 0x10000;
+  result->NewImageSize = result->OldImageSize;
+  ULONG remainder = result->NewImageSize % imageSizeGranularity;
+  if (remainder)
+    result->NewImageSize = (result->NewImageSize - remainder)
+			   + imageSizeGranularity;
+
+  result->NewImageBase = entry->ImageBase;
+  if (flags & REBASE_IMAGE_GOING_DOWN)
+    result->NewImageBase -= result->NewImageSize;
+
+  bool editing = (flags & REBASE_IMAGE_EDIT_HEADER) != 0;
+
+  // already rebased
+  if (result->OldImageBase == result->NewImageBase)
     {
-      SetLastError(ERROR_INVALID_PARAMETER);
+      if (Base::debug)
+        std::cerr << "dll is already rebased" << std::endl;
+      result->AlreadyRebased = TRUE;
+      if (!editing)
+	return true;
+    }
+
+  if (editing && !checkHeaderSizes (image, &entry->Header))
+    {
+      if (Base::debug)
+        std::cerr << "error: header size value too big" << std::endl;
+      result->Error = ERROR_INVALID_PARAMETER;
       return false;
     }
 
-  LinkedObjectFile dll(CurrentImageName,true);
+  // An existing checksum is kept valid by accounting for every changed
+  // value instead of summing up the whole file again afterwards.
+  PEChecksum sum;
+  PEChecksum *psum = 0;
+  PDWORD checksum = image.getCheckSum ();
+  typename PE::NtHeaders oldNTHeader;
 
+  if ((flags & REBASE_IMAGE_UPDATE_CHECKSUM)
+      && !(flags & REBASE_IMAGE_RECOMPUTE_CHECKSUM) && *checksum != 0
+      && sum.init (*checksum, dll.getFileSize ()))
+    {
+      oldNTHeader = *image.getHeaders ();
+      psum = &sum;
+    }
+
+  if (!result->AlreadyRebased)
+    {
+      image.setImageBase (result->NewImageBase);
+      *image.getTimeDateStamp () = entry->TimeStamp;
+
+      int64_t difference = result->NewImageBase - result->OldImageBase;
+
+      if (!dll.performRelocation(difference, psum, &result->Relocations))
+	{
+	  if (Base::debug)
+	    std::cerr << "error: could not rebase image" << std::endl;
+	  result->Error = ERROR_BAD_FORMAT;
+	  return false;
+	}
+
+      if (flags & REBASE_IMAGE_DROP_DYNAMICBASE)
+	*image.getDllCharacteristics ()
+	  &= ~IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE;
+    }
+
+  // The header changes go into the same write as the rebase.  An image
+  // at its base already is only written if they change anything.
+  if (editing)
+    result->HeaderChanged = editHeader (image, &entry->Header);
+  if (result->AlreadyRebased && !result->HeaderChanged)
+    return true;
+
+  if (psum)
+    {
+      // the CheckSum field is still unchanged, so it doesn't contribute
+      sum.update (dll.getNTHeaderOffset (), &oldNTHeader, image.getHeaders (),
+		  image.getHeaderSize ());
+      *checksum = sum.get ();
+    }
+  else if (flags & REBASE_IMAGE_RECOMPUTE_CHECKSUM)
+    {
+      *checksum = 0;
+      DWORD newCheckSum = dll.computeCheckSum ();
+      if (!newCheckSum)
+	{
+	  if (Base::debug)
+	    std::cerr << "error: could not compute checksum" << std::endl;
+	  result->Error = ERROR_READ_FAULT;
+	  return false;
+	}
+      *checksum = newCheckSum;
+    }
+
+  if (!flushImage (dll))
+    {
+      if (Base::debug)
+        std::cerr << "error: could not write image header" << std::endl;
+      result->Error = ERROR_WRITE_FAULT;
+      return false;
+    }
+
+  // after all writes, otherwise writing the header changes it again.
+  if ((flags & REBASE_IMAGE_CHANGE_FILE_TIME) && !result->AlreadyRebased)
+    dll.setFileTime (entry->TimeStamp);
+
+  return true;
+}
+
+template <class ImageFile>
+static bool
+rebaseImageFile (
+  ImageFile &dll,
+  const REBASE_IMAGE_ENTRY *entry,
+  REBASE_IMAGE_RESULT *result
+)
+{
   if (!dll.isLoaded())
     {
-      SetLastError(ERROR_FILE_NOT_FOUND);
+      result->Error = ERROR_FILE_NOT_FOUND;
       return false;
     }
 
@@ -65,85 +260,223 @@ BOOL ReBaseImage64 (
     {
       if (Base::debug)
         std::cerr << "error: dll relocation errors - please fix the errors at first" << std::endl;
-      SetLastError(ERROR_INVALID_DATA);
+      result->Error = ERROR_INVALID_DATA;
       return false;
     }
 
-  PIMAGE_NT_HEADERS32 ntheader32 = dll.getNTHeader32 ();
-  PIMAGE_NT_HEADERS64 ntheader64 = dll.getNTHeader64 ();
-
-  // set new header elements
+  // the only place which asks for the flavour of the image
   if (dll.is64bit ())
+    return rebaseImageView (dll, PEImage<PE64> (dll.getNTHeader64 ()),
+			    entry, result);
+  return rebaseImageView (dll, PEImage<PE32> (dll.getNTHeader32 ()),
+			  entry, result);
+}
+
+// Rebase a single image as described by entry.
+static void
+rebaseOneImage (const REBASE_IMAGE_ENTRY *entry, REBASE_IMAGE_RESULT *result)
+{
+  memset (result, 0, sizeof *result);
+
+  // Mapping a huge image just to patch a few relocated pages costs a lot
+  // of address space and page cache.  Beyond the threshold only the
+  // headers and the relocation table are read and each relocated page is
+  // patched in place.
+  ULONG64 threshold = entry->StreamingThreshold
+		      ? entry->StreamingThreshold : ReBaseStreamingThreshold;
+  struct stat st;
+  if (stat (entry->ImageName, &st) == 0
+      && (ULONG64) st.st_size >= threshold)
     {
-      *OldImageBase = ntheader64->OptionalHeader.ImageBase;
-      *OldImageSize = ntheader64->OptionalHeader.SizeOfImage;
-      *NewImageSize = ntheader64->OptionalHeader.SizeOfImage;
+      if (Base::debug)
+        std::cerr << "streaming rebase of " << entry->ImageName << std::endl;
+      StreamedObjectFile dll(entry->ImageName,true);
+      rebaseImageFile (dll, entry, result);
     }
   else
     {
-      *OldImageBase = ntheader32->OptionalHeader.ImageBase;
-      *OldImageSize = ntheader32->OptionalHeader.SizeOfImage;
-      *NewImageSize = ntheader32->OptionalHeader.SizeOfImage;
+      LinkedObjectFile dll(entry->ImageName,true);
+      rebaseImageFile (dll, entry, result);
     }
 
-  // Round NewImageSize to be consistent with MS's rebase.
-  const ULONG imageSizeGranularity = 0x10000;
-  ULONG remainder = *NewImageSize % imageSizeGranularity;
-  if (remainder)
-    *NewImageSize = (*NewImageSize - remainder) + imageSizeGranularity;
-
-  if (fGoingDown)
-    *NewImageBase -= *NewImageSize;
-
-  // already rebased
-  if ((dll.is64bit () && ntheader64->OptionalHeader.ImageBase == *NewImageBase)
-      || (dll.is32bit () && ntheader32->OptionalHeader.ImageBase == *NewImageBase))
+  if (result->Error == ERROR_INVALID_DATA
+      && (entry->Flags & REBASE_IMAGE_FIX_RELOCATIONS))
     {
-      if (!fGoingDown)
-        *NewImageBase += *NewImageSize;
       if (Base::debug)
-        std::cerr << "dll is already rebased" << std::endl;
-      SetLastError(NO_ERROR);
-      return true;
+        std::cerr << "fixing bad relocations of " << entry->ImageName << std::endl;
+      // like FixImage, but without going through the last error
+      {
+	LinkedObjectFile dll(entry->ImageName,true);
+	if (!dll.isLoaded())
+	  result->Error = ERROR_FILE_NOT_FOUND;
+	else if (!dll.fixRelocations())
+	  result->Error = ERROR_INVALID_DATA;
+	else
+	  result->Error = NO_ERROR;
+      }
+      if (result->Error != NO_ERROR)
+	return;
+      REBASE_IMAGE_ENTRY retry = *entry;
+      retry.Flags &= ~REBASE_IMAGE_FIX_RELOCATIONS;
+      rebaseOneImage (&retry, result);
+      if (result->Error == NO_ERROR)
+	result->Repaired = TRUE;
     }
+}
 
-  if (dll.is64bit ())
+// the state shared by the threads of one ReBaseImageEx call
+struct RebaseBatch
+{
+  const REBASE_IMAGE_ENTRY *entries;
+  REBASE_IMAGE_RESULT *results;
+  ULONG count;
+  PREBASE_IMAGE_PROGRESS progress;
+  PVOID context;
+  int debug;                // debug level of the calling thread
+  pthread_mutex_t lock;     // protects next, cancelled and progress calls
+  ULONG next;               // the next entry to rebase
+  bool cancelled;
+};
+
+static void *
+rebaseWorker (void *arg)
+{
+  RebaseBatch *batch = (RebaseBatch *) arg;
+  ULONG i;
+
+  Base::debug = batch->debug;
+  for (;;)
     {
-      ntheader64->OptionalHeader.ImageBase = *NewImageBase;
-      ntheader64->FileHeader.TimeDateStamp = TimeStamp;
+      pthread_mutex_lock (&batch->lock);
+      if (batch->cancelled || batch->next >= batch->count)
+	{
+	  pthread_mutex_unlock (&batch->lock);
+	  break;
+	}
+      i = batch->next++;
+      pthread_mutex_unlock (&batch->lock);
+
+      rebaseOneImage (&batch->entries[i], &batch->results[i]);
+
+      if (batch->progress)
+	{
+	  pthread_mutex_lock (&batch->lock);
+	  if (!batch->cancelled
+	      && !batch->progress (i, batch->count, &batch->entries[i],
+				   &batch->results[i], batch->context))
+	    batch->cancelled = true;
+	  pthread_mutex_unlock (&batch->lock);
+	}
     }
-  else
+  return NULL;
+}
+
+BOOL ReBaseImageEx (
+  const REBASE_IMAGE_ENTRY *Entries,
+  REBASE_IMAGE_RESULT *Results,
+  ULONG Count,
+  ULONG Threads,
+  PREBASE_IMAGE_PROGRESS Progress,
+  PVOID Context
+)
+{
+  DWORD error = NO_ERROR;
+  RebaseBatch batch;
+  pthread_t *threads = NULL;
+  ULONG started = 0;
+  ULONG i;
+
+  batch.entries = Entries;
+  batch.results = Results;
+  batch.count = Count;
+  batch.progress = Progress;
+  batch.context = Context;
+  batch.debug = Base::debug;
+  batch.next = 0;
+  batch.cancelled = false;
+  pthread_mutex_init (&batch.lock, NULL);
+
+  if (Threads > Count)
+    Threads = Count;
+  if (Threads > 1)
+    threads = (pthread_t *) malloc ((Threads - 1) * sizeof *threads);
+  // the calling thread is one of the workers; if no other thread can be
+  // started, it rebases all images alone.
+  for (; threads && started < Threads - 1; started++)
+    if (pthread_create (&threads[started], NULL, rebaseWorker, &batch))
+      break;
+  rebaseWorker (&batch);
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+  free (threads);
+  pthread_mutex_destroy (&batch.lock);
+
+  // entries not taken by any worker have been cancelled
+  for (i = batch.next; i < Count; i++)
     {
-      ntheader32->OptionalHeader.ImageBase = *NewImageBase;
-      ntheader32->FileHeader.TimeDateStamp = TimeStamp;
+      memset (&Results[i], 0, sizeof Results[i]);
+      Results[i].Error = ERROR_CANCELLED;
     }
+  for (i = 0; i < Count && error == NO_ERROR; i++)
+    error = Results[i].Error;
 
-  int64_t difference = *NewImageBase - *OldImageBase;
+  SetLastError(error);
+  return error == NO_ERROR;
+}
 
-  if (!dll.performRelocation(difference))
+BOOL ReBaseImage64 (
+  LPCSTR CurrentImageName,
+  LPCSTR SymbolPath,       // ignored
+  BOOL fReBase,
+  BOOL fRebaseSysfileOk,   // ignored
+  BOOL fGoingDown,
+  ULONG CheckImageSize,    // ignored
+  ULONG *OldImageSize,
+  ULONG64 *OldImageBase,
+  ULONG *NewImageSize,
+  ULONG64 *NewImageBase,
+  ULONG TimeStamp
+)
+{
+  REBASE_IMAGE_ENTRY entry;
+  REBASE_IMAGE_RESULT result;
+
+  if (fReBase == 0)
     {
-      if (Base::debug)
-        std::cerr << "error: could not rebase image" << std::endl;
-      SetLastError(ERROR_BAD_FORMAT);
+      SetLastError(ERROR_INVALID_PARAMETER);
       return false;
     }
 
+  entry.ImageName = CurrentImageName;
+  entry.ImageBase = *NewImageBase;
+  entry.Flags = 0;
+  if (fGoingDown)
+    entry.Flags |= REBASE_IMAGE_GOING_DOWN;
   if (ReBaseChangeFileTime)
-    dll.setFileTime (TimeStamp);
-
+    entry.Flags |= REBASE_IMAGE_CHANGE_FILE_TIME;
   if (ReBaseDropDynamicbaseFlag)
+    entry.Flags |= REBASE_IMAGE_DROP_DYNAMICBASE;
+  if (ReBaseUpdateCheckSum)
+    entry.Flags |= REBASE_IMAGE_UPDATE_CHECKSUM;
+  if (ReBaseRecomputeCheckSum)
+    entry.Flags |= REBASE_IMAGE_RECOMPUTE_CHECKSUM;
+  entry.TimeStamp = TimeStamp;
+  entry.StreamingThreshold = 0;
+  memset (&entry.Header, 0, sizeof entry.Header);
+
+  rebaseOneImage (&entry, &result);
+  if (result.Error != NO_ERROR)
     {
-      if (dll.is64bit ())
-	ntheader64->OptionalHeader.DllCharacteristics
-	  &= ~IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE;
-      else
-	ntheader32->OptionalHeader.DllCharacteristics
-	  &= ~IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE;
+      SetLastError(result.Error);
+      return false;
     }
 
-  if (!fGoingDown)
-    *NewImageBase += *NewImageSize;
-
+  *OldImageBase = result.OldImageBase;
+  *OldImageSize = result.OldImageSize;
+  *NewImageSize = result.NewImageSize;
+  // Like MS's rebase, return the base for the next image when going up.
+  *NewImageBase = fGoingDown ? result.NewImageBase
+			     : result.NewImageBase + result.NewImageSize;
   SetLastError(NO_ERROR);
   return true;
 }
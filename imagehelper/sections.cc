@@ -24,8 +24,10 @@
 #include <iomanip>
 
 #include "sections.h"
+#include "checksum.h"
+#include "peimage.h"
 
-int Base::debug = 0;
+__thread int Base::debug = 0;
 
 Section::Section(void *aFileBase, SectionHeader *p)
 {
@@ -72,19 +74,18 @@ bool Section::isIn(uint addr)
 SectionList::SectionList(void *aFileBase)
 {
   PIMAGE_DOS_HEADER dosheader = (PIMAGE_DOS_HEADER) aFileBase;
-  PIMAGE_NT_HEADERS32 ntheader32 = (PIMAGE_NT_HEADERS32) ((char *)dosheader + dosheader->e_lfanew);
-  PIMAGE_NT_HEADERS64 ntheader64 = (PIMAGE_NT_HEADERS64) ntheader32;
+  void *ntheader = (char *)dosheader + dosheader->e_lfanew;
 
   FileBase = (uintptr_t) aFileBase;
-  if (ntheader32->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+  if (isPE64(ntheader))
     {
-      header = (SectionHeader *) (ntheader64+1);
-      count = ntheader64->FileHeader.NumberOfSections;
+      header = PEImage<PE64>(ntheader).getSectionHeaders();
+      count = PEImage<PE64>(ntheader).getSectionCount();
     }
   else
     {
-      header = (SectionHeader *) (ntheader32+1);
-      count = ntheader32->FileHeader.NumberOfSections;
+      header = PEImage<PE32>(ntheader).getSectionHeaders();
+      count = PEImage<PE32>(ntheader).getSectionCount();
     }
   sections = new Section*[count];
   for (int i = 0; i < count; i++)
@@ -369,10 +370,36 @@ bool Relocations::fix(void)
 }
 
 
-bool Relocations::relocate(int64_t difference)
+// add difference to the Value at patch_adr
+template <class Value>
+static inline void
+patchValue(void *fileBase, void *patch_adr, int64_t difference, PEChecksum *sum)
+{
+  Value *p = (Value *) patch_adr;
+  Value old = *p;
+  *p += difference;
+  if (sum)
+    sum->update((char *)p - (char *)fileBase, &old, p, sizeof old);
+}
+
+bool Relocations::relocate(int64_t difference, PEChecksum *sum, ULONG *applied)
+{
+  PIMAGE_DOS_HEADER dosheader = (PIMAGE_DOS_HEADER) sections->getFileBase();
+
+  if (isPE64((char *)dosheader + dosheader->e_lfanew))
+    return relocateImage<PE64>(difference, sum, applied);
+  return relocateImage<PE32>(difference, sum, applied);
+}
+
+template <class PE>
+bool Relocations::relocateImage(int64_t difference, PEChecksum *sum, ULONG *applied)
 {
   PIMAGE_BASE_RELOCATION relocp = relocs;
   int WholeNumOfRelocs = 0;
+  ULONG patched = 0;
+  void *fileBase = sections->getFileBase();
+  // the native relocations are patched without any tracing
+  const bool fast = !debug;
 
   if (!relocs)
     return false;
@@ -409,6 +436,16 @@ bool Relocations::relocate(int64_t difference)
 	  WORD rel_type = (*p & 0xf000) >> 12;
 	  int location = (*p & 0x0fff) + va;
 
+	  // the relocation type native to the flavour is the common case
+	  if (rel_type == PE::RelocType && fast)
+	    {
+	      patchValue<typename PE::RelocValue>(fileBase,
+						  cursec->rva2real(location),
+						  difference, sum);
+	      patched++;
+	      continue;
+	    }
+
 	  switch (rel_type)
 	    {
 	    case IMAGE_REL_BASED_ABSOLUTE:
@@ -424,8 +461,9 @@ bool Relocations::relocate(int64_t difference)
 		    << std::setw(8) << std::setfill('0') << std::hex << location + adjust + 3 << std::dec \
 		    << std::endl;
 		  }
-		int32_t *patch_adr = (int *)cursec->rva2real(location);
-		*patch_adr += difference;
+		patchValue<int32_t>(fileBase,
+				    cursec->rva2real(location), difference, sum);
+		patched++;
 	      }
 	      break;
 	    case IMAGE_REL_BASED_DIR64:
@@ -439,8 +477,9 @@ bool Relocations::relocate(int64_t difference)
 		    << std::setw(16) << std::setfill('0') << std::hex << location + adjust + 7 << std::dec \
 		    << std::endl;
 		  }
-		int64_t *patch_adr = (int64_t *)cursec->rva2real(location);
-		*patch_adr += difference;
+		patchValue<int64_t>(fileBase,
+				    cursec->rva2real(location), difference, sum);
+		patched++;
 	      }
 	      break;
 	    default:
@@ -449,5 +488,7 @@ bool Relocations::relocate(int64_t difference)
 	    }
         }
     }
+  if (applied)
+    *applied = patched;
   return true;
 }
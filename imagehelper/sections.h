@@ -77,7 +77,7 @@ class BoundImportDescriptor : public IMAGE_BOUND_IMPORT_DESCRIPTOR
 class Base
   {
   public:
-    static int debug; /// 1 = print dedebug mode 
+    static __thread int debug; /// 1 = print dedebug mode, per thread
   };
 
 
@@ -141,6 +141,12 @@ class SectionList : public Base
     Section *find(const char *name);
     Section *find(uint address);
 
+    // return memory address of the file start
+    void *getFileBase(void)
+    {
+      return (void *) FileBase;
+    }
+
     // reset iterator
     void reset(void);
 
@@ -195,6 +201,8 @@ class Imports : public SectionBase
     ImportDescriptor *iterator;
   };
 
+class PEChecksum;
+
 class Relocations : SectionBase
   {
   public:
@@ -208,9 +216,14 @@ class Relocations : SectionBase
     bool fix(void);
 
     // precondition: fixed dll
-    bool relocate(int64_t difference);
+    // relocate the image by difference.  If sum is given, it is updated
+    // with every patched value, applied receives the number of patches.
+    bool relocate(int64_t difference, PEChecksum *sum = 0, ULONG *applied = 0);
 
   private:
+    template <class PE>
+    bool relocateImage(int64_t difference, PEChecksum *sum, ULONG *applied);
+
     PIMAGE_BASE_RELOCATION relocs;
     SectionList *sections;
     int size;   // section size
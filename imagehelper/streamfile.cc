@@ -0,0 +1,449 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * $Id$
+ */
+
+#include <stdlib.h>
+#include <iostream>
+#include <iomanip>
+
+#include "objectfile.h"
+#include "streamfile.h"
+#include "peimage.h"
+#include "checksum.h"
+
+/* Size of the initial header read.  Covers the DOS and NT headers and the
+   section table of every sane image; larger headers are read again. */
+#define HEADER_CHUNK	4096
+/* Relocations are applied in windows of this many bytes of file data. */
+#define PATCH_WINDOW	4096
+/* Chunk size for reading the whole file when computing the checksum. */
+#define CHECKSUM_CHUNK	(1024 * 1024)
+
+typedef struct
+{
+  ULONG64 offset;	// file offset of the patched value
+  WORD type;		// IMAGE_REL_BASED_xxx
+} patch_t;
+
+static int
+patch_cmp (const void *a, const void *b)
+{
+  const patch_t *pa = (const patch_t *) a;
+  const patch_t *pb = (const patch_t *) b;
+  return pa->offset < pb->offset ? -1 : pa->offset > pb->offset ? 1 : 0;
+}
+
+static inline int
+patch_width (WORD type)
+{
+  switch (type)
+    {
+    case IMAGE_REL_BASED_HIGHLOW:
+      return 4;
+    case IMAGE_REL_BASED_DIR64:
+      return 8;
+    default:
+      return 0;
+    }
+}
+
+//------- class StreamedObjectFile ----------------------------------
+
+StreamedObjectFile::StreamedObjectFile(const char *aFileName, bool writeable)
+{
+  hfile = INVALID_HANDLE_VALUE;
+  fileSize = 0;
+  isWritable = writeable;
+  headers = 0;
+  headerSize = 0;
+  ntheader = 0;
+  sectionHeaders = 0;
+  sectionCount = 0;
+  relocs = 0;
+  relocSize = 0;
+  is64bit_img = false;
+
+  PWSTR win32_path = (PWSTR) malloc (WIN32_PATH_MAX * sizeof (WCHAR));
+  if (!win32_path)
+    {
+      Error = 2;
+      return;
+    }
+  hfile = CreateFileW(Win32Path(aFileName, win32_path),
+		      writeable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		      FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  free (win32_path);
+  if (hfile == INVALID_HANDLE_VALUE)
+    {
+      Error = 2;
+      return;
+    }
+
+  DWORD high = 0;
+  DWORD low = GetFileSize (hfile, &high);
+  fileSize = ((ULONG64) high << 32) | low;
+  if (fileSize < sizeof (IMAGE_DOS_HEADER))
+    {
+      Error = 4;
+      return;
+    }
+
+  headerSize = fileSize < HEADER_CHUNK ? (DWORD) fileSize : HEADER_CHUNK;
+  headers = (PBYTE) malloc (headerSize);
+  if (!headers || !readAt (headers, headerSize, 0))
+    {
+      Error = 3;
+      return;
+    }
+
+  // basic file sanity checks to avoid crashes, same as in ObjectFile.
+  PIMAGE_DOS_HEADER dosheader = (PIMAGE_DOS_HEADER) headers;
+  if (dosheader->e_magic != 0x5a4d)	/* "MZ" */
+    {
+      Error = 4;
+      return;
+    }
+  if (dosheader->e_lfanew < 0
+      || fileSize < dosheader->e_lfanew + sizeof (IMAGE_NT_HEADERS32))
+    {
+      Error = 4;
+      return;
+    }
+
+  // the complete header area is the NT header plus the section table.
+  // Since e_lfanew may point anywhere, fetch the NT header first if it is
+  // not covered by the initial chunk.
+  DWORD needed = dosheader->e_lfanew + sizeof (IMAGE_NT_HEADERS64);
+  for (int pass = 0; pass < 2; pass++)
+    {
+      if (needed > fileSize)
+	needed = (DWORD) fileSize;
+      if (needed > headerSize)
+	{
+	  PBYTE p = (PBYTE) realloc (headers, needed);
+	  if (!p)
+	    {
+	      Error = 3;
+	      return;
+	    }
+	  headers = p;
+	  if (!readAt (headers + headerSize, needed - headerSize, headerSize))
+	    {
+	      Error = 3;
+	      return;
+	    }
+	  headerSize = needed;
+	}
+      ntheader = (PIMAGE_NT_HEADERS32)
+		 (headers + ((PIMAGE_DOS_HEADER) headers)->e_lfanew);
+      if (ntheader->Signature != 0x00004550)
+	{
+	  Error = 4;
+	  return;
+	}
+      is64bit_img = isPE64 (ntheader);
+      if (is64bit_img)
+	{
+	  sectionHeaders = PEImage<PE64> (ntheader).getSectionHeaders ();
+	  sectionCount = PEImage<PE64> (ntheader).getSectionCount ();
+	}
+      else
+	{
+	  sectionHeaders = PEImage<PE32> (ntheader).getSectionHeaders ();
+	  sectionCount = PEImage<PE32> (ntheader).getSectionCount ();
+	}
+      needed = (PBYTE) (sectionHeaders + sectionCount) - headers;
+    }
+  if (needed > headerSize)
+    {
+      Error = 4;
+      return;
+    }
+  // only the header area proper is written back by flush(); the rest of
+  // the initial chunk may belong to sections patched in place.
+  headerSize = needed;
+
+  // load the relocation table.  The same lookup by name as
+  // LinkedObjectFile is used, so both paths accept the same images.
+  for (int i = 0; i < sectionCount; i++)
+    {
+      char name[9];
+      strncpy (name, (char *) sectionHeaders[i].Name, 8);
+      name[8] = '\0';
+      if (!strstr (name, ".reloc"))
+	continue;
+      relocSize = sectionHeaders[i].SizeOfRawData;
+      if (sectionHeaders[i].PointerToRawData + (ULONG64) relocSize > fileSize)
+	{
+	  Error = 4;
+	  return;
+	}
+      relocs = (PBYTE) malloc (relocSize ? relocSize : 1);
+      if (!relocs
+	  || !readAt (relocs, relocSize, sectionHeaders[i].PointerToRawData))
+	{
+	  Error = 3;
+	  return;
+	}
+      break;
+    }
+
+  if (debug)
+    std::cerr << "streamed image: headers 0x" << std::hex << headerSize
+	      << " relocs 0x" << relocSize << std::dec << std::endl;
+
+  Error = 0;
+}
+
+StreamedObjectFile::~StreamedObjectFile()
+{
+  if (relocs)
+    free (relocs);
+  if (headers)
+    free (headers);
+  if (hfile != INVALID_HANDLE_VALUE)
+    CloseHandle (hfile);
+}
+
+bool StreamedObjectFile::readAt(void *buf, DWORD len, ULONG64 offset)
+{
+  OVERLAPPED ov;
+  DWORD done;
+
+  memset (&ov, 0, sizeof ov);
+  ov.Offset = (DWORD) offset;
+  ov.OffsetHigh = (DWORD) (offset >> 32);
+  return ReadFile (hfile, buf, len, &done, &ov) && done == len;
+}
+
+bool StreamedObjectFile::writeAt(const void *buf, DWORD len, ULONG64 offset)
+{
+  OVERLAPPED ov;
+  DWORD done;
+
+  memset (&ov, 0, sizeof ov);
+  ov.Offset = (DWORD) offset;
+  ov.OffsetHigh = (DWORD) (offset >> 32);
+  return WriteFile (hfile, buf, len, &done, &ov) && done == len;
+}
+
+SectionHeader *StreamedObjectFile::findSection(DWORD rva)
+{
+  for (int i = 0; i < sectionCount; i++)
+    if (rva >= sectionHeaders[i].VirtualAddress
+	&& rva < sectionHeaders[i].VirtualAddress
+		 + sectionHeaders[i].SizeOfRawData)
+      return &sectionHeaders[i];
+  return 0;
+}
+
+void StreamedObjectFile::setFileTime (ULONG seconds_since_epoche)
+{
+  LARGE_INTEGER filetime;
+  filetime.QuadPart = seconds_since_epoche * NSPERSEC + FACTOR;
+  if (!SetFileTime (hfile, NULL, NULL, (FILETIME *) &filetime))
+    std::cerr << "SetFileTime: " << GetLastError () << std::endl;
+}
+
+bool StreamedObjectFile::checkRelocations(void)
+{
+  PIMAGE_BASE_RELOCATION relocp = (PIMAGE_BASE_RELOCATION) relocs;
+  int errors = 0;
+
+  if (!relocs)
+    return false;
+
+  for (; &relocp->SizeOfBlock < (PDWORD) (relocs + relocSize) && relocp->SizeOfBlock != 0; relocp = (PIMAGE_BASE_RELOCATION) ((char *)relocp + relocp->SizeOfBlock))
+    {
+      if (!findSection (relocp->VirtualAddress))
+	{
+	  if (debug)
+	    std::cerr << "warning: dll is corrupted - relocations for '0x" \
+	    << std::setw(8) << std::setfill('0') << std::hex << relocp->VirtualAddress << std::dec \
+	    << "' are pointing to a non existent section" << std::endl;
+	  errors++;
+	}
+    }
+  return errors == 0;
+}
+
+// add difference to the Value at patch_adr, which is at offset in the file
+template <class Value>
+static inline void
+patchValue (BYTE *patch_adr, ULONG64 offset, int64_t difference,
+	    PEChecksum *sum)
+{
+  Value v, old;
+  memcpy (&old, patch_adr, sizeof v);
+  v = old + difference;
+  memcpy (patch_adr, &v, sizeof v);
+  if (sum)
+    sum->update (offset, &old, &v, sizeof v);
+}
+
+bool StreamedObjectFile::performRelocation(int64_t difference, PEChecksum *sum,
+					   ULONG *applied)
+{
+  if (is64bit_img)
+    return relocateImage<PE64> (difference, sum, applied);
+  return relocateImage<PE32> (difference, sum, applied);
+}
+
+template <class PE>
+bool StreamedObjectFile::relocateImage(int64_t difference, PEChecksum *sum,
+				       ULONG *applied)
+{
+  PIMAGE_BASE_RELOCATION relocp = (PIMAGE_BASE_RELOCATION) relocs;
+  patch_t *patches;
+  size_t count = 0;
+  bool ret = true;
+
+  if (!relocs)
+    return false;
+
+  // the number of WORD entries is an upper bound for the number of patches
+  patches = (patch_t *) malloc ((relocSize / sizeof (WORD) + 1) * sizeof *patches);
+  if (!patches)
+    return false;
+
+  // pass 1: translate every relocation into a file offset.
+  for (; &relocp->SizeOfBlock < (PDWORD) (relocs + relocSize) && relocp->SizeOfBlock != 0; relocp = (PIMAGE_BASE_RELOCATION) ((char *)relocp + relocp->SizeOfBlock))
+    {
+      int NumOfRelocs = (relocp->SizeOfBlock - sizeof(IMAGE_BASE_RELOCATION)) / sizeof (WORD);
+      DWORD va = relocp->VirtualAddress;
+      PWORD p = (PWORD)((uintptr_t)relocp + sizeof(IMAGE_BASE_RELOCATION));
+
+      SectionHeader *cursec = findSection (va);
+      if (!cursec)
+	{
+	  if (debug)
+	    std::cerr << "warning: dll is corrupted - the relocations '0x" \
+	    << std::setw(8) << std::setfill('0') << std::hex << va << std::dec \
+	    << "' points to a non existing section and could not be relocated" << std::endl;
+	  free (patches);
+	  return false;
+	}
+
+      for (int i = 0; i < NumOfRelocs; i++,p++)
+	{
+	  WORD rel_type = (*p & 0xf000) >> 12;
+	  DWORD location = (*p & 0x0fff) + va;
+
+	  if (rel_type == IMAGE_REL_BASED_ABSOLUTE)
+	    continue;
+	  if (!patch_width (rel_type))
+	    {
+	      std::cerr << "Unsupported relocation type " << rel_type << std::endl;
+	      continue;
+	    }
+	  patches[count].offset = (ULONG64) location - cursec->VirtualAddress
+				  + cursec->PointerToRawData;
+	  patches[count].type = rel_type;
+	  if (patches[count].offset + patch_width (rel_type) > fileSize)
+	    {
+	      if (debug)
+		std::cerr << "warning: relocation at 0x" << std::hex
+			  << location << std::dec
+			  << " is beyond the end of file" << std::endl;
+	      free (patches);
+	      return false;
+	    }
+	  count++;
+	}
+    }
+
+  // pass 2: apply them window by window in ascending file order, so each
+  // page is read and written exactly once.
+  qsort (patches, count, sizeof *patches, patch_cmp);
+
+  BYTE window[PATCH_WINDOW + 8];
+  size_t i = 0;
+  while (i < count)
+    {
+      ULONG64 start = patches[i].offset;
+      ULONG64 end = start;
+      size_t j;
+
+      for (j = i; j < count && patches[j].offset < start + PATCH_WINDOW; j++)
+	if (patches[j].offset + patch_width (patches[j].type) > end)
+	  end = patches[j].offset + patch_width (patches[j].type);
+
+      if (!readAt (window, (DWORD) (end - start), start))
+	{
+	  ret = false;
+	  break;
+	}
+      for (; i < j; i++)
+	{
+	  BYTE *patch_adr = window + (patches[i].offset - start);
+	  // the relocation type native to the flavour is the common case
+	  if (patches[i].type == PE::RelocType)
+	    patchValue<typename PE::RelocValue> (patch_adr, patches[i].offset,
+						 difference, sum);
+	  else if (patches[i].type == IMAGE_REL_BASED_HIGHLOW)
+	    patchValue<int32_t> (patch_adr, patches[i].offset, difference, sum);
+	  else
+	    patchValue<int64_t> (patch_adr, patches[i].offset, difference, sum);
+	}
+      if (!writeAt (window, (DWORD) (end - start), start))
+	{
+	  ret = false;
+	  break;
+	}
+    }
+
+  if (debug)
+    std::cerr << "streamed " << count << " relocations" << std::endl;
+  if (applied)
+    *applied = count;
+
+  free (patches);
+  return ret;
+}
+
+bool StreamedObjectFile::flush(void)
+{
+  if (!isWritable)
+    return false;
+  return writeAt (headers, headerSize, 0);
+}
+
+DWORD StreamedObjectFile::computeCheckSum(void)
+{
+  ULONG64 partial = 0;
+  PBYTE buf;
+
+  if (!flush ())
+    return 0;
+  buf = (PBYTE) malloc (CHECKSUM_CHUNK);
+  if (!buf)
+    return 0;
+  for (ULONG64 off = 0; off < fileSize; off += CHECKSUM_CHUNK)
+    {
+      DWORD len = fileSize - off < CHECKSUM_CHUNK
+		  ? (DWORD) (fileSize - off) : CHECKSUM_CHUNK;
+      if (!readAt (buf, len, off))
+	{
+	  free (buf);
+	  return 0;
+	}
+      partial += PEChecksum::sum (buf, len, off);
+    }
+  free (buf);
+  return PEChecksum::finish (partial, fileSize);
+}
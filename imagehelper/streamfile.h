@@ -0,0 +1,118 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * $Id$
+ */
+
+#ifndef STREAMFILE_H
+#define STREAMFILE_H
+
+#include "sections.h"
+
+class PEChecksum;
+
+/// an image which is edited with positional reads and writes.
+/// Unlike ObjectFile it never maps the file.  Only the headers and the
+/// .reloc section are kept in memory; relocated pages are read, patched
+/// and written back one at a time in ascending file offset order.
+class StreamedObjectFile : public Base
+  {
+
+  public:
+    StreamedObjectFile(const char *FileName, bool writeable = false);
+    ~StreamedObjectFile();
+
+    PIMAGE_NT_HEADERS64 getNTHeader64 (void)
+    {
+      return (PIMAGE_NT_HEADERS64) ntheader;
+    }
+
+    PIMAGE_NT_HEADERS32 getNTHeader32 (void)
+    {
+      return ntheader;
+    }
+
+    bool isLoaded(void)
+    {
+      return Error == 0;
+    }
+
+    bool is64bit(void)
+    {
+      return is64bit_img;
+    }
+
+    bool is32bit(void)
+    {
+      return !is64bit_img;
+    }
+
+    int getError(void)
+    {
+      return Error;
+    }
+
+    ULONG64 getFileSize(void)
+    {
+      return fileSize;
+    }
+
+    // file offset of the NT headers
+    DWORD getNTHeaderOffset(void)
+    {
+      return (PBYTE) ntheader - headers;
+    }
+
+    // checksum of the whole file; the CheckSum field must be zero.
+    // Writes back the headers before reading the file.
+    DWORD computeCheckSum(void);
+
+    void setFileTime (ULONG seconds_since_epoche);
+
+    // check for bad relocations
+    bool checkRelocations(void);
+
+    // patch all relocated pages in the file
+    // If sum is given, it is updated with every patched value, applied
+    // receives the number of patches.
+    bool performRelocation(int64_t difference, PEChecksum *sum = 0,
+			   ULONG *applied = 0);
+
+    // write back the (modified) headers
+    bool flush(void);
+
+  private:
+    template <class PE>
+    bool relocateImage(int64_t difference, PEChecksum *sum, ULONG *applied);
+    bool readAt(void *buf, DWORD len, ULONG64 offset);
+    bool writeAt(const void *buf, DWORD len, ULONG64 offset);
+    SectionHeader *findSection(DWORD rva);
+
+    HANDLE hfile;
+    ULONG64 fileSize;
+    int Error;
+    bool isWritable;
+
+    PBYTE headers;      // DOS header, NT headers and section table
+    DWORD headerSize;
+    PIMAGE_NT_HEADERS32 ntheader;
+    SectionHeader *sectionHeaders;
+    int sectionCount;
+    PBYTE relocs;       // raw content of the .reloc section
+    DWORD relocSize;
+    bool is64bit_img;
+  };
+
+#endif
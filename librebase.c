@@ -0,0 +1,3546 @@
+/*
+ * Copyright (c) 2001, 2002, 2003, 2004, 2008, 2011, 2012, 2013 Jason Tishler
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ *
+ * Written by Jason Tishler <jason@tishler.net>
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__CYGWIN__) || defined(__MSYS__)
+#include <sys/cygwin.h>
+#endif
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "imagehelper.h"
+#include "librebase.h"
+#include "rebase-db.h"
+#include "rebase-cache.h"
+#include "rebase-journal.h"
+#include "rebase-daemon.h"
+#include "peoptions.h"
+
+#if !defined (__CYGWIN__) && !defined (__MSYS__)
+#undef SYSCONFDIR
+#define SYSCONFDIR "/../etc"
+#endif
+#define IMG_INFO_FILE SYSCONFDIR "/rebase.db"
+#define IMG_INFO_FILE_I386 SYSCONFDIR "/rebase.db.i386"
+#define IMG_INFO_FILE_AMD64 SYSCONFDIR "/rebase.db.x86_64"
+#define TMP_FILE_SUFFIX ".XXXXXX"
+/* Snapshot of the list while a database rebase is in progress. */
+#define PLAN_SUFFIX ".plan"
+/* The log is compacted into the database once it would grow beyond
+   a quarter of the database, or this size for small databases. */
+#define LOG_COMPACT_MIN (64 * 1024)
+
+#if defined(__MSYS__)
+# define CYGWIN_DLL "/usr/bin/msys-1.0.dll"
+#elif defined (__CYGWIN__)
+# define CYGWIN_DLL "/usr/bin/cygwin1.dll"
+#endif
+
+#define LONG_PATH_MAX 32768
+/* Allocation unit of the image name arena. */
+#define NAME_BLOCK_SIZE (64 * 1024)
+/* Initial size of the image table, doubled whenever it is full. */
+#define IMG_INFO_INITIAL_SIZE 256
+/* Upper limit of threads reading the DLL headers for -i. */
+#define INFO_THREADS_MAX 16
+/* DLLs handed to an -i thread at once. */
+#define INFO_CHUNK 32
+/* Number of gaps printed by --summary. */
+#define INFO_GAPS 5
+/* Size of the windows in the utilisation table of --layout-report. */
+#define LAYOUT_WINDOW 0x10000000ULL
+
+/* The path names of the image table are allocated from an arena, a chain
+   of blocks which are freed all at once with the table. */
+typedef struct _name_block
+{
+  struct _name_block *next;
+  size_t used;
+  size_t size;
+  char data[];
+} name_block_t;
+
+struct _rebase_ctx
+{
+  WORD machine;
+  ULONG64 image_base;
+  ULONG64 low_addr;
+  BOOL down_flag;
+  BOOL image_info_flag;
+  BOOL info_summary;
+  BOOL image_storage_flag;
+  BOOL image_oblivious_flag;
+  BOOL force_rebase_flag;
+  BOOL defrag_flag;
+  BOOL rollback_flag;
+  BOOL resume_flag;
+  ULONG offset;
+  BOOL verbose;
+  BOOL quiet;
+  const char *progname;
+
+  /* Settings of the imagehelper library, applied before each rebase. */
+  BOOL touch;
+  BOOL drop_dynamicbase;
+  BOOL update_checksum;
+  BOOL recompute_checksum;
+  ULONG64 stream_threshold;
+  BOOL edit_header;
+  rebase_header_t header;
+
+  char *cache_dir;
+  ULONG64 cache_size;
+
+  char *db_file;
+  char *tmp_file;
+  char *journal_file;
+  char *plan_file;
+  char *log_file;
+
+  /* The database as loaded or last saved.  The changes against it are
+     appended to the log, unless db_section_size is 0. */
+  img_info_hdr_t db_hdr;
+  img_info_t *db_list;		/* db_hdr.count entries, sorted by name. */
+  char *db_names;
+  ULONG db_section_crc;
+  size_t db_section_size;
+  size_t log_size;		/* Length of the valid part of the log. */
+  off_t log_file_size;		/* Length of the log file, to notice appends
+				   of other processes. */
+  BOOL journaling;		/* Rebased files are recorded in the journal. */
+  int db_lock;			/* Exclusive lock, held while the journal and
+				   the plan are in use, or -1. */
+
+  /* After the first commit the database matches the files, so only the
+     new files have to be checked on every further commit. */
+  BOOL database_verified;
+  BOOL database_changed;
+  /* Next base address without database. */
+  ULONG64 next_image_base;
+
+  ULONG allocation_slot;	/* Allocation granularity. */
+
+  img_info_t *img_info_list;
+  unsigned int img_info_size;
+  unsigned int img_info_rebase_start;
+  unsigned int img_info_max_size;
+  name_block_t *names;		/* Arena of the names in img_info_list. */
+  size_t names_size;		/* Bytes allocated from the arena. */
+  size_t names_dropped;		/* Bytes of names dropped from the list. */
+
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  ULONG64 cygwin_dll_image_base;
+  ULONG cygwin_dll_image_size;
+#endif
+};
+
+static int lock_database (rebase_ctx_t *ctx);
+static void unlock_database (rebase_ctx_t *ctx);
+static int save_image_info (rebase_ctx_t *ctx);
+static int write_image_info (rebase_ctx_t *ctx, const char *file,
+			     ULONG *crc, size_t *size);
+static int log_image_info (rebase_ctx_t *ctx);
+static void remember_image_info (rebase_ctx_t *ctx);
+static int remerge_image_info (rebase_ctx_t *ctx);
+static size_t diff_image_info (rebase_ctx_t *ctx, BYTE *buf);
+static void free_image_info (rebase_ctx_t *ctx);
+static BYTE *build_section (rebase_ctx_t *ctx, size_t *size);
+static int write_section (rebase_ctx_t *ctx, int fd, const char *file,
+			  const BYTE *section, size_t size);
+static int load_image_info (rebase_ctx_t *ctx, const char *file);
+static int merge_image_info (rebase_ctx_t *ctx);
+static int place_images (rebase_ctx_t *ctx);
+static int defrag_image_info (rebase_ctx_t *ctx, img_info_t *list,
+			      unsigned int count);
+static int replay_journal (rebase_ctx_t *ctx);
+static int resume_plan (rebase_ctx_t *ctx);
+static int rebase_database (rebase_ctx_t *ctx);
+static BOOL collect_image_info (rebase_ctx_t *ctx, const char *pathname);
+static char *full_path_name (rebase_ctx_t *ctx, const char *pathname);
+static void print_image_info (rebase_ctx_t *ctx);
+static BOOL rebase_entry (rebase_ctx_t *ctx, img_info_t *img);
+static void edit_entry_header (rebase_ctx_t *ctx, img_info_t *img);
+static BOOL rebase (rebase_ctx_t *ctx, const char *pathname,
+		    ULONG64 *new_image_base, BOOL down_flag);
+static BOOL is_rebaseable (const char *pathname);
+static BOOL edit_header (rebase_ctx_t *ctx, const char *pathname,
+			 ULONG64 image_base);
+
+/* Allocate LEN bytes from the name arena.  Long names get a block of
+   their own, so they don't waste the rest of the current block. */
+static char *
+name_alloc (rebase_ctx_t *ctx, size_t len)
+{
+  name_block_t *block = ctx->names;
+
+  if (!block || block->size - block->used < len)
+    {
+      size_t size = len > NAME_BLOCK_SIZE / 4 ? len : NAME_BLOCK_SIZE;
+
+      block = (name_block_t *) malloc (sizeof *block + size);
+      if (!block)
+	return NULL;
+      block->used = 0;
+      block->size = size;
+      if (size == len && ctx->names)
+	{
+	  block->next = ctx->names->next;
+	  ctx->names->next = block;
+	}
+      else
+	{
+	  block->next = ctx->names;
+	  ctx->names = block;
+	}
+    }
+  block->used += len;
+  ctx->names_size += len;
+  return block->data + block->used - len;
+}
+
+static char *
+name_dup (rebase_ctx_t *ctx, const char *name)
+{
+  size_t len = strlen (name) + 1;
+  char *ret = name_alloc (ctx, len);
+
+  if (ret)
+    memcpy (ret, name, len);
+  return ret;
+}
+
+/* Account for a name dropped from the list.  The space is reclaimed by
+   compact_names. */
+static inline void
+name_drop (rebase_ctx_t *ctx, size_t len)
+{
+  ctx->names_dropped += len;
+}
+
+static void
+free_names (rebase_ctx_t *ctx)
+{
+  name_block_t *block;
+
+  while ((block = ctx->names))
+    {
+      ctx->names = block->next;
+      free (block);
+    }
+  ctx->names_size = 0;
+  ctx->names_dropped = 0;
+}
+
+/* Once most of the arena is taken by dropped names, as it happens in a
+   long running daemon, copy the names still in the list into a fresh
+   arena. */
+static void
+compact_names (rebase_ctx_t *ctx)
+{
+  name_block_t *old = ctx->names;
+  size_t old_size = ctx->names_size;
+  size_t live = ctx->names_size - ctx->names_dropped;
+  unsigned int i;
+  char *p;
+
+  if (ctx->names_dropped < NAME_BLOCK_SIZE
+      || ctx->names_dropped < ctx->names_size / 2)
+    return;
+  ctx->names = NULL;
+  ctx->names_size = 0;
+  if (!(p = name_alloc (ctx, live)))
+    {
+      /* Keep the old arena. */
+      ctx->names = old;
+      ctx->names_size = old_size;
+      return;
+    }
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      memcpy (p, ctx->img_info_list[i].name, ctx->img_info_list[i].name_size);
+      ctx->img_info_list[i].name = p;
+      p += ctx->img_info_list[i].name_size;
+    }
+  ctx->names_dropped = 0;
+  while (old)
+    {
+      name_block_t *next = old->next;
+      free (old);
+      old = next;
+    }
+}
+
+/* Make room for one more entry in the image list. */
+static BOOL
+grow_image_info (rebase_ctx_t *ctx)
+{
+  img_info_t *list;
+  unsigned int max_size;
+
+  if (ctx->img_info_size < ctx->img_info_max_size)
+    return TRUE;
+  max_size = ctx->img_info_max_size ? ctx->img_info_max_size * 2
+				    : IMG_INFO_INITIAL_SIZE;
+  list = (img_info_t *) realloc (ctx->img_info_list,
+				 max_size * sizeof (img_info_t));
+  if (!list)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      return FALSE;
+    }
+  ctx->img_info_list = list;
+  ctx->img_info_max_size = max_size;
+  return TRUE;
+}
+
+static int
+check_base_address_sanity (rebase_ctx_t *ctx, ULONG64 addr, BOOL at_start)
+{
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  /* Sanity checks for Cygwin:
+   *
+   * - No DLLs below 0x38000000 on 32 bit, W10 1703+ rebase those on
+   *   runtime anyway
+   * - No DLLs below 0x2:00000000, ever, on 64 bit.
+   */
+  if (addr <= ctx->low_addr)
+    {
+      if (at_start)
+	fprintf (stderr, "%s: Invalid Baseaddress 0x%" PRIx64 ", must be > 0x%" PRIx64 "\n",
+		 ctx->progname, (uint64_t) addr, (uint64_t) ctx->low_addr);
+      else
+	fprintf (stderr, "%s: Too many DLLs for available address space: %s\n",
+		 ctx->progname, strerror (ENOMEM));
+      return -1;
+    }
+#endif
+  return 0;
+}
+
+#if !defined(__CYGWIN__) && !defined(__MSYS__)
+int
+mkstemp (char *name)
+{
+  return _open (mktemp (name),
+      O_RDWR | O_BINARY | O_CREAT | O_EXCL | O_TRUNC | _O_SHORT_LIVED,
+      _S_IREAD|_S_IWRITE);
+}
+#endif
+
+/* Remove all DLLs for which rebasing failed from the list, and drop the
+   cannot_rebase flag, before storing the list in the database file. */
+static void
+drop_failed_images (rebase_ctx_t *ctx)
+{
+  int i;
+
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      ctx->img_info_list[i].flag.cannot_rebase = 0;
+      if (ctx->img_info_list[i].flag.needs_rebasing)
+	{
+	  name_drop (ctx, ctx->img_info_list[i].name_size);
+	  ctx->img_info_list[i--] = ctx->img_info_list[--ctx->img_info_size];
+	}
+    }
+}
+
+/* Size of FILE, 0 if it doesn't exist. */
+static off_t
+file_size (const char *file)
+{
+  struct stat st;
+
+  return stat (file, &st) < 0 ? 0 : st.st_size;
+}
+
+/* TRUE if another process saved the database since we loaded or saved
+   it, either by rewriting our section or by appending to its log.  Called
+   with the database locked. */
+static BOOL
+image_info_changed (rebase_ctx_t *ctx)
+{
+  img_info_map_t map;
+  const img_info_hdr_t *section;
+  img_info_hdr_t hdr;
+  size_t size;
+  ULONG generation = 0;
+
+  if (file_size (ctx->log_file) != ctx->log_file_size)
+    return TRUE;
+  if (img_info_map (ctx->db_file, &map) == 0)
+    {
+      section = img_info_map_section (&map, ctx->machine, &size);
+      if (section && img_info_read_hdr (section, size, &hdr))
+	generation = hdr.generation;
+      img_info_unmap (&map);
+    }
+  return generation != ctx->db_hdr.generation;
+}
+
+/* Store the image list in the database, as log records or by rewriting
+   the database. */
+static int
+store_image_info (rebase_ctx_t *ctx)
+{
+  int ret;
+
+  img_info_sort_by_name (ctx->img_info_list, ctx->img_info_size);
+  if ((ret = log_image_info (ctx)) != 0)
+    return ret < 0 ? -1 : 0;
+  if (write_image_info (ctx, ctx->db_file, &ctx->db_section_crc,
+			&ctx->db_section_size) < 0)
+    {
+      ctx->db_section_size = 0;
+      return -1;
+    }
+  /* The log belongs to the old database.  If it can't be removed, it is
+     ignored from now on anyway. */
+  unlink (ctx->log_file);
+  ctx->log_size = 0;
+  ctx->db_hdr.base = ctx->image_base;
+  ctx->db_hdr.offset = ctx->offset;
+  ctx->db_hdr.down_flag = ctx->down_flag;
+  ++ctx->db_hdr.generation;
+  remember_image_info (ctx);
+  return 0;
+}
+
+/* Take the exclusive lock of the database.  The journal and the plan are
+   shared by all rebase runs on the database, so it is held from placing
+   the DLLs until the journal is removed, and while replaying a journal.
+   This serialises all runs, even those rebasing disjoint sets of DLLs.
+   A run which dies releases the lock, so a journal found under the lock
+   has been left by an interrupted run. */
+static int
+lock_database (rebase_ctx_t *ctx)
+{
+  if (ctx->db_lock >= 0)
+    return 0;
+  ctx->db_lock = img_info_lock (ctx->db_file, TRUE);
+  if (ctx->db_lock < 0)
+    {
+      fprintf (stderr, "%s: failed to lock rebase database \"%s\":\n%s\n",
+	       ctx->progname, ctx->db_file, strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+static void
+unlock_database (rebase_ctx_t *ctx)
+{
+  if (ctx->db_lock >= 0)
+    img_info_unlock (ctx->db_lock);
+  ctx->db_lock = -1;
+}
+
+static int
+save_image_info (rebase_ctx_t *ctx)
+{
+  BOOL locked = ctx->db_lock >= 0;
+  int ret;
+
+  /* Do not re-write the database if --oblivious is active */
+  if (ctx->image_oblivious_flag)
+    return 0;
+  drop_failed_images (ctx);
+  /* Storing the list is done under the lock, if the caller doesn't hold
+     it already.  If another rebase saved the database in the meantime,
+     our changes are merged into its version instead of overwriting it. */
+  if (lock_database (ctx) < 0)
+    return -1;
+  if (image_info_changed (ctx) && remerge_image_info (ctx) < 0)
+    ret = -1;
+  else
+    ret = store_image_info (ctx);
+  ctx->log_file_size = file_size (ctx->log_file);
+  if (!locked)
+    unlock_database (ctx);
+  return ret;
+}
+
+/* Compare two names by pointer, for bsearch. */
+static int
+name_ptr_cmp (const void *a, const void *b)
+{
+  return strcmp (*(const char * const *) a, *(const char * const *) b);
+}
+
+/* Another rebase saved the database since we loaded it.  Load its version
+   and apply our changes, as the log records they would become.  Our DLLs
+   whose slot now overlaps a DLL placed by the other rebase are placed and
+   rebased again.  Called with the database locked. */
+static int
+remerge_image_info (rebase_ctx_t *ctx)
+{
+  const img_info_log_rec_t *rec;
+  const char **ours = NULL;
+  unsigned int nours = 0, conflicts = 0, i;
+  img_info_t *img, *owner = NULL, *victim;
+  BOOL force_rebase_flag = ctx->force_rebase_flag;
+  ULONG64 end = 0;
+  BYTE *changes;
+  size_t len, pos;
+  int ret = -1;
+
+  img_info_sort_by_name (ctx->img_info_list, ctx->img_info_size);
+  len = sizeof (img_info_log_hdr_t) + diff_image_info (ctx, NULL);
+  if (!(changes = (BYTE *) calloc (1, len)))
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      return -1;
+    }
+  diff_image_info (ctx, changes + sizeof (img_info_log_hdr_t));
+  free_image_info (ctx);
+  if (load_image_info (ctx, ctx->db_file) < 0)
+    goto out;
+  ctx->force_rebase_flag = force_rebase_flag;
+  if (img_info_log_apply (&ctx->img_info_list, &ctx->img_info_size,
+			  &ctx->img_info_max_size, changes, len) < 0)
+    goto out_of_memory;
+  ours = (const char **) malloc (len / sizeof (img_info_log_rec_t)
+				 * sizeof *ours + 1);
+  if (!ours)
+    goto out_of_memory;
+  /* The records are sorted by name, like the list they are made of. */
+  pos = 0;
+  while ((rec = img_info_log_next (changes, len, &pos)))
+    if (rec->type != IMG_INFO_LOG_REMOVE)
+      ours[nours++] = (const char *) (rec + 1);
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      img = &ctx->img_info_list[i];
+      if ((BYTE *) img->name >= changes && (BYTE *) img->name < changes + len
+	  && !(img->name = name_dup (ctx, img->name)))
+	goto out_of_memory;
+    }
+  /* Find the slots taken twice.  A DLL of ours gives way. */
+  img_info_sort_by_base (ctx->img_info_list, ctx->img_info_size);
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      img = &ctx->img_info_list[i];
+      if (owner && img->base < end)
+	{
+	  if (bsearch (&img->name, ours, nours, sizeof *ours, name_ptr_cmp))
+	    victim = img;
+	  else if (bsearch (&owner->name, ours, nours, sizeof *ours,
+			    name_ptr_cmp))
+	    victim = owner;
+	  else
+	    victim = NULL;
+	  if (victim && !victim->flag.needs_rebasing)
+	    {
+	      victim->flag.needs_rebasing = 1;
+	      ++conflicts;
+	      if (ctx->verbose)
+		fprintf (stderr, "rebasing %s because another rebase took "
+				 "its slot\n", victim->name);
+	    }
+	  if (victim == img)
+	    continue;
+	}
+      if (img->base + img->slot_size > end)
+	{
+	  end = img->base + img->slot_size;
+	  owner = img;
+	}
+    }
+  if (conflicts)
+    {
+      for (i = 0; i < ctx->img_info_size; ++i)
+	if (ctx->img_info_list[i].flag.needs_rebasing)
+	  ctx->img_info_list[i].base = 0;
+      img_info_sort_by_base (ctx->img_info_list, ctx->img_info_size);
+      if (place_images (ctx) < 0)
+	goto out;
+      for (i = 0; i < ctx->img_info_size; ++i)
+	if (ctx->img_info_list[i].flag.needs_rebasing)
+	  rebase_entry (ctx, &ctx->img_info_list[i]);
+      drop_failed_images (ctx);
+    }
+  ctx->img_info_rebase_start = ctx->img_info_size;
+  ret = 0;
+  goto out;
+
+out_of_memory:
+  fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+out:
+  free (ours);
+  free (changes);
+  return ret;
+}
+
+/* Another rebase saved the database between loading it and taking the
+   lock to place the collected DLLs.  Bring the database part of the list
+   up to date like remerge_image_info, and append the collected DLLs again,
+   so they are placed against the current database.  Called with the
+   database locked. */
+static int
+reload_image_info (rebase_ctx_t *ctx)
+{
+  unsigned int count = ctx->img_info_size - ctx->img_info_rebase_start, i;
+  img_info_t *added, *img;
+  size_t names_size = 0;
+  char *names;
+  int ret = -1;
+
+  /* The names of the collected DLLs are in the arena, which is freed
+     when the database is loaded again. */
+  for (i = 0; i < count; ++i)
+    names_size += ctx->img_info_list[ctx->img_info_rebase_start + i].name_size;
+  added = (img_info_t *) malloc (count * sizeof (img_info_t) + 1);
+  names = (char *) malloc (names_size + 1);
+  if (!added || !names)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      goto out;
+    }
+  memcpy (added, ctx->img_info_list + ctx->img_info_rebase_start,
+	  count * sizeof (img_info_t));
+  for (names_size = 0, i = 0; i < count; ++i)
+    {
+      memcpy (names + names_size, added[i].name, added[i].name_size);
+      added[i].name = names + names_size;
+      names_size += added[i].name_size;
+    }
+  ctx->img_info_size = ctx->img_info_rebase_start;
+  if (remerge_image_info (ctx) < 0)
+    goto out;
+  for (i = 0; i < count; ++i)
+    {
+      if (!grow_image_info (ctx))
+	goto out;
+      img = &ctx->img_info_list[ctx->img_info_size];
+      *img = added[i];
+      if (!(img->name = name_dup (ctx, added[i].name)))
+	{
+	  fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+	  goto out;
+	}
+      ++ctx->img_info_size;
+    }
+  ret = 0;
+
+out:
+  free (added);
+  free (names);
+  return ret;
+}
+
+/* Store a copy of the image list, sorted by name, as the state of the
+   database.  If out of memory, the next save rewrites the database. */
+static void
+remember_image_info (rebase_ctx_t *ctx)
+{
+  size_t names_size = 0;
+  char *names;
+  int i;
+
+  free (ctx->db_list);
+  free (ctx->db_names);
+  for (i = 0; i < ctx->img_info_size; ++i)
+    names_size += ctx->img_info_list[i].name_size;
+  ctx->db_list = (img_info_t *) malloc (ctx->img_info_size
+					* sizeof (img_info_t) + 1);
+  ctx->db_names = (char *) malloc (names_size + 1);
+  if (!ctx->db_list || !ctx->db_names)
+    {
+      free (ctx->db_list);
+      free (ctx->db_names);
+      ctx->db_list = NULL;
+      ctx->db_names = NULL;
+      ctx->db_hdr.count = 0;
+      ctx->db_section_size = 0;
+      return;
+    }
+  memcpy (ctx->db_list, ctx->img_info_list,
+	  ctx->img_info_size * sizeof (img_info_t));
+  names = ctx->db_names;
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      memcpy (names, ctx->img_info_list[i].name,
+	      ctx->img_info_list[i].name_size);
+      ctx->db_list[i].name = names;
+      names += ctx->img_info_list[i].name_size;
+    }
+  ctx->db_hdr.count = ctx->img_info_size;
+}
+
+/* Store a log record at BUF for each difference between the database
+   state and the image list, both sorted by name.  Returns the size of the
+   records.  If BUF is NULL, only the size is computed. */
+static size_t
+diff_image_info (rebase_ctx_t *ctx, BYTE *buf)
+{
+  const img_info_t *cur = ctx->img_info_list;
+  const img_info_t *old = ctx->db_list;
+  unsigned int i = 0, j = 0;
+  size_t size = 0;
+  int cmp;
+
+  while (i < ctx->img_info_size || j < ctx->db_hdr.count)
+    {
+      if (i == ctx->img_info_size)
+	cmp = 1;
+      else if (j == ctx->db_hdr.count)
+	cmp = -1;
+      else
+	cmp = strcmp (cur[i].name, old[j].name);
+      if (cmp < 0)
+	size += img_info_log_record (buf ? buf + size : NULL,
+				     IMG_INFO_LOG_ADD, &cur[i++]);
+      else if (cmp > 0)
+	size += img_info_log_record (buf ? buf + size : NULL,
+				     IMG_INFO_LOG_REMOVE, &old[j++]);
+      else
+	{
+	  if (cur[i].base != old[j].base)
+	    size += img_info_log_record (buf ? buf + size : NULL,
+					 IMG_INFO_LOG_MOVE, &cur[i]);
+	  if (cur[i].size != old[j].size
+	      || cur[i].slot_size != old[j].slot_size)
+	    size += img_info_log_record (buf ? buf + size : NULL,
+					 IMG_INFO_LOG_RESIZE, &cur[i]);
+	  ++i;
+	  ++j;
+	}
+    }
+  return size;
+}
+
+/* Append the changes of the image list since the database has been loaded
+   or saved to the log.  Returns 0 if the database has to be rewritten
+   instead, because there is none yet, its header changes or the log grows
+   too big.  Returns 1 if the changes are in the log. */
+static int
+log_image_info (rebase_ctx_t *ctx)
+{
+  img_info_log_hdr_t hdr;
+  BYTE *buf;
+  size_t size, len = 0;
+  int fd;
+
+  if (!ctx->db_section_size
+      || ctx->db_hdr.base != ctx->image_base
+      || ctx->db_hdr.offset != ctx->offset
+      || ctx->db_hdr.down_flag != ctx->down_flag)
+    return 0;
+  size = diff_image_info (ctx, NULL);
+  if (size == 0)
+    return 1;
+  if (ctx->log_size + size > max (LOG_COMPACT_MIN, ctx->db_section_size / 4))
+    return 0;
+  if (!(buf = (BYTE *) malloc (sizeof hdr + size)))
+    return 0;
+  if (ctx->log_size == 0)
+    {
+      memset (&hdr, 0, sizeof hdr);
+      memcpy (hdr.magic, IMG_INFO_LOG_MAGIC, 4);
+      hdr.machine = ctx->machine;
+      hdr.version = IMG_INFO_LOG_VERSION;
+      hdr.section_crc = ctx->db_section_crc;
+      hdr.section_size = ctx->db_section_size;
+      memcpy (buf, &hdr, sizeof hdr);
+      len = sizeof hdr;
+    }
+  len += diff_image_info (ctx, buf + len);
+  /* A torn record at the end of the log is dropped before appending.  If
+     the log can't be written, rewriting the database still works. */
+  if (ctx->log_size == 0)
+    {
+      fd = open (ctx->log_file, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC,
+		 0660);
+      if (fd >= 0)
+	chmod (ctx->log_file, 0660);
+    }
+  else if ((fd = open (ctx->log_file, O_WRONLY | O_BINARY)) >= 0
+	   && (ftruncate (fd, ctx->log_size) < 0
+	       || lseek (fd, ctx->log_size, SEEK_SET) < 0))
+    {
+      close (fd);
+      fd = -1;
+    }
+  if (fd < 0 || write (fd, buf, len) != len)
+    {
+      if (fd >= 0)
+	close (fd);
+      free (buf);
+      return 0;
+    }
+  close (fd);
+  free (buf);
+  ctx->log_size += len;
+  remember_image_info (ctx);
+  return 1;
+}
+
+/* The database section of CTX's image list, as written to the database
+   file: the header, the list and the names.  Returns NULL if out of
+   memory. */
+static BYTE *
+build_section (rebase_ctx_t *ctx, size_t *size)
+{
+  img_info_hdr_t hdr;
+
+  memcpy (hdr.magic, IMG_INFO_MAGIC, 4);
+  hdr.machine = ctx->machine;
+  hdr.version = IMG_INFO_VERSION;
+  hdr.base = ctx->image_base;
+  hdr.offset = ctx->offset;
+  hdr.down_flag = ctx->down_flag;
+  hdr.count = ctx->img_info_size;
+  hdr.generation = ctx->db_hdr.generation + 1;
+  return img_info_build_section (&hdr, ctx->img_info_list, size);
+}
+
+/* Write SECTION to FD.  If FILE is a container, write the container
+   with SECTION in place of the section of CTX's machine instead. */
+static int
+write_section (rebase_ctx_t *ctx, int fd, const char *file,
+	       const BYTE *section, size_t size)
+{
+  img_info_section_t sections[IMG_INFO_SECTIONS_MAX];
+  const void *data[IMG_INFO_SECTIONS_MAX];
+  img_info_map_t map;
+  unsigned int i;
+  int ret;
+
+  if (img_info_map (file, &map) < 0 || !map.container)
+    {
+      if (map.addr)
+	img_info_unmap (&map);
+      return write (fd, section, size) == size ? 0 : -1;
+    }
+  for (i = 0; i < map.count; ++i)
+    {
+      sections[i] = map.sections[i];
+      data[i] = map.addr + map.sections[i].offset;
+      if (map.sections[i].machine == ctx->machine)
+	break;
+    }
+  if (i == IMG_INFO_SECTIONS_MAX)
+    {
+      img_info_unmap (&map);
+      errno = ENOSPC;
+      return -1;
+    }
+  sections[i].machine = ctx->machine;
+  sections[i].size = size;
+  data[i] = section;
+  for (++i; i < map.count; ++i)
+    {
+      sections[i] = map.sections[i];
+      data[i] = map.addr + map.sections[i].offset;
+    }
+  ret = img_info_write_container (fd, i, sections, data);
+  img_info_unmap (&map);
+  return ret;
+}
+
+/* Write the image list to FILE, replacing it atomically.  If CRC is
+   given, the CRC32C and the size of the written section are returned in
+   CRC and SIZE. */
+static int
+write_image_info (rebase_ctx_t *ctx, const char *file, ULONG *crc,
+		  size_t *size)
+{
+  int fd;
+  int ret = 0;
+  BYTE *section;
+  size_t section_size;
+
+  /* Create a temporary file to write to. */
+  fd = mkstemp (ctx->tmp_file);
+  if (fd < 0)
+    {
+      fprintf (stderr, "%s: failed to create temporary rebase database: %s\n",
+	       ctx->progname, strerror (errno));
+      ret = -1;
+      goto out;
+    }
+  img_info_sort_by_name (ctx->img_info_list, ctx->img_info_size);
+  /* The whole section is written at once. */
+  section = build_section (ctx, &section_size);
+  if (!section)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      ret = -1;
+    }
+  else if (write_section (ctx, fd, file, section, section_size) < 0)
+    {
+      fprintf (stderr, "%s: failed to write rebase database: %s\n",
+	       ctx->progname, strerror (errno));
+      ret = -1;
+    }
+  else if (crc)
+    {
+      *crc = ((const img_info_hdr_t *) section)->crc;
+      *size = section_size;
+    }
+  free (section);
+#if defined(__CYGWIN__) && !defined(__MSYS__)
+  /* fchmod is broken on msys */
+  fchmod (fd, 0660);
+#else
+  chmod (ctx->tmp_file, 0660);
+#endif
+  close (fd);
+  if (ret < 0)
+    unlink (ctx->tmp_file);
+  else
+    {
+      if (unlink (file) < 0 && errno != ENOENT)
+	{
+	  fprintf (stderr,
+		   "%s: failed to remove old rebase database file \"%s\":\n"
+		   "%s\n"
+		   "The new rebase database is stored in \"%s\".\n"
+		   "Manually remove \"%s\" and rename \"%s\" to \"%s\",\n"
+		   "otherwise the new rebase database will be unusable.\n",
+		   ctx->progname, file,
+		   strerror (errno),
+		   ctx->tmp_file,
+		   file, ctx->tmp_file, file);
+	  ret = -1;
+	}
+      else if (rename (ctx->tmp_file, file) < 0)
+	{
+	  fprintf (stderr,
+		   "%s: failed to rename \"%s\" to \"%s\":\n"
+		   "%s\n"
+		   "Manually rename \"%s\" to \"%s\",\n"
+		   "otherwise the new rebase database will be unusable.\n",
+		   ctx->progname, ctx->tmp_file, file,
+		   strerror (errno),
+		   ctx->tmp_file, file);
+	  ret = -1;
+	}
+    }
+out:
+  /* mkstemp replaced the template, restore it for the next call, also
+     after a failure. */
+  strcpy (ctx->tmp_file + strlen (ctx->tmp_file) - 6, "XXXXXX");
+  return ret;
+}
+
+static int
+load_image_info (rebase_ctx_t *ctx, const char *file)
+{
+  img_info_map_t map;
+  const img_info_hdr_t *section;
+  img_info_hdr_t hdr;
+  size_t section_size, names_size = 0, log_size = 0;
+  char *names = NULL;
+  BYTE *log = NULL;
+  /* Only the database has a log, the plan hasn't. */
+  BOOL is_db = !strcmp (file, ctx->db_file);
+  ULONG crc;
+  int ret = 0;
+  int i;
+
+  if (is_db)
+    {
+      memset (&ctx->db_hdr, 0, sizeof ctx->db_hdr);
+      ctx->db_section_size = 0;
+      ctx->log_size = 0;
+      ctx->log_file_size = file_size (ctx->log_file);
+    }
+  /* Only the section of our machine is looked at. */
+  if (img_info_map (file, &map) < 0)
+    {
+      /* It's no error if the file doesn't exist.  However, in this case
+	 the -b option is mandatory. */
+      if (errno == ENOENT && ctx->image_base)
+        return 0;
+      if (errno == ENOEXEC)
+	fprintf (stderr, "%s: \"%s\" is not a valid rebase database.\n",
+		 ctx->progname, file);
+      else
+	fprintf (stderr, "%s: failed to open rebase database \"%s\":\n%s\n",
+		 ctx->progname, file, strerror (errno));
+      return -1;
+    }
+  section = img_info_map_section (&map, ctx->machine, &section_size);
+  if (!section && map.container)
+    {
+      img_info_unmap (&map);
+      /* Like a missing file. */
+      if (ctx->image_base)
+	return 0;
+      fprintf (stderr, "%s: \"%s\" has no %s database yet.  Use -b to "
+		       "create it.\n",
+	       ctx->progname, file, img_info_machine_name (ctx->machine));
+      return -1;
+    }
+  if (!section)
+    {
+      if (map.sections[0].machine == IMAGE_FILE_MACHINE_I386)
+	fprintf (stderr,
+"%s: \"%s\" is a database file for 32 bit DLLs but\n"
+"I'm started to handle 64 bit DLLs.  If you want to handle 32 bit DLLs,\n"
+"use the -4 option.\n", ctx->progname, file);
+      else if (map.sections[0].machine == IMAGE_FILE_MACHINE_AMD64)
+	fprintf (stderr,
+"%s: \"%s\" is a database file for 64 bit DLLs but\n"
+"I'm started to handle 32 bit DLLs.  If you want to handle 64 bit DLLs,\n"
+"use the -8 option.\n", ctx->progname, file);
+      else
+	fprintf (stderr, "%s: \"%s\" is a database file for a machine type\n"
+			 "I don't know about.", ctx->progname, file);
+      img_info_unmap (&map);
+      return -1;
+    }
+  if (!img_info_read_hdr (section, section_size, &hdr)
+      || memcmp (hdr.magic, IMG_INFO_MAGIC, 4) != 0)
+    {
+      fprintf (stderr, "%s: \"%s\" is not a valid rebase database.\n",
+	       ctx->progname, file);
+      img_info_unmap (&map);
+      return -1;
+    }
+  if (hdr.version == 0 || hdr.version > IMG_INFO_VERSION)
+    {
+      fprintf (stderr, "%s: \"%s\" is a version %u rebase database.\n"
+		       "I can only handle versions up to %u.\n",
+	       ctx->progname, file, hdr.version, (uint32_t) IMG_INFO_VERSION);
+      img_info_unmap (&map);
+      return -1;
+    }
+  switch (img_info_check_section (section, section_size, &crc))
+    {
+    case -1:
+      fprintf (stderr, "%s: premature end of rebase database \"%s\".\n",
+	       ctx->progname, file);
+      img_info_unmap (&map);
+      return -1;
+    case -2:
+      fprintf (stderr, "%s: rebase database \"%s\" is corrupt (checksum "
+		       "mismatch).\n", ctx->progname, file);
+      img_info_unmap (&map);
+      return -1;
+    }
+  /* If no new image base has been specified, use the one from the header. */
+  if (ctx->image_base == 0)
+    {
+      ctx->image_base = hdr.base;
+      ctx->down_flag = hdr.down_flag;
+    }
+  if (ctx->offset == 0)
+    ctx->offset = hdr.offset;
+  /* Don't enforce rebasing if address and offset are unchanged or taken from
+     the file anyway. */
+  if (ctx->image_base == hdr.base && ctx->offset == hdr.offset)
+    ctx->force_rebase_flag = FALSE;
+  if (is_db)
+    {
+      ctx->db_hdr = hdr;
+      ctx->db_section_crc = crc;
+      ctx->db_section_size = section_size;
+      if (img_info_log_read (ctx->log_file, section, section_size, crc,
+			     &log, &log_size) < 0)
+	{
+	  fprintf (stderr, "%s: failed to read rebase database log \"%s\":\n"
+			   "%s\n", ctx->progname, ctx->log_file,
+		   strerror (errno));
+	  img_info_unmap (&map);
+	  return -1;
+	}
+      ctx->log_size = log_size;
+    }
+  ctx->img_info_size = hdr.count;
+  /* Copy the list out of the mapping and apply the log.  The names
+     point into the mapping or the log until they are copied, too. */
+  ctx->img_info_max_size = roundup (ctx->img_info_size, 100);
+  ctx->img_info_list = img_info_copy_list (section, ctx->img_info_size,
+					   ctx->img_info_max_size);
+  if (ctx->img_info_list && log
+      && img_info_log_apply (&ctx->img_info_list, &ctx->img_info_size,
+			     &ctx->img_info_max_size, log, log_size) < 0)
+    ret = -1;
+  if (ctx->img_info_list && ret == 0)
+    {
+      for (i = 0; i < ctx->img_info_size; ++i)
+	names_size += ctx->img_info_list[i].name_size;
+      names = names_size ? name_alloc (ctx, names_size) : NULL;
+    }
+  if (!ctx->img_info_list || ret < 0 || (names_size && !names))
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      ret = -1;
+    }
+  else
+    {
+      for (i = 0; i < ctx->img_info_size; ++i)
+	{
+	  memcpy (names, ctx->img_info_list[i].name,
+		  ctx->img_info_list[i].name_size);
+	  ctx->img_info_list[i].name = names;
+	  names += ctx->img_info_list[i].name_size;
+	  /* Ensure that existing database entries are not touched when
+	   *  --oblivious is active, even if they are out-of sync with
+	   *  reality. */
+	  if (ctx->image_oblivious_flag)
+	    ctx->img_info_list[i].flag.cannot_rebase = 2;
+	}
+      if (is_db)
+	remember_image_info (ctx);
+    }
+  free (log);
+  img_info_unmap (&map);
+  /* On failure, free all allocated memory and set list pointer to NULL. */
+  if (ret < 0)
+    {
+      free_names (ctx);
+      free (ctx->img_info_list);
+      ctx->img_info_list = NULL;
+      ctx->img_info_size = 0;
+      ctx->img_info_max_size = 0;
+    }
+  return ret;
+}
+
+/* Rebase the collected files and the database entries which need it, and
+   save the database.  Returns the number of rebased DLLs, or -1 on error. */
+static int
+rebase_database (rebase_ctx_t *ctx)
+{
+  int i, rebased = 0;
+  BOOL header;
+
+  /* --resume holds the lock since loading the plan. */
+  if (!ctx->image_oblivious_flag && lock_database (ctx) < 0)
+    return -1;
+  if (!ctx->resume_flag)
+    {
+      /* The DLLs are placed under the lock, against the database as it
+	 is now, not as it was when it has been loaded. */
+      if (!ctx->image_oblivious_flag && image_info_changed (ctx)
+	  && reload_image_info (ctx) < 0)
+	goto fail;
+      if (merge_image_info (ctx) < 0)
+	goto fail;
+      /* Keep the result, so an interrupted run can be resumed without
+	 collecting and placing the DLLs again. */
+      if (!ctx->image_oblivious_flag
+	  && write_image_info (ctx, ctx->plan_file, NULL, NULL) < 0)
+	goto fail;
+    }
+  /* Record every change in the journal until the database is saved. */
+  if (!ctx->image_oblivious_flag
+      && (ctx->resume_flag ? journal_continue (ctx->journal_file, ctx->machine)
+		      : journal_begin (ctx->journal_file, ctx->machine)) < 0)
+    {
+      fprintf (stderr, "%s: failed to create rebase journal \"%s\":\n%s\n",
+	       ctx->progname, ctx->journal_file, strerror (errno));
+      goto fail;
+    }
+  ctx->journaling = !ctx->image_oblivious_flag;
+  for (i = 0; i < ctx->img_info_size; ++i)
+    if (ctx->img_info_list[i].flag.needs_rebasing)
+      {
+	if (rebase_entry (ctx, &ctx->img_info_list[i]))
+	  ++rebased;
+      }
+    /* The header changes of the files at their base already.  Once the
+       database is verified, they have been applied on an earlier commit. */
+    else if (ctx->edit_header && !ctx->database_verified
+	     && !ctx->img_info_list[i].flag.cannot_rebase)
+      edit_entry_header (ctx, &ctx->img_info_list[i]);
+  for (header = FALSE, i = 0; i < ctx->img_info_size; ++i)
+    if (ctx->img_info_list[i].flag.cannot_rebase == 1)
+      {
+	if (!header)
+	  {
+	    fputs ("\nThe following DLLs couldn't be rebased "
+		   "because they were in use:\n", stderr);
+	    header = TRUE;
+	  }
+	fprintf (stderr, "  %s\n", ctx->img_info_list[i].name);
+      }
+  for (header = FALSE, i = 0; i < ctx->img_info_size; ++i)
+    if (ctx->img_info_list[i].flag.needs_rebasing)
+      {
+	if (!header)
+	  {
+	    fputs ("\nThe following DLLs couldn't be rebased "
+		   "due to errors:\n", stderr);
+	    header = TRUE;
+	  }
+	fprintf (stderr, "  %s\n", ctx->img_info_list[i].name);
+      }
+  /* On failure the journal is kept, so the next run can bring the
+     database up to date. */
+  if (save_image_info (ctx) < 0)
+    goto fail;
+  journal_end ();
+  ctx->journaling = FALSE;
+  unlink (ctx->plan_file);
+  unlock_database (ctx);
+  return rebased;
+
+fail:
+  unlock_database (ctx);
+  return -1;
+}
+
+/* Rebase IMG to its base address in the list, recording it in the
+   journal while a database rebase is in progress. */
+static BOOL
+rebase_entry (rebase_ctx_t *ctx, img_info_t *img)
+{
+  ULONG64 new_image_base = img->base;
+  ULONG seq;
+  BOOL journaled = FALSE;
+
+  if (ctx->journaling)
+    {
+      journaled = journal_intent (img->name, new_image_base, &seq) == 0;
+      if (!journaled && !ctx->quiet)
+	fprintf (stderr, "%s: can't record rebase in journal\n", img->name);
+    }
+  if (!rebase (ctx, img->name, &new_image_base, FALSE))
+    return FALSE;
+  img->flag.needs_rebasing = 0;
+  if (journaled)
+    journal_done (seq);
+  return TRUE;
+}
+
+/* Apply the header changes to IMG, a file at its base already, recording
+   it in the journal like rebase_entry. */
+static void
+edit_entry_header (rebase_ctx_t *ctx, img_info_t *img)
+{
+  ULONG seq;
+  BOOL journaled = FALSE;
+
+  if (ctx->journaling)
+    {
+      journaled = journal_intent (img->name, img->base, &seq) == 0;
+      if (!journaled && !ctx->quiet)
+	fprintf (stderr, "%s: can't record header change in journal\n",
+		 img->name);
+    }
+  if (edit_header (ctx, img->name, img->base) && journaled)
+    journal_done (seq);
+}
+
+/* Callbacks for rebase_watch.  Changed files are collected like files
+   added by rebase_add, and merged into the database on flush. */
+static BOOL
+daemon_changed (void *arg, const char *pathname)
+{
+  return collect_image_info ((rebase_ctx_t *) arg, pathname);
+}
+
+static void
+daemon_removed (void *arg, const char *pathname)
+{
+  rebase_ctx_t *ctx = (rebase_ctx_t *) arg;
+  char *name = full_path_name (ctx, pathname);
+  unsigned int i;
+
+  if (!name)
+    return;
+  /* Only needed for the lookup. */
+  name_drop (ctx, strlen (name) + 1);
+  for (i = 0; i < ctx->img_info_rebase_start; ++i)
+    if (!strcmp (ctx->img_info_list[i].name, name))
+      {
+	if (ctx->verbose)
+	  fprintf (stderr, "%s: removed from database\n", name);
+	name_drop (ctx, ctx->img_info_list[i].name_size);
+	memmove (ctx->img_info_list + i, ctx->img_info_list + i + 1,
+		 (ctx->img_info_size - i - 1) * sizeof (img_info_t));
+	--ctx->img_info_rebase_start;
+	--ctx->img_info_size;
+	ctx->database_changed = TRUE;
+	break;
+      }
+}
+
+static int
+daemon_flush (void *arg)
+{
+  rebase_ctx_t *ctx = (rebase_ctx_t *) arg;
+  int ret;
+
+  ret = rebase_commit (ctx);
+  if (ctx->cache_dir)
+    rebase_cache_trim (ctx->cache_dir, ctx->cache_size);
+  return ret;
+}
+
+static unsigned int
+daemon_count (void *arg)
+{
+  return ((rebase_ctx_t *) arg)->img_info_rebase_start;
+}
+
+int
+rebase_watch (rebase_ctx_t *ctx, char * const *roots, int root_count,
+	      const char *control, unsigned int settle)
+{
+  static const rebase_daemon_ops_t ops = {
+    daemon_changed,
+    daemon_removed,
+    daemon_flush,
+    daemon_count
+  };
+  rebase_daemon_config_t config;
+
+  if (!ctx->image_storage_flag)
+    {
+      fprintf (stderr, "%s: watching directories requires the database\n",
+	       ctx->progname);
+      return -1;
+    }
+  config.progname = ctx->progname;
+  config.roots = roots;
+  config.root_count = root_count;
+  config.control = control;
+  config.settle = settle;
+  config.verbose = ctx->verbose;
+  config.arg = ctx;
+  return rebase_daemon (&config, &ops);
+}
+
+/* The ReBaseImageEx streaming threshold of CTX.  0 selects the library
+   default there, but means to stream every image here. */
+static ULONG64
+stream_threshold (rebase_ctx_t *ctx)
+{
+  return ctx->stream_threshold ? ctx->stream_threshold : 1;
+}
+
+/* The ReBaseImageEx flags for the settings of CTX. */
+static ULONG
+rebase_image_flags (rebase_ctx_t *ctx)
+{
+  ULONG flags = REBASE_IMAGE_FIX_RELOCATIONS;
+
+  if (ctx->touch)
+    flags |= REBASE_IMAGE_CHANGE_FILE_TIME;
+  if (ctx->drop_dynamicbase)
+    flags |= REBASE_IMAGE_DROP_DYNAMICBASE;
+  if (ctx->update_checksum)
+    flags |= REBASE_IMAGE_UPDATE_CHECKSUM;
+  if (ctx->recompute_checksum)
+    flags |= REBASE_IMAGE_RECOMPUTE_CHECKSUM;
+  if (ctx->edit_header)
+    flags |= REBASE_IMAGE_EDIT_HEADER;
+  return flags;
+}
+
+/* Fill in the header changes of CTX in IMAGE. */
+static void
+rebase_image_header (rebase_ctx_t *ctx, REBASE_IMAGE_ENTRY *image)
+{
+  int i;
+
+  memset (&image->Header, 0, sizeof image->Header);
+  if (!ctx->edit_header)
+    return;
+  image->Header.CharacteristicsSet = ctx->header.coff_set;
+  image->Header.CharacteristicsClear = ctx->header.coff_clr;
+  image->Header.DllCharacteristicsSet = ctx->header.pe_set;
+  image->Header.DllCharacteristicsClear = ctx->header.pe_clr;
+  image->Header.SizeMask = ctx->header.size_mask;
+  for (i = 0; i < REBASE_IMAGE_SIZES; ++i)
+    image->Header.Sizes[i] = ctx->header.sizes[i];
+}
+
+/* TRUE if the header fields A and B other than the image base differ. */
+static BOOL
+header_differs (const pe_header_fields_t *a, const pe_header_fields_t *b)
+{
+  int i;
+
+  if (a->timestamp != b->timestamp || a->checksum != b->checksum
+      || a->dll_characteristics != b->dll_characteristics
+      || a->characteristics != b->characteristics)
+    return TRUE;
+  for (i = 0; i < PE_SIZES; ++i)
+    if (a->sizes[i] != b->sizes[i])
+      return TRUE;
+  return FALSE;
+}
+
+/* Restore the header fields of a file recorded in the journal. */
+static BOOL
+restore_header (journal_entry_t *entry)
+{
+  if (pe_header_restore (entry->name, &entry->old) < 0)
+    {
+      fprintf (stderr, "%s: failed to restore PE header: %s\n",
+	       entry->name, strerror (errno));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Undo the rebase of a file recorded in the journal.  Rebasing by the
+   negated delta restores all relocations, the header fields a rebase
+   changes are restored from the journal. */
+static BOOL
+rollback_file (rebase_ctx_t *ctx, journal_entry_t *entry)
+{
+  REBASE_IMAGE_ENTRY image;
+  REBASE_IMAGE_RESULT result;
+
+  /* Only the relocations, the header fields are restored below. */
+  image.ImageName = entry->name;
+  image.ImageBase = entry->old_base;
+  image.Flags = 0;
+  image.TimeStamp = entry->old.timestamp;
+  image.StreamingThreshold = stream_threshold (ctx);
+  memset (&image.Header, 0, sizeof image.Header);
+  if (!ReBaseImageEx (&image, &result, 1, 1, NULL, NULL))
+    {
+      fprintf (stderr, "ReBaseImage (%s) failed with last error = %u\n",
+	       entry->name, (uint32_t) result.Error);
+      return FALSE;
+    }
+  if (!restore_header (entry))
+    return FALSE;
+  if (ctx->verbose)
+    printf ("%s: rolled back to base %" PRIx64 "\n",
+	    entry->name, (uint64_t) entry->old_base);
+  return TRUE;
+}
+
+/* Record the new base of a file rebased by the interrupted run in the
+   database list. */
+static BOOL
+roll_forward_file (rebase_ctx_t *ctx, journal_entry_t *entry, ULONG64 new_base)
+{
+  img_info_t *img;
+  WORD dll_machine;
+  unsigned int i;
+
+  for (i = 0; i < ctx->img_info_size; ++i)
+    if (!strcmp (ctx->img_info_list[i].name, entry->name))
+      {
+	ctx->img_info_list[i].base = new_base;
+	return TRUE;
+      }
+  /* Not in the database yet. */
+  if (!grow_image_info (ctx))
+    return FALSE;
+  img = &ctx->img_info_list[ctx->img_info_size];
+  memset (img, 0, sizeof *img);
+  if (!GetImageInfos64 (entry->name, &dll_machine, &img->base, &img->size))
+    return TRUE;
+  img->slot_size = roundup2 (img->size, ctx->allocation_slot);
+  img->name = name_dup (ctx, entry->name);
+  if (!img->name)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      return FALSE;
+    }
+  img->name_size = strlen (img->name) + 1;
+  ++ctx->img_info_size;
+  return TRUE;
+}
+
+/* Check for a journal left by an interrupted run.  Files it has rebased
+   are either recorded in the database (roll forward), or, with
+   --rollback, rebased back to their old address. */
+static int
+replay_journal (rebase_ctx_t *ctx)
+{
+  journal_entry_t *entries;
+  unsigned int count, i;
+  int ret = 0;
+
+  /* The journal of a running rebase is never replayed, it holds the lock
+     until the journal is removed. */
+  if (lock_database (ctx) < 0)
+    return -1;
+  switch (journal_read (ctx->journal_file, ctx->machine, &entries, &count))
+    {
+    case 0:
+      if (ctx->rollback_flag)
+	fprintf (stderr, "%s: no unfinished rebase to roll back\n",
+		 ctx->progname);
+      unlock_database (ctx);
+      return 0;
+    case -1:
+      fprintf (stderr, "%s: failed to read rebase journal \"%s\":\n%s\n",
+	       ctx->progname, ctx->journal_file, strerror (errno));
+      unlock_database (ctx);
+      return -1;
+    }
+  if (!ctx->quiet)
+    fprintf (stderr, "%s: the last rebase didn't finish, %s\n", ctx->progname,
+	     ctx->rollback_flag ? "rolling back" : "updating the database");
+  for (i = 0; i < count; ++i)
+    {
+      /* Undo in reverse order, a resumed run may record a file again. */
+      journal_entry_t *e = &entries[ctx->rollback_flag ? count - 1 - i : i];
+      ULONG64 new_base = e->old_base + e->delta;
+      pe_header_fields_t cur;
+
+      if (pe_header_read (e->name, &cur) < 0)
+	{
+	  if (!ctx->quiet)
+	    fprintf (stderr, "%s: skipped because file info unreadable.\n",
+		     e->name);
+	  continue;
+	}
+      /* Only the header has been changed, which the database doesn't
+	 record. */
+      if (e->delta == 0 && cur.image_base == e->old_base)
+	{
+	  if (!ctx->rollback_flag || !header_differs (&cur, &e->old))
+	    continue;
+	  if (!restore_header (e))
+	    ret = -1;
+	  else if (ctx->verbose)
+	    printf ("%s: header restored\n", e->name);
+	  continue;
+	}
+      /* Never touched. */
+      if (cur.image_base == e->old_base)
+	continue;
+      if (cur.image_base != new_base)
+	{
+	  fprintf (stderr, "%s: unexpected base %" PRIx64 ", left alone.\n",
+		   e->name, (uint64_t) cur.image_base);
+	  continue;
+	}
+      /* The header is already changed, but the run died before the rebase
+	 returned.  Streamed images write the header last, mapped images
+	 don't guarantee any order. */
+      if (!e->done)
+	fprintf (stderr, "%s: rebase has been interrupted, the file might "
+			 "be damaged.\n", e->name);
+      if (ctx->rollback_flag)
+	{
+	  if (!rollback_file (ctx, e))
+	    ret = -1;
+	}
+      else if (!roll_forward_file (ctx, e, new_base))
+	ret = -1;
+    }
+  journal_free (entries, count);
+  if (ret == 0 && !ctx->rollback_flag)
+    ret = save_image_info (ctx);
+  /* Keep the journal if anything failed, to allow trying again. */
+  if (ret == 0 && unlink (ctx->journal_file) < 0)
+    {
+      fprintf (stderr, "%s: failed to remove rebase journal \"%s\":\n%s\n",
+	       ctx->progname, ctx->journal_file, strerror (errno));
+      ret = -1;
+    }
+  /* The interrupted run can't be resumed anymore. */
+  if (ret == 0)
+    unlink (ctx->plan_file);
+  unlock_database (ctx);
+  return ret;
+}
+
+/* Load the list of an interrupted database rebase for --resume.  The DLLs
+   up to the last one recorded in the journal have been handled already,
+   so only check their header.  Returns 1 if there is something to resume,
+   0 if not, -1 on error. */
+static int
+resume_plan (rebase_ctx_t *ctx)
+{
+  journal_entry_t *entries;
+  unsigned int count, i;
+  int watermark = -1;
+
+  /* Held until rebase_database is done with the plan and the journal. */
+  if (lock_database (ctx) < 0)
+    return -1;
+  if (access (ctx->plan_file, F_OK) < 0)
+    {
+      fprintf (stderr, "%s: no interrupted rebase to resume\n", ctx->progname);
+      unlock_database (ctx);
+      return 0;
+    }
+  /* The plan has been computed with the settings stored in its header. */
+  ctx->image_base = 0;
+  ctx->offset = 0;
+  if (load_image_info (ctx, ctx->plan_file) < 0)
+    {
+      unlock_database (ctx);
+      return -1;
+    }
+  if (journal_read (ctx->journal_file, ctx->machine, &entries, &count) < 0)
+    {
+      fprintf (stderr, "%s: failed to read rebase journal \"%s\":\n%s\n",
+	       ctx->progname, ctx->journal_file, strerror (errno));
+      unlock_database (ctx);
+      return -1;
+    }
+  /* The plan is sorted by name, and the DLLs are processed in this
+     order. */
+  for (i = 0; i < count; ++i)
+    {
+      img_info_t key, *found;
+
+      key.name = entries[i].name;
+      found = (img_info_t *) bsearch (&key, ctx->img_info_list, ctx->img_info_size,
+				      sizeof (img_info_t), img_info_name_cmp);
+      if (found && found - ctx->img_info_list > watermark)
+	watermark = found - ctx->img_info_list;
+    }
+  journal_free (entries, count);
+  for (i = 0; (int) i <= watermark; ++i)
+    {
+      img_info_t *img = &ctx->img_info_list[i];
+      ULONG64 cur_base;
+      ULONG cur_size;
+      WORD dll_machine;
+
+      if (!img->flag.needs_rebasing)
+	continue;
+      if (GetImageInfos64 (img->name, &dll_machine, &cur_base, &cur_size)
+	  && cur_base == img->base)
+	img->flag.needs_rebasing = 0;
+      else if (ctx->verbose)
+	printf ("%s: not at planned base, rebasing again\n", img->name);
+    }
+  if (ctx->verbose)
+    printf ("Resuming after %d of %u DLLs\n", watermark + 1, ctx->img_info_size);
+  return 1;
+}
+
+/* True if A and B, sorted next to each other, name the same file. */
+static inline BOOL
+same_image_name (const img_info_t *a, const img_info_t *b)
+{
+  return a->name_size == b->name_size && !strcmp (a->name, b->name);
+}
+
+static BOOL
+set_cannot_rebase (img_info_t *img)
+{
+  /* While --oblivious is active, cannot_rebase is set to 2 on loading
+   * the database entries */
+  if (img->flag.cannot_rebase <= 1 )
+    {
+      int fd = open (img->name, O_WRONLY);
+      if (fd < 0)
+	img->flag.cannot_rebase = 1;
+      else
+	close (fd);
+    }
+  return img->flag.cannot_rebase;
+}
+
+static int
+merge_image_info (rebase_ctx_t *ctx)
+{
+  int i, end;
+  unsigned int r, w;
+  img_info_t *match;
+
+  /* Sort new files from command line by name. */
+  img_info_sort_by_name (ctx->img_info_list + ctx->img_info_rebase_start,
+			 ctx->img_info_size - ctx->img_info_rebase_start);
+  /* Iterate through new files and eliminate duplicates, keeping the last
+     one, in a single compacting pass. */
+  for (r = w = ctx->img_info_rebase_start; r < ctx->img_info_size; ++r)
+    {
+#if defined(__CYGWIN__) || defined(__MSYS__)
+      if (!strcmp (ctx->img_info_list[r].name, CYGWIN_DLL))
+	{
+	  name_drop (ctx, ctx->img_info_list[r].name_size);
+	  continue;
+	}
+#endif
+      if (w > ctx->img_info_rebase_start
+	  && same_image_name (&ctx->img_info_list[w - 1],
+			      &ctx->img_info_list[r]))
+	{
+	  name_drop (ctx, ctx->img_info_list[w - 1].name_size);
+	  --w;
+	}
+      ctx->img_info_list[w++] = ctx->img_info_list[r];
+    }
+  ctx->img_info_size = w;
+  /* Iterate through new files and see if they are already available in
+     existing database. */
+  if (ctx->img_info_rebase_start)
+    {
+      for (i = ctx->img_info_rebase_start; i < ctx->img_info_size; ++i)
+	{
+	  /* First test if we can open the DLL for writing.  If not, it's
+	     probably blocked by another process. */
+	  set_cannot_rebase (&ctx->img_info_list[i]);
+	  match = bsearch (&ctx->img_info_list[i], ctx->img_info_list,
+			   ctx->img_info_rebase_start, sizeof (img_info_t),
+			   img_info_name_cmp);
+	  if (match)
+	    {
+	      /* We found a match.  Now test if the "new" file is actually
+		 the old file, or if it at least fits into the memory slot
+		 of the old file.  If so, screw the new file into the old slot.
+		 Otherwise set base to 0 to indicate that this DLL needs a new
+		 base address. */
+	      if (ctx->img_info_list[i].flag.cannot_rebase)
+		match->base = ctx->img_info_list[i].base;
+	      else if (match->base != ctx->img_info_list[i].base
+		       || match->slot_size < ctx->img_info_list[i].slot_size)
+		{
+		  /* Reuse the old address if possible. */
+		  if (match->slot_size < ctx->img_info_list[i].slot_size)
+		    {
+		      match->base = 0;
+		      if (ctx->verbose)
+		        fprintf (stderr, "rebasing %s because it won't fit in it's old slot size\n", ctx->img_info_list[i].name);
+		    }
+		  else if (ctx->verbose)
+		    fprintf (stderr, "rebasing %s because it's not located at it's old slot\n", ctx->img_info_list[i].name);
+
+		  match->flag.needs_rebasing = 1;
+		}
+	      /* Unconditionally overwrite old with new size. */
+	      match->size = ctx->img_info_list[i].size;
+	      match->slot_size = ctx->img_info_list[i].slot_size;
+	      /* With an --oblivious active, the files should not
+	       * already be in the database.  Warn since the file will
+	       * not be touched. */
+	      if (ctx->image_oblivious_flag)
+		fprintf (stderr, "%s: oblivious file \"%s\" already "
+			 "found in rebase database "
+			 "(file and database kept unchanged).\n",
+			 ctx->progname, ctx->img_info_list[i].name);
+	      /* Remove new entry from array. */
+	      name_drop (ctx, ctx->img_info_list[i].name_size);
+	      ctx->img_info_list[i--] = ctx->img_info_list[--ctx->img_info_size];
+	    }
+	  else if (!ctx->img_info_list[i].flag.cannot_rebase)
+	    {
+	      /* Not in database yet.  Set base to 0 to choose a new one. */
+	      ctx->img_info_list[i].base = 0;
+	      if (ctx->verbose)
+		fprintf (stderr, "rebasing %s because not in database yet\n", ctx->img_info_list[i].name);
+	    }
+	}
+    }
+  if (!ctx->img_info_rebase_start || ctx->force_rebase_flag)
+    {
+      /* No database yet or enforcing a new base address.  Set base of all
+	 DLLs to 0, if possible. */
+      for (i = 0; i < ctx->img_info_size; ++i)
+	{
+	  /* Test DLLs already in database for writability. */
+	  if (i < ctx->img_info_rebase_start)
+	    set_cannot_rebase (&ctx->img_info_list[i]);
+	  if (!ctx->img_info_list[i].flag.cannot_rebase)
+	    {
+	      ctx->img_info_list[i].base = 0;
+	      if (ctx->verbose)
+		fprintf (stderr, "rebasing %s because forced or database missing\n", ctx->img_info_list[i].name);
+	    }
+	}
+      ctx->img_info_rebase_start = 0;
+    }
+
+  /* Now sort the old part of the list by base address. */
+  if (ctx->img_info_rebase_start)
+    img_info_sort_by_base (ctx->img_info_list, ctx->img_info_rebase_start);
+  /* Perform several tests on the information fetched from the database
+     to match with reality. */
+  for (i = 0; i < ctx->img_info_rebase_start && !ctx->database_verified; ++i)
+    {
+      ULONG64 cur_base;
+      ULONG cur_size, slot_size;
+
+      /* Files with the needs_rebasing or cannot_rebase flags set have been
+	 checked already. */
+      if (ctx->img_info_list[i].flag.needs_rebasing
+      	  || ctx->img_info_list[i].flag.cannot_rebase)
+	continue;
+      /* Check if the files in the old list still exist.  Drop non-existant
+	 or unaccessible files. */
+      if (access (ctx->img_info_list[i].name, F_OK) == -1
+	  || !GetImageInfos64 (ctx->img_info_list[i].name, NULL,
+			       &cur_base, &cur_size))
+	{
+	  name_drop (ctx, ctx->img_info_list[i].name_size);
+	  memmove (ctx->img_info_list + i, ctx->img_info_list + i + 1,
+		   (ctx->img_info_size - i - 1) * sizeof (img_info_t));
+	  --ctx->img_info_rebase_start;
+	  --ctx->img_info_size;
+	  /* Check the entry moved into this slot, too. */
+	  --i;
+	  continue;
+	}
+      slot_size = roundup2 (cur_size, ctx->allocation_slot);
+      if (set_cannot_rebase (&ctx->img_info_list[i]))
+	ctx->img_info_list[i].base = cur_base;
+      else
+	{
+	  /* If the file has been reinstalled, try to rebase to the same address
+	     in the first place. */
+	  if (cur_base != ctx->img_info_list[i].base)
+	    {
+	      ctx->img_info_list[i].flag.needs_rebasing = 1;
+	      if (ctx->verbose)
+		fprintf (stderr, "rebasing %s because it's base has changed (due to being reinstalled?)\n", ctx->img_info_list[i].name);
+	      /* Set cur_base to the old base to simplify subsequent tests. */
+	      cur_base = ctx->img_info_list[i].base;
+	    }
+	  /* However, if the DLL got bigger and doesn't fit into its slot
+	     anymore, rebase this DLL from scratch. */
+	  if (i + 1 < ctx->img_info_rebase_start
+	      && cur_base + slot_size + ctx->offset > ctx->img_info_list[i + 1].base)
+	    {
+	      ctx->img_info_list[i].base = 0;
+	      if (ctx->verbose)
+		fprintf (stderr, "rebasing %s because it won't fit in it's old slot without overlapping next DLL\n", ctx->img_info_list[i].name);
+	    }
+	  /* Does the previous DLL reach into the address space of this
+	     DLL?  This happens if the previous DLL is not rebaseable. */
+	  else if (i > 0 && cur_base < ctx->img_info_list[i - 1].base
+				       + ctx->img_info_list[i - 1].slot_size)
+	    {
+	      ctx->img_info_list[i].base = 0;
+	      if (ctx->verbose)
+		fprintf (stderr, "rebasing %s because previous DLL now overlaps\n", ctx->img_info_list[i].name);
+	    }
+	  /* Does the file match the base address requirements?  If not,
+	     rebase from scratch. */
+	  else if ((ctx->down_flag && cur_base + slot_size + ctx->offset > ctx->image_base)
+		   || (!ctx->down_flag && cur_base < ctx->image_base))
+	    {
+	      ctx->img_info_list[i].base = 0;
+	      if (ctx->verbose)
+		fprintf (stderr, "rebasing %s because it's base address is outside the expected area\n", ctx->img_info_list[i].name);
+	    }
+	}
+      /* Unconditionally overwrite old with new size. */
+      ctx->img_info_list[i].size = cur_size;
+      ctx->img_info_list[i].slot_size = slot_size;
+      /* Make sure all DLLs with base address 0 have the needs_rebasing
+	 flag set. */
+      if (ctx->img_info_list[i].base == 0)
+	ctx->img_info_list[i].flag.needs_rebasing = 1;
+    }
+  /* The remainder of the function expects img_info_size to be > 0. */
+  if (ctx->img_info_size == 0)
+    return 0;
+
+  /* Now sort entire list by base address.  The files with address 0 will
+     be first. */
+  if (!ctx->force_rebase_flag)
+    {
+      img_info_sort_by_base (ctx->img_info_list, ctx->img_info_size);
+      /* Pack the DLLs from the database first, so the new DLLs go below
+	 them. */
+      if (ctx->defrag_flag)
+	{
+	  for (i = 0; i < ctx->img_info_size
+		      && ctx->img_info_list[i].base == 0; ++i)
+	    ;
+	  end = defrag_image_info (ctx, ctx->img_info_list + i,
+				   ctx->img_info_size - i);
+	  if (end < 0)
+	    return -1;
+	  if (end > 0)
+	    img_info_sort_by_base (ctx->img_info_list, ctx->img_info_size);
+	}
+    }
+  return place_images (ctx);
+}
+
+/* Index list terminator for the placement view. */
+#define PLACE_NONE ((unsigned int) -1)
+
+/* A free range between the slots of two DLLs. */
+typedef struct
+{
+  ULONG64 low;		/* End of the slot below, or of the reserved area. */
+  ULONG64 high;		/* Base of the DLL above, or image_base. */
+  unsigned int below;	/* Index of the DLL ending at low, or PLACE_NONE. */
+} hole_t;
+
+/* Collect the holes between the slots of the COUNT DLLs in LIST, which
+   must be sorted by base address, up to image_base.  On Cygwin, the area
+   reserved for the Cygwin DLL is taken into account like a DLL.  Returns
+   the number of holes in *HOLES, in ascending order, or -1 if out of
+   memory. */
+static int
+collect_holes (rebase_ctx_t *ctx, img_info_t *list, unsigned int count,
+	       hole_t **holes)
+{
+  unsigned int i, n = 0;
+  unsigned int top = PLACE_NONE;
+  ULONG64 end;
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  BOOL reserved = ctx->cygwin_dll_image_size
+		  && count
+		  && ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size
+		     > list[0].base
+		  && ctx->cygwin_dll_image_base < ctx->image_base;
+#endif
+
+  *holes = (hole_t *) malloc ((count + 2) * sizeof (hole_t));
+  if (!*holes)
+    return -1;
+  if (!count)
+    return 0;
+  end = list[0].base;
+  for (i = 0; i <= count; ++i)
+    {
+      ULONG64 start = i < count ? list[i].base : ctx->image_base;
+
+#if defined(__CYGWIN__) || defined(__MSYS__)
+      if (reserved && ctx->cygwin_dll_image_base <= start)
+	{
+	  if (ctx->cygwin_dll_image_base > end)
+	    {
+	      (*holes)[n].low = end;
+	      (*holes)[n].high = ctx->cygwin_dll_image_base;
+	      (*holes)[n++].below = top;
+	    }
+	  if (ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size > end)
+	    {
+	      end = ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size;
+	      top = PLACE_NONE;
+	    }
+	  reserved = FALSE;
+	}
+#endif
+      if (start > end)
+	{
+	  (*holes)[n].low = end;
+	  (*holes)[n].high = start;
+	  (*holes)[n++].below = top;
+	}
+      if (i < count && list[i].base + list[i].slot_size > end)
+	{
+	  end = list[i].base + list[i].slot_size;
+	  top = i;
+	}
+    }
+  return n;
+}
+
+/* Move the COUNT DLLs in LIST, which must be sorted by base address, up
+   into the holes below image_base, starting with the lowest DLL, to grow
+   the free block below the DLLs.  Every DLL goes to the highest hole it
+   fits in, so the holes are filled with as few DLLs as possible and the
+   DLLs which are packed already stay where they are.  DLLs which can't be
+   rebased are left alone.  Stops at the first DLL which can't be moved
+   up.  Returns the number of moved DLLs, -1 if out of memory. */
+static int
+defrag_image_info (rebase_ctx_t *ctx, img_info_t *list, unsigned int count)
+{
+  hole_t *holes;
+  int nholes = collect_holes (ctx, list, count, &holes);
+  unsigned int i, moved = 0;
+  ULONG64 bytes = 0;
+  int h;
+
+  if (nholes < 0)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      return -1;
+    }
+  for (i = 0; i < count; ++i)
+    {
+      img_info_t *img = &list[i];
+      BOOL placed = FALSE;
+
+      if (img->flag.cannot_rebase)
+	continue;
+      for (h = nholes - 1; h >= 0 && holes[h].high > img->base; --h)
+	{
+	  ULONG64 new_base = holes[h].high - img->slot_size - ctx->offset;
+	  /* The hole right above the DLL grows by its slot when it moves. */
+	  ULONG64 low = holes[h].below == i ? img->base : holes[h].low;
+
+	  if (holes[h].high >= img->slot_size + ctx->offset
+	      && new_base >= low && new_base > img->base)
+	    {
+	      if (ctx->verbose)
+		fprintf (stderr, "moving %s from 0x%" PRIx64 " to 0x%" PRIx64
+			 " to defragment\n", img->name,
+			 (uint64_t) img->base, (uint64_t) new_base);
+	      holes[h].high = new_base;
+	      img->base = new_base;
+	      img->flag.needs_rebasing = 1;
+	      ++moved;
+	      bytes += img->size;
+	      placed = TRUE;
+	      break;
+	    }
+	}
+      if (!placed)
+	break;
+    }
+  if (ctx->verbose)
+    fprintf (stderr, "Defragmenting moves %u DLLs, 0x%" PRIx64 " bytes\n",
+	     moved, (uint64_t) bytes);
+  free (holes);
+  return moved;
+}
+
+/* Find a base address for all DLLs with base address 0, in list order.
+   On return, the list is sorted by base address.
+
+   The placement only looks at base addresses and slot sizes, so it runs
+   on a structure-of-arrays view of the list: dense base and slot size
+   arrays, a linked list of the DLLs still to place, and two stacks of
+   indices for the placed DLLs below and above the hole which is filled
+   top-down.  DLLs are moved around by index, and the img_info_t records
+   are only reordered once at the end. */
+static int
+place_images (rebase_ctx_t *ctx)
+{
+  img_info_t *list = ctx->img_info_list;
+  unsigned int count = ctx->img_info_size;
+  ULONG64 *base;
+  ULONG *slot_size;
+  unsigned int *next, *prev, *below, *above;
+  unsigned int head, tail, nbelow = 0, nabove = 0;
+  unsigned int i, cur;
+  img_info_t *sorted;
+  void *view;
+  ULONG64 floating_image_base;
+  int ret = -1;
+
+  view = malloc (count * (sizeof *base + sizeof *slot_size
+			  + 4 * sizeof (unsigned int)));
+  sorted = (img_info_t *) malloc (count * sizeof (img_info_t));
+  if (!view || !sorted)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      goto out;
+    }
+  base = (ULONG64 *) view;
+  slot_size = (ULONG *) (base + count);
+  next = (unsigned int *) (slot_size + count);
+  prev = next + count;
+  below = prev + count;
+  above = below + count;
+  head = tail = PLACE_NONE;
+  for (i = 0; i < count; ++i)
+    {
+      base[i] = list[i].base;
+      slot_size[i] = list[i].slot_size;
+      if (base[i] != 0)
+	{
+	  unsigned int j;
+
+	  /* Already sorted, unless --force left some DLLs which can't be
+	     rebased in between. */
+	  for (j = nbelow; j > 0 && base[below[j - 1]] > base[i]; --j)
+	    below[j] = below[j - 1];
+	  below[j] = i;
+	  ++nbelow;
+	}
+      else
+	{
+	  prev[i] = tail;
+	  next[i] = PLACE_NONE;
+	  if (tail != PLACE_NONE)
+	    next[tail] = i;
+	  else
+	    head = i;
+	  tail = i;
+	}
+    }
+
+  /* FIXME: This loop only implements the top-down case.  Implement a
+     bottom-up case, too, at one point. */
+  floating_image_base = ctx->image_base;
+  while (head != PLACE_NONE)
+    {
+      ULONG64 new_base = 0;
+
+      /* Skip trailing entries as long as there is no hole. */
+      while (nbelow
+	     && base[below[nbelow - 1]] + slot_size[below[nbelow - 1]]
+		+ ctx->offset >= floating_image_base)
+	{
+	  floating_image_base = base[below[nbelow - 1]];
+	  above[nabove++] = below[--nbelow];
+	}
+      /* The DLL right below the hole.  If all placed DLLs are above the
+	 hole, this is the last DLL still to place. */
+      cur = nbelow ? below[nbelow - 1] : tail;
+
+      /* Test if one of the DLLs with address 0 fits into the hole. */
+      for (i = head; i != PLACE_NONE; i = next[i])
+	{
+	  ULONG64 new = floating_image_base - slot_size[i] - ctx->offset;
+	  /* Check if address is still valid */
+	  if (check_base_address_sanity (ctx, new, FALSE))
+	    goto out;
+	  if (new >= base[cur] + slot_size[cur]
+#if defined(__CYGWIN__) || defined(__MSYS__)
+	      /* Don't overlap the Cygwin/MSYS DLL. */
+	      && (new >= ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size
+		  || new + slot_size[i] <= ctx->cygwin_dll_image_base)
+#endif
+	     )
+	    {
+	      new_base = new;
+	      break;
+	    }
+	}
+      /* Found a match.  It is the new DLL right below the hole. */
+      if (new_base)
+	{
+	  if (prev[i] != PLACE_NONE)
+	    next[prev[i]] = next[i];
+	  else
+	    head = next[i];
+	  if (next[i] != PLACE_NONE)
+	    prev[next[i]] = prev[i];
+	  else
+	    tail = prev[i];
+	  base[i] = new_base;
+	  below[nbelow++] = i;
+	  continue;
+	}
+      /* Nothing matches.  Set floating_image_base to the start of the
+	 uppermost DLL at this point and try again. */
+#if defined(__CYGWIN__) || defined(__MSYS__)
+      if (floating_image_base >= ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size
+	  && base[cur] < ctx->cygwin_dll_image_base)
+	  floating_image_base = ctx->cygwin_dll_image_base;
+      else
+#endif
+	{
+	  if (!nbelow)
+	    {
+	      fprintf (stderr,
+		       "%s: Too many DLLs for available address space: %s\n",
+		       ctx->progname, strerror (ENOMEM));
+	      goto out;
+	    }
+	  floating_image_base = base[cur];
+	  above[nabove++] = below[--nbelow];
+	}
+    }
+
+  /* Write the new order and base addresses back to the list. */
+  for (i = 0; i < nbelow; ++i)
+    {
+      sorted[i] = list[below[i]];
+      sorted[i].base = base[below[i]];
+    }
+  while (nabove)
+    {
+      cur = above[--nabove];
+      sorted[i] = list[cur];
+      sorted[i++].base = base[cur];
+    }
+  memcpy (list, sorted, count * sizeof (img_info_t));
+  ret = 0;
+
+out:
+  free (sorted);
+  free (view);
+  return ret;
+}
+
+/* Return the full path of PATHNAME as stored in the database, allocated
+   from the name arena of CTX. */
+static char *
+full_path_name (rebase_ctx_t *ctx, const char *pathname)
+{
+  /* This back and forth from POSIX to Win32 is a way to get a full path
+     more thoroughly.  For instance, the difference between /bin and
+     /usr/bin will be eliminated. */
+#if defined (__MSYS__)
+  char w32_path[MAX_PATH];
+  char full_path[MAX_PATH];
+  cygwin_conv_to_full_win32_path (pathname, w32_path);
+  cygwin_conv_to_full_posix_path (w32_path, full_path);
+  return name_dup (ctx, full_path);
+#elif defined (__CYGWIN__)
+  PWSTR w32_path = cygwin_create_path (CCP_POSIX_TO_WIN_W, pathname);
+  char *full_path = NULL;
+  ssize_t len;
+  if (!w32_path)
+    return NULL;
+  len = cygwin_conv_path (CCP_WIN_W_TO_POSIX, w32_path, NULL, 0);
+  if (len > 0 && (full_path = name_alloc (ctx, len))
+      && cygwin_conv_path (CCP_WIN_W_TO_POSIX, w32_path, full_path, len))
+    {
+      name_drop (ctx, len);
+      full_path = NULL;
+    }
+  free (w32_path);
+  return full_path;
+#else
+  char full_path[MAX_PATH];
+  GetFullPathName (pathname, MAX_PATH, full_path, NULL);
+  return name_dup (ctx, full_path);
+#endif
+}
+
+static BOOL
+collect_image_info (rebase_ctx_t *ctx, const char *pathname)
+{
+  BOOL ret;
+  WORD dll_machine;
+
+  /* Skip if file does not exist to prevent ReBaseImage() from using it's
+     stupid search algorithm (e.g, PATH, etc.). */
+  if (access (pathname, F_OK) == -1)
+    {
+      if (!ctx->quiet)
+	fprintf (stderr, "%s: skipped because nonexistent.\n", pathname);
+      return TRUE;
+    }
+
+  /* Skip if not rebaseable, but only if we're collecting for rebasing,
+     not if we're collecting for printing only. */
+  if (!ctx->image_info_flag && !is_rebaseable (pathname))
+    {
+      if (!ctx->quiet)
+	fprintf (stderr, "%s: skipped because not rebaseable\n", pathname);
+      return TRUE;
+    }
+
+  if (!grow_image_info (ctx))
+    return FALSE;
+
+  ret = GetImageInfos64 (pathname, &dll_machine,
+			 &ctx->img_info_list[ctx->img_info_size].base,
+			 &ctx->img_info_list[ctx->img_info_size].size);
+  if (!ret)
+    {
+      if (!ctx->quiet)
+	fprintf (stderr, "%s: skipped because file info unreadable.\n",
+		 pathname);
+      return TRUE;
+    }
+  /* We only support IMAGE_FILE_MACHINE_I386 and IMAGE_FILE_MACHINE_AMD64
+     so far. */
+  if (ctx->machine != IMAGE_FILE_MACHINE_I386
+      && ctx->machine != IMAGE_FILE_MACHINE_AMD64)
+    {
+      if (ctx->quiet)
+	fprintf (stderr, "%s: is an executable for a machine type\n"
+			 "I don't know about.", pathname);
+      return TRUE;
+    }
+  /* We either operate on 32 bit or 64 bit files.  Never mix them. */
+  if (dll_machine != ctx->machine)
+    {
+      if (!ctx->quiet)
+	fprintf (stderr, "%s: skipped because wrong machine type.\n",
+		 pathname);
+      return TRUE;
+    }
+  ctx->img_info_list[ctx->img_info_size].slot_size
+    = roundup2 (ctx->img_info_list[ctx->img_info_size].size, ctx->allocation_slot);
+  ctx->img_info_list[ctx->img_info_size].flag.needs_rebasing = 1;
+  ctx->img_info_list[ctx->img_info_size].flag.cannot_rebase = 0;
+  ctx->img_info_list[ctx->img_info_size].name = full_path_name (ctx, pathname);
+  if (!ctx->img_info_list[ctx->img_info_size].name)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      return FALSE;
+    }
+  ctx->img_info_list[ctx->img_info_size].name_size
+    = strlen (ctx->img_info_list[ctx->img_info_size].name) + 1;
+  if (ctx->verbose)
+    fprintf (stderr, "rebasing %s because filename given on command line\n", ctx->img_info_list[ctx->img_info_size].name);
+  ++ctx->img_info_size;
+  return TRUE;
+}
+
+/* Work queue of refresh_image_info. */
+typedef struct
+{
+  rebase_ctx_t *ctx;
+  pthread_mutex_t lock;
+  unsigned int next;
+} info_queue_t;
+
+static void *
+refresh_worker (void *arg)
+{
+  info_queue_t *queue = (info_queue_t *) arg;
+  rebase_ctx_t *ctx = queue->ctx;
+
+  while (1)
+    {
+      unsigned int i, end;
+
+      pthread_mutex_lock (&queue->lock);
+      i = queue->next;
+      queue->next = i + INFO_CHUNK < ctx->img_info_size
+		    ? i + INFO_CHUNK : ctx->img_info_size;
+      end = queue->next;
+      pthread_mutex_unlock (&queue->lock);
+      if (i >= end)
+	break;
+      for (; i < end; ++i)
+	{
+	  img_info_t *img = &ctx->img_info_list[i];
+	  ULONG64 base;
+	  ULONG size;
+
+	  if (img->flag.needs_rebasing == 0
+	      && GetImageInfos64 (img->name, NULL, &base, &size))
+	    {
+	      img->base = base;
+	      img->size = size;
+	      img->slot_size = roundup2 (size, ctx->allocation_slot);
+	    }
+	}
+    }
+  return NULL;
+}
+
+/* Read base address and size of the database entries in the list from
+   the DLLs.  On a big system most of the time of -i is spent opening the
+   DLLs, so the headers are read by several threads. */
+static void
+refresh_image_info (rebase_ctx_t *ctx)
+{
+  info_queue_t queue;
+  pthread_t threads[INFO_THREADS_MAX - 1];
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  unsigned int nthreads, started = 0, i;
+
+  nthreads = cpus < 1 ? 1 : cpus > INFO_THREADS_MAX ? INFO_THREADS_MAX : cpus;
+  if (nthreads > ctx->img_info_size / INFO_CHUNK + 1)
+    nthreads = ctx->img_info_size / INFO_CHUNK + 1;
+  queue.ctx = ctx;
+  queue.next = 0;
+  pthread_mutex_init (&queue.lock, NULL);
+  while (started < nthreads - 1
+	 && !pthread_create (&threads[started], NULL, refresh_worker, &queue))
+    ++started;
+  /* The calling thread works the queue, too. */
+  refresh_worker (&queue);
+  for (i = 0; i < started; ++i)
+    pthread_join (threads[i], NULL);
+  pthread_mutex_destroy (&queue.lock);
+}
+
+/* Result of sweep_image_info. */
+typedef struct
+{
+  unsigned int (*pairs)[2];	/* Overlapping DLLs, as list indices. */
+  unsigned int pair_count;
+  unsigned int pair_max;
+  struct {
+    ULONG64 start;
+    ULONG64 size;
+  } gaps[INFO_GAPS];		/* Largest gaps, largest first. */
+  unsigned int gap_count;
+  ULONG64 low;			/* Start of the lowest DLL. */
+  ULONG64 high;			/* End of the highest slot. */
+  ULONG64 used;			/* Bytes covered by at least one slot. */
+} sweep_t;
+
+static void
+sweep_add_gap (sweep_t *sweep, ULONG64 start, ULONG64 size)
+{
+  unsigned int i;
+
+  if (sweep->gap_count == INFO_GAPS
+      && size <= sweep->gaps[INFO_GAPS - 1].size)
+    return;
+  if (sweep->gap_count < INFO_GAPS)
+    ++sweep->gap_count;
+  for (i = sweep->gap_count - 1; i > 0 && sweep->gaps[i - 1].size < size; --i)
+    sweep->gaps[i] = sweep->gaps[i - 1];
+  sweep->gaps[i].start = start;
+  sweep->gaps[i].size = size;
+}
+
+static int
+sweep_add_pair (sweep_t *sweep, unsigned int a, unsigned int b)
+{
+  if (sweep->pair_count == sweep->pair_max)
+    {
+      unsigned int max = sweep->pair_max ? 2 * sweep->pair_max : 64;
+      void *pairs = realloc (sweep->pairs, max * sizeof *sweep->pairs);
+
+      if (!pairs)
+	return -1;
+      sweep->pairs = (unsigned int (*)[2]) pairs;
+      sweep->pair_max = max;
+    }
+  sweep->pairs[sweep->pair_count][0] = a;
+  sweep->pairs[sweep->pair_count][1] = b;
+  ++sweep->pair_count;
+  return 0;
+}
+
+/* Set needs_rebasing for all DLLs whose slot overlaps another one in the
+   list, which must be sorted by base address, and collect the gaps and
+   the address space in use in SWEEP.  A DLL overlaps one of the DLLs
+   before it if it starts below the highest end of their slots, so a
+   single pass finds all of them.  With PAIRS, also collect all
+   overlapping pairs, using the list of DLLs whose slots reach the
+   current one.  Returns -1 if the pairs don't fit into memory. */
+static int
+sweep_image_info (rebase_ctx_t *ctx, sweep_t *sweep, BOOL pairs)
+{
+  img_info_t *list = ctx->img_info_list;
+  unsigned int *active = NULL;
+  unsigned int nactive = 0;
+  unsigned int i, j, k, top = 0;
+  ULONG64 seg_start = 0, seg_end = 0;
+  int ret = 0;
+
+  memset (sweep, 0, sizeof *sweep);
+  if (pairs
+      && !(active = (unsigned int *) malloc (ctx->img_info_size
+					     * sizeof *active)))
+    {
+      pairs = FALSE;
+      ret = -1;
+    }
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      ULONG64 start = list[i].base;
+      ULONG64 end = start + list[i].slot_size;
+
+      if (i == 0)
+	seg_start = sweep->low = start;
+      else if (start < seg_end)
+	{
+	  /* Overlaps the DLL with the highest end so far. */
+	  list[i].flag.needs_rebasing = 1;
+	  list[top].flag.needs_rebasing = 1;
+	}
+      else
+	{
+	  sweep->used += seg_end - seg_start;
+	  if (start > seg_end)
+	    sweep_add_gap (sweep, seg_end, start - seg_end);
+	  seg_start = start;
+	}
+      if (i == 0 || end > seg_end)
+	{
+	  seg_end = end;
+	  top = i;
+	}
+      if (!pairs)
+	continue;
+      /* Drop the DLLs ending below this one, pair up with the others. */
+      for (j = k = 0; j < nactive; ++j)
+	if (list[active[j]].base + list[active[j]].slot_size > start)
+	  {
+	    active[k++] = active[j];
+	    if (sweep_add_pair (sweep, active[j], i) < 0)
+	      {
+		pairs = FALSE;
+		ret = -1;
+		break;
+	      }
+	  }
+      nactive = k;
+      active[nactive++] = i;
+    }
+  if (ctx->img_info_size)
+    {
+      sweep->used += seg_end - seg_start;
+      sweep->high = seg_end;
+    }
+  free (active);
+  return ret;
+}
+
+static void
+print_image_summary (rebase_ctx_t *ctx, sweep_t *sweep)
+{
+  int width = ctx->machine == IMAGE_FILE_MACHINE_I386 ? 8 : 12;
+  unsigned int i;
+
+  if (sweep->pair_count)
+    {
+      printf ("\nOverlapping DLLs:\n");
+      for (i = 0; i < sweep->pair_count; ++i)
+	printf ("  %s\n    overlaps %s\n",
+		ctx->img_info_list[sweep->pairs[i][0]].name,
+		ctx->img_info_list[sweep->pairs[i][1]].name);
+    }
+  if (sweep->gap_count)
+    {
+      printf ("\nLargest gaps:\n");
+      for (i = 0; i < sweep->gap_count; ++i)
+	printf ("  0x%0*" PRIx64 " - 0x%0*" PRIx64 " size 0x%" PRIx64 "\n",
+		width, (uint64_t) sweep->gaps[i].start,
+		width, (uint64_t) (sweep->gaps[i].start + sweep->gaps[i].size),
+		(uint64_t) sweep->gaps[i].size);
+    }
+  printf ("\n%u DLLs in 0x%0*" PRIx64 " - 0x%0*" PRIx64 ", 0x%" PRIx64
+	  " bytes in use, 0x%" PRIx64 " bytes free, %u overlaps\n",
+	  ctx->img_info_size,
+	  width, (uint64_t) sweep->low, width, (uint64_t) sweep->high,
+	  (uint64_t) sweep->used, (uint64_t) (sweep->high - sweep->low
+					       - sweep->used),
+	  sweep->pair_count);
+}
+
+static void
+print_image_info (rebase_ctx_t *ctx)
+{
+  unsigned int i, w;
+  sweep_t sweep;
+  /* Default name field width to longest available for 80 char display. */
+  int name_width = (ctx->machine == IMAGE_FILE_MACHINE_I386) ? 45 : 41;
+
+  /* Sort list by name. */
+  img_info_sort_by_name (ctx->img_info_list, ctx->img_info_size);
+  /* Iterate through list and eliminate duplicates in a single compacting
+     pass. */
+  for (i = w = 0; i < ctx->img_info_size; ++i)
+    {
+      if (w > 0
+	  && same_image_name (&ctx->img_info_list[w - 1],
+			      &ctx->img_info_list[i]))
+	{
+	  /* Remove duplicate, but prefer one from the command line over one
+	     from the database, because the one from the command line reflects
+	     the reality, while the database is wishful thinking. */
+	  if (ctx->img_info_list[w - 1].flag.needs_rebasing == 0)
+	    {
+	      name_drop (ctx, ctx->img_info_list[w - 1].name_size);
+	      ctx->img_info_list[w - 1] = ctx->img_info_list[i];
+	    }
+	  else
+	    name_drop (ctx, ctx->img_info_list[i].name_size);
+	  continue;
+	}
+      ctx->img_info_list[w++] = ctx->img_info_list[i];
+    }
+  ctx->img_info_size = w;
+  /* For entries loaded from database, collect image info to reflect reality.
+     Also, collect_image_info sets needs_rebasing to 1, so reset here.
+     Also, fetch the longest name length for formatting purposes. */
+  refresh_image_info (ctx);
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      ctx->img_info_list[i].flag.needs_rebasing = 0;
+      name_width = max (name_width, ctx->img_info_list[i].name_size - 1);
+    }
+  /* Now sort by address. */
+  img_info_sort_by_base (ctx->img_info_list, ctx->img_info_size);
+  if (sweep_image_info (ctx, &sweep, ctx->info_summary) < 0)
+    fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+  for (i = 0; i < ctx->img_info_size; ++i)
+    {
+      printf ("%-*s base 0x%0*" PRIx64 " size 0x%08x %c\n",
+	      name_width,
+	      ctx->img_info_list[i].name,
+	      ctx->machine == IMAGE_FILE_MACHINE_I386 ? 8 : 12,
+	      (uint64_t) ctx->img_info_list[i].base,
+	      (uint32_t) ctx->img_info_list[i].size,
+	      ctx->img_info_list[i].flag.needs_rebasing ? '*' : ' ');
+    }
+  if (ctx->info_summary)
+    print_image_summary (ctx, &sweep);
+  free (sweep.pairs);
+}
+
+/* The options which change the content of a rebased file, as far as
+   the result cache is concerned. */
+static ULONG
+rebase_cache_flags (rebase_ctx_t *ctx)
+{
+  ULONG flags = 0;
+
+  if (ctx->drop_dynamicbase)
+    flags |= REBASE_CACHE_DROP_DYNAMICBASE;
+  if (ctx->update_checksum)
+    flags |= REBASE_CACHE_UPDATE_CHECKSUM;
+  if (ctx->recompute_checksum)
+    flags |= REBASE_CACHE_RECOMPUTE_CHECKSUM;
+  return flags;
+}
+
+
+
+static BOOL
+rebase (rebase_ctx_t *ctx, const char *pathname, ULONG64 *new_image_base,
+	BOOL down_flag)
+{
+  ULONG64 old_image_base, prev_new_image_base;
+  ULONG old_image_size, new_image_size;
+  ULONG timestamp;
+  REBASE_IMAGE_ENTRY image;
+  REBASE_IMAGE_RESULT result;
+  BYTE *cache_image = NULL;
+  ULONG64 cache_image_size = 0;
+  char cache_key[REBASE_CACHE_KEY_LEN + 1];
+  rebase_cache_result_t cache_result;
+
+  /* Skip if not writable. */
+  if (access (pathname, W_OK) == -1)
+    {
+      if (!ctx->quiet)
+	fprintf (stderr, "%s: skipped because not writable\n", pathname);
+      return TRUE;
+    }
+
+  /* Calculate next base address, if rebasing down. */
+  if (down_flag)
+    *new_image_base -= ctx->offset;
+
+#if defined(__CYGWIN__) || defined(__MSYS__)
+retry:
+#endif
+
+  prev_new_image_base = *new_image_base;
+  timestamp = time (0);
+
+  /* Try to replay an earlier identical rebase from the cache.  The cache
+     doesn't know about header changes. */
+  if (ctx->cache_dir && !ctx->edit_header
+      && (cache_image = rebase_cache_read_file (pathname, &cache_image_size)))
+    {
+      rebase_cache_key (cache_image, cache_image_size, *new_image_base,
+			down_flag, rebase_cache_flags (ctx), cache_key);
+      switch (rebase_cache_apply (ctx->cache_dir, cache_key, pathname,
+				  cache_image, cache_image_size, timestamp,
+				  ctx->touch, &cache_result))
+	{
+	case 1:
+	  free (cache_image);
+	  cache_image = NULL;
+	  old_image_base = cache_result.old_image_base;
+	  old_image_size = cache_result.old_image_size;
+	  new_image_size = cache_result.new_image_size;
+	  *new_image_base = cache_result.new_image_base;
+	  if (ctx->verbose)
+	    printf ("%s: rebased from cache\n", pathname);
+	  goto rebased;
+	case -1:
+	  free (cache_image);
+	  fprintf (stderr, "%s: applying cached rebase failed\n", pathname);
+	  return FALSE;
+	}
+    }
+
+  /* Rebase the image, fixing bad relocations if necessary. */
+  image.ImageName = pathname;
+  image.ImageBase = *new_image_base;
+  image.Flags = rebase_image_flags (ctx);
+  if (down_flag)
+    image.Flags |= REBASE_IMAGE_GOING_DOWN;
+  image.TimeStamp = timestamp;
+  image.StreamingThreshold = stream_threshold (ctx);
+  rebase_image_header (ctx, &image);
+  if (!ReBaseImageEx (&image, &result, 1, 1, NULL, NULL))
+    {
+      fprintf (stderr, "ReBaseImage (%s) failed with last error = %u\n",
+	       pathname, (uint32_t) result.Error);
+      free (cache_image);
+      return FALSE;
+    }
+  if (result.Repaired && ctx->verbose)
+    fprintf (stderr, "%s: fixed bad relocations\n", pathname);
+  old_image_base = result.OldImageBase;
+  old_image_size = result.OldImageSize;
+  new_image_size = result.NewImageSize;
+  /* Going up, continue with the next base. */
+  *new_image_base = down_flag ? result.NewImageBase
+			      : result.NewImageBase + result.NewImageSize;
+
+  /* Remember the result for the next run. */
+  if (cache_image)
+    {
+      cache_result.old_image_base = old_image_base;
+      cache_result.old_image_size = old_image_size;
+      cache_result.new_image_size = new_image_size;
+      cache_result.new_image_base = *new_image_base;
+      if (rebase_cache_store (ctx->cache_dir, cache_key, pathname, cache_image,
+			      cache_image_size, rebase_cache_flags (ctx),
+			      &cache_result) < 0 && !ctx->quiet)
+	fprintf (stderr, "%s: can't store rebase result in cache %s\n",
+		 pathname, ctx->cache_dir);
+      free (cache_image);
+      cache_image = NULL;
+    }
+
+rebased:
+
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  /* Avoid the case that a DLL is rebased into the address space taken
+     by the Cygwin DLL.  Only test in down_flag == TRUE case, otherwise
+     the return value in new_image_base is not meaningful */
+  if (down_flag
+      && *new_image_base >= ctx->cygwin_dll_image_base
+      && *new_image_base <= ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size)
+    {
+      *new_image_base = ctx->cygwin_dll_image_base - new_image_size;
+      goto retry;
+    }
+#endif
+
+  /* Display rebase results, if verbose. */
+  if (ctx->verbose)
+    {
+      printf ("%s: new base = %" PRIx64 ", new size = %x\n",
+	      pathname,
+	      (uint64_t) ((down_flag) ? *new_image_base : prev_new_image_base),
+	      (uint32_t) (new_image_size + ctx->offset));
+    }
+
+  /* Calculate next base address, if rebasing up. */
+  if (!down_flag)
+    *new_image_base += ctx->offset;
+
+  return TRUE;
+}
+
+/* Apply the header changes of CTX to PATHNAME, a file at IMAGE_BASE
+   already.  The file is only written if that changes anything. */
+static BOOL
+edit_header (rebase_ctx_t *ctx, const char *pathname, ULONG64 image_base)
+{
+  REBASE_IMAGE_ENTRY image;
+  REBASE_IMAGE_RESULT result;
+
+  image.ImageName = pathname;
+  image.ImageBase = image_base;
+  image.Flags = rebase_image_flags (ctx);
+  image.TimeStamp = time (0);
+  image.StreamingThreshold = stream_threshold (ctx);
+  rebase_image_header (ctx, &image);
+  if (!ReBaseImageEx (&image, &result, 1, 1, NULL, NULL))
+    {
+      fprintf (stderr, "ReBaseImage (%s) failed with last error = %u\n",
+	       pathname, (uint32_t) result.Error);
+      return FALSE;
+    }
+  if (result.HeaderChanged && ctx->verbose)
+    printf ("%s: header updated\n", pathname);
+  return TRUE;
+}
+
+static BOOL
+is_rebaseable (const char *pathname)
+{
+  const int pe_signature_offset_offset = 0x3c;
+  const int pe_characteristics_offset = 150;
+  short int pe_signature_offset = 0;
+  BOOL status = FALSE;
+  int fd, size;
+  long offset;
+  DWORD pe_sig;
+  WORD pe_char;
+
+  fd = open (pathname, O_RDONLY);
+  if (fd == -1)
+    return status;
+
+  offset = lseek (fd, pe_signature_offset_offset, SEEK_SET);
+  if (offset == -1)
+    goto done;
+
+  size = read (fd, &pe_signature_offset, sizeof (pe_signature_offset));
+  if (size != sizeof(pe_signature_offset))
+    goto done;
+
+  offset = lseek (fd, pe_signature_offset, SEEK_SET);
+  if (offset == -1)
+    goto done;
+
+  pe_sig = 0;
+  size = read (fd, &pe_sig, sizeof (pe_sig));
+  if (size != sizeof (pe_sig))
+    goto done;
+
+  if (pe_sig != IMAGE_NT_SIGNATURE)
+    goto done;
+
+  lseek (fd, 0, SEEK_SET);
+  offset = lseek (fd, pe_characteristics_offset, SEEK_CUR);
+  if (offset == -1)
+    goto done;
+
+  pe_char = 0;
+  size = read (fd, &pe_char, sizeof (pe_char));
+  if (size != sizeof (pe_char))
+    goto done;
+
+  status = ((pe_char & IMAGE_FILE_RELOCS_STRIPPED) == 0) ? TRUE : FALSE;
+
+done:
+  close (fd);
+  return status;
+}
+
+/* Return PATH with SUFFIX appended in a malloced buffer. */
+static char *
+path_with_suffix (const char *path, const char *suffix)
+{
+  char *ret = (char *) malloc (strlen (path) + strlen (suffix) + 1);
+
+  if (ret)
+    {
+      strcpy (ret, path);
+      strcat (ret, suffix);
+    }
+  return ret;
+}
+
+/* The default database file NAME.  Without Cygwin, SYSCONFDIR is taken
+   relative to the directory of the rebase executable. */
+static char *
+default_db_file (const char *progname, const char *name)
+{
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  return strdup (name);
+#else
+  char exepath[LONG_PATH_MAX];
+  char* p = NULL;
+  char* p2 = NULL;
+  char *file;
+  size_t sz = 0;
+
+  if (!GetModuleFileNameA (NULL, exepath, LONG_PATH_MAX))
+    fprintf (stderr, "%s: can't determine rebase installation path\n",
+	     progname);
+
+  /* strip off exename and trailing slash */
+  sz = strlen (exepath);
+  p = exepath + sz - 1;
+  while (p && (p > exepath) && (*p == '/' || *p == '\\'))
+    {
+      *p = '\0';
+      p--;
+    }
+  p = strrchr(exepath, '/');
+  p2 = strrchr(exepath, '\\');
+  if (p || p2)
+    {
+      if (p2 > p)
+	p = p2;
+      if (p > exepath)
+	*p = '\0';
+      else
+	{
+	  p++;
+	  *p = '\0';
+	}
+    }
+
+  file = path_with_suffix (exepath, name);
+  if (file)
+    for (p = file; *p != '\0'; p++)
+      if (*p == '/')
+	*p = '\\';
+  return file;
+#endif
+}
+
+/* Initialize the names of the database and its companion files. */
+static int
+init_db_files (rebase_ctx_t *ctx, const char *db_file)
+{
+  const char *default_file = (ctx->machine == IMAGE_FILE_MACHINE_I386)
+			     ? IMG_INFO_FILE_I386 : IMG_INFO_FILE_AMD64;
+  char *run_file;
+  BOOL container;
+
+  if (db_file)
+    ctx->db_file = strdup (db_file);
+  else
+    {
+      /* Once the container exists, it holds the databases of all
+	 machines. */
+      ctx->db_file = default_db_file (ctx->progname, IMG_INFO_FILE);
+      if (ctx->db_file && access (ctx->db_file, F_OK) < 0)
+	{
+	  free (ctx->db_file);
+	  ctx->db_file = default_db_file (ctx->progname, default_file);
+	}
+    }
+  if (!ctx->db_file)
+    return -1;
+  /* The journal and the plan of a run belong to one machine, so with a
+     container they get the machine name in their names, like the log. */
+  container = img_info_is_container (ctx->db_file);
+  if (container)
+    {
+      char suffix[16];
+
+      snprintf (suffix, sizeof suffix, ".%s",
+		img_info_machine_name (ctx->machine));
+      run_file = path_with_suffix (ctx->db_file, suffix);
+    }
+  else
+    run_file = strdup (ctx->db_file);
+  if (!run_file)
+    return -1;
+  ctx->tmp_file = path_with_suffix (ctx->db_file, TMP_FILE_SUFFIX);
+  ctx->journal_file = path_with_suffix (run_file, REBASE_JOURNAL_SUFFIX);
+  ctx->plan_file = path_with_suffix (run_file, PLAN_SUFFIX);
+  ctx->log_file = img_info_log_file (ctx->db_file, ctx->machine, container);
+  free (run_file);
+  if (!ctx->tmp_file || !ctx->journal_file || !ctx->plan_file
+      || !ctx->log_file)
+    return -1;
+  return 0;
+}
+
+/* The database section HDR of SIZE bytes and CRC CRC of the single
+   machine database FILE, with the changes in its log applied.  If there
+   are changes, the new section is malloc'ed, returned in BUILT and its
+   size in SIZE.  Returns NULL on failure. */
+static const img_info_hdr_t *
+apply_db_log (const char *progname, const char *file,
+	      const img_info_hdr_t *hdr, size_t *size, ULONG crc,
+	      BYTE **built)
+{
+  img_info_hdr_t new_hdr;
+  img_info_t *list = NULL;
+  unsigned int count = hdr->count, max_size = hdr->count;
+  char *log_file;
+  BYTE *log = NULL;
+  size_t log_size;
+  int ret;
+
+  *built = NULL;
+  if (!(log_file = img_info_log_file (file, hdr->machine, FALSE)))
+    {
+      fprintf (stderr, "%s: Out of memory.\n", progname);
+      return NULL;
+    }
+  ret = img_info_log_read (log_file, hdr, *size, crc, &log, &log_size);
+  if (ret < 0)
+    fprintf (stderr, "%s: failed to read rebase database log \"%s\":\n%s\n",
+	     progname, log_file, strerror (errno));
+  free (log_file);
+  if (ret <= 0)
+    return ret < 0 ? NULL : hdr;
+  list = img_info_copy_list (hdr, count, max_size);
+  if (list
+      && img_info_log_apply (&list, &count, &max_size, log, log_size) == 0)
+    {
+      /* The section is written in the current layout. */
+      img_info_read_hdr (hdr, *size, &new_hdr);
+      new_hdr.version = IMG_INFO_VERSION;
+      new_hdr.count = count;
+      *built = img_info_build_section (&new_hdr, list, size);
+    }
+  free (list);
+  free (log);
+  if (!*built)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", progname);
+      return NULL;
+    }
+  return (const img_info_hdr_t *) *built;
+}
+
+int
+rebase_convert_db (const rebase_options_t *opts)
+{
+  static const WORD machines[2] = {
+    IMAGE_FILE_MACHINE_I386, IMAGE_FILE_MACHINE_AMD64
+  };
+  static const char *names[2] = { IMG_INFO_FILE_I386, IMG_INFO_FILE_AMD64 };
+  img_info_map_t maps[2];
+  img_info_section_t sections[2];
+  const void *data[2];
+  const img_info_hdr_t *hdr;
+  BYTE *built[2] = { NULL, NULL };
+  char *files[2] = { NULL, NULL };
+  char *container = NULL, *tmp_file = NULL;
+  unsigned int count = 0, i;
+  size_t size;
+  ULONG crc;
+  int fd, ret = -1;
+
+  memset (maps, 0, sizeof maps);
+  for (i = 0; i < 2; ++i)
+    {
+      if (!(files[i] = default_db_file (opts->progname, names[i])))
+	goto out_of_memory;
+      if (img_info_map (files[i], &maps[i]) < 0)
+	{
+	  if (errno == ENOENT)
+	    continue;
+	  fprintf (stderr, "%s: failed to open rebase database \"%s\":\n%s\n",
+		   opts->progname, files[i], strerror (errno));
+	  goto out;
+	}
+      hdr = img_info_map_section (&maps[i], machines[i], &size);
+      if (maps[i].container || !hdr || hdr->version == 0
+	  || hdr->version > IMG_INFO_VERSION
+	  || img_info_check_section (hdr, size, &crc) < 0)
+	{
+	  fprintf (stderr, "%s: \"%s\" is not a valid %s rebase database.\n",
+		   opts->progname, files[i], img_info_machine_name (machines[i]));
+	  goto out;
+	}
+      /* The container starts without logs. */
+      if (!(hdr = apply_db_log (opts->progname, files[i], hdr, &size, crc,
+				&built[i])))
+	goto out;
+      sections[count].machine = machines[i];
+      sections[count].size = size;
+      data[count++] = hdr;
+      if (opts->verbose)
+	printf ("%s: %u DLLs\n", files[i], (uint32_t) hdr->count);
+    }
+  if (count == 0)
+    {
+      fprintf (stderr, "%s: no rebase database to convert\n", opts->progname);
+      goto out;
+    }
+  container = opts->db_file ? strdup (opts->db_file)
+			    : default_db_file (opts->progname, IMG_INFO_FILE);
+  if (!container
+      || !(tmp_file = path_with_suffix (container, TMP_FILE_SUFFIX)))
+    goto out_of_memory;
+  if (access (container, F_OK) == 0)
+    {
+      fprintf (stderr, "%s: \"%s\" exists already\n", opts->progname,
+	       container);
+      goto out;
+    }
+  fd = mkstemp (tmp_file);
+  if (fd < 0)
+    {
+      fprintf (stderr, "%s: failed to create temporary rebase database: %s\n",
+	       opts->progname, strerror (errno));
+      goto out;
+    }
+  if (img_info_write_container (fd, count, sections, data) < 0)
+    fprintf (stderr, "%s: failed to write rebase database: %s\n",
+	     opts->progname, strerror (errno));
+  else
+    ret = 0;
+#if defined(__CYGWIN__) && !defined(__MSYS__)
+  fchmod (fd, 0660);
+#else
+  chmod (tmp_file, 0660);
+#endif
+  close (fd);
+  if (ret == 0 && rename (tmp_file, container) < 0)
+    {
+      fprintf (stderr, "%s: failed to rename \"%s\" to \"%s\":\n%s\n",
+	       opts->progname, tmp_file, container, strerror (errno));
+      ret = -1;
+    }
+  if (ret < 0)
+    unlink (tmp_file);
+  else if (opts->verbose)
+    printf ("%s: written\n", container);
+  goto out;
+
+out_of_memory:
+  fprintf (stderr, "%s: Out of memory.\n", opts->progname);
+out:
+  for (i = 0; i < 2; ++i)
+    {
+      if (maps[i].addr)
+	img_info_unmap (&maps[i]);
+      free (built[i]);
+      free (files[i]);
+    }
+  free (container);
+  free (tmp_file);
+  return ret;
+}
+
+static void
+free_image_info (rebase_ctx_t *ctx)
+{
+  free_names (ctx);
+  free (ctx->img_info_list);
+  ctx->img_info_list = NULL;
+  ctx->img_info_size = 0;
+  ctx->img_info_rebase_start = 0;
+  ctx->img_info_max_size = 0;
+  free (ctx->db_list);
+  free (ctx->db_names);
+  ctx->db_list = NULL;
+  ctx->db_names = NULL;
+  ctx->db_hdr.count = 0;
+  ctx->db_section_size = 0;
+}
+
+static void
+free_ctx (rebase_ctx_t *ctx)
+{
+  unlock_database (ctx);
+  free_image_info (ctx);
+  free (ctx->cache_dir);
+  free (ctx->db_file);
+  free (ctx->tmp_file);
+  free (ctx->journal_file);
+  free (ctx->plan_file);
+  free (ctx->log_file);
+  free (ctx);
+}
+
+void
+rebase_options_init (rebase_options_t *opts)
+{
+  memset (opts, 0, sizeof *opts);
+#ifdef __x86_64__
+  opts->machine = IMAGE_FILE_MACHINE_AMD64;
+#else
+  opts->machine = IMAGE_FILE_MACHINE_I386;
+#endif
+  opts->stream_threshold = ReBaseStreamingThreshold;
+  opts->cache_size = REBASE_CACHE_DEFAULT_SIZE;
+  opts->progname = "rebase";
+}
+
+/* The peflags option of size index INDEX. */
+static const pe_option_t *
+header_size_option (int index)
+{
+  const pe_option_t *option;
+
+  for (option = pe_options; option->size_index != index; ++option)
+    ;
+  return option;
+}
+
+int
+rebase_header_option (rebase_options_t *opts, const char *option)
+{
+  rebase_header_t *header = &opts->header;
+  const char *value = strchr (option, '=');
+  const pe_option_t *pe_option;
+  unsigned long long number;
+  char *end;
+  int set;
+
+  if (!value || !*++value
+      || !(pe_option = pe_option_by_name (option, value - 1 - option)))
+    return -1;
+  /* The size indices of peflags are those of REBASE_IMAGE_HEADER. */
+  if (pe_option->size_index >= 0)
+    {
+      errno = 0;
+      number = strtoull (value, &end, 0);
+      if (end == value || *end || errno == ERANGE
+	  || pe_check_size (pe_option->size_index, number))
+	return -1;
+      header->size_mask |= 1 << pe_option->size_index;
+      header->sizes[pe_option->size_index] = number;
+      return 0;
+    }
+  if (pe_string_to_bool (value, &set))
+    return -1;
+  /* The last setting of a flag wins. */
+  if (set)
+    {
+      header->coff_set |= pe_option->coff_flag;
+      header->coff_clr &= ~pe_option->coff_flag;
+      header->pe_set |= pe_option->pe_flag;
+      header->pe_clr &= ~pe_option->pe_flag;
+    }
+  else
+    {
+      header->coff_clr |= pe_option->coff_flag;
+      header->coff_set &= ~pe_option->coff_flag;
+      header->pe_clr |= pe_option->pe_flag;
+      header->pe_set &= ~pe_option->pe_flag;
+    }
+  return 0;
+}
+
+rebase_ctx_t *
+rebase_open (const rebase_options_t *opts)
+{
+  rebase_ctx_t *ctx;
+  SYSTEM_INFO si;
+  int i;
+
+  ctx = (rebase_ctx_t *) calloc (1, sizeof *ctx);
+  if (!ctx)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", opts->progname);
+      return NULL;
+    }
+  ctx->db_lock = -1;
+  ctx->machine = opts->machine;
+  ctx->image_base = opts->image_base;
+  ctx->offset = opts->offset;
+  /* A new base address or offset enforces rebasing all DLLs. */
+  ctx->force_rebase_flag = opts->image_base || opts->offset;
+  ctx->image_info_flag = opts->info;
+  ctx->info_summary = opts->summary;
+  ctx->defrag_flag = opts->defrag;
+  ctx->image_oblivious_flag = opts->oblivious;
+  ctx->rollback_flag = opts->rollback;
+  ctx->resume_flag = opts->resume;
+  ctx->image_storage_flag = opts->database || opts->oblivious
+			    || opts->rollback || opts->resume;
+  /* FIXME: For now enforce top-down rebasing when using the database.*/
+  ctx->down_flag = opts->down || ctx->image_storage_flag;
+  ctx->verbose = opts->verbose;
+  ctx->quiet = opts->quiet;
+  ctx->progname = opts->progname;
+  ctx->touch = opts->touch;
+  ctx->drop_dynamicbase = opts->drop_dynamicbase;
+  ctx->update_checksum = opts->update_checksum;
+  ctx->recompute_checksum = opts->recompute_checksum;
+  ctx->stream_threshold = opts->stream_threshold;
+  ctx->header = opts->header;
+  ctx->edit_header = opts->header.coff_set || opts->header.coff_clr
+		     || opts->header.pe_set || opts->header.pe_clr
+		     || opts->header.size_mask;
+  ctx->cache_size = opts->cache_size;
+  if ((opts->cache_dir && !(ctx->cache_dir = strdup (opts->cache_dir)))
+      || init_db_files (ctx, opts->db_file) < 0)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      goto fail;
+    }
+  GetSystemInfo (&si);
+  ctx->allocation_slot = si.dwAllocationGranularity;
+
+  if (ctx->image_base == 0 && !ctx->image_info_flag
+      && !ctx->image_storage_flag)
+    {
+      fprintf (stderr, "%s: a base address is required without the "
+		       "database\n", ctx->progname);
+      goto fail;
+    }
+  if (ctx->machine == IMAGE_FILE_MACHINE_I386 && ctx->image_base > 0xffffffff)
+    {
+      fprintf (stderr,
+	       "%s: Base address 0x%" PRIx64 " too big for 32 bit machines.\n",
+	       ctx->progname, (uint64_t) ctx->image_base);
+      goto fail;
+    }
+
+  if (ctx->machine == IMAGE_FILE_MACHINE_I386)
+    for (i = 0; i < REBASE_IMAGE_SIZES; ++i)
+      if ((ctx->header.size_mask & (1 << i))
+	  && ctx->header.sizes[i] > 0xffffffff)
+	{
+	  fprintf (stderr,
+		   "%s: %s 0x%" PRIx64 " too big for 32 bit machines.\n",
+		   ctx->progname, header_size_option (i)->name,
+		   (uint64_t) ctx->header.sizes[i]);
+	  goto fail;
+	}
+
+  /* The low address for 32 bit is extremly low, and apparently
+     W10 1703 and later rebase all DLLs with start addresses < 0x38000000
+     at runtime.  However, we have so many DLLs that a hardcoded lowest
+     address of 0x38000000 is just not feasible. */
+  ctx->low_addr = (ctx->machine == IMAGE_FILE_MACHINE_I386) ? 0x001000000ULL
+							   : 0x200000000ULL;
+
+  if (ctx->image_base && check_base_address_sanity (ctx, ctx->image_base,
+						    TRUE) < 0)
+    goto fail;
+
+  /* If database support has been requested, load database. */
+  if (ctx->image_storage_flag && ctx->resume_flag)
+    {
+      /* Continue with the list of the interrupted run.  If there is none,
+	 the list stays empty. */
+      if (resume_plan (ctx) < 0)
+	goto fail;
+    }
+  else if (ctx->image_storage_flag)
+    {
+      /* Don't read the database while another rebase saves it.  Without
+	 the lock file, e.g. for an unprivileged -i, read it anyway. */
+      int lock = img_info_lock (ctx->db_file, FALSE);
+      int ret = load_image_info (ctx, ctx->db_file);
+
+      if (lock >= 0)
+	img_info_unlock (lock);
+      if (ret < 0)
+	goto fail;
+      /* Finish or undo an interrupted run first, so the database matches
+	 the files again. */
+      if (!ctx->image_info_flag && !ctx->image_oblivious_flag
+	  && replay_journal (ctx) < 0)
+	goto fail;
+      ctx->img_info_rebase_start = ctx->img_info_size;
+    }
+  ctx->next_image_base = ctx->image_base;
+
+#if defined(__MSYS__)
+  if (ctx->machine == IMAGE_FILE_MACHINE_I386)
+    {
+      GetImageInfos64 ("/bin/msys-1.0.dll", NULL,
+	               &ctx->cygwin_dll_image_base, &ctx->cygwin_dll_image_size);
+    }
+#elif defined(__CYGWIN__)
+  if (ctx->machine == IMAGE_FILE_MACHINE_I386)
+    {
+      /* Fetch the Cygwin DLLs data to make sure that DLLs aren't rebased
+	 into the memory area taken by the Cygwin DLL. */
+      GetImageInfos64 ("/bin/cygwin1.dll", NULL,
+		       &ctx->cygwin_dll_image_base,
+		       &ctx->cygwin_dll_image_size);
+      /* Take the up to four shared memory areas preceeding the DLL into
+      	 account. */
+      ctx->cygwin_dll_image_base -= 4 * ctx->allocation_slot;
+      /* Add a slack of 8 * 64K at the end of the Cygwin DLL.  This leave a
+	 bit of room to install newer, bigger Cygwin DLLs, as well as room to
+	 install non-optimized DLLs for debugging purposes.  Otherwise the
+	 slightest change might break fork again :-P */
+      ctx->cygwin_dll_image_size += 4 * ctx->allocation_slot
+				    + 8 * ctx->allocation_slot;
+    }
+  else
+    {
+      /* On x86_64 Cygwin, we want to keep free the whole 2 Gigs area in which
+	 the Cygwin DLL resides, no matter what. */
+      ctx->cygwin_dll_image_base = 0x180000000L;
+      ctx->cygwin_dll_image_size = 0x080000000L;
+    }
+#endif /* __CYGWIN__ */
+
+  return ctx;
+
+fail:
+  free_ctx (ctx);
+  return NULL;
+}
+
+int
+rebase_add (rebase_ctx_t *ctx, const char *pathname)
+{
+  return collect_image_info (ctx, pathname) ? 0 : -1;
+}
+
+int
+rebase_commit (rebase_ctx_t *ctx)
+{
+  unsigned int i;
+  int ret = 0;
+
+  /* Nothing to do? */
+  if (ctx->img_info_size == 0 || ctx->image_info_flag || ctx->rollback_flag)
+    return 0;
+
+  if (!ctx->image_storage_flag)
+    {
+      /* Rebase, continuing at the address the last commit stopped at. */
+      for (i = 0; i < ctx->img_info_size; ++i)
+	{
+	  if (!rebase (ctx, ctx->img_info_list[i].name, &ctx->next_image_base,
+		       ctx->down_flag))
+	    {
+	      ret = -1;
+	      break;
+	    }
+	  ++ret;
+	}
+      free_image_info (ctx);
+      return ret;
+    }
+
+  /* Rebase with database support.  Once the database has been checked,
+     only new or removed files require another run. */
+  if (ctx->database_verified
+      && ctx->img_info_size == ctx->img_info_rebase_start
+      && !ctx->database_changed)
+    return 0;
+  /* The database part has to be sorted by name for merging. */
+  img_info_sort_by_name (ctx->img_info_list, ctx->img_info_rebase_start);
+  ret = rebase_database (ctx);
+  /* The database matches the files now.  Only the files added from here on
+     have to be checked on the next commit.  After a failure, the next
+     commit has to check everything again. */
+  if (ret >= 0)
+    {
+      ctx->img_info_rebase_start = ctx->img_info_size;
+      ctx->force_rebase_flag = FALSE;
+      ctx->resume_flag = FALSE;
+      ctx->database_verified = TRUE;
+      ctx->database_changed = FALSE;
+    }
+  compact_names (ctx);
+  return ret;
+}
+
+void
+rebase_print (rebase_ctx_t *ctx)
+{
+  if (ctx->img_info_size)
+    print_image_info (ctx);
+}
+
+/* Format SIZE in BUF with a binary unit, if it is a multiple of one. */
+static const char *
+format_size (char *buf, ULONG64 size)
+{
+  static const char units[] = "KMGT";
+  int unit = -1;
+
+  while (size >= 1024 && (size & 1023) == 0 && unit < 3)
+    {
+      size >>= 10;
+      ++unit;
+    }
+  if (unit < 0)
+    sprintf (buf, "%" PRIu64, (uint64_t) size);
+  else
+    sprintf (buf, "%" PRIu64 "%c", (uint64_t) size, units[unit]);
+  return buf;
+}
+
+int
+rebase_layout_report (rebase_ctx_t *ctx)
+{
+  int width = ctx->machine == IMAGE_FILE_MACHINE_I386 ? 8 : 12;
+  /* Bucket k holds the gaps of allocation_slot << k up to twice that,
+     bucket 0 also the smaller ones. */
+  unsigned int bucket_count[64] = { 0 };
+  ULONG64 bucket_size[64] = { 0 };
+  hole_t *holes, *largest = NULL;
+  ULONG64 low, free_bytes = 0, reserved = 0, window;
+  char from[32], to[32];
+  int nholes, h, k;
+
+  if (!ctx->img_info_size)
+    {
+      printf ("The rebase database is empty.\n");
+      return 0;
+    }
+  img_info_sort_by_base (ctx->img_info_list, ctx->img_info_size);
+  nholes = collect_holes (ctx, ctx->img_info_list, ctx->img_info_size,
+			  &holes);
+  if (nholes < 0)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", ctx->progname);
+      return -1;
+    }
+  low = ctx->img_info_list[0].base;
+  for (h = 0; h < nholes; ++h)
+    {
+      ULONG64 size = holes[h].high - holes[h].low;
+
+      free_bytes += size;
+      if (!largest || size > largest->high - largest->low)
+	largest = &holes[h];
+      for (k = 0; k < 63 && size >= ((ULONG64) ctx->allocation_slot << (k + 1));
+	   ++k)
+	;
+      ++bucket_count[k];
+      bucket_size[k] += size;
+    }
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  if (ctx->cygwin_dll_image_size
+      && ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size > low
+      && ctx->cygwin_dll_image_base < ctx->image_base)
+    reserved = min (ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size,
+		    ctx->image_base)
+	       - max (ctx->cygwin_dll_image_base, low);
+#endif
+
+  printf ("%u DLLs in 0x%0*" PRIx64 " - 0x%0*" PRIx64 "\n",
+	  ctx->img_info_size, width, (uint64_t) low,
+	  width, (uint64_t) ctx->image_base);
+  printf ("  in use:        0x%" PRIx64 " bytes\n",
+	  (uint64_t) (ctx->image_base - low - free_bytes - reserved));
+  if (reserved)
+    printf ("  reserved:      0x%" PRIx64 " bytes for the Cygwin DLL\n",
+	    (uint64_t) reserved);
+  printf ("  free:          0x%" PRIx64 " bytes in %d gaps\n",
+	  (uint64_t) free_bytes, nholes);
+  if (largest)
+    printf ("  largest hole:  0x%0*" PRIx64 " - 0x%0*" PRIx64
+	    " size 0x%" PRIx64 "\n",
+	    width, (uint64_t) largest->low, width, (uint64_t) largest->high,
+	    (uint64_t) (largest->high - largest->low));
+  printf ("  below lowest:  0x%" PRIx64 " bytes down to 0x%0*" PRIx64 "\n",
+	  (uint64_t) (low > ctx->low_addr ? low - ctx->low_addr : 0),
+	  width, (uint64_t) ctx->low_addr);
+
+  if (nholes)
+    {
+      printf ("\nFree gaps by size:\n");
+      for (k = 0; k < 64; ++k)
+	if (bucket_count[k])
+	  printf ("  %6s - %-6s %8u gaps  0x%" PRIx64 " bytes\n",
+		  format_size (from, (ULONG64) ctx->allocation_slot << k),
+		  format_size (to, (ULONG64) ctx->allocation_slot << (k + 1)),
+		  bucket_count[k], (uint64_t) bucket_size[k]);
+    }
+
+  printf ("\nUtilisation per %s window:\n", format_size (from, LAYOUT_WINDOW));
+  h = 0;
+  for (window = low & ~(LAYOUT_WINDOW - 1); window < ctx->image_base;
+       window += LAYOUT_WINDOW)
+    {
+      ULONG64 start = max (window, low);
+      ULONG64 end = min (window + LAYOUT_WINDOW, ctx->image_base);
+      ULONG64 unused = 0;
+      int i;
+
+      /* Subtract the holes and the reserved area from the window. */
+      for (i = h; i < nholes && holes[i].low < end; ++i)
+	if (holes[i].high > start)
+	  unused += min (holes[i].high, end) - max (holes[i].low, start);
+      while (h < nholes && holes[h].high <= end)
+	++h;
+#if defined(__CYGWIN__) || defined(__MSYS__)
+      if (reserved
+	  && ctx->cygwin_dll_image_base < end
+	  && ctx->cygwin_dll_image_base + ctx->cygwin_dll_image_size > start)
+	unused += min (ctx->cygwin_dll_image_base
+		       + ctx->cygwin_dll_image_size, end)
+		  - max (ctx->cygwin_dll_image_base, start);
+#endif
+      printf ("  0x%0*" PRIx64 " - 0x%0*" PRIx64 " %5.1f%%\n",
+	      width, (uint64_t) window, width,
+	      (uint64_t) (window + LAYOUT_WINDOW),
+	      100.0 * (end - start - unused) / LAYOUT_WINDOW);
+    }
+  free (holes);
+  return 0;
+}
+
+unsigned int
+rebase_count (rebase_ctx_t *ctx)
+{
+  return ctx->img_info_size;
+}
+
+void
+rebase_close (rebase_ctx_t *ctx)
+{
+  if (!ctx)
+    return;
+  if (ctx->cache_dir)
+    rebase_cache_trim (ctx->cache_dir, ctx->cache_size);
+  free_ctx (ctx);
+}
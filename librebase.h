@@ -0,0 +1,149 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#ifndef LIBREBASE_H
+#define LIBREBASE_H
+
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* librebase is the engine behind the rebase tool.  It allows to rebase
+   DLLs without spawning rebase, e.g. from a package manager:
+
+     rebase_options_t opts;
+     rebase_ctx_t *ctx;
+
+     rebase_options_init (&opts);
+     opts.database = TRUE;
+     if (!(ctx = rebase_open (&opts)))
+       return -1;
+     for (each installed package)
+       for (each DLL of the package)
+	 if (rebase_add (ctx, dll) < 0)
+	   ...
+     rebase_commit (ctx);
+     rebase_close (ctx);
+
+   All state is kept in the context.  The rebase journal is a per-process
+   resource though, so only one context may commit to a database at a
+   time.  Errors are reported on stderr, prefixed with PROGNAME. */
+
+typedef struct _rebase_ctx rebase_ctx_t;
+
+/* Header fields changed together with the rebase, see
+   rebase_header_option.  Each file is then read and written once for
+   both. */
+typedef struct _rebase_header_t
+{
+  WORD coff_set;		/* COFF characteristics to set */
+  WORD coff_clr;		/* and to clear. */
+  WORD pe_set;			/* DLL characteristics to set */
+  WORD pe_clr;			/* and to clear. */
+  ULONG size_mask;		/* 1 << index of each size to write. */
+  ULONG64 sizes[5];		/* Stack reserve, stack commit, heap reserve,
+				   heap commit and Cygwin heap in MB. */
+} rebase_header_t;
+
+typedef struct _rebase_options_t
+{
+  WORD machine;			/* IMAGE_FILE_MACHINE_I386 or _AMD64. */
+  ULONG64 image_base;		/* Base address, 0 to use the database's. */
+  ULONG offset;			/* Additional offset between DLLs. */
+  BOOL down;			/* Rebase top-down from image_base. */
+  BOOL database;		/* Use the rebase database (implies down). */
+  BOOL oblivious;		/* Don't touch or record database entries. */
+  BOOL info;			/* Collect for rebase_print only. */
+  BOOL summary;			/* rebase_print also prints overlaps, gaps
+				   and the address space in use. */
+  BOOL rollback;		/* Undo an interrupted database rebase. */
+  BOOL resume;			/* Continue an interrupted database rebase. */
+  BOOL defrag;			/* Pack the database DLLs toward image_base. */
+  BOOL touch;			/* Bump the file time of rebased files. */
+  BOOL drop_dynamicbase;	/* Remove the dynamicbase flag. */
+  BOOL update_checksum;		/* Keep the PE checksum valid. */
+  BOOL recompute_checksum;	/* Compute the PE checksum from scratch. */
+  ULONG64 stream_threshold;	/* See --stream-threshold. */
+  const char *cache_dir;	/* Result cache, or NULL. */
+  ULONG64 cache_size;		/* Size limit of the result cache. */
+  const char *db_file;		/* Database file, NULL for the default. */
+  rebase_header_t header;	/* Header changes, see above. */
+  BOOL verbose;
+  BOOL quiet;
+  const char *progname;		/* Prefix of error messages. */
+} rebase_options_t;
+
+/* Initialize OPTS with the defaults of the rebase tool. */
+void rebase_options_init (rebase_options_t *opts);
+
+/* Add the header change OPTION to OPTS.  OPTION is NAME=VALUE with the
+   name of a peflags long option, e.g. "tsaware=1" or
+   "stack-reserve=0x800000".  Files at their base already get the
+   changes as well.  Returns -1 if OPTION is invalid, 0 otherwise. */
+int rebase_header_option (rebase_options_t *opts, const char *option);
+
+/* Write the default i386 and x86_64 databases into a database container,
+   opts->db_file or the default container file, which must not exist yet.
+   From then on, the container is used instead of the single machine
+   databases.  Returns -1 on error, 0 otherwise. */
+int rebase_convert_db (const rebase_options_t *opts);
+
+/* Create a context.  With database set, the database is loaded, and an
+   interrupted run is rolled forward, or with rollback, rolled back.
+   With resume, the list of the interrupted run is loaded instead.
+   Returns NULL on error. */
+rebase_ctx_t *rebase_open (const rebase_options_t *opts);
+
+/* Add PATHNAME to the next batch.  Files which can't be rebased are
+   skipped with a message.  Returns -1 on fatal errors, 0 otherwise. */
+int rebase_add (rebase_ctx_t *ctx, const char *pathname);
+
+/* Rebase the files added since the last commit.  With a database, the
+   database entries which need it are rebased too, and the database is
+   saved.  A context can be committed any number of times.  Returns the
+   number of rebased DLLs, or -1 on error. */
+int rebase_commit (rebase_ctx_t *ctx);
+
+/* Print base address and size of the added files, and with database set,
+   of the database entries, to stdout. */
+void rebase_print (rebase_ctx_t *ctx);
+
+/* Print the layout of the database DLLs below the base address to
+   stdout: the free gaps by size, the largest hole, the utilisation of
+   each 256 MB window and the room left above the lowest address.  Returns
+   -1 if out of memory. */
+int rebase_layout_report (rebase_ctx_t *ctx);
+
+/* Run the rebase daemon on the directories ROOTS.  CONTROL is the path of
+   the control socket or NULL, SETTLE the time in seconds without changes
+   before rebasing.  Requires database.  Returns 0 when stopped, -1 on
+   error. */
+int rebase_watch (rebase_ctx_t *ctx, char * const *roots, int root_count,
+		  const char *control, unsigned int settle);
+
+/* Number of DLLs in the database and the current batch. */
+unsigned int rebase_count (rebase_ctx_t *ctx);
+
+/* Trim the result cache and free the context. */
+void rebase_close (rebase_ctx_t *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBREBASE_H */
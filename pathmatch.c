@@ -0,0 +1,101 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#include <ctype.h>
+#include <stddef.h>
+#include "pathmatch.h"
+
+static const char *path_class (const char *pattern, int c);
+
+/* Match string against the shell pattern with *, ? and [...].  Case is
+   ignored, as file names on Windows are case insensitive. */
+int
+path_match (const char *pattern, const char *string)
+{
+  const char *p = pattern, *s = string;
+  const char *star = NULL, *retry = NULL;
+
+  while (*s)
+    {
+      const char *next = NULL;
+
+      if (*p == '*')
+	{
+	  star = ++p;
+	  retry = s;
+	  continue;
+	}
+      if (*p == '?')
+	next = p + 1;
+      else if (*p == '[')
+	next = path_class (p, *s);
+      else if (*p && tolower ((unsigned char) *p)
+		     == tolower ((unsigned char) *s))
+	next = p + 1;
+      if (next)
+	{
+	  p = next;
+	  ++s;
+	}
+      else if (star)
+	{
+	  /* Let the last * swallow one more character. */
+	  p = star;
+	  s = ++retry;
+	}
+      else
+	return 0;
+    }
+  while (*p == '*')
+    ++p;
+  return *p == '\0';
+}
+
+/* Match c against the class starting at the [ at pattern.  Returns the
+   pattern after the class if c matches, NULL otherwise.  A [ without a
+   closing ] matches itself. */
+static const char *
+path_class (const char *pattern, int c)
+{
+  const char *q = pattern + 1;
+  int negate = 0, found = 0;
+
+  if (*q == '!' || *q == '^')
+    {
+      negate = 1;
+      ++q;
+    }
+  c = tolower ((unsigned char) c);
+  do
+    {
+      int low, high;
+
+      if (!*q)
+	return c == '[' ? pattern + 1 : NULL;
+      low = high = tolower ((unsigned char) *q);
+      if (q[1] == '-' && q[2] && q[2] != ']')
+	{
+	  high = tolower ((unsigned char) q[2]);
+	  q += 3;
+	}
+      else
+	++q;
+      if (low <= c && c <= high)
+	found = 1;
+    }
+  while (*q != ']');
+  return found != negate ? q + 1 : NULL;
+}
@@ -0,0 +1,33 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#ifndef PATHMATCH_H
+#define PATHMATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shell pattern matching for the tools, which can't rely on fnmatch
+   being available on all hosts. */
+
+int path_match (const char *pattern, const char *string);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PATHMATCH_H */
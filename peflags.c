@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -31,9 +32,7 @@
 #include <getopt.h>
 #include <errno.h>
 #include <limits.h>
-#if defined (__CYGWIN__) || defined (__MSYS__)
-#include <sys/mman.h>
-#endif
+#include <pthread.h>
 #if defined(__MSYS__)
 /* MSYS has no inttypes.h */
 # define PRIu64 "llu"
@@ -43,6 +42,8 @@
 #endif
 
 #include <windows.h>
+#include "pathmatch.h"
+#include "peoptions.h"
 
 #if defined(__MSYS__)
 /* MSYS has no strtoull */
@@ -67,9 +68,18 @@ static WORD pe_characteristics_set;
 static WORD pe_characteristics_clr;
 static WORD pe_characteristics_show;
 
+/* The headers of a PE file.  pe_open reads the first page of the file
+   into header; the flags and sizes are changed in the copy and pe_close
+   writes back the bytes between dirty_low and dirty_high, if any. */
 typedef struct
 {
   const char *pathname;
+  int fd;
+  DWORD header_len;
+  DWORD dirty_low;
+  DWORD dirty_high;
+  unsigned int syscalls;	/* Made for this file, shown with -v. */
+  BYTE header[4096];
   PIMAGE_DOS_HEADER dosheader;
   union
     {
@@ -77,6 +87,9 @@ typedef struct
       PIMAGE_NT_HEADERS64 ntheader64;
     };
   BOOL is_64bit;
+  /* The flavour specific fields, located once in pe_open. */
+  PWORD coff_characteristics;
+  PWORD pe_characteristics;
 } pe_file;
 
 typedef struct {
@@ -127,12 +140,12 @@ static const symbolic_flags_t pe_symbolic_flags[] = {
 };
 
 enum {
-  SIZEOF_STACK_RESERVE = 0,
-  SIZEOF_STACK_COMMIT,
-  SIZEOF_HEAP_RESERVE,
-  SIZEOF_HEAP_COMMIT,
-  SIZEOF_CYGWIN_HEAP,
-  NUM_SIZEOF_VALUES		/* Keep at the end */
+  SIZEOF_STACK_RESERVE = PE_SIZE_STACK_RESERVE,
+  SIZEOF_STACK_COMMIT = PE_SIZE_STACK_COMMIT,
+  SIZEOF_HEAP_RESERVE = PE_SIZE_HEAP_RESERVE,
+  SIZEOF_HEAP_COMMIT = PE_SIZE_HEAP_COMMIT,
+  SIZEOF_CYGWIN_HEAP = PE_SIZE_CYGWIN_HEAP,
+  NUM_SIZEOF_VALUES = PE_SIZES
 };
 
 typedef enum {
@@ -176,6 +189,93 @@ sizeof_values_t sizeof_vals[5] = {
   }
 };
 
+/* Output of a single file.  If stream is set the text goes straight to
+   it, otherwise it is collected in buf, so that the results of parallel
+   jobs can be printed in the order of the input files. */
+typedef struct
+{
+  FILE *stream;
+  char *buf;
+  size_t len;
+  size_t size;
+} out_t;
+
+/* A file processed with -j. */
+typedef struct
+{
+  const char *pathname;
+  out_t out;
+  out_t err;
+  int status;
+  BOOL done;
+} job_t;
+
+/* Work queue of the -j worker threads.  The main thread waits on done
+   for the next job in input order and prints its output. */
+typedef struct
+{
+  job_t *jobs;
+  unsigned int count;
+  unsigned int next;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} job_queue_t;
+
+#define JOBS_MAX 64
+
+/* Output of --format.  FORMAT_TEXT is the human readable default. */
+typedef enum {
+  FORMAT_TEXT = 0,
+  FORMAT_TSV,
+  FORMAT_JSON,
+  FORMAT_BINARY
+} format_t;
+
+/* Record types of --format. */
+enum {
+  RECORD_FILE = 1,
+  RECORD_COUNT = 2
+};
+
+/* Size of a --format=binary record without the path name. */
+#define BINARY_RECORD_SIZE (2 + 3 * 2 + NUM_SIZEOF_VALUES * 8 + 4)
+
+/* Number of files with the same characteristics, for --format. */
+typedef struct
+{
+  WORD coff;
+  WORD pe;
+  unsigned long count;
+} combination_t;
+
+/* Flags to set and clear in a file. */
+typedef struct
+{
+  WORD coff_set;
+  WORD coff_clr;
+  WORD pe_set;
+  WORD pe_clr;
+} flag_ops_t;
+
+typedef enum {
+  RULE_ANY = 0,
+  RULE_EXE,
+  RULE_DLL
+} rule_type_t;
+
+/* A line of the rule file given with -r. */
+typedef struct
+{
+  const char *pattern;
+  BOOL match_path;		/* pattern contains a slash */
+  rule_type_t type;
+  flag_ops_t ops;
+  BOOL set_sizeof[NUM_SIZEOF_VALUES];
+  ULONGLONG sizeof_value[NUM_SIZEOF_VALUES];
+} rule_t;
+
+#define RULE_LINE_MAX 1024
+
 #define pulonglong(struct, offset)	(PULONGLONG)((PBYTE)(struct)+(offset))
 #define pulong(struct, offset)		(PULONG)((PBYTE)(struct)+(offset))
 
@@ -197,36 +297,62 @@ static struct option long_options[] = {
   {"heap-commit",  optional_argument, NULL, 'Y'},
   {"cygwin-heap",  optional_argument, NULL, 'z'},
   {"filelist",     no_argument, NULL, 'T'},
+  {"jobs",         required_argument, NULL, 'j'},
+  {"rules",        required_argument, NULL, 'r'},
+  {"format",       required_argument, NULL, 'F'},
   {"verbose",      no_argument, NULL, 'v'},
   {"help",         no_argument, NULL, 'h'},
   {"version",      no_argument, NULL, 'V'},
   {NULL, no_argument, NULL, 0}
 };
 static const char *short_options
-	= "d::f::n::i::s::b::W::t::w::l::S::x::X::y::Y::z::T:vhV";
+	= "d::f::n::i::s::b::W::t::w::l::S::x::X::y::Y::z::T:j:r:F:vhV";
 
 static void short_usage (FILE *f);
 static void help (FILE *f);
 static void version (FILE *f);
 
-int do_mark (const char *pathname);
-pe_file *pe_open (const char *path, BOOL writing);
-void pe_close (pe_file *pep);
-void get_and_set_sizes(const pe_file *pep);
+int do_mark (const char *pathname, out_t *out, out_t *err);
+static int do_inspect (const char *pathname, out_t *out, out_t *err);
+static void report_open_error (const char *pathname, BOOL writing,
+			       out_t *err);
+static void count_combination (WORD coff, WORD pe);
+static int combination_cmp (const void *a, const void *b);
+static void print_combinations (out_t *out);
+static void print_record (out_t *out, int type, const char *pathname,
+			  int bits, WORD coff, WORD pe,
+			  const ULONGLONG *values);
+static int out_flag_names (out_t *out, WORD coff, WORD pe,
+			   const char *quote, const char *separator);
+static int utf8_length (const unsigned char *string);
+static void out_escaped (out_t *out, const char *string, BOOL json);
+static void add_job (const char *pathname);
+static int run_jobs (void);
+static void *job_worker (void *arg);
+static void out_printf (out_t *out, const char *format, ...);
+static void out_write (out_t *out, const void *data, size_t len);
+static void out_flush (out_t *out, FILE *stream);
+pe_file *pe_open (pe_file *pef, const char *path, BOOL writing);
+int pe_reopen_writable (pe_file *pep);
+int pe_close (pe_file *pep);
+static void pe_set_dirty (pe_file *pep, const void *field, size_t size);
+void get_and_set_sizes(pe_file *pep, sizeof_values_t *vals, out_t *err);
 int get_characteristics(const pe_file *pep,
                         WORD* coff_characteristics,
                         WORD* pe_characteristics);
-int set_coff_characteristics(const pe_file *pep,
+int set_coff_characteristics(pe_file *pep,
                              WORD coff_characteristics);
-int set_pe_characteristics(const pe_file *pep,
+int set_pe_characteristics(pe_file *pep,
                            WORD pe_characteristics);
 
-static void display_flags (const char *field_name, const symbolic_flags_t *syms,
+static void display_flags (out_t *out, const char *field_name,
+			   const symbolic_flags_t *syms,
                            WORD show_symbolic, WORD old_flag_value,
 			   WORD new_flag_value);
 static char *symbolic_flags (const symbolic_flags_t *syms, long show, long value);
 static void append_and_decorate (char **str, int is_set, const char *name, int len);
 static void *xmalloc (size_t num);
+static void *xrealloc (void *ptr, size_t num);
 #define XMALLOC(type, num)      ((type *) xmalloc ((num) * sizeof(type)))
 static void handle_coff_flag_option (const char *option_name,
                                      const char *option_arg,
@@ -237,8 +363,12 @@ static void handle_pe_flag_option (const char *option_name,
 static void handle_num_option (const char *option_name,
 			       const char *option_arg,
 			       int option_index);
+static void read_rules (const char *rule_file);
+static BOOL rule_matches_name (const rule_t *rule, const char *pathname);
+static BOOL rule_matches (const rule_t *rule, const char *pathname,
+			  WORD coff_characteristics);
+static void merge_flag_ops (flag_ops_t *ops, const flag_ops_t *later);
 void parse_args (int argc, char *argv[]);
-int string_to_bool  (const char *string, int *value);
 int string_to_ulonglong (const char *string, unsigned long long *value);
 FILE *file_list_fopen (const char *file_list);
 char *file_list_fgets (char *buf, int size, FILE *file);
@@ -250,6 +380,17 @@ int verbose = 0;
 const char *file_list = 0;
 const char *stdin_file_list = "-";
 int mark_any = 0;
+unsigned int jobs = 1;
+rule_t *rules = NULL;
+unsigned int rule_count = 0;
+job_t *job_list = NULL;
+unsigned int job_count = 0;
+unsigned int job_size = 0;
+format_t format = FORMAT_TEXT;
+combination_t *combinations = NULL;
+unsigned int combination_count = 0;
+unsigned int combination_size = 0;
+pthread_mutex_t combination_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int
 main (int argc, char *argv[])
@@ -257,6 +398,8 @@ main (int argc, char *argv[])
   int files_attempted = 0;
   int i = 0;
   int ret = 0;
+  out_t out = { stdout, NULL, 0, 0 };
+  out_t err = { stderr, NULL, 0, 0 };
 
   parse_args (argc, argv);
 
@@ -273,7 +416,9 @@ main (int argc, char *argv[])
       while (file_list_fgets (filename, MAX_PATH + 2, file))
 	{
           files_attempted++;
-	  if ((status = do_mark (filename)) != 0)
+	  if (jobs > 1)
+	    add_job (filename);
+	  else if ((status = do_mark (filename, &out, &err)) != 0)
 	    ret = 2;
 	}
 
@@ -296,10 +441,18 @@ main (int argc, char *argv[])
     {
       const char *filename = argv[i];
       files_attempted++;
-      if (do_mark (filename) != 0)
+      if (jobs > 1)
+	add_job (filename);
+      else if (do_mark (filename, &out, &err) != 0)
 	ret = 2;
     }
 
+  if (job_count > 0 && run_jobs () != 0)
+    ret = 2;
+
+  if (format != FORMAT_TEXT)
+    print_combinations (&out);
+
   if (files_attempted == 0)
     {
       /* warn the user */
@@ -312,7 +465,7 @@ main (int argc, char *argv[])
 }
 
 int
-do_mark (const char *pathname)
+do_mark (const char *pathname, out_t *out, out_t *err)
 {
   int has_relocs;
   int is_executable;
@@ -321,46 +474,64 @@ do_mark (const char *pathname)
   WORD new_coff_characteristics;
   WORD old_pe_characteristics;
   WORD new_pe_characteristics;
-
-  /* Skip if file does not exist */
-  if (access (pathname, F_OK) == -1)
-    {
-      fprintf (stderr, "%s: skipped because nonexistent\n", pathname);
-      return 0;
-    }
-
-  if (mark_any)
-    {
-      /* Skip if not writable. */
-      if (access (pathname, W_OK) == -1)
-        {
-          fprintf (stderr, "%s: skipped because not writable\n", pathname);
-          return 0;
-        }
-    }
-
-  pe_file *pep = pe_open (pathname, mark_any != 0
-				    || handle_any_sizeof == DO_WRITE);
+  /* The sizes read or written are per file. */
+  sizeof_values_t vals[NUM_SIZEOF_VALUES];
+  do_handle_t handle_sizeof = DONT_HANDLE;
+  flag_ops_t ops = { 0, 0, 0, 0 };
+  flag_ops_t command_line_ops = {
+    coff_characteristics_set, coff_characteristics_clr,
+    pe_characteristics_set, pe_characteristics_clr
+  };
+  /* With rules, only the files matching one are changed or shown. */
+  BOOL marking = mark_any || rule_count > 0;
+  BOOL writing = mark_any || handle_any_sizeof == DO_WRITE;
+  pe_file pef;
+  unsigned int r;
+  int i, ret = 0;
+
+  if (format != FORMAT_TEXT)
+    return do_inspect (pathname, out, err);
+
+  /* Whether a rule applies to the file is only known once its headers
+     are read, so the file is opened read-only for the rules, and reopened
+     for writing if they change something. */
+  pe_file *pep = pe_open (&pef, pathname, writing);
   if (!pep)
     {
-      fprintf (stderr,
-               "%s: skipped because could not open\n",
-               pathname);
+      report_open_error (pathname, writing, err);
       return 0;
     }
 
   get_characteristics (pep,
 		       &old_coff_characteristics,
 		       &old_pe_characteristics);
-  get_and_set_sizes (pep);
+  memcpy (vals, sizeof_vals, sizeof vals);
+
+  /* Apply the matching rules in order, then the command line on top. */
+  for (r = 0; r < rule_count; ++r)
+    if (rule_matches (rules + r, pathname, old_coff_characteristics))
+      {
+	merge_flag_ops (&ops, &rules[r].ops);
+	for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
+	  if (rules[r].set_sizeof[i] && sizeof_vals[i].handle != DO_WRITE)
+	    {
+	      vals[i].handle = DO_WRITE;
+	      vals[i].value = rules[r].sizeof_value[i];
+	    }
+      }
+  merge_flag_ops (&ops, &command_line_ops);
+  for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
+    if (vals[i].handle > handle_sizeof)
+      handle_sizeof = vals[i].handle;
+  get_and_set_sizes (pep, vals, err);
 
   new_coff_characteristics = old_coff_characteristics;
-  new_coff_characteristics |= coff_characteristics_set;
-  new_coff_characteristics &= ~coff_characteristics_clr;
+  new_coff_characteristics |= ops.coff_set;
+  new_coff_characteristics &= ~ops.coff_clr;
 
   new_pe_characteristics = old_pe_characteristics;
-  new_pe_characteristics |= pe_characteristics_set;
-  new_pe_characteristics &= ~pe_characteristics_clr;
+  new_pe_characteristics |= ops.pe_set;
+  new_pe_characteristics &= ~ops.pe_clr;
 
   is_executable = ((new_coff_characteristics & IMAGE_FILE_EXECUTABLE_IMAGE) > 0);
   is_dll        = ((new_coff_characteristics & IMAGE_FILE_DLL) > 0);
@@ -375,7 +546,7 @@ do_mark (const char *pathname)
          && (new_pe_characteristics & IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE)
          && (old_pe_characteristics & IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE))
         {
-          fprintf (stderr,
+          out_printf (err,
                    "Warning: file has no relocation info but has dynbase set (%s).\n",
                    pathname);
         }
@@ -386,13 +557,13 @@ do_mark (const char *pathname)
          && (new_pe_characteristics & IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE)
          && (old_pe_characteristics & IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE))
         {
-          fprintf (stderr,
+          out_printf (err,
                    "Warning: file is non-executable but has tsaware set (%s).\n",
                    pathname);
         }
     }
  
-  if (mark_any)
+  if (marking)
     {
       /* validation and warnings about things we are changing */
       if (!has_relocs)
@@ -400,7 +571,7 @@ do_mark (const char *pathname)
           if (   (new_pe_characteristics & IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE)
              && !(old_pe_characteristics & IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE))
             {
-              fprintf (stderr,
+              out_printf (err,
                        "Warning: setting dynbase on file with no relocation info (%s).\n",
                        pathname);
             }
@@ -411,7 +582,7 @@ do_mark (const char *pathname)
           if (   (new_pe_characteristics & IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE)
              && !(old_pe_characteristics & IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE))
             {
-              fprintf (stderr,
+              out_printf (err,
                        "Warning: setting tsaware on non-executable (%s).\n",
                        pathname);
             }
@@ -424,58 +595,513 @@ do_mark (const char *pathname)
         set_pe_characteristics (pep, new_pe_characteristics);
     }
 
+  if (!writing && pep->dirty_low < pep->dirty_high
+      && pe_reopen_writable (pep) != 0)
+    {
+      report_open_error (pathname, TRUE, err);
+      ++pep->syscalls;
+      close (pep->fd);
+      return 0;
+    }
+
+  if (pe_close (pep) != 0)
+    {
+      out_printf (err, "%s: could not write: %s\n", pathname,
+		  strerror (errno));
+      ret = 1;
+    }
+
   /* Display characteristics. */
   if (verbose
-      || !mark_any
+      || !marking
       || coff_characteristics_show
       || pe_characteristics_show
-      || handle_any_sizeof != DONT_HANDLE)
+      || handle_sizeof != DONT_HANDLE)
     {
       BOOL printed_characteristic = FALSE;
-      int i;
 
-      printf ("%s: ", pathname);
+      out_printf (out, "%s: ", pathname);
       if (verbose
-	  || (!mark_any && handle_any_sizeof == DONT_HANDLE)
+	  || (!marking && handle_sizeof == DONT_HANDLE)
 	  || coff_characteristics_show || pe_characteristics_show)
 	{
-	  display_flags ("coff", coff_symbolic_flags,
+	  display_flags (out, "coff", coff_symbolic_flags,
 			 coff_characteristics_show ?:
 			 verbose ? old_coff_characteristics : 0,
 			 old_coff_characteristics,
 			 new_coff_characteristics);
-	  display_flags ("pe", pe_symbolic_flags,
+	  display_flags (out, "pe", pe_symbolic_flags,
 			 pe_characteristics_show ?:
 			 verbose ? old_pe_characteristics : 0,
 			 old_pe_characteristics,
 			 new_pe_characteristics);
-	  puts ("");
+	  out_printf (out, "\n");
 	  printed_characteristic = TRUE;
 	}
 
       for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
 	{
-	  if (sizeof_vals[i].handle != DONT_HANDLE)
+	  if (vals[i].handle != DONT_HANDLE)
 	    {
-	      printf ("%*s%-24s: %" PRIu64 " (0x%" PRIx64 ") %s\n",
-		      printed_characteristic ? (int) strlen (pathname) + 2
-					     : 0, "",
-		      sizeof_vals[i].name,
-		      (uint64_t) sizeof_vals[i].value,
-		      (uint64_t) sizeof_vals[i].value,
-		      sizeof_vals[i].unit);
+	      out_printf (out, "%*s%-24s: %" PRIu64 " (0x%" PRIx64 ") %s\n",
+			  printed_characteristic ? (int) strlen (pathname) + 2
+						 : 0, "",
+			  vals[i].name,
+			  (uint64_t) vals[i].value,
+			  (uint64_t) vals[i].value,
+			  vals[i].unit);
 	      printed_characteristic = TRUE;
 	    }
 	}
+      if (verbose)
+	out_printf (out, "%*s%-24s: %u\n",
+		    printed_characteristic ? (int) strlen (pathname) + 2 : 0,
+		    "", "system calls", pef.syscalls);
     }
 
+  return ret;
+}
+
+/* The reason for skipping a file is taken from the failing open, so
+   that no extra system calls are made for the files that work. */
+static void
+report_open_error (const char *pathname, BOOL writing, out_t *err)
+{
+  if (errno == ENOENT || errno == ENOTDIR)
+    out_printf (err, "%s: skipped because nonexistent\n", pathname);
+  else if (writing && (errno == EACCES || errno == EPERM || errno == EROFS))
+    out_printf (err, "%s: skipped because not writable\n", pathname);
+  else
+    out_printf (err, "%s: skipped because could not open\n", pathname);
+}
+
+/* Print the characteristics and sizes of pathname as a --format record
+   and count its combination of characteristics. */
+static int
+do_inspect (const char *pathname, out_t *out, out_t *err)
+{
+  sizeof_values_t vals[NUM_SIZEOF_VALUES];
+  ULONGLONG values[NUM_SIZEOF_VALUES];
+  WORD coff_characteristics, pe_characteristics;
+  pe_file pef;
+  pe_file *pep;
+  int bits, i;
+
+  if (!(pep = pe_open (&pef, pathname, FALSE)))
+    {
+      report_open_error (pathname, FALSE, err);
+      return 0;
+    }
+  get_characteristics (pep, &coff_characteristics, &pe_characteristics);
+  memcpy (vals, sizeof_vals, sizeof vals);
+  for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
+    vals[i].handle = DO_READ;
+  get_and_set_sizes (pep, vals, err);
+  bits = pep->is_64bit ? 64 : 32;
   pe_close (pep);
 
+  for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
+    values[i] = vals[i].value;
+  count_combination (coff_characteristics, pe_characteristics);
+  print_record (out, RECORD_FILE, pathname, bits, coff_characteristics,
+		pe_characteristics, values);
   return 0;
 }
 
+/* Add a file with the given characteristics to combinations.  There are
+   only a few dozen different combinations even on big installations, so
+   a linear search is good enough.  Called by the -j threads. */
+static void
+count_combination (WORD coff, WORD pe)
+{
+  unsigned int i;
+
+  pthread_mutex_lock (&combination_lock);
+  for (i = 0; i < combination_count; ++i)
+    if (combinations[i].coff == coff && combinations[i].pe == pe)
+      break;
+  if (i == combination_count)
+    {
+      if (combination_count == combination_size)
+	{
+	  combination_size = combination_size ? 2 * combination_size : 32;
+	  combinations = (combination_t *)
+	    xrealloc (combinations, combination_size * sizeof *combinations);
+	}
+      combinations[i].coff = coff;
+      combinations[i].pe = pe;
+      combinations[i].count = 0;
+      ++combination_count;
+    }
+  ++combinations[i].count;
+  pthread_mutex_unlock (&combination_lock);
+}
+
+/* Most frequent combination first. */
+static int
+combination_cmp (const void *a, const void *b)
+{
+  const combination_t *ca = (const combination_t *) a;
+  const combination_t *cb = (const combination_t *) b;
+
+  if (ca->count != cb->count)
+    return ca->count < cb->count ? 1 : -1;
+  if (ca->coff != cb->coff)
+    return ca->coff < cb->coff ? -1 : 1;
+  return ca->pe < cb->pe ? -1 : ca->pe > cb->pe;
+}
+
+/* Print a count record for each combination of characteristics seen. */
+static void
+print_combinations (out_t *out)
+{
+  ULONGLONG values[NUM_SIZEOF_VALUES];
+  unsigned int i;
+
+  qsort (combinations, combination_count, sizeof *combinations,
+	 combination_cmp);
+  memset (values, 0, sizeof values);
+  for (i = 0; i < combination_count; ++i)
+    {
+      values[0] = combinations[i].count;
+      print_record (out, RECORD_COUNT, NULL, 0, combinations[i].coff,
+		    combinations[i].pe, values);
+    }
+  free (combinations);
+  combinations = NULL;
+  combination_count = combination_size = 0;
+}
+
+/* Print a --format record.  For RECORD_COUNT, values[0] is the number
+   of files and pathname and the sizes are not used. */
+static void
+print_record (out_t *out, int type, const char *pathname, int bits,
+	      WORD coff, WORD pe, const ULONGLONG *values)
+{
+  int i;
+
+  switch (format)
+    {
+    case FORMAT_TSV:
+      if (type == RECORD_FILE)
+	{
+	  out_printf (out, "file\t");
+	  out_escaped (out, pathname, FALSE);
+	  out_printf (out, "\t%d\t0x%04x\t0x%04x", bits, coff, pe);
+	  for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
+	    out_printf (out, "\t%" PRIu64, (uint64_t) values[i]);
+	}
+      else
+	out_printf (out, "count\t%" PRIu64 "\t0x%04x\t0x%04x",
+		    (uint64_t) values[0], coff, pe);
+      out_printf (out, "\t");
+      if (!out_flag_names (out, coff, pe, "", ","))
+	out_printf (out, "-");
+      out_printf (out, "\n");
+      break;
+    case FORMAT_JSON:
+      if (type == RECORD_FILE)
+	{
+	  out_printf (out, "{\"type\":\"file\",\"path\":\"");
+	  out_escaped (out, pathname, TRUE);
+	  out_printf (out, "\",\"bits\":%d,", bits);
+	}
+      else
+	out_printf (out, "{\"type\":\"count\",\"count\":%" PRIu64 ",",
+		    (uint64_t) values[0]);
+      out_printf (out, "\"coff\":%u,\"pe\":%u,\"flags\":[", coff, pe);
+      out_flag_names (out, coff, pe, "\"", ",");
+      out_printf (out, "]");
+      if (type == RECORD_FILE)
+	out_printf (out, ",\"stack_reserve\":%" PRIu64
+			 ",\"stack_commit\":%" PRIu64
+			 ",\"heap_reserve\":%" PRIu64
+			 ",\"heap_commit\":%" PRIu64
+			 ",\"cygwin_heap\":%" PRIu64,
+		    (uint64_t) values[SIZEOF_STACK_RESERVE],
+		    (uint64_t) values[SIZEOF_STACK_COMMIT],
+		    (uint64_t) values[SIZEOF_HEAP_RESERVE],
+		    (uint64_t) values[SIZEOF_HEAP_COMMIT],
+		    (uint64_t) values[SIZEOF_CYGWIN_HEAP]);
+      out_printf (out, "}\n");
+      break;
+    case FORMAT_BINARY:
+      {
+	BYTE record[BINARY_RECORD_SIZE], *p = record;
+	uint32_t path_len = pathname ? strlen (pathname) : 0;
+	uint64_t value;
+	int shift;
+
+	*p++ = type;
+	*p++ = bits;
+	*p++ = coff & 0xff;
+	*p++ = coff >> 8;
+	*p++ = pe & 0xff;
+	*p++ = pe >> 8;
+	*p++ = 0;
+	*p++ = 0;
+	for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
+	  for (value = values[i], shift = 0; shift < 64; shift += 8)
+	    *p++ = (value >> shift) & 0xff;
+	for (shift = 0; shift < 32; shift += 8)
+	  *p++ = (path_len >> shift) & 0xff;
+	out_write (out, record, sizeof record);
+	out_write (out, pathname, path_len);
+      }
+      break;
+    default:
+      break;
+    }
+}
+
+/* Print the names of the flags set in coff and pe, each enclosed in
+   quote, separated by separator.  Returns the number of names. */
+static int
+out_flag_names (out_t *out, WORD coff, WORD pe, const char *quote,
+		const char *separator)
+{
+  const symbolic_flags_t *syms;
+  WORD value;
+  int n = 0, i;
+
+  for (syms = coff_symbolic_flags, value = coff; syms;
+       syms = syms == coff_symbolic_flags ? pe_symbolic_flags : NULL,
+       value = pe)
+    for (i = 0; syms[i].name; ++i)
+      if (value & syms[i].flag)
+	out_printf (out, "%s%s%s%s", n++ ? separator : "", quote,
+		    syms[i].name, quote);
+  return n;
+}
+
+/* Length of the valid UTF-8 sequence at string, or 0. */
+static int
+utf8_length (const unsigned char *string)
+{
+  unsigned char c = string[0], min = 0x80, max = 0xbf;
+  int len, i;
+
+  if (c < 0x80)
+    return 1;
+  else if (c >= 0xc2 && c <= 0xdf)
+    len = 2;
+  else if (c >= 0xe0 && c <= 0xef)
+    {
+      len = 3;
+      /* No overlong forms and no surrogates. */
+      if (c == 0xe0)
+	min = 0xa0;
+      else if (c == 0xed)
+	max = 0x9f;
+    }
+  else if (c >= 0xf0 && c <= 0xf4)
+    {
+      len = 4;
+      /* No overlong forms and nothing above U+10FFFF. */
+      if (c == 0xf0)
+	min = 0x90;
+      else if (c == 0xf4)
+	max = 0x8f;
+    }
+  else
+    return 0;
+  for (i = 1; i < len; ++i, min = 0x80, max = 0xbf)
+    if (string[i] < min || string[i] > max)
+      return 0;
+  return len;
+}
+
+/* Print string with the characters escaped which would break a TSV
+   field or, with json, a JSON string.  JSON must be valid UTF-8, so
+   other bytes above 0x7f are printed as \u00XX there. */
+static void
+out_escaped (out_t *out, const char *string, BOOL json)
+{
+  const char *start = string;
+  const char *s;
+  int len;
+
+  for (s = string; *s; ++s)
+    {
+      unsigned char c = *s;
+
+      if (json && c >= 0x80)
+	{
+	  if ((len = utf8_length ((const unsigned char *) s)) > 0)
+	    {
+	      s += len - 1;
+	      continue;
+	    }
+	  out_write (out, start, s - start);
+	  start = s + 1;
+	  out_printf (out, "\\u%04x", c);
+	}
+      else if (c == '\\' || c < 0x20 || (json && c == '"'))
+	{
+	  out_write (out, start, s - start);
+	  start = s + 1;
+	  if (c == '\t')
+	    out_printf (out, "\\t");
+	  else if (c == '\n')
+	    out_printf (out, "\\n");
+	  else if (c == '\\' || c == '"')
+	    out_printf (out, "\\%c", c);
+	  else if (json)
+	    out_printf (out, "\\u%04x", c);
+	  else
+	    out_printf (out, "\\x%02x", c);
+	}
+    }
+  out_write (out, start, s - start);
+}
+
+/* Queue pathname for run_jobs. */
+static void
+add_job (const char *pathname)
+{
+  job_t *job;
+
+  if (job_count == job_size)
+    {
+      job_size = job_size ? 2 * job_size : 256;
+      job_list = (job_t *) xrealloc (job_list, job_size * sizeof *job_list);
+    }
+  job = &job_list[job_count++];
+  memset (job, 0, sizeof *job);
+  job->pathname = strcpy (XMALLOC (char, strlen (pathname) + 1), pathname);
+}
+
+static void *
+job_worker (void *arg)
+{
+  job_queue_t *queue = (job_queue_t *) arg;
+
+  while (1)
+    {
+      job_t *job;
+
+      pthread_mutex_lock (&queue->lock);
+      job = queue->next < queue->count ? &queue->jobs[queue->next++] : NULL;
+      pthread_mutex_unlock (&queue->lock);
+      if (!job)
+	break;
+      job->status = do_mark (job->pathname, &job->out, &job->err);
+      pthread_mutex_lock (&queue->lock);
+      job->done = TRUE;
+      pthread_cond_signal (&queue->done);
+      pthread_mutex_unlock (&queue->lock);
+    }
+  return NULL;
+}
+
+/* Run do_mark on the queued files with up to jobs threads.  Most of the
+   time is spent opening and mapping the files, so several files are kept
+   in flight.  The output of each file is buffered and printed in the
+   order the files were given, so it is the same as without -j. */
+static int
+run_jobs (void)
+{
+  job_queue_t queue;
+  pthread_t threads[JOBS_MAX];
+  unsigned int started = 0, i;
+  int ret = 0;
+
+  queue.jobs = job_list;
+  queue.count = job_count;
+  queue.next = 0;
+  pthread_mutex_init (&queue.lock, NULL);
+  pthread_cond_init (&queue.done, NULL);
+  while (started < jobs && started < job_count
+	 && !pthread_create (&threads[started], NULL, job_worker, &queue))
+    ++started;
+  if (started == 0)
+    job_worker (&queue);
+
+  for (i = 0; i < job_count; ++i)
+    {
+      job_t *job = &job_list[i];
+
+      pthread_mutex_lock (&queue.lock);
+      while (!job->done)
+	pthread_cond_wait (&queue.done, &queue.lock);
+      pthread_mutex_unlock (&queue.lock);
+      out_flush (&job->err, stderr);
+      out_flush (&job->out, stdout);
+      if (job->status != 0)
+	ret = 2;
+      free ((char *) job->pathname);
+    }
+
+  for (i = 0; i < started; ++i)
+    pthread_join (threads[i], NULL);
+  pthread_cond_destroy (&queue.done);
+  pthread_mutex_destroy (&queue.lock);
+  return ret;
+}
+
+static void
+out_printf (out_t *out, const char *format, ...)
+{
+  va_list ap;
+  int len;
+
+  va_start (ap, format);
+  if (out->stream)
+    {
+      vfprintf (out->stream, format, ap);
+      va_end (ap);
+      return;
+    }
+  len = vsnprintf (out->buf ? out->buf + out->len : NULL,
+		   out->size - out->len, format, ap);
+  va_end (ap);
+  if (len < 0)
+    return;
+  if (out->len + len >= out->size)
+    {
+      while (out->len + len >= out->size)
+	out->size = out->size ? 2 * out->size : 256;
+      out->buf = (char *) xrealloc (out->buf, out->size);
+      va_start (ap, format);
+      vsnprintf (out->buf + out->len, out->size - out->len, format, ap);
+      va_end (ap);
+    }
+  out->len += len;
+}
+
+/* Add len bytes of data to out. */
+static void
+out_write (out_t *out, const void *data, size_t len)
+{
+  if (out->stream)
+    {
+      fwrite (data, 1, len, out->stream);
+      return;
+    }
+  if (out->len + len >= out->size)
+    {
+      while (out->len + len >= out->size)
+	out->size = out->size ? 2 * out->size : 256;
+      out->buf = (char *) xrealloc (out->buf, out->size);
+    }
+  memcpy (out->buf + out->len, data, len);
+  out->len += len;
+}
+
+/* Print and release the text collected in out. */
+static void
+out_flush (out_t *out, FILE *stream)
+{
+  if (out->len)
+    fwrite (out->buf, 1, out->len, stream);
+  free (out->buf);
+  out->buf = NULL;
+  out->len = out->size = 0;
+}
+
 static void
-display_flags (const char *field_name, const symbolic_flags_t *syms,
+display_flags (out_t *out, const char *field_name,
+	       const symbolic_flags_t *syms,
                WORD show_symbolic, WORD old_flag_value,
 	       WORD new_flag_value)
 {
@@ -485,7 +1111,7 @@ display_flags (const char *field_name, const symbolic_flags_t *syms,
         {
           char * old_symbolic = symbolic_flags (syms, show_symbolic, old_flag_value);
           char * new_symbolic = symbolic_flags (syms, show_symbolic, new_flag_value);
-          printf ("%s(0x%04x%s==>0x%04x%s) ", field_name,
+          out_printf (out, "%s(0x%04x%s==>0x%04x%s) ", field_name,
               old_flag_value, old_symbolic,
               new_flag_value, new_symbolic);
           free (old_symbolic);
@@ -494,7 +1120,7 @@ display_flags (const char *field_name, const symbolic_flags_t *syms,
       else
         {
           char * old_symbolic = symbolic_flags (syms, show_symbolic, old_flag_value);
-          printf ("%s(0x%04x%s) ", field_name,
+          out_printf (out, "%s(0x%04x%s) ", field_name,
               old_flag_value, old_symbolic);
           free (old_symbolic);
         }
@@ -502,10 +1128,10 @@ display_flags (const char *field_name, const symbolic_flags_t *syms,
   else
     {
       if (old_flag_value != new_flag_value)
-        printf ("%s(0x%04x==>0x%04x) ", field_name,
+        out_printf (out, "%s(0x%04x==>0x%04x) ", field_name,
             old_flag_value, new_flag_value);
       else
-        printf ("%s(0x%04x) ", field_name, old_flag_value);
+        out_printf (out, "%s(0x%04x) ", field_name, old_flag_value);
     }
 }
 
@@ -578,6 +1204,18 @@ xmalloc (size_t num)
   return p;
 }
 
+static void *
+xrealloc (void *ptr, size_t num)
+{
+  void *p = realloc (ptr, num);
+  if (!p)
+    {
+      fputs ("Memory exhausted", stderr);
+      exit (2);
+    }
+  return p;
+}
+
 static void
 handle_num_option (const char *option_name,
 		   const char *option_arg,
@@ -591,11 +1229,7 @@ handle_num_option (const char *option_name,
 	handle_any_sizeof = DO_READ;
     }
   else if (string_to_ulonglong (option_arg, &sizeof_vals[option_index].value)
-	   /* 48 bit address space */
-	   || sizeof_vals[option_index].value > 0x0000ffffffffffffULL
-	   /* Just a ULONG value */
-	   || (sizeof_vals[option_index].is_ulong
-	       && sizeof_vals[option_index].value > ULONG_MAX))
+	   || pe_check_size (option_index, sizeof_vals[option_index].value))
     {
       fprintf (stderr, "Invalid argument for %s: %s\n", 
 	       option_name, option_arg);
@@ -621,7 +1255,7 @@ handle_pe_flag_option (const char *option_name,
     }
   else
     {
-      if (string_to_bool (option_arg, &bool_value) != 0)
+      if (pe_string_to_bool (option_arg, &bool_value) != 0)
         {
           fprintf (stderr, "Invalid argument for %s: %s\n", 
                    option_name, option_arg);
@@ -647,7 +1281,7 @@ handle_coff_flag_option (const char *option_name,
     }
   else
     {
-      if (string_to_bool (option_arg, &bool_value) != 0)
+      if (pe_string_to_bool (option_arg, &bool_value) != 0)
         {
           fprintf (stderr, "Invalid argument for %s: %s\n", 
                    option_name, option_arg);
@@ -664,6 +1298,8 @@ handle_coff_flag_option (const char *option_name,
 void
 parse_args (int argc, char *argv[])
 {
+  const char *rule_file = NULL;
+  const pe_option_t *option;
   int c;
 
   while (1)
@@ -694,88 +1330,43 @@ parse_args (int argc, char *argv[])
 	  exit (0);
 	  break;
 
-	case 'd':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE);
-	  break;
-	case 'n':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_NX_COMPAT);
-	  break;
-	case 't':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE);
-	  break;
-	case 'f':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_FORCE_INTEGRITY);
-	  break;
-	case 'i':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_NO_ISOLATION);
-	  break;
-	case 's':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_NO_SEH);
-	  break;
-	case 'b':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_NO_BIND);
-	  break;
-	case 'W':
-	  handle_pe_flag_option (long_options[option_index].name,
-	                         optarg,
-	                         IMAGE_DLLCHARACTERISTICS_WDM_DRIVER);
-	  break;
-	case 'w':
-	  handle_coff_flag_option (long_options[option_index].name,
-	                           optarg,
-	                           IMAGE_FILE_AGGRESIVE_WS_TRIM);
-	  break;
-	case 'l':
-	  handle_coff_flag_option (long_options[option_index].name,
-	                           optarg,
-	                           IMAGE_FILE_LARGE_ADDRESS_AWARE);
-	  break;
-	case 'S':
-	  handle_coff_flag_option (long_options[option_index].name,
-	                           optarg,
-	                           IMAGE_FILE_DEBUG_STRIPPED);
-	  break;
-	case 'x':
-	  handle_num_option (long_options[option_index].name,
-			     optarg,
-			     SIZEOF_STACK_RESERVE);
-	  break;
-	case 'X':
-	  handle_num_option (long_options[option_index].name,
-			     optarg,
-			     SIZEOF_STACK_COMMIT);
-	  break;
-	case 'y':
-	  handle_num_option (long_options[option_index].name,
-			     optarg,
-			     SIZEOF_HEAP_RESERVE);
+	case 'T':
+	  file_list = optarg;
 	  break;
-	case 'Y':
-	  handle_num_option (long_options[option_index].name,
-			     optarg,
-			     SIZEOF_HEAP_COMMIT);
+	case 'r':
+	  rule_file = optarg;
 	  break;
-	case 'z':
-	  handle_num_option (long_options[option_index].name,
-			     optarg,
-			     SIZEOF_CYGWIN_HEAP);
+	case 'j':
+	  {
+	    unsigned long long value;
+
+	    if (string_to_ulonglong (optarg, &value) || value < 1
+		|| value > JOBS_MAX)
+	      {
+		fprintf (stderr, "Invalid argument for %s: %s\n",
+			 long_options[option_index].name, optarg);
+		short_usage (stderr);
+		exit (1);
+	      }
+	    jobs = (unsigned int) value;
+	  }
 	  break;
-	case 'T':
-	  file_list = optarg;
+	case 'F':
+	  if (!strcmp (optarg, "text"))
+	    format = FORMAT_TEXT;
+	  else if (!strcmp (optarg, "tsv"))
+	    format = FORMAT_TSV;
+	  else if (!strcmp (optarg, "json"))
+	    format = FORMAT_JSON;
+	  else if (!strcmp (optarg, "binary"))
+	    format = FORMAT_BINARY;
+	  else
+	    {
+	      fprintf (stderr, "Invalid argument for %s: %s\n",
+		       long_options[option_index].name, optarg);
+	      short_usage (stderr);
+	      exit (1);
+	    }
 	  break;
 	case 'v':
 	  verbose = TRUE;
@@ -783,53 +1374,237 @@ parse_args (int argc, char *argv[])
         case '?':
           break;
 	default:
-	  short_usage (stderr);
-	  exit (1);
+	  if (!(option = pe_option_by_val (c)))
+	    {
+	      short_usage (stderr);
+	      exit (1);
+	    }
+	  if (option->pe_flag)
+	    handle_pe_flag_option (long_options[option_index].name,
+				   optarg,
+				   option->pe_flag);
+	  else if (option->coff_flag)
+	    handle_coff_flag_option (long_options[option_index].name,
+				     optarg,
+				     option->coff_flag);
+	  else if (option->size_index >= 0)
+	    handle_num_option (long_options[option_index].name,
+			       optarg,
+			       option->size_index);
+	  else
+	    {
+	      short_usage (stderr);
+	      exit (1);
+	    }
 	  break;
 	}
     }
 
+  if (rule_file)
+    read_rules (rule_file);
+
   args_index = optind;
   mark_any =   pe_characteristics_set
              | pe_characteristics_clr
              | coff_characteristics_set
              | coff_characteristics_clr;
+
+  /* --format only inspects the files. */
+  if (format != FORMAT_TEXT
+      && (mark_any || rule_count > 0 || handle_any_sizeof == DO_WRITE))
+    {
+      fprintf (stderr, "Error: --format can't be combined with changing "
+		       "flags or sizes\n");
+      short_usage (stderr);
+      exit (1);
+    }
+#if !defined (__CYGWIN__) && !defined (__MSYS__)
+  if (format == FORMAT_BINARY)
+    _setmode (_fileno (stdout), _O_BINARY);
+#endif
 }
 
-int
-string_to_bool (const char *string, int *value)
+/* Read the rules from rule_file into rules.  Each line is
+
+     PATTERN TYPE OPTION...
+
+   where TYPE is exe, dll or any and each OPTION is the long name of a
+   flag or size option with a value, e.g. tsaware=yes.  Empty lines and
+   lines starting with # are ignored. */
+static void
+read_rules (const char *rule_file)
 {
-  unsigned long long number = 0;
-  if (!string || !*string)
-    return 1;
+  char line[RULE_LINE_MAX];
+  unsigned int line_no = 0, size = 0;
+  FILE *file = fopen (rule_file, "r");
 
-  if (string_to_ulonglong (string, &number) != 0)
+  if (!file)
     {
-      size_t len = strlen (string);
-      if ( (len == 4 && strcasecmp (string, "true") == 0)
-         ||(len == 3 && strcasecmp (string, "yes") == 0) 
-         ||(len == 1 && strcasecmp (string, "t") == 0)
-         ||(len == 1 && strcasecmp (string, "y") == 0)) 
-        {
-          *value = TRUE;
-        }
-      else if ( (len == 5 && strcasecmp (string, "false") == 0)
-         ||(len == 2 && strcasecmp (string, "no") == 0) 
-         ||(len == 1 && strcasecmp (string, "f") == 0) 
-         ||(len == 1 && strcasecmp (string, "n") == 0))
-        {
-          *value = FALSE;
-        }
+      fprintf (stderr, "cannot read %s\n", rule_file);
+      exit (2);
+    }
+  while (fgets (line, sizeof line, file))
+    {
+      static const char *blanks = " \t\r\n";
+      char *token[3], *p = line;
+      rule_t *rule;
+      int n;
+
+      ++line_no;
+      if (!strchr (line, '\n') && !feof (file))
+	{
+	  fprintf (stderr, "%s:%u: line too long\n", rule_file, line_no);
+	  exit (1);
+	}
+      /* Split off pattern, type and the rest of the line. */
+      for (n = 0; n < 3; ++n)
+	{
+	  p += strspn (p, blanks);
+	  token[n] = p;
+	  if (n < 2)
+	    {
+	      p += strcspn (p, blanks);
+	      if (*p)
+		*p++ = '\0';
+	    }
+	}
+      if (*token[0] == '\0' || *token[0] == '#')
+	continue;
+
+      if (rule_count == size)
+	{
+	  size = size ? 2 * size : 16;
+	  rules = (rule_t *) xrealloc (rules, size * sizeof *rules);
+	}
+      rule = &rules[rule_count++];
+      memset (rule, 0, sizeof *rule);
+      rule->pattern = strcpy (XMALLOC (char, strlen (token[0]) + 1),
+			      token[0]);
+      rule->match_path = strchr (token[0], '/') != NULL;
+      if (strcmp (token[1], "any") == 0)
+	rule->type = RULE_ANY;
+      else if (strcmp (token[1], "exe") == 0)
+	rule->type = RULE_EXE;
+      else if (strcmp (token[1], "dll") == 0)
+	rule->type = RULE_DLL;
       else
-        {
-          return 1;
-        }
+	{
+	  fprintf (stderr, "%s:%u: type must be exe, dll or any: %s\n",
+		   rule_file, line_no, token[1]);
+	  exit (1);
+	}
+
+      p = token[2];
+      while (*(p += strspn (p, blanks)))
+	{
+	  const pe_option_t *option;
+	  char *name = p, *value;
+
+	  p += strcspn (p, blanks);
+	  if (*p)
+	    *p++ = '\0';
+	  if (strncmp (name, "--", 2) == 0)
+	    name += 2;
+	  value = strchr (name, '=');
+	  if (value)
+	    *value++ = '\0';
+	  if (!(option = pe_option_by_name (name, strlen (name))))
+	    {
+	      fprintf (stderr, "%s:%u: unknown option %s\n",
+		       rule_file, line_no, name);
+	      exit (1);
+	    }
+	  if (option->size_index >= 0)
+	    {
+	      unsigned long long number;
+	      int index = option->size_index;
+
+	      if (!value || string_to_ulonglong (value, &number)
+		  || pe_check_size (index, number))
+		{
+		  fprintf (stderr, "%s:%u: invalid value for %s\n",
+			   rule_file, line_no, name);
+		  exit (1);
+		}
+	      rule->set_sizeof[index] = TRUE;
+	      rule->sizeof_value[index] = number;
+	    }
+	  else
+	    {
+	      flag_ops_t ops = { 0, 0, 0, 0 };
+	      int bool_value;
+
+	      if (!value || pe_string_to_bool (value, &bool_value))
+		{
+		  fprintf (stderr, "%s:%u: invalid value for %s\n",
+			   rule_file, line_no, name);
+		  exit (1);
+		}
+	      if (bool_value)
+		{
+		  ops.coff_set = option->coff_flag;
+		  ops.pe_set = option->pe_flag;
+		}
+	      else
+		{
+		  ops.coff_clr = option->coff_flag;
+		  ops.pe_clr = option->pe_flag;
+		}
+	      merge_flag_ops (&rule->ops, &ops);
+	    }
+	}
     }
-  else
+  fclose (file);
+}
+
+/* True if the pattern of rule matches the name of pathname, or the whole
+   of pathname if the pattern contains a slash. */
+static BOOL
+rule_matches_name (const rule_t *rule, const char *pathname)
+{
+  const char *name = pathname;
+
+  if (!rule->match_path)
+    {
+      const char *p;
+
+      for (p = pathname; *p; ++p)
+	if (*p == '/' || *p == '\\')
+	  name = p + 1;
+    }
+  return path_match (rule->pattern, name);
+}
+
+static BOOL
+rule_matches (const rule_t *rule, const char *pathname,
+	      WORD coff_characteristics)
+{
+  switch (rule->type)
     {
-      *value = (number != 0);
+    case RULE_EXE:
+      if (!(coff_characteristics & IMAGE_FILE_EXECUTABLE_IMAGE)
+	  || (coff_characteristics & IMAGE_FILE_DLL))
+	return FALSE;
+      break;
+    case RULE_DLL:
+      if (!(coff_characteristics & IMAGE_FILE_DLL))
+	return FALSE;
+      break;
+    default:
+      break;
     }
-  return 0; 
+  return rule_matches_name (rule, pathname);
+}
+
+/* Add the flag changes of later to ops.  Where both change a flag,
+   later wins. */
+static void
+merge_flag_ops (flag_ops_t *ops, const flag_ops_t *later)
+{
+  ops->coff_set = (ops->coff_set & ~later->coff_clr) | later->coff_set;
+  ops->coff_clr = (ops->coff_clr & ~later->coff_set) | later->coff_clr;
+  ops->pe_set = (ops->pe_set & ~later->pe_clr) | later->pe_set;
+  ops->pe_clr = (ops->pe_clr & ~later->pe_set) | later->pe_clr;
 }
 
 int
@@ -862,79 +1637,141 @@ string_to_ulonglong (const char *string, unsigned long long *value)
 }
 
 #if !defined (__CYGWIN__) && !defined (__MSYS__)
-/* Minimal mmap on files for Win32 */
-#define PROT_READ 0
-#define PROT_WRITE 1
-#define MAP_SHARED 0
-#define MAP_FAILED NULL
-
-void *
-mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+/* Minimal pread and pwrite for Win32.  Every file has its own
+   descriptor, so moving the file pointer does no harm. */
+static ssize_t
+pread (int fd, void *buf, size_t count, off_t offset)
 {
-  HANDLE fh = (HANDLE) _get_osfhandle (fd);
-  HANDLE h = CreateFileMapping (fh, NULL, prot ? PAGE_READWRITE : PAGE_READONLY,
-				0, 0, NULL);
-  if (!h)
-    return MAP_FAILED;
-  addr = MapViewOfFileEx (h, prot ? FILE_MAP_WRITE : FILE_MAP_READ,
-			  0, 0, 4096, addr);
-  CloseHandle (h);
-  return addr;
+  if (lseek (fd, offset, SEEK_SET) == -1)
+    return -1;
+  return read (fd, buf, count);
 }
 
-int
-munmap (void *addr, size_t len)
+static ssize_t
+pwrite (int fd, const void *buf, size_t count, off_t offset)
 {
-  UnmapViewOfFile (addr);
-  return 0;
+  if (lseek (fd, offset, SEEK_SET) == -1)
+    return -1;
+  return write (fd, buf, count);
 }
 #endif
 
 pe_file *
-pe_open (const char *path, BOOL writing)
+pe_open (pe_file *pef, const char *path, BOOL writing)
 {
-  /* Non-threaded application. */
-  static pe_file pef;
-  int fd;
-  void *map;
-  
-  fd = open (path, O_BINARY | (writing ? O_RDWR : O_RDONLY));
-  if (fd == -1)
+  ssize_t len;
+  int error;
+
+  pef->syscalls = 1;
+  pef->fd = open (path, O_BINARY | (writing ? O_RDWR : O_RDONLY));
+  if (pef->fd == -1)
     return NULL;
-  map = mmap (NULL, 4096, PROT_READ | (writing ? PROT_WRITE : 0), MAP_SHARED,
-	      fd, 0);
-  if (map == MAP_FAILED)
+  ++pef->syscalls;
+  len = pread (pef->fd, pef->header, sizeof pef->header, 0);
+  pef->pathname = path;
+  pef->header_len = len < 0 ? 0 : len;
+  pef->dirty_low = sizeof pef->header;
+  pef->dirty_high = 0;
+  pef->dosheader = (PIMAGE_DOS_HEADER) pef->header;
+  /* Sanity checks */
+  if (len < 0)
+    error = errno;
+  else if (pef->header_len < sizeof *pef->dosheader
+	   || pef->dosheader->e_magic != 0x5a4d	/* "MZ" */
+	   || pef->dosheader->e_lfanew < 0
+	   || (DWORD) pef->dosheader->e_lfanew + sizeof *pef->ntheader32
+	      >= pef->header_len)
+    error = ENOEXEC;
+  else
     {
-      close (fd);
-      return NULL;
+      pef->ntheader32 = (PIMAGE_NT_HEADERS32)
+			(pef->header + pef->dosheader->e_lfanew);
+      pef->is_64bit = pef->ntheader32->OptionalHeader.Magic
+		     == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+      /* The PE32+ headers are larger, they must fit into the copy, too. */
+      if (pef->ntheader32->Signature != 0x00004550
+	  || (pef->is_64bit
+	      && (DWORD) pef->dosheader->e_lfanew + sizeof *pef->ntheader64
+		 >= pef->header_len))
+	error = ENOEXEC;
+      else
+	error = 0;
     }
-  pef.pathname = path;
-  pef.dosheader = (PIMAGE_DOS_HEADER) map;
-  pef.ntheader32 = (PIMAGE_NT_HEADERS32)
-		   ((PBYTE) pef.dosheader + pef.dosheader->e_lfanew);
-  /* Sanity checks */
-  if (pef.dosheader->e_magic != 0x5a4d	/* "MZ" */
-      || (PBYTE) pef.ntheader32 - (PBYTE) map + sizeof *pef.ntheader32 >= 4096
-      || pef.ntheader32->Signature != 0x00004550)
+  if (error)
     {
-      munmap (map, 4096);
-      close (fd);
+      close (pef->fd);
+      errno = error;
       return NULL;
     }
-  pef.is_64bit = pef.ntheader32->OptionalHeader.Magic
-		 == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
-  return &pef;
+  pef->coff_characteristics = &pef->ntheader32->FileHeader.Characteristics;
+  pef->pe_characteristics = pef->is_64bit
+			   ? &pef->ntheader64->OptionalHeader.DllCharacteristics
+			   : &pef->ntheader32->OptionalHeader.DllCharacteristics;
+  return pef;
 }
 
-void
+/* Reopen the file read-write, after its headers have been read with
+   pe_open read-only.  Returns -1 with errno set on failure, the file is
+   still open read-only then. */
+int
+pe_reopen_writable (pe_file *pep)
+{
+  int fd;
+
+  ++pep->syscalls;
+  fd = open (pep->pathname, O_BINARY | O_RDWR);
+  if (fd == -1)
+    return -1;
+  ++pep->syscalls;
+  close (pep->fd);
+  pep->fd = fd;
+  return 0;
+}
+
+/* Note that size bytes at field of the header copy have changed. */
+static void
+pe_set_dirty (pe_file *pep, const void *field, size_t size)
+{
+  DWORD low = (const BYTE *) field - pep->header;
+
+  if (low < pep->dirty_low)
+    pep->dirty_low = low;
+  if (low + size > pep->dirty_high)
+    pep->dirty_high = low + size;
+}
+
+/* Write back the changed part of the headers, if any, and close the
+   file.  Returns -1 with errno set if the write failed. */
+int
 pe_close (pe_file *pep)
 {
-  if (pep)
-    munmap ((void *) pep->dosheader, 4096);
+  int ret = 0;
+  int error = 0;
+
+  if (pep->dirty_low < pep->dirty_high)
+    {
+      DWORD count = pep->dirty_high - pep->dirty_low;
+      ssize_t written;
+
+      ++pep->syscalls;
+      written = pwrite (pep->fd, pep->header + pep->dirty_low, count,
+			pep->dirty_low);
+      if (written != (ssize_t) count)
+	{
+	  /* A short write doesn't set errno. */
+	  error = written < 0 ? errno : EIO;
+	  ret = -1;
+	}
+    }
+  ++pep->syscalls;
+  close (pep->fd);
+  if (ret)
+    errno = error;
+  return ret;
 }
 
 void
-get_and_set_size (const pe_file *pep, sizeof_values_t *val)
+get_and_set_size (pe_file *pep, sizeof_values_t *val, out_t *err)
 {
   if (val->handle == DO_READ)
     {
@@ -949,26 +1786,39 @@ get_and_set_size (const pe_file *pep, sizeof_values_t *val)
     {
       if ((!pep->is_64bit || val->is_ulong) && val->value >= ULONG_MAX)
 	{
-	  fprintf (stderr, "%s: Skip writing %s, value too big\n",
-		   pep->pathname, val->name);
+	  out_printf (err, "%s: Skip writing %s, value too big\n",
+		      pep->pathname, val->name);
 	  val->handle = DONT_HANDLE;
 	}
-      else if (!pep->is_64bit)
-	*pulong (pep->ntheader32, val->offset32) = val->value;
-      else if (val->is_ulong)
-	*pulong (pep->ntheader64, val->offset64) = val->value;
+      else if (!pep->is_64bit || val->is_ulong)
+	{
+	  PULONG field = !pep->is_64bit ? pulong (pep->ntheader32, val->offset32)
+					: pulong (pep->ntheader64, val->offset64);
+	  if (*field != val->value)
+	    {
+	      *field = val->value;
+	      pe_set_dirty (pep, field, sizeof *field);
+	    }
+	}
       else
-	*pulonglong (pep->ntheader64, val->offset64) = val->value;
+	{
+	  PULONGLONG field = pulonglong (pep->ntheader64, val->offset64);
+	  if (*field != val->value)
+	    {
+	      *field = val->value;
+	      pe_set_dirty (pep, field, sizeof *field);
+	    }
+	}
     }
 }
 
 void
-get_and_set_sizes (const pe_file *pep)
+get_and_set_sizes (pe_file *pep, sizeof_values_t *vals, out_t *err)
 {
   int i;
 
   for (i = 0; i < NUM_SIZEOF_VALUES; ++i)
-    get_and_set_size (pep, sizeof_vals + i);
+    get_and_set_size (pep, vals + i, err);
 }
 
 int
@@ -976,38 +1826,26 @@ get_characteristics(const pe_file *pep,
                     WORD* coff_characteristics,
                     WORD* pe_characteristics)
 {
-  if (pep->is_64bit)
-    {
-      *coff_characteristics = pep->ntheader64->FileHeader.Characteristics;
-      *pe_characteristics = pep->ntheader64->OptionalHeader.DllCharacteristics;
-    }
-  else
-    {
-      *coff_characteristics = pep->ntheader32->FileHeader.Characteristics;
-      *pe_characteristics = pep->ntheader32->OptionalHeader.DllCharacteristics;
-    }
+  *coff_characteristics = *pep->coff_characteristics;
+  *pe_characteristics = *pep->pe_characteristics;
   return 0;
 }
 
 int
-set_coff_characteristics(const pe_file *pep,
+set_coff_characteristics(pe_file *pep,
                          WORD coff_characteristics)
 {
-  if (pep->is_64bit)
-    pep->ntheader64->FileHeader.Characteristics = coff_characteristics;
-  else
-    pep->ntheader32->FileHeader.Characteristics = coff_characteristics;
+  *pep->coff_characteristics = coff_characteristics;
+  pe_set_dirty (pep, pep->coff_characteristics, sizeof (WORD));
   return 0;
 }
 
 int
-set_pe_characteristics(const pe_file *pep,
+set_pe_characteristics(pe_file *pep,
                        WORD pe_characteristics)
 {
-  if (pep->is_64bit)
-    pep->ntheader64->OptionalHeader.DllCharacteristics = pe_characteristics;
-  else
-    pep->ntheader32->OptionalHeader.DllCharacteristics = pe_characteristics;
+  *pep->pe_characteristics = pe_characteristics;
+  pe_set_dirty (pep, pep->pe_characteristics, sizeof (WORD));
   return 0;
 }
 
@@ -1103,7 +1941,16 @@ help (FILE *f)
 "                              Has no meaning for non-Cygwin applications.\n"
 "  -T, --filelist FILE         Indicate that FILE contains a list\n"
 "                              of PE files to process\n"
-"  -v, --verbose               Display diagnostic information\n"
+"  -r, --rules=FILE            Apply the rules in FILE, see RULES below.\n"
+"  -j, --jobs=N                Process up to N files in parallel (1-64).  The\n"
+"                              output is printed in the order of the files.\n"
+"  -F, --format=FORMAT         Print the characteristics and sizes of each file\n"
+"                              as a record, followed by the number of files of\n"
+"                              each combination of characteristics.  FORMAT is\n"
+"                              tsv, json or binary, see FORMATS below.  Only\n"
+"                              displays, no flags or sizes may be changed.\n"
+"  -v, --verbose               Display diagnostic information and the number\n"
+"                              of system calls made for each file\n"
 "  -V, --version               Display version information\n"
 "  -h, --help                  Display this help\n"
 "\n"
@@ -1118,6 +1965,22 @@ help (FILE *f)
 "                                --cygwin-heap, --cygwin-heap=512, etc\n"
 "For flag values, to set a value, and display the results symbolic, repeat the\n"
 "option:  --tsaware=true --tsaware -d0 -d\n"
+"RULES: each line of a rule file is PATTERN TYPE OPTION...  PATTERN is matched\n"
+"      against the file name, or the whole path if it contains a '/', and may\n"
+"      use *, ? and [...].  TYPE is exe, dll or any.  Each OPTION is the long\n"
+"      name of a flag or size option with a value, e.g. tsaware=yes or\n"
+"      stack-reserve=0x800000.  The matching rules are applied in order, the\n"
+"      options given on the command line take precedence.  Lines starting\n"
+"      with # are ignored.\n"
+"FORMATS: tsv prints one line per record.  A file is\n"
+"      file PATH BITS COFF PE STACK-RESERVE STACK-COMMIT HEAP-RESERVE\n"
+"      HEAP-COMMIT CYGWIN-HEAP FLAGS, a combination is count N COFF PE FLAGS,\n"
+"      FLAGS being the names of the flags set, separated by commas.  json\n"
+"      prints one JSON object per line with the same fields, not a single\n"
+"      JSON document; path bytes which aren't valid UTF-8 are printed as\n"
+"      \\u00XX.  binary records are u8 type (1 file, 2 count), u8 bits,\n"
+"      u16 coff, u16 pe, u16 reserved, u64 sizes[5] (the count in sizes[0]),\n"
+"      u32 path length, path, all little endian.\n"
 "\n", f);
 }
 
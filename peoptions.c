@@ -0,0 +1,117 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "peoptions.h"
+
+#if defined(__MSYS__)
+/* MSYS has no strtoull */
+unsigned long long strtoull(const char *, char **, int);
+#endif
+
+const pe_option_t pe_options[] = {
+  { "dynamicbase", 'd', 0, IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE, -1 },
+  { "forceinteg", 'f', 0, IMAGE_DLLCHARACTERISTICS_FORCE_INTEGRITY, -1 },
+  { "nxcompat", 'n', 0, IMAGE_DLLCHARACTERISTICS_NX_COMPAT, -1 },
+  { "no-isolation", 'i', 0, IMAGE_DLLCHARACTERISTICS_NO_ISOLATION, -1 },
+  { "no-seh", 's', 0, IMAGE_DLLCHARACTERISTICS_NO_SEH, -1 },
+  { "no-bind", 'b', 0, IMAGE_DLLCHARACTERISTICS_NO_BIND, -1 },
+  { "wdmdriver", 'W', 0, IMAGE_DLLCHARACTERISTICS_WDM_DRIVER, -1 },
+  { "tsaware", 't', 0, IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE, -1 },
+  { "wstrim", 'w', IMAGE_FILE_AGGRESIVE_WS_TRIM, 0, -1 },
+  { "bigaddr", 'l', IMAGE_FILE_LARGE_ADDRESS_AWARE, 0, -1 },
+  { "sepdbg", 'S', IMAGE_FILE_DEBUG_STRIPPED, 0, -1 },
+  { "stack-reserve", 'x', 0, 0, PE_SIZE_STACK_RESERVE },
+  { "stack-commit", 'X', 0, 0, PE_SIZE_STACK_COMMIT },
+  { "heap-reserve", 'y', 0, 0, PE_SIZE_HEAP_RESERVE },
+  { "heap-commit", 'Y', 0, 0, PE_SIZE_HEAP_COMMIT },
+  { "cygwin-heap", 'z', 0, 0, PE_SIZE_CYGWIN_HEAP },
+  { NULL, 0, 0, 0, -1 }
+};
+
+/* The option called by the LEN characters at NAME, or NULL. */
+const pe_option_t *
+pe_option_by_name (const char *name, size_t len)
+{
+  const pe_option_t *option;
+
+  for (option = pe_options; option->name; ++option)
+    if (strlen (option->name) == len && !strncmp (option->name, name, len))
+      return option;
+  return NULL;
+}
+
+/* The option with the short option VAL, or NULL. */
+const pe_option_t *
+pe_option_by_val (int val)
+{
+  const pe_option_t *option;
+
+  for (option = pe_options; option->name; ++option)
+    if (option->val == val)
+      return option;
+  return NULL;
+}
+
+/* Parse the boolean STRING into VALUE: a number, or true, yes, t, y,
+   false, no, f and n, ignoring case.  Returns nonzero if invalid. */
+int
+pe_string_to_bool (const char *string, int *value)
+{
+  static const char *true_names[] = { "true", "yes", "t", "y", NULL };
+  static const char *false_names[] = { "false", "no", "f", "n", NULL };
+  unsigned long long number;
+  char *end;
+  int i;
+
+  if (!string || !*string)
+    return 1;
+  errno = 0;
+  number = strtoull (string, &end, 0);
+  if (end != string && !*end && errno != ERANGE)
+    {
+      *value = number != 0;
+      return 0;
+    }
+  for (i = 0; true_names[i]; ++i)
+    if (!strcasecmp (string, true_names[i]))
+      {
+	*value = 1;
+	return 0;
+      }
+  for (i = 0; false_names[i]; ++i)
+    if (!strcasecmp (string, false_names[i]))
+      {
+	*value = 0;
+	return 0;
+      }
+  return 1;
+}
+
+/* Returns nonzero if VALUE does not fit the size value INDEX. */
+int
+pe_check_size (int index, unsigned long long value)
+{
+  /* 48 bit address space */
+  if (value > 0x0000ffffffffffffULL)
+    return 1;
+  /* The Cygwin heap size is just a ULONG. */
+  if (index == PE_SIZE_CYGWIN_HEAP && value > 0xffffffffULL)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#ifndef PEOPTIONS_H
+#define PEOPTIONS_H
+
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The header fields of a PE image which peflags, and rebase with
+   --peflags, can change: the options, their flags and size values, and
+   the spelling of their values. */
+
+/* Indices of the size values, in the order of REBASE_IMAGE_STACK_RESERVE
+   and following in imagehelper.h. */
+enum
+{
+  PE_SIZE_STACK_RESERVE = 0,
+  PE_SIZE_STACK_COMMIT,
+  PE_SIZE_HEAP_RESERVE,
+  PE_SIZE_HEAP_COMMIT,
+  PE_SIZE_CYGWIN_HEAP,
+  PE_SIZES			/* Keep at the end */
+};
+
+typedef struct
+{
+  const char *name;		/* The long option of peflags. */
+  int val;			/* The short option of peflags. */
+  WORD coff_flag;
+  WORD pe_flag;
+  int size_index;		/* PE_SIZE_*, -1 for the flags. */
+} pe_option_t;
+
+extern const pe_option_t pe_options[];
+
+const pe_option_t *pe_option_by_name (const char *name, size_t len);
+const pe_option_t *pe_option_by_val (int val);
+int pe_string_to_bool (const char *string, int *value);
+int pe_check_size (int index, unsigned long long value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PEOPTIONS_H */
@@ -0,0 +1,605 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__CYGWIN__) || defined(__MSYS__)
+#include <utime.h>
+#else
+#include <sys/utime.h>
+#endif
+#include "rebase-cache.h"
+
+const char REBASE_CACHE_MAGIC[4] = "rBcE";
+const ULONG REBASE_CACHE_VERSION = 1;
+
+/* Patch ranges closer than this are merged into one. */
+#define PATCH_MERGE_GAP 16
+
+#pragma pack (push, 4)
+typedef struct _cache_hdr_t
+{
+  char magic[4];
+  ULONG version;
+  ULONG flags;			/* CACHE_xxx */
+  ULONG timestamp_offset;	/* file offset of FileHeader.TimeDateStamp */
+  ULONG checksum_offset;	/* file offset of OptionalHeader.CheckSum */
+  ULONG count;			/* number of patches following */
+  ULONG64 size;			/* file size */
+  rebase_cache_result_t result;
+} cache_hdr_t;
+
+typedef struct _cache_patch_t
+{
+  ULONG64 offset;
+  ULONG len;			/* followed by len bytes */
+} cache_patch_t;
+#pragma pack (pop)
+
+#define CACHE_REBASED		0x01	/* image base and time stamp changed */
+#define CACHE_CHECKSUM		0x02	/* checksum kept valid */
+
+/* SHA-256 (FIPS 180-4).  Only used to name cache entries. */
+
+typedef struct
+{
+  ULONG state[8];
+  ULONG64 length;
+  BYTE buf[64];
+  ULONG fill;
+} sha256_ctx;
+
+static const ULONG sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x,n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block (sha256_ctx *ctx, const BYTE *p)
+{
+  ULONG w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (i = 0; i < 16; ++i, p += 4)
+    w[i] = ((ULONG) p[0] << 24) | ((ULONG) p[1] << 16)
+	   | ((ULONG) p[2] << 8) | p[3];
+  for (; i < 64; ++i)
+    w[i] = w[i - 16] + w[i - 7]
+	   + (ROR32 (w[i - 15], 7) ^ ROR32 (w[i - 15], 18) ^ (w[i - 15] >> 3))
+	   + (ROR32 (w[i - 2], 17) ^ ROR32 (w[i - 2], 19) ^ (w[i - 2] >> 10));
+  a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2];
+  d = ctx->state[3]; e = ctx->state[4]; f = ctx->state[5];
+  g = ctx->state[6]; h = ctx->state[7];
+  for (i = 0; i < 64; ++i)
+    {
+      t1 = h + (ROR32 (e, 6) ^ ROR32 (e, 11) ^ ROR32 (e, 25))
+	   + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      t2 = (ROR32 (a, 2) ^ ROR32 (a, 13) ^ ROR32 (a, 22))
+	   + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c;
+  ctx->state[3] += d; ctx->state[4] += e; ctx->state[5] += f;
+  ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void
+sha256_init (sha256_ctx *ctx)
+{
+  static const ULONG init[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy (ctx->state, init, sizeof init);
+  ctx->length = 0;
+  ctx->fill = 0;
+}
+
+static void
+sha256_update (sha256_ctx *ctx, const void *data, ULONG64 len)
+{
+  const BYTE *p = (const BYTE *) data;
+
+  ctx->length += len;
+  if (ctx->fill)
+    {
+      ULONG n = 64 - ctx->fill;
+      if (n > len)
+	n = (ULONG) len;
+      memcpy (ctx->buf + ctx->fill, p, n);
+      ctx->fill += n;
+      p += n;
+      len -= n;
+      if (ctx->fill < 64)
+	return;
+      sha256_block (ctx, ctx->buf);
+      ctx->fill = 0;
+    }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block (ctx, p);
+  memcpy (ctx->buf, p, len);
+  ctx->fill = (ULONG) len;
+}
+
+static void
+sha256_final (sha256_ctx *ctx, BYTE digest[32])
+{
+  ULONG64 bits = ctx->length * 8;
+  BYTE pad[72];
+  ULONG n = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+  int i;
+
+  memset (pad, 0, sizeof pad);
+  pad[0] = 0x80;
+  for (i = 0; i < 8; ++i)
+    pad[n + i] = (BYTE) (bits >> (56 - 8 * i));
+  sha256_update (ctx, pad, n + 8);
+  for (i = 0; i < 32; ++i)
+    digest[i] = (BYTE) (ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/* PE header helpers. */
+
+static BOOL
+pe_header_offsets (const BYTE *image, ULONG64 size, ULONG *timestamp_offset,
+		   ULONG *checksum_offset, ULONG *image_base_offset,
+		   ULONG *image_base_size)
+{
+  LONG lfanew;
+  WORD magic;
+
+  if (size < sizeof (IMAGE_DOS_HEADER))
+    return FALSE;
+  lfanew = ((const IMAGE_DOS_HEADER *) image)->e_lfanew;
+  if (lfanew < 0 || lfanew + sizeof (IMAGE_NT_HEADERS32) > size)
+    return FALSE;
+  *timestamp_offset = lfanew + offsetof (IMAGE_NT_HEADERS32,
+					 FileHeader.TimeDateStamp);
+  *checksum_offset = lfanew + offsetof (IMAGE_NT_HEADERS32,
+					OptionalHeader.CheckSum);
+  memcpy (&magic, image + lfanew + offsetof (IMAGE_NT_HEADERS32,
+					     OptionalHeader.Magic),
+	  sizeof magic);
+  if (magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+    {
+      *image_base_offset = lfanew + offsetof (IMAGE_NT_HEADERS64,
+					      OptionalHeader.ImageBase);
+      *image_base_size = sizeof (ULONG64);
+    }
+  else
+    {
+      *image_base_offset = lfanew + offsetof (IMAGE_NT_HEADERS32,
+					      OptionalHeader.ImageBase);
+      *image_base_size = sizeof (ULONG);
+    }
+  return TRUE;
+}
+
+/* Ones' complement contribution of LEN bytes at file offset OFF to the
+   PE checksum, modulo 0xffff. */
+static ULONG
+checksum_bytes (const BYTE *p, ULONG len, ULONG off)
+{
+  ULONG64 s = 0;
+  ULONG i;
+
+  for (i = 0; i < len; ++i)
+    s += (ULONG64) p[i] << (((off + i) & 1) ? 8 : 0);
+  return (ULONG) (s % 0xffff);
+}
+
+static int
+write_at (int fd, const void *buf, ULONG len, ULONG64 offset)
+{
+  if (lseek (fd, (off_t) offset, SEEK_SET) == (off_t) -1
+      || write (fd, buf, len) != (ssize_t) len)
+    return -1;
+  return 0;
+}
+
+static char *
+entry_path (const char *cache_dir, const char *key, const char *suffix)
+{
+  char *path = (char *) malloc (strlen (cache_dir) + REBASE_CACHE_KEY_LEN
+				+ strlen (suffix) + 2);
+  if (path)
+    sprintf (path, "%s/%s%s", cache_dir, key, suffix);
+  return path;
+}
+
+BYTE *
+rebase_cache_read_file (const char *pathname, ULONG64 *size)
+{
+  struct stat st;
+  BYTE *image;
+  ULONG64 done = 0;
+  int fd;
+
+  fd = open (pathname, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) < 0
+      || !(image = (BYTE *) malloc (st.st_size ? st.st_size : 1)))
+    {
+      close (fd);
+      return NULL;
+    }
+  while (done < (ULONG64) st.st_size)
+    {
+      ssize_t ret = read (fd, image + done, st.st_size - done);
+      if (ret <= 0)
+	{
+	  free (image);
+	  close (fd);
+	  return NULL;
+	}
+      done += ret;
+    }
+  close (fd);
+  *size = done;
+  return image;
+}
+
+void
+rebase_cache_key (const BYTE *image, ULONG64 size, ULONG64 base,
+		  BOOL down_flag, ULONG flags,
+		  char key[REBASE_CACHE_KEY_LEN + 1])
+{
+  sha256_ctx ctx;
+  BYTE digest[32];
+  ULONG64 params[3];
+  int i;
+
+  sha256_init (&ctx);
+  sha256_update (&ctx, image, size);
+  params[0] = base;
+  params[1] = down_flag ? 1 : 0;
+  params[2] = flags | ((ULONG64) REBASE_CACHE_VERSION << 32);
+  sha256_update (&ctx, params, sizeof params);
+  sha256_final (&ctx, digest);
+  for (i = 0; i < 32; ++i)
+    sprintf (key + 2 * i, "%02x", digest[i]);
+}
+
+int
+rebase_cache_apply (const char *cache_dir, const char *key,
+		    const char *pathname, BYTE *image, ULONG64 size,
+		    ULONG timestamp, BOOL touch,
+		    rebase_cache_result_t *result)
+{
+  char *path;
+  BYTE *entry;
+  ULONG64 entry_size, pos;
+  cache_hdr_t hdr;
+  ULONG i;
+  int fd, ret = -1;
+
+  path = entry_path (cache_dir, key, "");
+  if (!path)
+    return 0;
+  entry = rebase_cache_read_file (path, &entry_size);
+  if (!entry)
+    {
+      free (path);
+      return 0;
+    }
+  /* Mark the entry as recently used for rebase_cache_trim. */
+  utime (path, NULL);
+  free (path);
+
+  /* Validate the entry completely before touching the image. */
+  if (entry_size < sizeof hdr)
+    goto miss;
+  memcpy (&hdr, entry, sizeof hdr);
+  if (memcmp (hdr.magic, REBASE_CACHE_MAGIC, 4) != 0
+      || hdr.version != REBASE_CACHE_VERSION
+      || hdr.size != size
+      || hdr.timestamp_offset + sizeof (ULONG) > size
+      || hdr.checksum_offset + sizeof (ULONG) > size)
+    goto miss;
+  for (pos = sizeof hdr, i = 0; i < hdr.count; ++i)
+    {
+      cache_patch_t patch;
+      if (pos + sizeof patch > entry_size)
+	goto miss;
+      memcpy (&patch, entry + pos, sizeof patch);
+      pos += sizeof patch;
+      if (pos + patch.len > entry_size || patch.offset + patch.len > size)
+	goto miss;
+      pos += patch.len;
+    }
+  for (pos = sizeof hdr, i = 0; i < hdr.count; ++i)
+    {
+      cache_patch_t patch;
+      memcpy (&patch, entry + pos, sizeof patch);
+      pos += sizeof patch;
+      memcpy (image + patch.offset, entry + pos, patch.len);
+      pos += patch.len;
+    }
+
+  /* Bring the time stamp up to date, as ReBaseImage64 would have done. */
+  if (hdr.flags & CACHE_REBASED)
+    {
+      ULONG old_stamp, checksum;
+
+      memcpy (&old_stamp, image + hdr.timestamp_offset, sizeof old_stamp);
+      memcpy (image + hdr.timestamp_offset, &timestamp, sizeof timestamp);
+      memcpy (&checksum, image + hdr.checksum_offset, sizeof checksum);
+      if (hdr.flags & CACHE_CHECKSUM)
+	{
+	  ULONG s = (checksum - (ULONG) size) % 0xffff;
+	  s = (s + checksum_bytes (image + hdr.timestamp_offset,
+				   sizeof timestamp, hdr.timestamp_offset)
+	       + 0xffff - checksum_bytes ((BYTE *) &old_stamp,
+					  sizeof old_stamp,
+					  hdr.timestamp_offset)) % 0xffff;
+	  if (s == 0)
+	    s = 0xffff;
+	  checksum = s + (ULONG) size;
+	  memcpy (image + hdr.checksum_offset, &checksum, sizeof checksum);
+	}
+    }
+
+  fd = open (pathname, O_WRONLY | O_BINARY);
+  if (fd < 0)
+    goto out;
+  for (pos = sizeof hdr, i = 0; i < hdr.count; ++i)
+    {
+      cache_patch_t patch;
+      memcpy (&patch, entry + pos, sizeof patch);
+      pos += sizeof patch + patch.len;
+      if (write_at (fd, image + patch.offset, patch.len, patch.offset) < 0)
+	break;
+    }
+  if (i == hdr.count
+      && (!(hdr.flags & CACHE_REBASED)
+	  || (write_at (fd, image + hdr.timestamp_offset, sizeof (ULONG),
+			hdr.timestamp_offset) == 0
+	      && write_at (fd, image + hdr.checksum_offset, sizeof (ULONG),
+			   hdr.checksum_offset) == 0)))
+    ret = 1;
+  close (fd);
+
+  if (ret == 1 && touch && (hdr.flags & CACHE_REBASED))
+    {
+      struct utimbuf times;
+      times.actime = time (NULL);
+      times.modtime = timestamp;
+      utime (pathname, &times);
+    }
+  *result = hdr.result;
+  goto out;
+
+miss:
+  ret = 0;
+out:
+  free (entry);
+  return ret;
+}
+
+int
+rebase_cache_store (const char *cache_dir, const char *key,
+		    const char *pathname, const BYTE *image, ULONG64 size,
+		    ULONG flags, const rebase_cache_result_t *result)
+{
+  BYTE *out;
+  ULONG64 out_size, pos, start;
+  ULONG image_base_offset, image_base_size;
+  cache_hdr_t hdr;
+  char *path, *tmp_path = NULL;
+  char suffix[32];
+  FILE *fp = NULL;
+  int ret = -1;
+
+  out = rebase_cache_read_file (pathname, &out_size);
+  if (!out)
+    return -1;
+  if (out_size != size
+      || !pe_header_offsets (image, size, &hdr.timestamp_offset,
+			     &hdr.checksum_offset, &image_base_offset,
+			     &image_base_size))
+    goto out;
+
+  memcpy (hdr.magic, REBASE_CACHE_MAGIC, 4);
+  hdr.version = REBASE_CACHE_VERSION;
+  hdr.flags = 0;
+  hdr.count = 0;
+  hdr.size = size;
+  hdr.result = *result;
+  if (memcmp (image + image_base_offset, out + image_base_offset,
+	      image_base_size) != 0)
+    {
+      ULONG checksum;
+
+      hdr.flags |= CACHE_REBASED;
+      /* Same condition as used by ReBaseImage64 to maintain the sum. */
+      memcpy (&checksum, image + hdr.checksum_offset, sizeof checksum);
+      if ((flags & REBASE_CACHE_RECOMPUTE_CHECKSUM)
+	  || ((flags & REBASE_CACHE_UPDATE_CHECKSUM)
+	      && checksum > (ULONG) size
+	      && checksum - (ULONG) size <= 0xffff))
+	hdr.flags |= CACHE_CHECKSUM;
+    }
+
+  if (mkdir (cache_dir
+#if defined(__CYGWIN__) || defined(__MSYS__)
+	     , 0755
+#endif
+	     ) < 0 && errno != EEXIST)
+    goto out;
+  snprintf (suffix, sizeof suffix, ".tmp%d", (int) getpid ());
+  tmp_path = entry_path (cache_dir, key, suffix);
+  if (!tmp_path || !(fp = fopen (tmp_path, "wb")))
+    goto out;
+
+  /* Header first, count is fixed up at the end. */
+  if (fwrite (&hdr, sizeof hdr, 1, fp) != 1)
+    goto out;
+  for (pos = 0; pos < size; )
+    {
+      cache_patch_t patch;
+      ULONG64 end;
+
+      if (image[pos] == out[pos])
+	{
+	  ++pos;
+	  continue;
+	}
+      /* Extend the range as long as the next difference is close. */
+      start = pos;
+      end = pos + 1;
+      for (pos = end; pos < size && pos < end + PATCH_MERGE_GAP; ++pos)
+	if (image[pos] != out[pos])
+	  end = pos + 1;
+      pos = end;
+      patch.offset = start;
+      patch.len = (ULONG) (end - start);
+      if (fwrite (&patch, sizeof patch, 1, fp) != 1
+	  || fwrite (out + start, patch.len, 1, fp) != 1)
+	goto out;
+      ++hdr.count;
+    }
+  if (fseek (fp, 0, SEEK_SET) != 0
+      || fwrite (&hdr, sizeof hdr, 1, fp) != 1)
+    goto out;
+  if (fclose (fp) != 0)
+    {
+      fp = NULL;
+      goto out;
+    }
+  fp = NULL;
+
+  path = entry_path (cache_dir, key, "");
+  if (path)
+    {
+      unlink (path);
+      if (rename (tmp_path, path) == 0)
+	ret = 0;
+      free (path);
+    }
+
+out:
+  if (fp)
+    fclose (fp);
+  if (tmp_path)
+    {
+      if (ret < 0)
+	unlink (tmp_path);
+      free (tmp_path);
+    }
+  free (out);
+  return ret;
+}
+
+typedef struct
+{
+  char *path;
+  ULONG64 size;
+  time_t mtime;
+} cache_file_t;
+
+static int
+cache_file_cmp (const void *a, const void *b)
+{
+  const cache_file_t *fa = (const cache_file_t *) a;
+  const cache_file_t *fb = (const cache_file_t *) b;
+  return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime ? 1 : 0;
+}
+
+void
+rebase_cache_trim (const char *cache_dir, ULONG64 max_size)
+{
+  DIR *dir;
+  struct dirent *de;
+  cache_file_t *files = NULL;
+  unsigned int count = 0, max_count = 0, i;
+  ULONG64 total = 0;
+
+  dir = opendir (cache_dir);
+  if (!dir)
+    return;
+  while ((de = readdir (dir)) != NULL)
+    {
+      struct stat st;
+      char *path;
+
+      /* Only touch files which look like our entries. */
+      if (strlen (de->d_name) != REBASE_CACHE_KEY_LEN
+	  || strspn (de->d_name, "0123456789abcdef") != REBASE_CACHE_KEY_LEN)
+	continue;
+      path = entry_path (cache_dir, de->d_name, "");
+      if (!path)
+	break;
+      if (stat (path, &st) < 0)
+	{
+	  free (path);
+	  continue;
+	}
+      if (count >= max_count)
+	{
+	  cache_file_t *f;
+	  max_count = max_count ? 2 * max_count : 64;
+	  f = (cache_file_t *) realloc (files, max_count * sizeof *files);
+	  if (!f)
+	    {
+	      free (path);
+	      break;
+	    }
+	  files = f;
+	}
+      files[count].path = path;
+      files[count].size = st.st_size;
+      files[count].mtime = st.st_mtime;
+      total += st.st_size;
+      ++count;
+    }
+  closedir (dir);
+
+  if (total > max_size)
+    {
+      /* Least recently used first. */
+      qsort (files, count, sizeof *files, cache_file_cmp);
+      for (i = 0; i < count && total > max_size; ++i)
+	if (unlink (files[i].path) == 0)
+	  total -= files[i].size;
+    }
+  for (i = 0; i < count; ++i)
+    free (files[i].path);
+  free (files);
+}
@@ -0,0 +1,82 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#ifndef REBASE_CACHE_H
+#define REBASE_CACHE_H
+
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The rebase result cache maps the content of an image plus the rebase
+   parameters to the set of byte ranges rebasing changed in the file.
+   A cache hit applies these ranges instead of calling ReBaseImage64. */
+
+extern const char REBASE_CACHE_MAGIC[4];
+extern const ULONG REBASE_CACHE_VERSION;
+
+#define REBASE_CACHE_KEY_LEN	64	/* hex digits of a SHA-256 */
+#define REBASE_CACHE_DEFAULT_SIZE (64ULL * 1024 * 1024)
+
+/* Parameters which influence the content of the rebased file. */
+#define REBASE_CACHE_DROP_DYNAMICBASE	0x01
+#define REBASE_CACHE_UPDATE_CHECKSUM	0x02
+#define REBASE_CACHE_RECOMPUTE_CHECKSUM	0x04
+
+/* Result of a cached rebase, as returned by ReBaseImage64. */
+typedef struct _rebase_cache_result_t
+{
+  ULONG64 old_image_base;
+  ULONG64 new_image_base;	/* *NewImageBase after the call */
+  ULONG old_image_size;
+  ULONG new_image_size;
+} rebase_cache_result_t;
+
+/* Read the whole file into a malloced buffer. */
+BYTE *rebase_cache_read_file (const char *pathname, ULONG64 *size);
+
+/* Compute the cache key for IMAGE when rebased to BASE. */
+void rebase_cache_key (const BYTE *image, ULONG64 size, ULONG64 base,
+		       BOOL down_flag, ULONG flags,
+		       char key[REBASE_CACHE_KEY_LEN + 1]);
+
+/* Look up KEY and, if found, apply the stored patches to PATHNAME, whose
+   current content is IMAGE.  The file gets TIMESTAMP as new time stamp,
+   and as modification time if TOUCH is set.  Returns 1 on a hit, 0 on a
+   miss and -1 if applying the patches failed. */
+int rebase_cache_apply (const char *cache_dir, const char *key,
+			const char *pathname, BYTE *image, ULONG64 size,
+			ULONG timestamp, BOOL touch,
+			rebase_cache_result_t *result);
+
+/* Store the difference between IMAGE and the current content of the
+   rebased file PATHNAME under KEY.  FLAGS are the REBASE_CACHE_xxx flags
+   the key has been computed with. */
+int rebase_cache_store (const char *cache_dir, const char *key,
+			const char *pathname, const BYTE *image, ULONG64 size,
+			ULONG flags, const rebase_cache_result_t *result);
+
+/* Remove the least recently used entries until the cache doesn't take
+   more than MAX_SIZE bytes. */
+void rebase_cache_trim (const char *cache_dir, ULONG64 max_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REBASE_CACHE_H */
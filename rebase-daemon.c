@@ -0,0 +1,646 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__CYGWIN__) || defined(__MSYS__)
+#include <sys/cygwin.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define HAVE_CONTROL_SOCKET
+#else
+#define lstat stat
+#endif
+#include "rebase-daemon.h"
+
+/* Rescan interval of trees without change notification. */
+#define POLL_INTERVAL	5000
+/* Rebase after this time, even if the trees don't settle. */
+#define MAX_DELAY	60000
+/* Upper limit for waiting, so the control socket stays responsive. */
+#define WAIT_SLICE	250
+
+/* Same as rebaseall's default suffixes. */
+static const char *suffixes[] = { ".dll", ".so", ".oct", NULL };
+
+typedef struct _watch_file_t
+{
+  char *name;
+  time_t mtime;
+  off_t size;
+  BOOL reported;	/* Reported as changed in the current batch. */
+} watch_file_t;
+
+typedef struct _watch_list_t
+{
+  watch_file_t *files;	/* Sorted by name. */
+  unsigned int count;
+  unsigned int max_count;
+} watch_list_t;
+
+typedef struct _watch_root_t
+{
+  char *path;
+  HANDLE notify;	/* INVALID_HANDLE_VALUE if polled. */
+  watch_list_t list;	/* State as last reported. */
+  BOOL dirty;		/* Changes since the last report. */
+  ULONG64 signature;	/* Polled roots: result of the last check. */
+  DWORD last_poll;
+} watch_root_t;
+
+static const rebase_daemon_config_t *cfg;
+static const rebase_daemon_ops_t *cb;
+static watch_root_t *roots;
+static int root_count;
+
+static volatile sig_atomic_t stop_request;
+
+/* Statistics for the status command. */
+static unsigned int batches;
+static unsigned int rebased_total;
+static int last_rebased;
+static time_t last_batch;
+
+static void
+stop_handler (int sig)
+{
+  stop_request = 1;
+}
+
+static BOOL
+has_suffix (const char *name)
+{
+  size_t len = strlen (name);
+  int i;
+
+  for (i = 0; suffixes[i]; ++i)
+    {
+      size_t slen = strlen (suffixes[i]);
+      if (len > slen && !strcasecmp (name + len - slen, suffixes[i]))
+	return TRUE;
+    }
+  return FALSE;
+}
+
+static int
+watch_file_cmp (const void *a, const void *b)
+{
+  return strcmp (((const watch_file_t *) a)->name,
+		 ((const watch_file_t *) b)->name);
+}
+
+static void
+free_list (watch_list_t *list)
+{
+  unsigned int i;
+
+  for (i = 0; i < list->count; ++i)
+    free (list->files[i].name);
+  free (list->files);
+  list->files = NULL;
+  list->count = list->max_count = 0;
+}
+
+/* Collect all DLLs below DIR.  Unreadable directories are skipped, they
+   may just be in the process of being created or removed. */
+static int
+scan_dir (const char *dir, watch_list_t *list)
+{
+  struct dirent *de;
+  DIR *d;
+  int ret = 0;
+
+  d = opendir (dir);
+  if (!d)
+    return 0;
+  while (ret == 0 && (de = readdir (d)) != NULL)
+    {
+      struct stat st;
+      char *path;
+
+      if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+	continue;
+      path = (char *) malloc (strlen (dir) + strlen (de->d_name) + 2);
+      if (!path)
+	{
+	  ret = -1;
+	  break;
+	}
+      sprintf (path, "%s/%s", dir, de->d_name);
+      if (lstat (path, &st) < 0)
+	free (path);
+      else if (S_ISDIR (st.st_mode))
+	{
+	  ret = scan_dir (path, list);
+	  free (path);
+	}
+      else if (S_ISREG (st.st_mode) && has_suffix (de->d_name))
+	{
+	  if (list->count >= list->max_count)
+	    {
+	      watch_file_t *files;
+
+	      list->max_count = list->max_count ? 2 * list->max_count : 256;
+	      files = (watch_file_t *) realloc (list->files, list->max_count
+						* sizeof (watch_file_t));
+	      if (!files)
+		{
+		  free (path);
+		  ret = -1;
+		  break;
+		}
+	      list->files = files;
+	    }
+	  list->files[list->count].name = path;
+	  list->files[list->count].mtime = st.st_mtime;
+	  list->files[list->count].size = st.st_size;
+	  list->files[list->count].reported = FALSE;
+	  ++list->count;
+	}
+      else
+	free (path);
+    }
+  closedir (d);
+  return ret;
+}
+
+static int
+scan_root (watch_root_t *root, watch_list_t *list)
+{
+  memset (list, 0, sizeof *list);
+  if (scan_dir (root->path, list) < 0)
+    {
+      free_list (list);
+      fprintf (stderr, "%s: Out of memory.\n", cfg->progname);
+      return -1;
+    }
+  qsort (list->files, list->count, sizeof (watch_file_t), watch_file_cmp);
+  return 0;
+}
+
+/* Cheap fingerprint of a sorted list, to notice changes in polled trees. */
+static ULONG64
+list_signature (const watch_list_t *list)
+{
+  ULONG64 sig = 14695981039346656037ULL;
+  unsigned int i;
+  const char *p;
+
+  for (i = 0; i < list->count; ++i)
+    {
+      for (p = list->files[i].name; *p; ++p)
+	sig = (sig ^ (BYTE) *p) * 1099511628211ULL;
+      sig = (sig ^ (ULONG64) list->files[i].mtime) * 1099511628211ULL;
+      sig = (sig ^ (ULONG64) list->files[i].size) * 1099511628211ULL;
+    }
+  return sig;
+}
+
+/* Compare the current content of ROOT with the last reported state and
+   report the differences.  Returns the number of reported files, or -1 on
+   error. */
+static int
+report_root (watch_root_t *root)
+{
+  watch_list_t now;
+  watch_file_t *o, *n, *o_end, *n_end;
+  int changes = 0;
+
+  if (scan_root (root, &now) < 0)
+    return -1;
+  o = root->list.files;
+  o_end = o + root->list.count;
+  n = now.files;
+  n_end = n + now.count;
+  while (o < o_end || n < n_end)
+    {
+      int cmp = o == o_end ? 1 : n == n_end ? -1 : strcmp (o->name, n->name);
+
+      if (cmp < 0)
+	{
+	  cb->removed (cfg->arg, o->name);
+	  ++changes;
+	  ++o;
+	  continue;
+	}
+      if (cmp > 0 || o->mtime != n->mtime || o->size != n->size)
+	{
+	  if (!cb->changed (cfg->arg, n->name))
+	    {
+	      free_list (&now);
+	      return -1;
+	    }
+	  n->reported = TRUE;
+	  ++changes;
+	}
+      if (cmp == 0)
+	++o;
+      ++n;
+    }
+  free_list (&root->list);
+  root->list = now;
+  root->signature = list_signature (&now);
+  root->dirty = FALSE;
+  return changes;
+}
+
+/* Rebasing changes the reported files.  Take their new state, so this
+   doesn't count as a change next time. */
+static void
+refresh_reported (watch_root_t *root)
+{
+  unsigned int i;
+  struct stat st;
+
+  for (i = 0; i < root->list.count; ++i)
+    if (root->list.files[i].reported)
+      {
+	if (stat (root->list.files[i].name, &st) == 0)
+	  {
+	    root->list.files[i].mtime = st.st_mtime;
+	    root->list.files[i].size = st.st_size;
+	  }
+	root->list.files[i].reported = FALSE;
+      }
+  root->signature = list_signature (&root->list);
+}
+
+static void
+watch_init (watch_root_t *root, int index)
+{
+  root->notify = INVALID_HANDLE_VALUE;
+  /* More roots than handles can be waited for are polled. */
+  if (index >= MAXIMUM_WAIT_OBJECTS)
+    return;
+#if defined(__MSYS__)
+  {
+    char win32_path[MAX_PATH];
+
+    cygwin_conv_to_full_win32_path (root->path, win32_path);
+    root->notify = FindFirstChangeNotificationA (win32_path, TRUE,
+					     FILE_NOTIFY_CHANGE_FILE_NAME
+					     | FILE_NOTIFY_CHANGE_DIR_NAME
+					     | FILE_NOTIFY_CHANGE_SIZE
+					     | FILE_NOTIFY_CHANGE_LAST_WRITE);
+  }
+#elif defined(__CYGWIN__)
+  {
+    char *win32_path = (char *) cygwin_create_path (CCP_POSIX_TO_WIN_A,
+						    root->path);
+    if (!win32_path)
+      return;
+    root->notify = FindFirstChangeNotificationA (win32_path, TRUE,
+					     FILE_NOTIFY_CHANGE_FILE_NAME
+					     | FILE_NOTIFY_CHANGE_DIR_NAME
+					     | FILE_NOTIFY_CHANGE_SIZE
+					     | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    free (win32_path);
+  }
+#else
+  root->notify = FindFirstChangeNotificationA (root->path, TRUE,
+					     FILE_NOTIFY_CHANGE_FILE_NAME
+					     | FILE_NOTIFY_CHANGE_DIR_NAME
+					     | FILE_NOTIFY_CHANGE_SIZE
+					     | FILE_NOTIFY_CHANGE_LAST_WRITE);
+#endif
+  if (root->notify == INVALID_HANDLE_VALUE && cfg->verbose)
+    fprintf (stderr, "%s: no change notification for %s, polling\n",
+	     cfg->progname, root->path);
+}
+
+/* Wait up to TIMEOUT milliseconds for a change notification.  Returns TRUE
+   if a root has changed. */
+static BOOL
+watch_wait (DWORD timeout)
+{
+  HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+  int index[MAXIMUM_WAIT_OBJECTS];
+  DWORD count = 0, ret;
+  int i;
+
+  for (i = 0; i < root_count && count < MAXIMUM_WAIT_OBJECTS; ++i)
+    if (roots[i].notify != INVALID_HANDLE_VALUE)
+      {
+	handles[count] = roots[i].notify;
+	index[count++] = i;
+      }
+  if (count == 0)
+    {
+      Sleep (timeout);
+      return FALSE;
+    }
+  ret = WaitForMultipleObjects (count, handles, FALSE, timeout);
+  if (ret >= WAIT_OBJECT_0 && ret < WAIT_OBJECT_0 + count)
+    {
+      watch_root_t *root = &roots[index[ret - WAIT_OBJECT_0]];
+
+      root->dirty = TRUE;
+      if (!FindNextChangeNotification (root->notify))
+	{
+	  FindCloseChangeNotification (root->notify);
+	  root->notify = INVALID_HANDLE_VALUE;
+	}
+      return TRUE;
+    }
+  return FALSE;
+}
+
+/* Check the polled roots which are due.  Returns TRUE if one of them
+   changed since the last check. */
+static BOOL
+watch_poll (DWORD now, DWORD interval)
+{
+  BOOL changed = FALSE;
+  int i;
+
+  for (i = 0; i < root_count; ++i)
+    {
+      watch_root_t *root = &roots[i];
+      watch_list_t list;
+      ULONG64 sig;
+
+      if (root->notify != INVALID_HANDLE_VALUE
+	  || now - root->last_poll < interval)
+	continue;
+      root->last_poll = now;
+      if (scan_root (root, &list) < 0)
+	continue;
+      sig = list_signature (&list);
+      free_list (&list);
+      if (sig != root->signature)
+	{
+	  root->signature = sig;
+	  root->dirty = TRUE;
+	  changed = TRUE;
+	}
+    }
+  return changed;
+}
+
+/* Report all changed roots and rebase.  With FORCE, check all roots, not
+   only those with notifications. */
+static int
+flush_roots (BOOL force)
+{
+  int i, n, changes = 0, ret;
+
+  for (i = 0; i < root_count; ++i)
+    if (force || roots[i].dirty)
+      {
+	if ((n = report_root (&roots[i])) < 0)
+	  return -1;
+	changes += n;
+      }
+  if (changes == 0)
+    return 0;
+  ret = cb->flush (cfg->arg);
+  for (i = 0; i < root_count; ++i)
+    refresh_reported (&roots[i]);
+  ++batches;
+  last_batch = time (NULL);
+  last_rebased = ret;
+  if (ret > 0)
+    rebased_total += ret;
+  if (cfg->verbose)
+    fprintf (stderr, "%s: %d changed files, %d DLLs rebased\n",
+	     cfg->progname, changes, ret);
+  return ret;
+}
+
+#ifdef HAVE_CONTROL_SOCKET
+static int
+control_open (const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen (path) >= sizeof addr.sun_path)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  unlink (path);
+  if (bind (fd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen (fd, 4) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* Handle a pending connection on the control socket.  A client sends one
+   command line and gets the reply until the connection is closed:
+
+     status	statistics
+     flush	check all roots and rebase now
+     stop	terminate the daemon */
+static void
+control_poll (int fd)
+{
+  struct timeval tv = { 0, 0 };
+  char buf[256], reply[1024];
+  fd_set fds;
+  ssize_t len;
+  char *nl;
+  int client;
+
+  FD_ZERO (&fds);
+  FD_SET (fd, &fds);
+  if (select (fd + 1, &fds, NULL, NULL, &tv) <= 0)
+    return;
+  client = accept (fd, NULL, NULL);
+  if (client < 0)
+    return;
+  /* The command is short, don't let a stuck client block the daemon. */
+  tv.tv_sec = 1;
+  setsockopt (client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  len = read (client, buf, sizeof buf - 1);
+  if (len <= 0)
+    {
+      close (client);
+      return;
+    }
+  buf[len] = '\0';
+  if ((nl = strpbrk (buf, "\r\n")) != NULL)
+    *nl = '\0';
+  if (!strcmp (buf, "status"))
+    {
+      int i, polled = 0, pending = 0;
+
+      for (i = 0; i < root_count; ++i)
+	{
+	  if (roots[i].notify == INVALID_HANDLE_VALUE)
+	    ++polled;
+	  if (roots[i].dirty)
+	    ++pending;
+	}
+      snprintf (reply, sizeof reply,
+		"roots %d\npolled %d\npending %d\ndlls %u\nbatches %u\n"
+		"rebased %u\nlast-rebased %d\nlast-batch %ld\n",
+		root_count, polled, pending, cb->count (cfg->arg), batches,
+		rebased_total, last_rebased, (long) last_batch);
+    }
+  else if (!strcmp (buf, "flush"))
+    {
+      int ret = flush_roots (TRUE);
+      if (ret < 0)
+	snprintf (reply, sizeof reply, "error\n");
+      else
+	snprintf (reply, sizeof reply, "ok %d\n", ret);
+    }
+  else if (!strcmp (buf, "stop"))
+    {
+      stop_request = 1;
+      snprintf (reply, sizeof reply, "ok\n");
+    }
+  else
+    snprintf (reply, sizeof reply, "error unknown command\n");
+  if (write (client, reply, strlen (reply)) < 0)
+    /* Nothing to do, the client is gone. */;
+  close (client);
+}
+#endif /* HAVE_CONTROL_SOCKET */
+
+int
+rebase_daemon (const rebase_daemon_config_t *config,
+	       const rebase_daemon_ops_t *ops)
+{
+  DWORD settle = config->settle * 1000, first_change = 0, last_change = 0;
+  BOOL pending = FALSE;
+  int control_fd = -1;
+  int i, ret = 0;
+
+  cfg = config;
+  cb = ops;
+#ifdef HAVE_CONTROL_SOCKET
+  if (config->control && (control_fd = control_open (config->control)) < 0)
+    {
+      fprintf (stderr, "%s: failed to create control socket \"%s\":\n%s\n",
+	       config->progname, config->control, strerror (errno));
+      return -1;
+    }
+#else
+  if (config->control)
+    {
+      fprintf (stderr, "%s: control sockets are not supported\n",
+	       config->progname);
+      return -1;
+    }
+#endif
+  roots = (watch_root_t *) calloc (config->root_count, sizeof (watch_root_t));
+  if (!roots)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", config->progname);
+      return -1;
+    }
+  root_count = config->root_count;
+  for (i = 0; i < root_count; ++i)
+    {
+      /* Report paths the way rebase stores them. */
+#if defined(__CYGWIN__) || defined(__MSYS__)
+      roots[i].path = realpath (config->roots[i], NULL);
+#else
+      roots[i].path = _fullpath (NULL, config->roots[i], 0);
+#endif
+      if (!roots[i].path)
+	{
+	  fprintf (stderr, "%s: %s: %s\n", config->progname,
+		   config->roots[i], strerror (errno));
+	  return -1;
+	}
+      /* Register for notifications before the first scan, to not miss a
+	 change in between. */
+      watch_init (&roots[i], i);
+      roots[i].dirty = TRUE;
+    }
+  signal (SIGINT, stop_handler);
+  signal (SIGTERM, stop_handler);
+
+  /* Catch up with the changes since the last run. */
+  if (flush_roots (TRUE) < 0)
+    ret = -1;
+
+  while (ret == 0 && !stop_request)
+    {
+      DWORD now, timeout = WAIT_SLICE;
+      BOOL changed;
+
+      if (pending)
+	{
+	  DWORD due = GetTickCount () - last_change;
+	  if (due < settle && settle - due < timeout)
+	    timeout = settle - due;
+	}
+      changed = watch_wait (timeout);
+      now = GetTickCount ();
+      /* While changes are pending, check polled roots as often as
+	 needed to notice the end of the activity. */
+      if (watch_poll (now, pending ? settle : POLL_INTERVAL))
+	changed = TRUE;
+      if (changed)
+	{
+	  if (!pending)
+	    first_change = now;
+	  last_change = now;
+	  pending = TRUE;
+	}
+#ifdef HAVE_CONTROL_SOCKET
+      if (control_fd >= 0)
+	control_poll (control_fd);
+#endif
+      if (pending && (now - last_change >= settle
+		      || now - first_change >= MAX_DELAY))
+	{
+	  pending = FALSE;
+	  if (flush_roots (FALSE) < 0)
+	    ret = -1;
+	}
+    }
+
+#ifdef HAVE_CONTROL_SOCKET
+  if (control_fd >= 0)
+    {
+      close (control_fd);
+      unlink (config->control);
+    }
+#endif
+  for (i = 0; i < root_count; ++i)
+    {
+      if (roots[i].notify != INVALID_HANDLE_VALUE)
+	FindCloseChangeNotification (roots[i].notify);
+      free_list (&roots[i].list);
+      free (roots[i].path);
+    }
+  free (roots);
+  return ret;
+}
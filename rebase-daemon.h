@@ -0,0 +1,67 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#ifndef REBASE_DAEMON_H
+#define REBASE_DAEMON_H
+
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The rebase daemon watches directory trees for new or changed DLLs and
+   hands them to rebase in batches, once the trees have been quiet for a
+   while.  The database itself is maintained by the caller. */
+
+#define REBASE_DAEMON_DEFAULT_SETTLE 2	/* seconds */
+
+/* Callbacks into rebase.  ARG is the arg member of the configuration. */
+typedef struct _rebase_daemon_ops_t
+{
+  /* A DLL has been added or changed.  Returns FALSE on fatal errors. */
+  BOOL (*changed) (void *arg, const char *pathname);
+  /* A DLL has been removed. */
+  void (*removed) (void *arg, const char *pathname);
+  /* Rebase the DLLs reported since the last call.  Returns the number of
+     rebased DLLs, or -1 on error. */
+  int (*flush) (void *arg);
+  /* Number of DLLs in the database. */
+  unsigned int (*count) (void *arg);
+} rebase_daemon_ops_t;
+
+typedef struct _rebase_daemon_config_t
+{
+  const char *progname;
+  char * const *roots;		/* Directories to watch. */
+  int root_count;
+  const char *control;		/* Path of the control socket, or NULL. */
+  unsigned int settle;		/* Seconds without changes before rebasing. */
+  BOOL verbose;
+  void *arg;			/* Passed to the callbacks. */
+} rebase_daemon_config_t;
+
+/* Run until stopped by a signal or the "stop" command.  All DLLs found in
+   the roots are reported as changed on startup.  Returns 0 on a regular
+   stop, -1 on error. */
+int rebase_daemon (const rebase_daemon_config_t *config,
+		   const rebase_daemon_ops_t *ops);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REBASE_DAEMON_H */
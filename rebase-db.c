@@ -16,6 +16,19 @@
  *
  * See the COPYING file for full license information.
  */
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__CYGWIN__) || defined(__MSYS__)
+#include <sys/mman.h>
+#else
+#include <io.h>
+#endif
 #include "rebase-db.h"
 
 #if defined(__MSYS__)
@@ -26,7 +39,28 @@
 #endif
 
 const char IMG_INFO_MAGIC[4] = "rBiI";
-const ULONG IMG_INFO_VERSION = 1;
+const ULONG IMG_INFO_VERSION = 3;
+const char IMG_INFO_CONTAINER_MAGIC[4] = "rBiC";
+const ULONG IMG_INFO_CONTAINER_VERSION = 1;
+const char IMG_INFO_LOG_MAGIC[4] = "rBiL";
+const WORD IMG_INFO_LOG_VERSION = 1;
+
+/* Alignment of the sections in a container. */
+#define SECTION_ALIGN 8
+/* Alignment of the records in a log. */
+#define LOG_REC_ALIGN 8
+/* Size of the header of a database section of VERSION.  Version 1 has no
+   generation, version 2 no crc. */
+#define HDR_SIZE(version) ((version) < 2 ? offsetof (img_info_hdr_t, generation) \
+			   : (version) < 3 ? offsetof (img_info_hdr_t, crc) \
+			   : sizeof (img_info_hdr_t))
+
+/* The SSE4.2 crc32 instruction computes CRC32C.  It is used if the CPU
+   has it, checked at runtime. */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_CRC32C_INSN 1
+#endif
 
 int
 img_info_cmp (const void *a, const void *b)
@@ -47,6 +81,139 @@ img_info_name_cmp (const void *a, const void *b)
   return strcmp (((img_info_t *) a)->name, ((img_info_t *) b)->name);
 }
 
+/* Partitions smaller than this are finished with an insertion sort. */
+#define NAME_SORT_CUTOFF 16
+/* Lists smaller than this are not worth the radix sort's scratch buffer. */
+#define BASE_SORT_CUTOFF 64
+
+static inline void
+img_info_swap (img_info_t *a, img_info_t *b)
+{
+  img_info_t tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static inline int
+name_char (const img_info_t *img, size_t depth)
+{
+  return (unsigned char) img->name[depth];
+}
+
+/* Multikey quicksort (Bentley/Sedgewick) on the names in LIST, all of
+   which share their first DEPTH characters.  Our paths mostly differ
+   only after a long common directory prefix, which a three-way split on
+   a single character skips in one linear pass per character, instead of
+   comparing it again in every strcmp a plain qsort would make. */
+static void
+name_sort (img_info_t *list, size_t count, size_t depth)
+{
+  size_t i, j;
+
+  while (count > NAME_SORT_CUTOFF)
+    {
+      size_t lt = 0, gt = count;
+      int a = name_char (&list[0], depth);
+      int b = name_char (&list[count / 2], depth);
+      int c = name_char (&list[count - 1], depth);
+      int pivot = a < b ? (b < c ? b : (a < c ? c : a))
+			: (a < c ? a : (b < c ? c : b));
+
+      i = 0;
+      while (i < gt)
+	{
+	  int ch = name_char (&list[i], depth);
+
+	  if (ch < pivot)
+	    img_info_swap (&list[lt++], &list[i++]);
+	  else if (ch > pivot)
+	    img_info_swap (&list[i], &list[--gt]);
+	  else
+	    ++i;
+	}
+      name_sort (list, lt, depth);
+      name_sort (list + gt, count - gt, depth);
+      /* The middle part is equal up to and including the pivot.  If the
+	 pivot is the trailing NUL, these are duplicates and done. */
+      if (pivot == 0)
+	return;
+      list += lt;
+      count = gt - lt;
+      ++depth;
+    }
+  for (i = 1; i < count; ++i)
+    for (j = i;
+	 j > 0 && strcmp (list[j - 1].name + depth, list[j].name + depth) > 0;
+	 --j)
+      img_info_swap (&list[j - 1], &list[j]);
+}
+
+/* Sort LIST by name, in the same order as img_info_name_cmp. */
+void
+img_info_sort_by_name (img_info_t *list, unsigned int count)
+{
+  name_sort (list, count, 0);
+}
+
+/* Sort LIST by base address and name, in the same order as img_info_cmp.
+   This is an LSD radix sort on the 64 bit base, skipping the bytes all
+   addresses have in common, which are most of them.  Runs of equal
+   addresses, typically the new DLLs at base 0, are then sorted by name. */
+void
+img_info_sort_by_base (img_info_t *list, unsigned int count)
+{
+  unsigned int counts[sizeof (ULONG64)][256];
+  BOOL skip[sizeof (ULONG64)];
+  img_info_t *tmp, *src, *dst;
+  unsigned int i, j;
+  unsigned int byte;
+
+  if (count < BASE_SORT_CUTOFF
+      || !(tmp = (img_info_t *) malloc (count * sizeof (img_info_t))))
+    {
+      qsort (list, count, sizeof (img_info_t), img_info_cmp);
+      return;
+    }
+  memset (counts, 0, sizeof counts);
+  for (i = 0; i < count; ++i)
+    for (byte = 0; byte < sizeof (ULONG64); ++byte)
+      ++counts[byte][(list[i].base >> (byte * 8)) & 0xff];
+  for (byte = 0; byte < sizeof (ULONG64); ++byte)
+    skip[byte] = counts[byte][(list[0].base >> (byte * 8)) & 0xff] == count;
+  src = list;
+  dst = tmp;
+  for (byte = 0; byte < sizeof (ULONG64); ++byte)
+    {
+      unsigned int pos = 0;
+      img_info_t *swap;
+
+      if (skip[byte])
+	continue;
+      for (i = 0; i < 256; ++i)
+	{
+	  unsigned int n = counts[byte][i];
+
+	  counts[byte][i] = pos;
+	  pos += n;
+	}
+      for (i = 0; i < count; ++i)
+	dst[counts[byte][(src[i].base >> (byte * 8)) & 0xff]++] = src[i];
+      swap = src;
+      src = dst;
+      dst = swap;
+    }
+  if (src != list)
+    memcpy (list, src, count * sizeof (img_info_t));
+  free (tmp);
+  for (i = 0; i < count; i = j)
+    {
+      for (j = i + 1; j < count && list[j].base == list[i].base; ++j)
+	;
+      if (j - i > 1)
+	name_sort (list + i, j - i, 0);
+    }
+}
+
 void
 dump_rebasedb_header (FILE *f, img_info_hdr_t const *h)
 {
@@ -64,7 +231,9 @@ dump_rebasedb_header (FILE *f, img_info_hdr_t const *h)
       "  base   : 0x%0*" PRIx64 "\n"
       "  offset : 0x%08x\n"
       "  downflg: %s\n"
-      "  count  : %d\n",
+      "  count  : %d\n"
+      "  gen    : %u\n"
+      "  crc    : 0x%08x\n",
       h->magic[0], h->magic[1], h->magic[2], h->magic[3],
       (h->machine == IMAGE_FILE_MACHINE_I386
       ? "i386"
@@ -76,7 +245,9 @@ dump_rebasedb_header (FILE *f, img_info_hdr_t const *h)
       (uint64_t) h->base,
       (uint32_t) h->offset,
       (h->down_flag ? "true" : "false"),
-      (uint32_t) h->count);
+      (uint32_t) h->count,
+      (uint32_t) h->generation,
+      (uint32_t) h->crc);
 }
 
 void
@@ -128,3 +299,669 @@ dump_rebasedb (FILE *f, img_info_hdr_t const *h,
     }
 }
 
+
+const char *
+img_info_machine_name (WORD machine)
+{
+  return machine == IMAGE_FILE_MACHINE_I386 ? "i386"
+	 : machine == IMAGE_FILE_MACHINE_AMD64 ? "x86_64" : "unknown";
+}
+
+/* Map FILE into MAP.  A single machine database becomes a container with
+   one section.  Returns -1 with errno set on failure, ENOEXEC if FILE is
+   neither a database nor a container. */
+int
+img_info_map (const char *file, img_info_map_t *map)
+{
+  const img_info_container_t *container;
+  struct stat st;
+  unsigned int i;
+  int fd;
+
+  memset (map, 0, sizeof *map);
+  fd = open (file, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  map->size = st.st_size;
+  if (map->size < sizeof (img_info_container_t))
+    {
+      close (fd);
+      errno = ENOEXEC;
+      return -1;
+    }
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  map->addr = (BYTE *) mmap (NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map->addr == MAP_FAILED)
+    {
+      map->addr = NULL;
+      close (fd);
+      return -1;
+    }
+  map->mapped = TRUE;
+#else
+  map->addr = (BYTE *) malloc (map->size);
+  if (!map->addr || read (fd, map->addr, map->size) != map->size)
+    {
+      if (map->addr)
+	errno = EIO;
+      free (map->addr);
+      map->addr = NULL;
+      close (fd);
+      return -1;
+    }
+#endif
+  close (fd);
+
+  container = (const img_info_container_t *) map->addr;
+  if (!memcmp (map->addr, IMG_INFO_MAGIC, 4) && map->size >= HDR_SIZE (1))
+    {
+      map->count = 1;
+      map->sections[0].machine = ((const img_info_hdr_t *) map->addr)->machine;
+      map->sections[0].size = map->size;
+      return 0;
+    }
+  if (memcmp (container->magic, IMG_INFO_CONTAINER_MAGIC, 4)
+      || container->version != IMG_INFO_CONTAINER_VERSION
+      || container->count > IMG_INFO_SECTIONS_MAX
+      || map->size < sizeof *container
+		     + container->count * sizeof (img_info_section_t))
+    goto invalid;
+  map->container = TRUE;
+  map->count = container->count;
+  memcpy (map->sections, container + 1,
+	  map->count * sizeof (img_info_section_t));
+  for (i = 0; i < map->count; ++i)
+    if (map->sections[i].offset > map->size
+	|| map->sections[i].size > map->size - map->sections[i].offset
+	|| map->sections[i].offset % SECTION_ALIGN)
+      goto invalid;
+  return 0;
+
+invalid:
+  img_info_unmap (map);
+  errno = ENOEXEC;
+  return -1;
+}
+
+/* True if FILE is a database container. */
+BOOL
+img_info_is_container (const char *file)
+{
+  char magic[4];
+  int fd = open (file, O_RDONLY | O_BINARY);
+  BOOL ret;
+
+  if (fd < 0)
+    return FALSE;
+  ret = read (fd, magic, sizeof magic) == sizeof magic
+	&& !memcmp (magic, IMG_INFO_CONTAINER_MAGIC, sizeof magic);
+  close (fd);
+  return ret;
+}
+
+/* The section of MACHINE in MAP, or NULL if there is none.  Its size is
+   returned in SIZE. */
+const img_info_hdr_t *
+img_info_map_section (const img_info_map_t *map, WORD machine, size_t *size)
+{
+  unsigned int i;
+
+  for (i = 0; i < map->count; ++i)
+    if (map->sections[i].machine == machine)
+      {
+	*size = map->sections[i].size;
+	return (const img_info_hdr_t *) (map->addr + map->sections[i].offset);
+      }
+  return NULL;
+}
+
+void
+img_info_unmap (img_info_map_t *map)
+{
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  if (map->mapped)
+    munmap (map->addr, map->size);
+  else
+#endif
+    free (map->addr);
+  map->addr = NULL;
+  map->size = 0;
+  map->count = 0;
+}
+
+/* Copy the header of the database section SECTION of SIZE bytes to HDR
+   in the layout of the current version.  Returns the size of the header
+   in the section, or 0 if the section is too small. */
+size_t
+img_info_read_hdr (const img_info_hdr_t *section, size_t size,
+		   img_info_hdr_t *hdr)
+{
+  size_t hdr_size;
+
+  if (size < HDR_SIZE (1))
+    return 0;
+  hdr_size = HDR_SIZE (section->version);
+  if (size < hdr_size)
+    return 0;
+  memset (hdr, 0, sizeof *hdr);
+  memcpy (hdr, section, hdr_size);
+  return hdr_size;
+}
+
+/* The img_info_t table of the database section SECTION. */
+const img_info_t *
+img_info_section_list (const img_info_hdr_t *section)
+{
+  return (const img_info_t *) ((const BYTE *) section
+			       + HDR_SIZE (section->version));
+}
+
+/* Copy the COUNT entries of the database section SECTION into a new list
+   with room for MAX_SIZE entries.  The names point into the section.
+   Returns NULL if out of memory. */
+img_info_t *
+img_info_copy_list (const img_info_hdr_t *section, unsigned int count,
+		    unsigned int max_size)
+{
+  const char *names;
+  img_info_t *list;
+  unsigned int i;
+
+  list = (img_info_t *) calloc (max_size ? max_size : 1, sizeof (img_info_t));
+  if (!list)
+    return NULL;
+  memcpy (list, img_info_section_list (section), count * sizeof (img_info_t));
+  names = (const char *) (img_info_section_list (section) + count);
+  for (i = 0; i < count; ++i)
+    {
+      list[i].name = (PCHAR) names;
+      names += list[i].name_size;
+    }
+  return list;
+}
+
+/* Check that the table and the names announced by HDR fit into the SIZE
+   bytes of the section and that each name is terminated.  Returns -1 if
+   not.  Since version 3, also check the CRC of the section; returns -2 if
+   it doesn't match.  Otherwise returns 0 and the CRC of the section, as
+   computed by img_info_section_crc, in CRC. */
+int
+img_info_check_section (const img_info_hdr_t *hdr, size_t size, ULONG *crc)
+{
+  const img_info_t *list = img_info_section_list (hdr);
+  size_t hdr_size = HDR_SIZE (hdr->version);
+  size_t names_size = 0, section_size = size;
+  const char *names;
+  ULONG i;
+
+  if (size < hdr_size
+      || hdr->count > (size - hdr_size) / sizeof (img_info_t))
+    return -1;
+  size -= hdr_size + hdr->count * sizeof (img_info_t);
+  names = (const char *) (list + hdr->count);
+  for (i = 0; i < hdr->count; ++i)
+    {
+      names_size += list[i].name_size;
+      if (list[i].name_size == 0 || names_size > size
+	  || names[names_size - 1] != '\0')
+	return -1;
+    }
+  *crc = img_info_section_crc (hdr, section_size);
+  if (hdr->version >= 3 && *crc != hdr->crc)
+    return -2;
+  return 0;
+}
+
+/* The CRC of the database section SECTION of SIZE bytes.  Since version 3,
+   this is the CRC stored in its header, computed over everything but the
+   crc field; before, the CRC of the whole section. */
+ULONG
+img_info_section_crc (const img_info_hdr_t *section, size_t size)
+{
+  size_t hdr_size = HDR_SIZE (section->version);
+  ULONG crc;
+
+  if (section->version < 3)
+    return img_info_crc32c (0, section, size);
+  crc = img_info_crc32c (0, section, offsetof (img_info_hdr_t, crc));
+  return img_info_crc32c (crc, (const BYTE *) section + hdr_size,
+			  size - hdr_size);
+}
+
+/* Write a container of the COUNT sections to FD.  The offsets in
+   SECTIONS are computed here, DATA holds the content of each section.
+   Returns -1 with errno set on failure. */
+int
+img_info_write_container (int fd, unsigned int count,
+			  const img_info_section_t *sections,
+			  const void * const *data)
+{
+  static const BYTE padding[SECTION_ALIGN];
+  img_info_section_t dir[IMG_INFO_SECTIONS_MAX];
+  img_info_container_t container;
+  ULONG64 offset;
+  unsigned int i;
+
+  if (count > IMG_INFO_SECTIONS_MAX)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  memcpy (container.magic, IMG_INFO_CONTAINER_MAGIC, 4);
+  container.version = IMG_INFO_CONTAINER_VERSION;
+  container.count = count;
+  offset = roundup2 (sizeof container + count * sizeof *dir, SECTION_ALIGN);
+  for (i = 0; i < count; ++i)
+    {
+      dir[i] = sections[i];
+      dir[i].reserved = 0;
+      dir[i].offset = offset;
+      offset = roundup2 (offset + dir[i].size, SECTION_ALIGN);
+    }
+  if (write (fd, &container, sizeof container) != sizeof container
+      || write (fd, dir, count * sizeof *dir) != count * sizeof *dir)
+    return -1;
+  offset = sizeof container + count * sizeof *dir;
+  for (i = 0; i < count; ++i)
+    {
+      if (write (fd, padding, dir[i].offset - offset) != dir[i].offset - offset
+	  || write (fd, data[i], dir[i].size) != dir[i].size)
+	return -1;
+      offset = dir[i].offset + dir[i].size;
+    }
+  return 0;
+}
+
+/* The database section for HDR and the HDR->count entries of LIST: the
+   header, the list and the names.  Returns NULL if out of memory. */
+BYTE *
+img_info_build_section (const img_info_hdr_t *hdr, const img_info_t *list,
+			size_t *size)
+{
+  BYTE *section;
+  char *names;
+  ULONG i;
+
+  *size = sizeof *hdr + hdr->count * sizeof (img_info_t);
+  for (i = 0; i < hdr->count; ++i)
+    *size += strlen (list[i].name) + 1;
+  if (!(section = (BYTE *) malloc (*size)))
+    return NULL;
+  memcpy (section, hdr, sizeof *hdr);
+  memcpy (section + sizeof *hdr, list, hdr->count * sizeof (img_info_t));
+  names = (char *) section + sizeof *hdr + hdr->count * sizeof (img_info_t);
+  for (i = 0; i < hdr->count; ++i)
+    {
+      strcpy (names, list[i].name);
+      names += strlen (names) + 1;
+    }
+  ((img_info_hdr_t *) section)->crc
+    = img_info_section_crc ((img_info_hdr_t *) section, *size);
+  return section;
+}
+
+static ULONG crc32c_table[256];
+
+#ifdef HAVE_CRC32C_INSN
+/* Continue the inverted CRC over LEN bytes at P with the crc32
+   instruction, 8 (4 on i386) bytes at a time. */
+__attribute__ ((target ("sse4.2")))
+static ULONG
+crc32c_insn (ULONG crc, const BYTE *p, size_t len)
+{
+#ifdef __x86_64__
+  unsigned long long c = crc, word;
+
+  for (; len >= sizeof word; p += sizeof word, len -= sizeof word)
+    {
+      memcpy (&word, p, sizeof word);
+      c = __builtin_ia32_crc32di (c, word);
+    }
+  crc = (ULONG) c;
+#else
+  unsigned int word;
+
+  for (; len >= sizeof word; p += sizeof word, len -= sizeof word)
+    {
+      memcpy (&word, p, sizeof word);
+      crc = __builtin_ia32_crc32si (crc, word);
+    }
+#endif
+  while (len--)
+    crc = __builtin_ia32_crc32qi (crc, *p++);
+  return crc;
+}
+#endif
+
+/* Continue the CRC32C (Castagnoli) CRC over the LEN bytes at BUF.  Start
+   with a CRC of 0. */
+ULONG
+img_info_crc32c (ULONG crc, const void *buf, size_t len)
+{
+  const BYTE *p = (const BYTE *) buf;
+#ifdef HAVE_CRC32C_INSN
+  static int have_insn = -1;
+
+  if (have_insn < 0)
+    {
+      __builtin_cpu_init ();
+      have_insn = __builtin_cpu_supports ("sse4.2") ? 1 : 0;
+    }
+  if (have_insn)
+    return ~crc32c_insn (~crc, p, len);
+#endif
+
+  if (!crc32c_table[1])
+    {
+      ULONG c;
+      int i, j;
+
+      for (i = 0; i < 256; ++i)
+	{
+	  for (c = i, j = 0; j < 8; ++j)
+	    c = (c >> 1) ^ ((c & 1) ? 0x82f63b78 : 0);
+	  crc32c_table[i] = c;
+	}
+    }
+  crc = ~crc;
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/* The name of the log of the MACHINE section of the database FILE.  In a
+   container, each section has a log of its own.  Returns a malloc'ed
+   string, or NULL if out of memory. */
+char *
+img_info_log_file (const char *file, WORD machine, BOOL container)
+{
+  const char *mach = container ? img_info_machine_name (machine) : NULL;
+  char *log = (char *) malloc (strlen (file) + (mach ? strlen (mach) + 1 : 0)
+			       + sizeof IMG_INFO_LOG_SUFFIX);
+
+  if (log)
+    {
+      strcpy (log, file);
+      if (mach)
+	{
+	  strcat (log, ".");
+	  strcat (log, mach);
+	}
+      strcat (log, IMG_INFO_LOG_SUFFIX);
+    }
+  return log;
+}
+
+/* Lock the database FILE, shared for reading or EXCLUSIVE for writing.
+   The lock is taken on a lock file next to the database, since the
+   database itself is replaced when it is rewritten.  Waits for the lock
+   if another process holds it.  Returns the descriptor to pass to
+   img_info_unlock, or -1 with errno set. */
+int
+img_info_lock (const char *file, BOOL exclusive)
+{
+  char *lock_file = (char *) malloc (strlen (file)
+				     + sizeof IMG_INFO_LOCK_SUFFIX);
+  int fd;
+
+  if (!lock_file)
+    return -1;
+  strcpy (lock_file, file);
+  strcat (lock_file, IMG_INFO_LOCK_SUFFIX);
+  fd = open (lock_file, O_RDWR | O_BINARY | O_CREAT, 0660);
+  /* A reader may not be allowed to create or write the lock file. */
+  if (fd < 0 && !exclusive)
+    fd = open (lock_file, O_RDONLY | O_BINARY);
+  free (lock_file);
+  if (fd < 0)
+    return -1;
+#if defined(__CYGWIN__) || defined(__MSYS__)
+  {
+    struct flock fl;
+
+    memset (&fl, 0, sizeof fl);
+    fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl (fd, F_SETLKW, &fl) < 0)
+      if (errno != EINTR)
+	{
+	  close (fd);
+	  return -1;
+	}
+  }
+#else
+  {
+    OVERLAPPED ov;
+
+    memset (&ov, 0, sizeof ov);
+    if (!LockFileEx ((HANDLE) _get_osfhandle (fd),
+		     exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &ov))
+      {
+	close (fd);
+	errno = EACCES;
+	return -1;
+      }
+  }
+#endif
+  return fd;
+}
+
+/* Release the lock taken by img_info_lock. */
+void
+img_info_unlock (int fd)
+{
+#if !defined(__CYGWIN__) && !defined(__MSYS__)
+  OVERLAPPED ov;
+
+  /* Windows releases the lock of a closed file only eventually. */
+  memset (&ov, 0, sizeof ov);
+  UnlockFileEx ((HANDLE) _get_osfhandle (fd), 0, 1, 0, &ov);
+#endif
+  close (fd);
+}
+
+/* Read the log FILE of the database section SECTION of SECTION_SIZE bytes
+   with the CRC SECTION_CRC, as returned by img_info_check_section.
+   Returns 0 if there is no log, or if it has been started for another
+   section than this one, e.g. before the database has been rewritten.
+   Otherwise returns 1, the malloc'ed log in LOG, and in SIZE the length of
+   the header and the complete records.  Returns -1 with errno set on
+   failure. */
+int
+img_info_log_read (const char *file, const img_info_hdr_t *section,
+		   size_t section_size, ULONG section_crc, BYTE **log,
+		   size_t *size)
+{
+  const img_info_log_hdr_t *hdr;
+  struct stat st;
+  size_t pos;
+  int fd;
+
+  *log = NULL;
+  *size = 0;
+  fd = open (file, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  if (st.st_size < sizeof *hdr)
+    {
+      close (fd);
+      return 0;
+    }
+  *log = (BYTE *) malloc (st.st_size);
+  if (!*log || read (fd, *log, st.st_size) != st.st_size)
+    {
+      if (*log)
+	errno = EIO;
+      free (*log);
+      *log = NULL;
+      close (fd);
+      return -1;
+    }
+  close (fd);
+  hdr = (const img_info_log_hdr_t *) *log;
+  if (memcmp (hdr->magic, IMG_INFO_LOG_MAGIC, 4)
+      || hdr->version != IMG_INFO_LOG_VERSION
+      || hdr->machine != section->machine
+      || hdr->section_size != section_size
+      || hdr->section_crc != section_crc)
+    {
+      free (*log);
+      *log = NULL;
+      return 0;
+    }
+  pos = sizeof *hdr;
+  while (img_info_log_next (*log, st.st_size, &pos))
+    ;
+  *size = pos;
+  return 1;
+}
+
+/* The record at offset POS of the SIZE bytes of LOG.  POS is advanced to
+   the next record.  Returns NULL at the end of the log, or if the record
+   is incomplete or broken. */
+const img_info_log_rec_t *
+img_info_log_next (const BYTE *log, size_t size, size_t *pos)
+{
+  const img_info_log_rec_t *rec;
+  size_t len;
+
+  if (*pos < sizeof (img_info_log_hdr_t))
+    *pos = sizeof (img_info_log_hdr_t);
+  if (size < *pos || size - *pos < sizeof *rec)
+    return NULL;
+  rec = (const img_info_log_rec_t *) (log + *pos);
+  if (rec->name_size == 0 || rec->name_size > size - *pos - sizeof *rec)
+    return NULL;
+  len = roundup2 (sizeof *rec + rec->name_size, LOG_REC_ALIGN);
+  if (len > size - *pos
+      || ((const char *) (rec + 1))[rec->name_size - 1] != '\0'
+      || rec->type < IMG_INFO_LOG_ADD || rec->type > IMG_INFO_LOG_RESIZE
+      || rec->crc != img_info_crc32c (0, &rec->type,
+				      sizeof *rec - sizeof rec->crc
+				      + rec->name_size))
+    return NULL;
+  *pos += len;
+  return rec;
+}
+
+/* Store a record of TYPE for the entry IMG at BUF.  Returns the size of
+   the record.  If BUF is NULL, only the size is returned. */
+size_t
+img_info_log_record (BYTE *buf, WORD type, const img_info_t *img)
+{
+  img_info_log_rec_t *rec = (img_info_log_rec_t *) buf;
+  ULONG name_size = strlen (img->name) + 1;
+  size_t len = roundup2 (sizeof *rec + name_size, LOG_REC_ALIGN);
+
+  if (!buf)
+    return len;
+  memset (buf, 0, len);
+  rec->type = type;
+  rec->name_size = name_size;
+  if (type == IMG_INFO_LOG_ADD || type == IMG_INFO_LOG_MOVE)
+    rec->base = img->base;
+  if (type == IMG_INFO_LOG_ADD || type == IMG_INFO_LOG_RESIZE)
+    {
+      rec->size = img->size;
+      rec->slot_size = img->slot_size;
+    }
+  memcpy (rec + 1, img->name, name_size);
+  rec->crc = img_info_crc32c (0, &rec->type,
+			      sizeof *rec - sizeof rec->crc + name_size);
+  return len;
+}
+
+/* Apply the SIZE bytes of LOG to the COUNT entries of LIST, which has room
+   for MAX_SIZE entries and is grown as needed.  The resulting list is
+   sorted by name.  The names of added entries point into LOG.  Returns -1
+   if out of memory. */
+int
+img_info_log_apply (img_info_t **list, unsigned int *count,
+		    unsigned int *max_size, const BYTE *log, size_t size)
+{
+  const img_info_log_rec_t *rec;
+  img_info_t key, *img;
+  unsigned int sorted = *count, adds = 0, i, w;
+  size_t pos = 0;
+
+  while ((rec = img_info_log_next (log, size, &pos)))
+    if (rec->type == IMG_INFO_LOG_ADD)
+      ++adds;
+  if (*count + adds > *max_size)
+    {
+      img = (img_info_t *) realloc (*list, (*count + adds) * sizeof *img);
+      if (!img)
+	return -1;
+      *list = img;
+      *max_size = *count + adds;
+    }
+  img_info_sort_by_name (*list, sorted);
+  /* The names added by the log which aren't in the list yet get an
+     entry appended up front, with a name_size of 0 until their add
+     record is applied.  The appended part is sorted by name as well, so
+     every record is looked up by bsearch.  A removed entry gets a
+     name_size of 0 until the list is compacted. */
+  pos = 0;
+  while ((rec = img_info_log_next (log, size, &pos)))
+    if (rec->type == IMG_INFO_LOG_ADD)
+      {
+	key.name = (PCHAR) (rec + 1);
+	if (!bsearch (&key, *list, sorted, sizeof key, img_info_name_cmp))
+	  {
+	    img = &(*list)[(*count)++];
+	    memset (img, 0, sizeof *img);
+	    img->name = key.name;
+	  }
+      }
+  img_info_sort_by_name (*list + sorted, *count - sorted);
+  for (i = w = sorted; i < *count; ++i)
+    if (w == sorted || strcmp ((*list)[w - 1].name, (*list)[i].name))
+      (*list)[w++] = (*list)[i];
+  *count = w;
+  pos = 0;
+  while ((rec = img_info_log_next (log, size, &pos)))
+    {
+      key.name = (PCHAR) (rec + 1);
+      img = (img_info_t *) bsearch (&key, *list, sorted, sizeof key,
+				    img_info_name_cmp);
+      if (!img)
+	img = (img_info_t *) bsearch (&key, *list + sorted, *count - sorted,
+				      sizeof key, img_info_name_cmp);
+      if (rec->type == IMG_INFO_LOG_ADD)
+	{
+	  memset (img, 0, sizeof *img);
+	  img->name = key.name;
+	  img->name_size = rec->name_size;
+	  img->base = rec->base;
+	  img->size = rec->size;
+	  img->slot_size = rec->slot_size;
+	}
+      else if (!img)
+	continue;
+      else if (rec->type == IMG_INFO_LOG_REMOVE)
+	img->name_size = 0;
+      else if (rec->type == IMG_INFO_LOG_MOVE)
+	img->base = rec->base;
+      else
+	{
+	  img->size = rec->size;
+	  img->slot_size = rec->slot_size;
+	}
+    }
+  for (i = w = 0; i < *count; ++i)
+    if ((*list)[i].name_size)
+      (*list)[w++] = (*list)[i];
+  *count = w;
+  img_info_sort_by_name (*list, *count);
+  return 0;
+}
@@ -38,6 +38,22 @@ extern "C" {
 
 extern const char IMG_INFO_MAGIC[4];
 extern const ULONG IMG_INFO_VERSION;
+extern const char IMG_INFO_CONTAINER_MAGIC[4];
+extern const ULONG IMG_INFO_CONTAINER_VERSION;
+extern const char IMG_INFO_LOG_MAGIC[4];
+extern const WORD IMG_INFO_LOG_VERSION;
+
+#define IMG_INFO_LOG_SUFFIX ".log"
+#define IMG_INFO_LOCK_SUFFIX ".lock"
+
+/* Change records in the database log. */
+#define IMG_INFO_LOG_ADD	1	/* New DLL, all fields valid.     */
+#define IMG_INFO_LOG_REMOVE	2	/* DLL dropped, only the name.    */
+#define IMG_INFO_LOG_MOVE	3	/* New base.                      */
+#define IMG_INFO_LOG_RESIZE	4	/* New size and slot_size.        */
+
+/* Upper limit of sections in a database container. */
+#define IMG_INFO_SECTIONS_MAX 8
 
 #pragma pack (push, 4)
 
@@ -50,6 +66,10 @@ typedef struct _img_info_hdr
   ULONG   offset;	/* Offset (-o) used to generate database.            */
   BOOL    down_flag;	/* Always TRUE right now.                            */
   ULONG   count;	/* Number of img_info_t entries following header.    */
+  ULONG   generation;	/* Incremented whenever the database is rewritten.   */
+			/* Not in version 1 databases.                       */
+  ULONG   crc;		/* CRC32C of the header up to here, the img_info_t   */
+			/* table and the names.  Since version 3.            */
 } img_info_hdr_t;
 
 typedef struct _img_info
@@ -70,10 +90,107 @@ typedef struct _img_info
   } flag;
 } img_info_t;
 
+/* A database container holds the databases of several machines in one
+   file.  It starts with an img_info_container_t, followed by count
+   img_info_section_t and the sections.  Each section is a complete
+   database as written for a single machine, img_info_hdr_t, the
+   img_info_t table and the names, aligned to 8 bytes. */
+typedef struct _img_info_container
+{
+  CHAR    magic[4];	/* Always IMG_INFO_CONTAINER_MAGIC.                  */
+  WORD    version;	/* Always IMG_INFO_CONTAINER_VERSION.                */
+  WORD    count;	/* Number of img_info_section_t following.           */
+} img_info_container_t;
+
+typedef struct _img_info_section
+{
+  WORD    machine;	/* IMAGE_FILE_MACHINE_I386/IMAGE_FILE_MACHINE_AMD64  */
+  WORD    reserved;	/* Always 0.                                         */
+  ULONG64 offset;	/* File offset of the section.                       */
+  ULONG64 size;		/* Size of the section.                              */
+} img_info_section_t;
+
+/* The database log holds the changes made to a database section since
+   it has been written, so small updates don't rewrite the whole database.
+   It starts with an img_info_log_hdr_t, followed by the change records.
+   The log only applies to the section it has been started for, which is
+   identified by the CRC32C and the size of the section.  Each record is
+   an img_info_log_rec_t followed by the name including the trailing NUL,
+   padded to 8 bytes.  A record with a bad checksum ends the log, so a
+   torn write at the end loses only the changes of that write. */
+typedef struct _img_info_log_hdr
+{
+  CHAR    magic[4];	/* Always IMG_INFO_LOG_MAGIC.                        */
+  WORD    machine;	/* Machine of the section the log applies to.        */
+  WORD    version;	/* Always IMG_INFO_LOG_VERSION.                      */
+  ULONG   section_crc;	/* CRC32C of the section the log applies to.         */
+  ULONG   reserved;	/* Always 0.                                         */
+  ULONG64 section_size;	/* Size of the section the log applies to.           */
+} img_info_log_hdr_t;
+
+typedef struct _img_info_log_rec
+{
+  ULONG   crc;		/* CRC32C of the rest of the record and the name.    */
+  WORD    type;		/* IMG_INFO_LOG_ADD etc.                             */
+  WORD    reserved;	/* Always 0.                                         */
+  ULONG64 base;
+  ULONG   size;
+  ULONG   slot_size;
+  ULONG   name_size;	/* Length of the name including trailing NUL.        */
+} img_info_log_rec_t;
+
 #pragma pack (pop)
 
+/* A database file mapped by img_info_map.  A single machine database is
+   presented as a container with one section, so the sections are only
+   looked at when they are needed. */
+typedef struct _img_info_map
+{
+  BYTE   *addr;
+  size_t  size;
+  BOOL    mapped;	/* addr is mmap'ed rather than malloc'ed. */
+  BOOL    container;	/* The file is a container. */
+  unsigned int count;
+  img_info_section_t sections[IMG_INFO_SECTIONS_MAX];
+} img_info_map_t;
+
+int img_info_map (const char *file, img_info_map_t *map);
+const img_info_hdr_t *img_info_map_section (const img_info_map_t *map,
+					    WORD machine, size_t *size);
+void img_info_unmap (img_info_map_t *map);
+BOOL img_info_is_container (const char *file);
+size_t img_info_read_hdr (const img_info_hdr_t *section, size_t size,
+			  img_info_hdr_t *hdr);
+const img_info_t *img_info_section_list (const img_info_hdr_t *section);
+img_info_t *img_info_copy_list (const img_info_hdr_t *section,
+				unsigned int count, unsigned int max_size);
+int img_info_check_section (const img_info_hdr_t *hdr, size_t size,
+			    ULONG *crc);
+ULONG img_info_section_crc (const img_info_hdr_t *section, size_t size);
+int img_info_write_container (int fd, unsigned int count,
+			      const img_info_section_t *sections,
+			      const void * const *data);
+const char *img_info_machine_name (WORD machine);
+BYTE *img_info_build_section (const img_info_hdr_t *hdr,
+			      const img_info_t *list, size_t *size);
+
+ULONG img_info_crc32c (ULONG crc, const void *buf, size_t len);
+char *img_info_log_file (const char *file, WORD machine, BOOL container);
+int img_info_lock (const char *file, BOOL exclusive);
+void img_info_unlock (int fd);
+int img_info_log_read (const char *file, const img_info_hdr_t *section,
+		       size_t section_size, ULONG section_crc, BYTE **log,
+		       size_t *size);
+const img_info_log_rec_t *img_info_log_next (const BYTE *log, size_t size,
+					     size_t *pos);
+size_t img_info_log_record (BYTE *buf, WORD type, const img_info_t *img);
+int img_info_log_apply (img_info_t **list, unsigned int *count,
+			unsigned int *max_size, const BYTE *log, size_t size);
+
 int img_info_cmp (const void *a, const void *b);
 int img_info_name_cmp (const void *a, const void *b);
+void img_info_sort_by_name (img_info_t *list, unsigned int count);
+void img_info_sort_by_base (img_info_t *list, unsigned int count);
 
 void dump_rebasedb_header (FILE *f, img_info_hdr_t const *h);
 void dump_rebasedb_entry  (FILE *f, img_info_hdr_t const *h,
@@ -41,8 +41,19 @@
 #include <errno.h>
 #include <windows.h>
 #include "rebase-db.h"
+#include "pathmatch.h"
 
-BOOL load_image_info ();
+#if defined(__MSYS__)
+/* MSYS has no strtoull */
+unsigned long long strtoull(const char *, char **, int);
+#endif
+
+int load_image_info (const img_info_hdr_t *section, size_t size);
+int apply_log (const img_info_hdr_t *section, size_t size, WORD machine,
+	       BOOL container, BYTE **log);
+unsigned int query_image_info (void);
+void print_entry (const img_info_t *img);
+int parse_range (const char *arg, ULONG64 *low, ULONG64 *high);
 void parse_args (int argc, char *argv[]);
 void usage ();
 void help ();
@@ -51,6 +62,7 @@ void version ();
 int args_index = 0;
 BOOL verbose = FALSE;
 BOOL quiet = FALSE;
+BOOL verify = FALSE;
 
 const char *progname;
 
@@ -59,7 +71,37 @@ img_info_t *img_info_list = NULL;
 unsigned int img_info_size = 0;
 unsigned int img_info_rebase_start = 0;
 unsigned int img_info_max_size = 0;
+ULONG section_crc = 0;
 char *db_file = NULL;
+WORD machine = 0;
+
+/* The query options.  Any of them prints the matching entries instead of
+   the whole database. */
+typedef enum
+{
+  SORT_NONE,
+  SORT_BASE,
+  SORT_SIZE,
+  SORT_NAME
+} sort_t;
+
+typedef enum
+{
+  FORMAT_TEXT,
+  FORMAT_JSON,
+  FORMAT_CSV,
+  FORMAT_COUNT
+} format_t;
+
+BOOL query = FALSE;
+const char *path_pattern = NULL;
+ULONG64 address_low = 0;
+ULONG64 address_high = ~(ULONG64) 0;
+ULONG64 size_min = 0;
+ULONG64 size_max = ~(ULONG64) 0;
+sort_t sort_by = SORT_NONE;
+format_t format = FORMAT_TEXT;
+WORD section_machine = 0;
 
 void
 gen_progname (const char *arg0)
@@ -77,6 +119,13 @@ gen_progname (const char *arg0)
 int
 main (int argc, char *argv[])
 {
+  img_info_map_t map;
+  size_t size;
+  BYTE *log;
+  unsigned int i;
+  unsigned long count = 0;
+  int ret = 0;
+
   setlocale (LC_ALL, "");
   gen_progname (argv[0]);
   parse_args (argc, argv);
@@ -90,49 +139,101 @@ main (int argc, char *argv[])
     }
   db_file = strdup (argv[args_index]);
 
-  if (load_image_info () < 0)
-    return 2;
-
-  /* Nothing to do? */
-  if (img_info_size == 0)
-    return 0;
+  if (img_info_map (db_file, &map) < 0)
+    {
+      if (errno == ENOEXEC)
+	fprintf (stderr, "%s: \"%s\" is not a valid rebase database.\n",
+		 progname, db_file);
+      else
+	fprintf (stderr, "%s: failed to open rebase database \"%s\":\n%s\n",
+		 progname, db_file, strerror (errno));
+      return 2;
+    }
+  if (machine && !img_info_map_section (&map, machine, &size))
+    {
+      fprintf (stderr, "%s: \"%s\" has no %s database.\n",
+	       progname, db_file, img_info_machine_name (machine));
+      img_info_unmap (&map);
+      return 2;
+    }
 
-  dump_rebasedb (stdout, &hdr, img_info_list, img_info_size);
-  return 0;
+  if (format == FORMAT_CSV)
+    printf ("machine,path,base,size,slot_size,needs_rebasing\n");
+  /* Dump each section of a container, or just the one asked for.  --verify
+     checks all of them. */
+  for (i = 0; i < map.count && (ret == 0 || verify); ++i)
+    {
+      if (machine && map.sections[i].machine != machine)
+	continue;
+      if (verbose && map.container)
+	printf ("== section %u: %s, offset 0x%08" PRIx64 ", size 0x%08" PRIx64
+		"\n", i, img_info_machine_name (map.sections[i].machine),
+		(uint64_t) map.sections[i].offset,
+		(uint64_t) map.sections[i].size);
+      log = NULL;
+      if (load_image_info ((const img_info_hdr_t *)
+			   (map.addr + map.sections[i].offset),
+			   map.sections[i].size) < 0
+	  || apply_log ((const img_info_hdr_t *)
+			(map.addr + map.sections[i].offset),
+			map.sections[i].size, map.sections[i].machine,
+			map.container, &log) < 0)
+	ret = 2;
+      else if (verify)
+	{
+	  if (!quiet)
+	    {
+	      printf ("%s: %s database, %u DLLs, ", db_file,
+		      img_info_machine_name (map.sections[i].machine),
+		      (uint32_t) hdr.count);
+	      if (hdr.version >= 3)
+		printf ("checksum 0x%08x ok\n", (uint32_t) section_crc);
+	      else
+		printf ("no checksum (version %u)\n", (uint32_t) hdr.version);
+	    }
+	}
+      else if (query)
+	{
+	  section_machine = map.sections[i].machine;
+	  count += query_image_info ();
+	}
+      else if (img_info_size)
+	dump_rebasedb (stdout, &hdr, img_info_list, img_info_size);
+      free (log);
+      free (img_info_list);
+      img_info_list = NULL;
+      img_info_size = 0;
+    }
+  img_info_unmap (&map);
+  if (format == FORMAT_COUNT && ret == 0)
+    printf ("%lu\n", count);
+  return ret;
 }
 
+/* Load the database section at SECTION of SIZE bytes.  The names point
+   into the section. */
 int
-load_image_info ()
+load_image_info (const img_info_hdr_t *section, size_t size)
 {
-  int fd;
-  int ret = 0;
+  size_t hdr_size;
   int i;
 
-  fd = open (db_file, O_RDONLY | O_BINARY);
-  if (fd < 0)
+  hdr_size = img_info_read_hdr (section, size, &hdr);
+  if (!hdr_size)
     {
-      fprintf (stderr, "%s: failed to open rebase database \"%s\":\n%s\n",
-	       progname, db_file, strerror (errno));
-      return -1;
-    }
-  /* First read the header. */
-  if (read (fd, &hdr, sizeof hdr) < 0)
-    {
-      fprintf (stderr, "%s: failed to read rebase database \"%s\":\n%s\n",
-	       progname, db_file, strerror (errno));
-      close (fd);
+      fprintf (stderr, "%s: premature end of rebase database \"%s\".\n",
+	       progname, db_file);
       return -1;
     }
   if (verbose)
     printf ("== read %" PRIu64 " (0x%08" PRIx64 ") bytes (database header)\n",
-	    (uint64_t) sizeof hdr, (uint64_t) sizeof hdr);
+	    (uint64_t) hdr_size, (uint64_t) hdr_size);
 
   /* Check the header. */
   if (memcmp (hdr.magic, IMG_INFO_MAGIC, 4) != 0)
     {
       fprintf (stderr, "%s: \"%s\" is not a valid rebase database.\n",
 	       progname, db_file);
-      close (fd);
       return -1;
     }
   if (verbose)
@@ -144,123 +245,295 @@ load_image_info ()
     {
       fprintf (stderr, "%s: \"%s\" is a database file for a machine type\n"
 		       "I don't know about.", progname, db_file);
-      close (fd);
       return -1;
     }
-  if (hdr.version != IMG_INFO_VERSION)
+  if (hdr.version == 0 || hdr.version > IMG_INFO_VERSION)
     {
       fprintf (stderr, "%s: \"%s\" is a version %u rebase database.\n"
 		       "I can only handle versions up to %u.\n",
 	       progname, db_file, hdr.version, (uint32_t) IMG_INFO_VERSION);
-      close (fd);
       return -1;
     }
-  img_info_size = hdr.count;
-  /* Allocate memory for the image list. */
-  if (ret == 0)
+  switch (img_info_check_section (section, size, &section_crc))
     {
-      img_info_max_size = roundup (img_info_size, 100);
-      img_info_list = (img_info_t *) calloc (img_info_max_size,
-					     sizeof (img_info_t));
-      if (!img_info_list)
-	{
-	  fprintf (stderr, "%s: Out of memory.\n", progname);
-	  ret = -1;
-	}
+    case -1:
+      fprintf (stderr, "%s: premature end of rebase database \"%s\".\n",
+	       progname, db_file);
+      return -1;
+    case -2:
+      fprintf (stderr, "%s: rebase database \"%s\" is corrupt (checksum "
+		       "mismatch).\n", progname, db_file);
+      return -1;
     }
-  /* Now read the list. */
-  if (ret == 0
-      && read (fd, img_info_list, img_info_size * sizeof (img_info_t)) < 0)
+  img_info_size = hdr.count;
+  /* Copy the list.  The names point into the mapped section. */
+  img_info_max_size = roundup (img_info_size, 100);
+  img_info_list = img_info_copy_list (section, img_info_size,
+				      img_info_max_size);
+  if (!img_info_list)
     {
-      fprintf (stderr, "%s: failed to read rebase database \"%s\":\n%s\n",
-	       progname, db_file, strerror (errno));
-      ret = -1;
+      fprintf (stderr, "%s: Out of memory.\n", progname);
+      img_info_size = 0;
+      return -1;
     }
-  if (ret == 0 && verbose)
+  if (verbose)
     {
       printf ("== read %" PRIu64 " (0x%08" PRIx64 ") bytes (database w/o strings)\n",
               (uint64_t) img_info_size * sizeof (img_info_t),
               (uint64_t) img_info_size * sizeof (img_info_t));
     }
-  /* Make sure all pointers are NULL (also dump db as read) */
-  if (ret == 0)
+  /* Dump db as read */
+  if (verbose)
     {
-      if (verbose)
-	printf ("---- database records without strings ----\n");
+      printf ("---- database records without strings ----\n");
 
       for (i = 0; i < img_info_size; ++i)
-        {
-          img_info_list[i].name = NULL;
-	  if (verbose)
-            printf ("%03d: base 0x%0*" PRIx64 " size 0x%08x slot 0x%08x namesize %4d %c\n",
-	            i,
-	            hdr.machine == IMAGE_FILE_MACHINE_I386 ? 8 : 12,
-	            (uint64_t) img_info_list[i].base,
-	            (uint32_t) img_info_list[i].size,
-	            (uint32_t) img_info_list[i].slot_size,
-	            (uint32_t) img_info_list[i].name_size,
-	            img_info_list[i].flag.needs_rebasing ? '*' : ' ');
-        }
+	printf ("%03d: base 0x%0*" PRIx64 " size 0x%08x slot 0x%08x namesize %4d %c\n",
+		i,
+		hdr.machine == IMAGE_FILE_MACHINE_I386 ? 8 : 12,
+		(uint64_t) img_info_list[i].base,
+		(uint32_t) img_info_list[i].size,
+		(uint32_t) img_info_list[i].slot_size,
+		(uint32_t) img_info_list[i].name_size,
+		img_info_list[i].flag.needs_rebasing ? '*' : ' ');
     }
 
-  /* Eventually read the strings. */
-  if (ret == 0)
+  if (verbose)
     {
+      printf ("---- database strings ----\n");
+      for (i = 0; i < img_info_size; ++i)
+	printf ("%03d: namesize %4d (0x%04x) %s\n", i,
+		(uint32_t) img_info_list[i].name_size,
+		(uint32_t) img_info_list[i].name_size,
+		img_info_list[i].name);
+    }
+  return 0;
+}
+
+/* Apply the log of the database section at SECTION of SIZE bytes to the
+   loaded list.  The log is returned in LOG, the names of added entries
+   point into it. */
+int
+apply_log (const img_info_hdr_t *section, size_t size, WORD machine,
+	   BOOL container, BYTE **log)
+{
+  char *log_file = img_info_log_file (db_file, machine, container);
+  size_t log_size;
+  int ret;
+
+  if (!log_file)
+    {
+      fprintf (stderr, "%s: Out of memory.\n", progname);
+      return -1;
+    }
+  ret = img_info_log_read (log_file, section, size, section_crc, log,
+			   &log_size);
+  if (ret < 0)
+    fprintf (stderr, "%s: failed to read rebase database log \"%s\":\n%s\n",
+	     progname, log_file, strerror (errno));
+  else if (ret > 0)
+    {
+      struct stat st;
+
       if (verbose)
-	printf ("---- database strings ----\n");
+	printf ("== read %" PRIu64 " (0x%08" PRIx64 ") bytes (log \"%s\")\n",
+		(uint64_t) log_size, (uint64_t) log_size, log_file);
+      /* An interrupted append leaves an incomplete record, which is
+	 ignored and overwritten by the next one. */
+      if (verify && !quiet && stat (log_file, &st) == 0
+	  && st.st_size > log_size)
+	printf ("%s: ignoring %" PRIu64 " bytes of incomplete records at the "
+		"end of the log\n", log_file,
+		(uint64_t) (st.st_size - log_size));
+      if (img_info_log_apply (&img_info_list, &img_info_size,
+			      &img_info_max_size, *log, log_size) < 0)
+	{
+	  fprintf (stderr, "%s: Out of memory.\n", progname);
+	  ret = -1;
+	}
+      hdr.count = img_info_size;
+    }
+  free (log_file);
+  return ret < 0 ? -1 : 0;
+}
 
-      for (i = 0; i < img_info_size; ++i)
+static int
+size_cmp (const void *a, const void *b)
+{
+  ULONG asize = ((const img_info_t *) a)->size;
+  ULONG bsize = ((const img_info_t *) b)->size;
+
+  if (asize < bsize)
+    return -1;
+  if (asize > bsize)
+    return 1;
+  return img_info_cmp (a, b);
+}
+
+/* True if NAME matches the --path pattern.  A pattern without a slash
+   only has to match the file name. */
+static BOOL
+path_matches (const char *name)
+{
+  const char *p;
+
+  if (!strchr (path_pattern, '/'))
+    for (p = name; *p; ++p)
+      if (*p == '/' || *p == '\\')
+	name = p + 1;
+  return path_match (path_pattern, name);
+}
+
+/* Reduce the loaded list to the entries matching the query options, sort
+   and print them.  Returns the number of matching entries. */
+unsigned int
+query_image_info (void)
+{
+  unsigned int i, n = 0;
+
+  for (i = 0; i < img_info_size; ++i)
+    {
+      const img_info_t *img = &img_info_list[i];
+
+      /* The address range selects the DLLs whose image overlaps it. */
+      if (img->base > address_high
+	  || img->base + img->size <= address_low
+	  || img->size < size_min || img->size > size_max
+	  || (path_pattern && !path_matches (img->name)))
+	continue;
+      img_info_list[n++] = *img;
+    }
+  switch (sort_by)
+    {
+    case SORT_BASE:
+      img_info_sort_by_base (img_info_list, n);
+      break;
+    case SORT_SIZE:
+      qsort (img_info_list, n, sizeof (img_info_t), size_cmp);
+      break;
+    case SORT_NAME:
+      img_info_sort_by_name (img_info_list, n);
+      break;
+    default:
+      break;
+    }
+  if (format != FORMAT_COUNT)
+    for (i = 0; i < n; ++i)
+      print_entry (&img_info_list[i]);
+  return n;
+}
+
+/* Print the path name NAME as a JSON string or a CSV field. */
+static void
+print_quoted (const char *name)
+{
+  const char *p;
+
+  putchar ('"');
+  for (p = name; *p; ++p)
+    {
+      unsigned char c = *p;
+
+      if (format == FORMAT_CSV)
 	{
-	  img_info_list[i].name = (char *)
-				  calloc (img_info_list[i].name_size, sizeof(char));
-	  if (!img_info_list[i].name)
-	    {
-	      fprintf (stderr, "%s: Out of memory.\n", progname);
-	      ret = -1;
-	      break;
-	    }
-	  if (read (fd, (void *)img_info_list[i].name,
-		    (size_t) img_info_list[i].name_size) < 0)
-	    {
-	      fprintf (stderr, "%s: failed to read rebase database \"%s\": "
-		       "%s\n", progname, db_file, strerror (errno));
-	      ret = -1;
-	      break;
-	    }
-	  else if (verbose)
-	    {
-              printf ("%03d: namesize %4d (0x%04x) %s\n", i,
-		      (uint32_t) img_info_list[i].name_size,
-		      (uint32_t) img_info_list[i].name_size,
-		      img_info_list[i].name);
-	    }
+	  if (c == '"')
+	    putchar ('"');
+	  putchar (c);
 	}
+      else if (c == '"' || c == '\\')
+	printf ("\\%c", c);
+      else if (c < 0x20)
+	printf ("\\u%04x", c);
+      else
+	putchar (c);
     }
-  close (fd);
-  /* On failure, free all allocated memory and set list pointer to NULL. */
-  if (ret < 0)
+  putchar ('"');
+}
+
+void
+print_entry (const img_info_t *img)
+{
+  switch (format)
     {
-      for (i = 0; i < img_info_size && img_info_list[i].name; ++i)
-	free (img_info_list[i].name);
-      free (img_info_list);
-      img_info_list = NULL;
-      img_info_size = 0;
-      img_info_max_size = 0;
+    case FORMAT_JSON:
+      printf ("{\"machine\":\"%s\",\"path\":",
+	      img_info_machine_name (section_machine));
+      print_quoted (img->name);
+      printf (",\"base\":%" PRIu64 ",\"size\":%u,\"slot_size\":%u"
+	      ",\"needs_rebasing\":%s}\n",
+	      (uint64_t) img->base, (uint32_t) img->size,
+	      (uint32_t) img->slot_size,
+	      img->flag.needs_rebasing ? "true" : "false");
+      break;
+    case FORMAT_CSV:
+      printf ("%s,", img_info_machine_name (section_machine));
+      print_quoted (img->name);
+      printf (",0x%0*" PRIx64 ",0x%08x,0x%08x,%d\n",
+	      section_machine == IMAGE_FILE_MACHINE_I386 ? 8 : 12,
+	      (uint64_t) img->base, (uint32_t) img->size,
+	      (uint32_t) img->slot_size, img->flag.needs_rebasing ? 1 : 0);
+      break;
+    default:
+      dump_rebasedb_entry (stdout, &hdr, img);
+      break;
     }
-  return ret;
+}
+
+/* Parse ARG of the form VALUE, LOW-HIGH, LOW- or -HIGH into LOW and HIGH.
+   A single VALUE sets both, a missing bound leaves the value unchanged.
+   Returns -1 if ARG is invalid. */
+int
+parse_range (const char *arg, ULONG64 *low, ULONG64 *high)
+{
+  ULONG64 value;
+  char *end;
+
+  if (*arg != '-')
+    {
+      errno = 0;
+      value = strtoull (arg, &end, 0);
+      if (end == arg || errno)
+	return -1;
+      *low = value;
+      arg = end;
+      if (!*arg)
+	{
+	  *high = value;
+	  return 0;
+	}
+    }
+  if (*arg++ != '-')
+    return -1;
+  if (*arg)
+    {
+      errno = 0;
+      value = strtoull (arg, &end, 0);
+      if (end == arg || *end || errno)
+	return -1;
+      *high = value;
+    }
+  return *low <= *high ? 0 : -1;
 }
 
 static struct option long_options[] = {
+  {"32",	no_argument,	   NULL, '4'},
+  {"64",	no_argument,	   NULL, '8'},
+  {"address",	required_argument, NULL, 'a'},
+  {"format",	required_argument, NULL, 'F'},
   {"help",	no_argument,	   NULL, 'h'},
   {"usage",	no_argument,	   NULL, 'h'},
+  {"path",	required_argument, NULL, 'p'},
   {"quiet",	no_argument,	   NULL, 'q'},
+  {"size",	required_argument, NULL, 's'},
+  {"sort",	required_argument, NULL, 'S'},
   {"usage",	no_argument,	   NULL, 'h'},
+  {"verify",	no_argument,	   NULL, 'c'},
   {"verbose",	no_argument,	   NULL, 'v'},
   {"version",	no_argument,	   NULL, 'V'},
   {NULL,	no_argument,	   NULL,  0 }
 };
 
-static const char *short_options = "hqvV";
+static const char *short_options = "48a:cF:hp:qs:S:vV";
 
 void
 parse_args (int argc, char *argv[])
@@ -272,9 +545,76 @@ parse_args (int argc, char *argv[])
     {
       switch (opt)
 	{
+	case '4':
+	  machine = IMAGE_FILE_MACHINE_I386;
+	  break;
+	case '8':
+	  machine = IMAGE_FILE_MACHINE_AMD64;
+	  break;
+	case 'a':
+	  if (parse_range (optarg, &address_low, &address_high) < 0)
+	    {
+	      fprintf (stderr, "%s: invalid address range: %s\n", progname,
+		       optarg);
+	      usage ();
+	      exit (1);
+	    }
+	  query = TRUE;
+	  break;
+	case 'c':
+	  verify = TRUE;
+	  break;
+	case 'F':
+	  if (!strcmp (optarg, "text"))
+	    format = FORMAT_TEXT;
+	  else if (!strcmp (optarg, "json"))
+	    format = FORMAT_JSON;
+	  else if (!strcmp (optarg, "csv"))
+	    format = FORMAT_CSV;
+	  else if (!strcmp (optarg, "count"))
+	    format = FORMAT_COUNT;
+	  else
+	    {
+	      fprintf (stderr, "%s: invalid output format: %s\n", progname,
+		       optarg);
+	      usage ();
+	      exit (1);
+	    }
+	  query = TRUE;
+	  break;
+	case 'p':
+	  path_pattern = optarg;
+	  query = TRUE;
+	  break;
 	case 'q':
 	  quiet = TRUE;
 	  break;
+	case 's':
+	  if (parse_range (optarg, &size_min, &size_max) < 0)
+	    {
+	      fprintf (stderr, "%s: invalid size range: %s\n", progname,
+		       optarg);
+	      usage ();
+	      exit (1);
+	    }
+	  query = TRUE;
+	  break;
+	case 'S':
+	  if (!strcmp (optarg, "base"))
+	    sort_by = SORT_BASE;
+	  else if (!strcmp (optarg, "size"))
+	    sort_by = SORT_SIZE;
+	  else if (!strcmp (optarg, "name"))
+	    sort_by = SORT_NAME;
+	  else
+	    {
+	      fprintf (stderr, "%s: invalid sort key: %s\n", progname,
+		       optarg);
+	      usage ();
+	      exit (1);
+	    }
+	  query = TRUE;
+	  break;
 	case 'v':
 	  verbose = TRUE;
 	  break;
@@ -300,7 +640,8 @@ void
 usage ()
 {
   fprintf (stderr,
-"usage: %s [-hqvV] dbfile\n"
+"usage: %s [-48chqvV] [-a RANGE] [-F FORMAT] [-p PATTERN] [-s RANGE]\n"
+"       [-S KEY] dbfile\n"
 "       %s --help or --usage for full help text\n",
 	   progname, progname);
 }
@@ -310,11 +651,33 @@ help ()
 {
   printf ("\
 Usage: %s [OPTIONS] [FILE]\n\
-Dumps the rebase database file in readable format.\n\
+Dumps the rebase database file in readable format, including the changes\n\
+recorded in its log.  A database container is dumped section by section.\n\
+  -4, --32                Only dump the i386 database.  Fails if there is none.\n\
+  -8, --64                Only dump the x86_64 database.  Fails if there is\n\
+                          none.\n\
+  -c, --verify            Only check the database and its log, and print a\n\
+                          summary of each section.  Exits with status 2 if\n\
+                          the database is damaged.\n\
   -q, --quiet             Be quiet about non-critical issues.\n\
   -v, --verbose           Print some debug output.\n\
   -V, --version           Print version info and exit.\n\
-  -h, --help, --usage     This help.\n",
+  -h, --help, --usage     This help.\n\
+\n\
+Query options.  With any of them, only the matching DLLs are printed, one\n\
+per line, without the database header:\n\
+  -p, --path=PATTERN      DLLs whose path name matches the shell PATTERN\n\
+                          (*, ? and [...], ignoring case).  A PATTERN\n\
+                          without a slash only has to match the file name.\n\
+  -a, --address=RANGE     DLLs whose image overlaps the address RANGE.\n\
+  -s, --size=RANGE        DLLs whose image size is in RANGE.\n\
+  -S, --sort=KEY          Sort the DLLs by KEY: base, size or name.  The\n\
+                          default is the database order, by base.\n\
+  -F, --format=FORMAT     Print the DLLs as FORMAT: text (the default),\n\
+                          json (one object per line), csv or count (only\n\
+                          the number of DLLs).\n\
+RANGE is VALUE, LOW-HIGH, LOW- or -HIGH; the bounds are included.  The\n\
+values are decimal, octal (leading 0) or hex (leading 0x).\n",
 	  progname);
 }
 
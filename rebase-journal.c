@@ -0,0 +1,454 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(__CYGWIN__) && !defined(__MSYS__)
+#include <io.h>
+#define fsync(fd) _commit (fd)
+#endif
+#include "rebase-journal.h"
+
+const char REBASE_JOURNAL_MAGIC[4] = "rBjL";
+const WORD REBASE_JOURNAL_VERSION = 2;
+
+#define JOURNAL_INTENT	1
+#define JOURNAL_DONE	2
+
+#pragma pack (push, 4)
+typedef struct _journal_hdr_t
+{
+  CHAR magic[4];	/* Always REBASE_JOURNAL_MAGIC.                 */
+  WORD machine;		/* Machine of the database the journal is for.  */
+  WORD version;		/* Always REBASE_JOURNAL_VERSION.               */
+} journal_hdr_t;
+
+typedef struct _journal_rec_t
+{
+  ULONG type;		/* JOURNAL_INTENT or JOURNAL_DONE.              */
+  ULONG seq;		/* Sequence number of the intent.               */
+} journal_rec_t;
+
+typedef struct _journal_intent_t
+{
+  ULONG64 old_base;
+  LONG64 delta;
+  ULONG old_timestamp;
+  ULONG old_checksum;
+  WORD old_dll_characteristics;
+  WORD old_characteristics;
+  ULONG64 old_sizes[PE_SIZES];
+  ULONG name_size;	/* Followed by the name including trailing NUL. */
+} journal_intent_t;
+#pragma pack (pop)
+
+static int journal_fd = -1;
+static char *journal_path;
+static ULONG journal_seq;
+
+/* The NT headers are identical for 32 and 64 bit up to the image base. */
+#define NT_TIMESTAMP	offsetof (IMAGE_NT_HEADERS32, FileHeader.TimeDateStamp)
+#define NT_CHARS	offsetof (IMAGE_NT_HEADERS32, FileHeader.Characteristics)
+#define NT_MAGIC	offsetof (IMAGE_NT_HEADERS32, OptionalHeader.Magic)
+#define NT_CHECKSUM	offsetof (IMAGE_NT_HEADERS32, OptionalHeader.CheckSum)
+#define NT_DLLCHARS	offsetof (IMAGE_NT_HEADERS32, \
+				  OptionalHeader.DllCharacteristics)
+
+/* The PE_SIZE_* fields in 32 and 64 bit NT headers.  Only the stack and
+   heap sizes of 64 bit images are 64 bit wide. */
+#define NT_SIZE(field, size64) \
+  { offsetof (IMAGE_NT_HEADERS32, OptionalHeader.field), \
+    offsetof (IMAGE_NT_HEADERS64, OptionalHeader.field), size64 }
+
+static const struct
+{
+  size_t offset32;
+  size_t offset64;
+  size_t size64;
+} nt_sizes[PE_SIZES] = {
+  NT_SIZE (SizeOfStackReserve, sizeof (ULONG64)),
+  NT_SIZE (SizeOfStackCommit, sizeof (ULONG64)),
+  NT_SIZE (SizeOfHeapReserve, sizeof (ULONG64)),
+  NT_SIZE (SizeOfHeapCommit, sizeof (ULONG64)),
+  NT_SIZE (LoaderFlags, sizeof (ULONG))
+};
+
+static int
+pe_nt_offset (int fd, LONG *lfanew)
+{
+  if (lseek (fd, offsetof (IMAGE_DOS_HEADER, e_lfanew), SEEK_SET) < 0
+      || read (fd, lfanew, sizeof *lfanew) != sizeof *lfanew
+      || *lfanew <= 0)
+    return -1;
+  return 0;
+}
+
+/* Read the NT headers of FD into NT.  Returns the number of bytes read,
+   or -1 if the file has no complete NT headers.  *IS_64BIT is set for
+   PE32+ images. */
+static ssize_t
+pe_nt_read (int fd, LONG *lfanew, BYTE *nt, BOOL *is_64bit)
+{
+  ssize_t len;
+  WORD magic;
+
+  if (pe_nt_offset (fd, lfanew) < 0
+      || lseek (fd, *lfanew, SEEK_SET) < 0
+      || (len = read (fd, nt, sizeof (IMAGE_NT_HEADERS64)))
+	 < (ssize_t) sizeof (IMAGE_NT_HEADERS32)
+      || ((PIMAGE_NT_HEADERS32) nt)->Signature != IMAGE_NT_SIGNATURE)
+    return -1;
+  memcpy (&magic, nt + NT_MAGIC, sizeof magic);
+  *is_64bit = magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+  if (*is_64bit && len < (ssize_t) sizeof (IMAGE_NT_HEADERS64))
+    return -1;
+  return len;
+}
+
+int
+pe_header_read (const char *pathname, pe_header_fields_t *fields)
+{
+  BYTE nt[sizeof (IMAGE_NT_HEADERS64)];
+  LONG lfanew;
+  BOOL is_64bit;
+  int fd, i, ret = -1;
+
+  fd = open (pathname, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return -1;
+  if (pe_nt_read (fd, &lfanew, nt, &is_64bit) >= 0)
+    {
+      if (is_64bit)
+	memcpy (&fields->image_base,
+		nt + offsetof (IMAGE_NT_HEADERS64, OptionalHeader.ImageBase),
+		sizeof (ULONG64));
+      else
+	{
+	  ULONG base;
+	  memcpy (&base,
+		  nt + offsetof (IMAGE_NT_HEADERS32, OptionalHeader.ImageBase),
+		  sizeof base);
+	  fields->image_base = base;
+	}
+      memcpy (&fields->timestamp, nt + NT_TIMESTAMP, sizeof (ULONG));
+      memcpy (&fields->characteristics, nt + NT_CHARS, sizeof (WORD));
+      memcpy (&fields->checksum, nt + NT_CHECKSUM, sizeof (ULONG));
+      memcpy (&fields->dll_characteristics, nt + NT_DLLCHARS, sizeof (WORD));
+      /* Little endian, like the PE format. */
+      for (i = 0; i < PE_SIZES; ++i)
+	{
+	  fields->sizes[i] = 0;
+	  if (is_64bit)
+	    memcpy (&fields->sizes[i], nt + nt_sizes[i].offset64,
+		    nt_sizes[i].size64);
+	  else
+	    memcpy (&fields->sizes[i], nt + nt_sizes[i].offset32,
+		    sizeof (ULONG));
+	}
+      ret = 0;
+    }
+  close (fd);
+  return ret;
+}
+
+int
+pe_header_restore (const char *pathname, const pe_header_fields_t *fields)
+{
+  BYTE nt[sizeof (IMAGE_NT_HEADERS64)];
+  LONG lfanew;
+  BOOL is_64bit;
+  ssize_t len;
+  int fd, i, ret = -1;
+
+  fd = open (pathname, O_RDWR | O_BINARY);
+  if (fd < 0)
+    return -1;
+  /* Patch the fields in the NT headers and write them back at once. */
+  if ((len = pe_nt_read (fd, &lfanew, nt, &is_64bit)) >= 0)
+    {
+      memcpy (nt + NT_TIMESTAMP, &fields->timestamp, sizeof (ULONG));
+      memcpy (nt + NT_CHARS, &fields->characteristics, sizeof (WORD));
+      memcpy (nt + NT_CHECKSUM, &fields->checksum, sizeof (ULONG));
+      memcpy (nt + NT_DLLCHARS, &fields->dll_characteristics, sizeof (WORD));
+      for (i = 0; i < PE_SIZES; ++i)
+	if (is_64bit)
+	  memcpy (nt + nt_sizes[i].offset64, &fields->sizes[i],
+		  nt_sizes[i].size64);
+	else
+	  memcpy (nt + nt_sizes[i].offset32, &fields->sizes[i],
+		  sizeof (ULONG));
+      if (lseek (fd, lfanew, SEEK_SET) >= 0
+	  && write (fd, nt, len) == len)
+	ret = 0;
+    }
+  close (fd);
+  return ret;
+}
+
+static int
+journal_append (const void *buf, size_t len, BOOL sync)
+{
+  if (write (journal_fd, buf, len) != (ssize_t) len)
+    return -1;
+  if (sync && fsync (journal_fd) < 0)
+    return -1;
+  return 0;
+}
+
+int
+journal_begin (const char *journal_file, WORD machine)
+{
+  journal_hdr_t hdr;
+
+  journal_fd = open (journal_file, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC,
+		     0660);
+  if (journal_fd < 0)
+    return -1;
+  journal_path = strdup (journal_file);
+  journal_seq = 0;
+  memcpy (hdr.magic, REBASE_JOURNAL_MAGIC, 4);
+  hdr.machine = machine;
+  hdr.version = REBASE_JOURNAL_VERSION;
+  if (!journal_path || journal_append (&hdr, sizeof hdr, TRUE) < 0)
+    {
+      close (journal_fd);
+      journal_fd = -1;
+      unlink (journal_file);
+      return -1;
+    }
+  return 0;
+}
+
+int
+journal_intent (const char *pathname, ULONG64 new_base, ULONG *seq)
+{
+  pe_header_fields_t old;
+  journal_rec_t rec;
+  journal_intent_t intent;
+  BYTE *buf;
+  size_t len;
+  int ret;
+
+  if (journal_fd < 0)
+    return -1;
+  if (pe_header_read (pathname, &old) < 0)
+    return -1;
+  rec.type = JOURNAL_INTENT;
+  rec.seq = journal_seq;
+  intent.old_base = old.image_base;
+  intent.delta = (LONG64) (new_base - old.image_base);
+  intent.old_timestamp = old.timestamp;
+  intent.old_checksum = old.checksum;
+  intent.old_dll_characteristics = old.dll_characteristics;
+  intent.old_characteristics = old.characteristics;
+  memcpy (intent.old_sizes, old.sizes, sizeof intent.old_sizes);
+  intent.name_size = strlen (pathname) + 1;
+  /* One write per record, so a crash leaves at most one truncated
+     record at the end. */
+  len = sizeof rec + sizeof intent + intent.name_size;
+  buf = (BYTE *) malloc (len);
+  if (!buf)
+    return -1;
+  memcpy (buf, &rec, sizeof rec);
+  memcpy (buf + sizeof rec, &intent, sizeof intent);
+  memcpy (buf + sizeof rec + sizeof intent, pathname, intent.name_size);
+  ret = journal_append (buf, len, TRUE);
+  free (buf);
+  if (ret == 0)
+    *seq = journal_seq++;
+  return ret;
+}
+
+int
+journal_done (ULONG seq)
+{
+  journal_rec_t rec;
+
+  if (journal_fd < 0)
+    return -1;
+  rec.type = JOURNAL_DONE;
+  rec.seq = seq;
+  /* No need to sync.  Recovery checks the file header anyway. */
+  return journal_append (&rec, sizeof rec, FALSE);
+}
+
+int
+journal_end (void)
+{
+  int ret = 0;
+
+  if (journal_fd < 0)
+    return 0;
+  close (journal_fd);
+  journal_fd = -1;
+  if (unlink (journal_path) < 0 && errno != ENOENT)
+    ret = -1;
+  free (journal_path);
+  journal_path = NULL;
+  return ret;
+}
+
+/* Read the records from FD.  *END is set to the end of the last complete
+   record. */
+static int
+journal_scan (int fd, WORD machine, journal_entry_t **entries,
+	      unsigned int *count, off_t *end)
+{
+  journal_hdr_t hdr;
+  journal_rec_t rec;
+  journal_entry_t *list = NULL;
+  unsigned int size = 0, max_size = 0;
+
+  *entries = NULL;
+  *count = 0;
+  if (read (fd, &hdr, sizeof hdr) != sizeof hdr
+      || memcmp (hdr.magic, REBASE_JOURNAL_MAGIC, 4) != 0
+      || hdr.version != REBASE_JOURNAL_VERSION
+      || hdr.machine != machine)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  *end = sizeof hdr;
+  while (read (fd, &rec, sizeof rec) == sizeof rec)
+    {
+      if (rec.type == JOURNAL_INTENT)
+	{
+	  journal_intent_t intent;
+	  journal_entry_t *e;
+
+	  if (read (fd, &intent, sizeof intent) != sizeof intent
+	      || intent.name_size == 0 || intent.name_size > 32768)
+	    break;
+	  if (size >= max_size)
+	    {
+	      max_size = max_size ? 2 * max_size : 64;
+	      e = (journal_entry_t *) realloc (list, max_size * sizeof *list);
+	      if (!e)
+		goto fail;
+	      list = e;
+	    }
+	  e = &list[size];
+	  e->name = (char *) malloc (intent.name_size);
+	  if (!e->name)
+	    goto fail;
+	  if (read (fd, e->name, intent.name_size)
+	      != (ssize_t) intent.name_size)
+	    {
+	      free (e->name);
+	      break;
+	    }
+	  e->name[intent.name_size - 1] = '\0';
+	  e->seq = rec.seq;
+	  e->old_base = intent.old_base;
+	  e->delta = intent.delta;
+	  e->old.image_base = intent.old_base;
+	  e->old.timestamp = intent.old_timestamp;
+	  e->old.checksum = intent.old_checksum;
+	  e->old.dll_characteristics = intent.old_dll_characteristics;
+	  e->old.characteristics = intent.old_characteristics;
+	  memcpy (e->old.sizes, intent.old_sizes, sizeof e->old.sizes);
+	  e->done = FALSE;
+	  ++size;
+	}
+      else if (rec.type == JOURNAL_DONE)
+	{
+	  unsigned int i;
+	  /* Records are appended in order, the intent is usually last. */
+	  for (i = size; i-- > 0; )
+	    if (list[i].seq == rec.seq)
+	      {
+		list[i].done = TRUE;
+		break;
+	      }
+	}
+      else
+	break;
+      *end = lseek (fd, 0, SEEK_CUR);
+    }
+  *entries = list;
+  *count = size;
+  return 1;
+
+fail:
+  journal_free (list, size);
+  errno = ENOMEM;
+  return -1;
+}
+
+int
+journal_read (const char *journal_file, WORD machine,
+	      journal_entry_t **entries, unsigned int *count)
+{
+  off_t end;
+  int fd, ret;
+
+  *entries = NULL;
+  *count = 0;
+  fd = open (journal_file, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+  ret = journal_scan (fd, machine, entries, count, &end);
+  close (fd);
+  return ret;
+}
+
+int
+journal_continue (const char *journal_file, WORD machine)
+{
+  journal_entry_t *list;
+  unsigned int size, i;
+  off_t end;
+
+  journal_fd = open (journal_file, O_RDWR | O_BINARY);
+  if (journal_fd < 0)
+    return errno == ENOENT ? journal_begin (journal_file, machine) : -1;
+  if (journal_scan (journal_fd, machine, &list, &size, &end) < 0)
+    goto fail;
+  journal_seq = 0;
+  for (i = 0; i < size; ++i)
+    if (list[i].seq >= journal_seq)
+      journal_seq = list[i].seq + 1;
+  journal_free (list, size);
+  /* Drop a truncated record, new records would be unreadable otherwise. */
+  if (ftruncate (journal_fd, end) < 0 || lseek (journal_fd, end, SEEK_SET) < 0)
+    goto fail;
+  journal_path = strdup (journal_file);
+  if (journal_path)
+    return 0;
+
+fail:
+  close (journal_fd);
+  journal_fd = -1;
+  return -1;
+}
+
+void
+journal_free (journal_entry_t *entries, unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; ++i)
+    free (entries[i].name);
+  free (entries);
+}
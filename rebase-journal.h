@@ -0,0 +1,97 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See the COPYING file for full license information.
+ */
+#ifndef REBASE_JOURNAL_H
+#define REBASE_JOURNAL_H
+
+#include <windows.h>
+#include "peoptions.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The rebase journal is an append-only file next to the rebase database,
+   written while a database rebase is in progress.  Before a file is
+   patched, an intent record with everything needed to undo the rebase is
+   synced to disk; a done record follows when the file has been rebased.
+   The journal is removed after the database has been saved, so an
+   existing journal means the last run didn't finish. */
+
+extern const char REBASE_JOURNAL_MAGIC[4];
+extern const WORD REBASE_JOURNAL_VERSION;
+
+#define REBASE_JOURNAL_SUFFIX ".jnl"
+
+/* The PE header fields a rebase changes, including those of --peflags. */
+typedef struct _pe_header_fields_t
+{
+  ULONG64 image_base;
+  ULONG timestamp;
+  ULONG checksum;
+  WORD dll_characteristics;
+  WORD characteristics;		/* COFF characteristics */
+  ULONG64 sizes[PE_SIZES];	/* Indexed by PE_SIZE_* */
+} pe_header_fields_t;
+
+/* One rebased file as recorded in the journal. */
+typedef struct _journal_entry_t
+{
+  char *name;
+  ULONG seq;
+  ULONG64 old_base;
+  LONG64 delta;			/* new base - old base */
+  pe_header_fields_t old;	/* header fields before rebasing */
+  BOOL done;			/* TRUE if the rebase completed */
+} journal_entry_t;
+
+/* Read the PE header fields of PATHNAME.  Returns 0 on success. */
+int pe_header_read (const char *pathname, pe_header_fields_t *fields);
+
+/* Write back all fields but the image base. */
+int pe_header_restore (const char *pathname, const pe_header_fields_t *fields);
+
+/* Create a new journal, replacing an existing one. */
+int journal_begin (const char *journal_file, WORD machine);
+
+/* Open an existing journal to append further records, e.g. when resuming
+   an interrupted rebase.  Creates a new journal if there is none. */
+int journal_continue (const char *journal_file, WORD machine);
+
+/* Record the intent to rebase PATHNAME to NEW_BASE.  Returns the sequence
+   number of the record in *SEQ.  The record is on disk when this returns
+   successfully. */
+int journal_intent (const char *pathname, ULONG64 new_base, ULONG *seq);
+
+/* Record that the rebase with sequence number SEQ completed. */
+int journal_done (ULONG seq);
+
+/* Close the journal and remove it. */
+int journal_end (void);
+
+/* Read an existing journal.  Returns 0 if there is no journal, 1 if the
+   entries have been read, -1 on error.  A truncated last record is
+   ignored, since the file it refers to hasn't been touched yet. */
+int journal_read (const char *journal_file, WORD machine,
+		  journal_entry_t **entries, unsigned int *count);
+
+void journal_free (journal_entry_t *entries, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REBASE_JOURNAL_H */